@@ -0,0 +1,118 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef VNFACL_H
+#define VNFACL_H
+
+#define ACL_NO_MATCH   UINT32_MAX
+#define ACL_LINE_SIZE  512
+
+#define ACL_PERMIT     0
+#define ACL_DENY       1
+#define ACL_REDIRECT   2
+/*
+* Fields a rule matches on besides the prefixes and port ranges
+*/
+#define ACL_MATCH_PROTO 0x01
+#define ACL_MATCH_VLAN  0x02
+#define ACL_MATCH_IN    0x04
+
+/*
+* A rule as written, prefixes of length 0 and the full port range match
+* anything. ethertype is set when the rule has an address.
+*/
+typedef struct _acl_rule {
+  uint8_t src[16];
+  uint8_t dst[16];
+  uint8_t src_len;
+  uint8_t dst_len;
+  uint16_t ethertype;
+  uint16_t sport_lo;
+  uint16_t sport_hi;
+  uint16_t dport_lo;
+  uint16_t dport_hi;
+  uint16_t vlan;
+  uint8_t proto;
+  uint8_t in_port;
+  uint8_t match;
+  uint8_t action;
+  uint8_t port;
+  uint32_t priority;
+} acl_rule_t;
+
+/*
+* Rules are compiled into one hash table per distinct field mask (tuple
+* space search). Ports other than a single one or any are left out of the
+* mask, so an entry lists every rule sharing its masked key and the port
+* ranges are checked on those. rank orders matches: higher priority wins,
+* then the rule that came first. Lists are sorted best rank first and
+* ranged is set when the first rule needs the port check.
+*/
+typedef struct _acl_entry {
+  flow_key_t key;
+  uint64_t rank;
+  uint32_t list;
+  uint16_t count;
+  uint16_t ranged;
+} __attribute__((aligned(CACHE_LINE_SIZE))) acl_entry_t;
+
+typedef struct _acl_tuple {
+  flow_key_t mask;
+  uint64_t max_rank;
+  uint64_t tmask;
+  unsigned int nentries;
+  unsigned int size;
+  acl_entry_t *table;
+} acl_tuple_t;
+
+typedef struct _acl_table {
+  acl_rule_t *rules;
+  unsigned int nrules;
+  unsigned int rules_size;
+  acl_tuple_t *tuples;
+  unsigned int ntuples;
+  unsigned long nentries;
+  uint32_t *lists;
+  unsigned long nlists;
+  unsigned long lists_size;
+} acl_table_t;
+
+static inline uint64_t acl_rank(acl_table_t *acl, uint32_t rule){
+  return ((uint64_t)acl->rules[rule].priority << 32) | (UINT32_MAX - rule);
+}
+
+static inline uint32_t acl_rank_rule(uint64_t rank){
+  return UINT32_MAX - (uint32_t)rank;
+}
+
+acl_table_t *acl_new(void);
+void acl_free(acl_table_t *acl);
+int acl_parse_rule(char *line, acl_rule_t *rule);
+void acl_format_rule(FILE *out, acl_rule_t *rule);
+int acl_add_rule(acl_table_t *acl, acl_rule_t *rule);
+int acl_compile(acl_table_t *acl);
+acl_table_t *acl_load(char *path);
+void acl_key_from_batch(flow_key_t *key, pkt_batch_t *batch, unsigned int i);
+bool acl_rule_match(acl_rule_t *rule, flow_key_t *key);
+uint32_t acl_classify(acl_table_t *acl, flow_key_t *key);
+uint32_t acl_classify_linear(acl_table_t *acl, flow_key_t *key);
+/*
+* n is at most PIPE_BATCH
+*/
+void acl_classify_batch(acl_table_t *acl, flow_key_t *keys, uint32_t *rules, unsigned int n);
+
+int acl_stage_init(pipe_stage_t *stage, arg_config_t *arg_config, unsigned int worker);
+unsigned int acl_stage(pipe_stage_t *stage, pkt_batch_t *batch);
+void acl_stage_print(pipe_stage_t *stage);
+
+#endif /* VNFACL_H */
@@ -14,7 +14,150 @@
 #ifndef VNFAPP_H 
 #define VNFAPP_H
 
+#include <signal.h>
+
+/*
+* RX burst sizes seen per wakeup, bucket i counts bursts of 2^i to 2^(i+1)-1
+*/
+#define BURST_BUCKETS 12
+
+typedef struct _burst_stats {
+  unsigned long bursts;
+  unsigned long packets;
+  unsigned long empty;
+  unsigned long losing;
+  unsigned long max;
+  unsigned long hist[BURST_BUCKETS];
+} burst_stats_t;
+
+/*
+* Time the forwarding loop spent spinning on the rings versus sleeping,
+* and the syscalls it made to wait and to kick TX
+*/
+typedef struct _poll_stats {
+  uint64_t budget_ns;
+  uint64_t spin_ns;
+  uint64_t sleep_ns;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long sleeps;
+  unsigned long kicks;
+  unsigned long syscalls;
+} poll_stats_t;
+
+/*
+* Ring autotuning of an interface, absorb_us is the burst the rings are
+* sized to hold at line rate, 0 when off. Drops are sampled once a
+* period, a larger geometry is recommended or, with apply, put in place
+* when the interface is quiet, or busy since want_ns for a whole period.
+* limited is set once the rings cannot grow.
+*/
+typedef struct _tune_state {
+  unsigned int absorb_us;
+  bool apply;
+  uint64_t next_ns;
+  uint64_t drops;
+  unsigned long losing;
+  unsigned long want_frames;
+  unsigned long want_blocks;
+  uint64_t want_ns;
+  unsigned long resizes;
+  bool limited;
+} tune_state_t;
+
+/*
+* Dataplane counters of one interface as seen by one worker. Only the
+* owning worker writes them, they live in the shared stats segment and
+* fill whole cache lines so workers never share a line.
+*/
+#define CACHE_LINE_SIZE 64
+
+typedef struct _intf_counters {
+  uint64_t rx_packets;
+  uint64_t rx_bytes;
+  uint64_t tx_packets;
+  uint64_t tx_bytes;
+  uint64_t tx_drops;
+  uint64_t tx_ring_full;
+  uint64_t tx_wrong_format;
+  uint64_t tx_kick_errors;
+  uint64_t tx_oversize;
+  uint64_t rx_truncated;
+} __attribute__((aligned(CACHE_LINE_SIZE))) intf_counters_t;
+/*
+* Log-linear latency histogram in ns, every power of two is split in
+* LAT_SUB_COUNT linear buckets so a bucket is at most 1/16 wide.
+* Histograms of different threads are merged by adding buckets.
+*/
+#define LAT_SUB_BITS  4
+#define LAT_SUB_COUNT (1 << LAT_SUB_BITS)
+#define LAT_MAX_EXP   40
+#define LAT_BUCKETS   ((LAT_MAX_EXP - LAT_SUB_BITS + 1) * LAT_SUB_COUNT)
+/*
+* RX timestamps of frames queued on the TX ring but not yet kicked
+*/
+#define LAT_PENDING   256
+
+typedef struct _lat_hist {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[LAT_BUCKETS];
+} lat_hist_t;
+
+typedef struct _lat_clock {
+  uint64_t anchor_tsc;
+  uint64_t anchor_ns;
+} lat_clock_t;
+
+typedef struct _lat_state {
+  lat_clock_t clock;
+  unsigned int npending;
+  uint64_t pending[LAT_PENDING];
+  uint64_t skipped;
+  uint64_t unstamped;
+  lat_hist_t hist;
+} lat_state_t;
+/*
+* Frames parked while the TX ring is full (drop oldest policy)
+*/
+#define TX_BACKLOG_FRAMES 256
+
+typedef struct _tx_backlog {
+  uint8_t *data;
+  unsigned int len[TX_BACKLOG_FRAMES];
+  unsigned int head;
+  unsigned int count;
+} tx_backlog_t;
+
+/*
+* I/O backend of an interface. Live interfaces use the packet mmap rings,
+* a pcap file can stand in as a RX source or a TX sink for offline replay.
+* read forwards up to rx_budget frames to the write of the peer, flush
+* pushes out what write queued, close releases the backend. vnet is the
+* offload header the frame came with, NULL when it had none.
+*/
+struct _intf_config;
+struct _pcap_file;
+struct _pipeline;
+struct _kernel_counters;
+struct _uring;
+struct virtio_net_hdr;
+
+typedef struct _io_backend {
+  const char *name;
+  unsigned int (*read)(struct _intf_config *r_config, struct _intf_config *w_config);
+  void (*write)(struct _intf_config *config, const struct virtio_net_hdr *vnet, uint8_t *data, size_t len, uint64_t rx_ns);
+  void (*flush)(struct _intf_config *config);
+  void (*close)(struct _intf_config *config);
+} io_backend_t;
+
 typedef struct _intf_config {
+	const io_backend_t *io;
+	struct _pcap_file *pcap;
+	struct _pipeline *pipe;
+	unsigned int port;
 	int fd;
 	uint8_t *r_ring;
 	uint8_t *w_ring;
@@ -23,15 +166,158 @@ typedef struct _intf_config {
   unsigned long max_ring_blocks;
   unsigned long max_frame_size;
   unsigned int mtu_size;
+  unsigned int tpacket_version;
+  unsigned int block_timeout;
+  unsigned int ringr_offset;
+  unsigned int ringw_offset;
+  unsigned int ringc_offset;
+  unsigned int tx_batch;
+  unsigned int tx_pending;
+  unsigned int tx_inflight;
+  unsigned int tx_policy;
+  unsigned int tx_wait_us;
+  intf_counters_t *stats;
+  struct _kernel_counters *kernel;
+  tx_backlog_t backlog;
+  unsigned int rx_budget;
+  burst_stats_t burst;
+  unsigned int busy_poll_us;
+  poll_stats_t poll;
+  unsigned int event_loop;
+  struct _uring *uring;
+  uint32_t kick_index;
+  bool kick_queued;
+  tune_state_t tune;
+  unsigned int latency;
+  lat_state_t lat;
   bool single;
+  bool vnet_hdr;
+  bool filtered;
 } intf_config_t;
 
+/*
+* Run to completion workers, each joins a PACKET_FANOUT group per interface
+*/
+#define MAX_WORKERS 64
+/*
+* NUMA node the workers run on and allocate from, picked from the nodes
+* of the interfaces unless given
+*/
+#define NUMA_AUTO     -1
+#define NUMA_OFF      -2
+#define MAX_NUMA_NODES 1024
+#define MAX_NODE_CPUS  4096
+/*
+* Name of the shared memory stats segment, empty when not exported
+*/
+#define STATS_NAME_SIZE 64
+/*
+* Replay a capture file instead of reading a live interface
+*/
+#define PCAP_PATH_SIZE 256
+/*
+* Comma separated names of the pipeline stages every frame goes through
+*/
+#define PIPELINE_SIZE 256
+#define DEFAULT_PIPELINE "bitw"
+/*
+* Flow cache entries per worker, rounded up to a power of two
+*/
+#define DEFAULT_FLOWS 65536
+#define MAX_FLOWS     (1UL << 28)
+/*
+* Rule file of the acl stage
+*/
+#define ACL_PATH_SIZE 256
+/*
+* MAC table of the bridge stage shared by all workers, aging in seconds
+* and learn rate in new addresses per second per worker, 0 is unlimited
+*/
+#define DEFAULT_MAC_ENTRIES 65536
+#define MAX_MAC_ENTRIES     (1UL << 26)
+#define DEFAULT_MAC_AGING   300
+#define MAX_MAC_AGING       86400
+#define DEFAULT_LEARN_RATE  0
+/*
+* Rule file of the qos stage
+*/
+#define QOS_PATH_SIZE 256
+/*
+* Capture tap: a filter in the acl match syntax, one in capture_sample
+* of the frames it matches, files of capture_mb MB of which the last
+* capture_files are kept, 0 keeps them all
+*/
+#define CAPTURE_FILTER_SIZE   256
+#define DEFAULT_CAPTURE_MB    64
+#define MAX_CAPTURE_MB        (1024 * 1024)
+#define DEFAULT_CAPTURE_FILES 8
+/*
+* Socket filter in a tcpdump style, frames it rejects never reach a ring
+*/
+#define FILTER_SIZE 512
+/*
+* Interfaces one VNF serves, each with its own rings. Forwarded frames of
+* a port go out of its peer.
+*/
+#define MAX_PORTS       16
+#define PORT_SPEC_SIZE  128
+#define PORT_MAP_SIZE   256
+
+typedef struct _port_config {
+  char name[IFNAMSIZ];
+  unsigned long max_ring_frames;
+  unsigned long max_ring_blocks;
+  unsigned long max_frame_size;
+  unsigned int peer;
+} port_config_t;
+
 typedef struct _arg_config {
   char first[IFNAMSIZ];
   char second[IFNAMSIZ];
   unsigned long max_ring_frames;
   unsigned long max_ring_blocks;
   unsigned long max_frame_size;
+  unsigned int tpacket_version;
+  unsigned int block_timeout;
+  unsigned int tx_batch;
+  unsigned int rx_budget;
+  unsigned int busy_poll_us;
+  bool sock_busy_poll;
+  unsigned int event_loop;
+  unsigned int tx_policy;
+  unsigned int tx_wait_us;
+  bool qdisc_bypass;
+  bool tx_loss;
+  bool vnet_hdr;
+  unsigned int autotune_us;
+  bool autotune_apply;
+  unsigned int backend;
+  bool xdp_drv_mode;
+  unsigned int workers;
+  unsigned int fanout_mode;
+  unsigned int ncpus;
+  int cpus[MAX_WORKERS];
+  int numa_node;
+  char stats_name[STATS_NAME_SIZE];
+  unsigned int latency;
+  int tai_offset;
+  char pcap_in[PCAP_PATH_SIZE];
+  char pcap_out[PCAP_PATH_SIZE];
+  char pipeline[PIPELINE_SIZE];
+  unsigned long flows;
+  char acl_path[ACL_PATH_SIZE];
+  unsigned long mac_entries;
+  unsigned int mac_aging;
+  unsigned long learn_rate;
+  char qos_path[QOS_PATH_SIZE];
+  char capture_path[PCAP_PATH_SIZE];
+  char capture_filter[CAPTURE_FILTER_SIZE];
+  unsigned long capture_sample;
+  unsigned long capture_mb;
+  unsigned int capture_files;
+  char filter[FILTER_SIZE];
+  unsigned int nports;
+  port_config_t ports[MAX_PORTS];
 } arg_config_t;
 
 /*
@@ -39,7 +325,79 @@ typedef struct _arg_config {
 */
 #define MAX_RING_FRAMES 32
 #define MAX_RING_BLOCKS 2
-#define MAX_FRAME_SIZE  4096
+/*
+* A frame size of 0 sizes the frames of an interface from its MTU, to
+* the power of two holding the ring header, a VLAN tag and a full frame
+*/
+#define AUTO_FRAME_SIZE 0
+#define MAX_FRAME_SIZE  (1UL << 17)
+#define FRAME_HEADROOM  128
+#define VLAN_TAG_LEN    4
+/*
+* With PACKET_VNET_HDR the kernel hands over GSO packets of up to 64 KB
+* unsegmented, frames sized from the MTU are sized for those instead
+*/
+#define VNET_MAX_PACKET 65536
+/*
+* Ring autotuning, bursts of up to DEFAULT_AUTOTUNE_US at line rate are
+* absorbed when only applying is asked for
+*/
+#define DEFAULT_AUTOTUNE_US 200
+#define MAX_AUTOTUNE_US     1000000
+/*
+* RX ring defaults, V3 packs variable length packets into blocks which
+* are handed to user space when full or when the retire timeout (ms) expires
+*/
+#define DEFAULT_TPACKET_VERSION 2
+#define DEFAULT_BLOCK_TIMEOUT   1
+/*
+* Number of TX frames queued before the kernel is poked
+*/
+#define DEFAULT_TX_BATCH 32
+/*
+* Frames drained from a RX ring per wakeup before going back to epoll
+*/
+#define DEFAULT_RX_BUDGET 256
+/*
+* What to drop when the TX ring of the peer is full
+*/
+#define TX_POLICY_DROP_NEWEST 0
+#define TX_POLICY_DROP_OLDEST 1
+#define TX_POLICY_WAIT        2
+#define DEFAULT_TX_WAIT_US    100
+/*
+* Busy polling spins at least this long before sleeping in epoll_wait
+*/
+#define POLL_MIN_BUDGET_NS 1000
+/*
+* RX to TX kick latency, timed from software or NIC hardware RX stamps
+*/
+#define LATENCY_OFF 0
+#define LATENCY_SW  1
+#define LATENCY_HW  2
+/*
+* Seconds a NIC clock on TAI runs ahead of CLOCK_REALTIME, taken from
+* the kernel TAI offset when not given
+*/
+#define LAT_TAI_KERNEL -1
+#define LAT_TAI_MAX    1000
+/*
+* I/O backends
+*/
+#define BACKEND_MMAP 0
+#define BACKEND_XDP  1
+/*
+* Event loops of the packet mmap backend, io_uring batches readiness
+* polls and TX kicks into the wait, SQPOLL leaves them to a kernel thread
+*/
+#define EVENT_EPOLL  0
+#define EVENT_URING  1
+#define EVENT_SQPOLL 2
+/*
+* Set by SIGINT and SIGTERM, the io_uring loop checks it as a wait that
+* also submitted entries returns their count rather than EINTR
+*/
+extern volatile sig_atomic_t stop_requested;
 
 #ifndef MAX
 #define MAX(a,b)            (((a) > (b)) ? (a) : (b))
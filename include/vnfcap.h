@@ -0,0 +1,67 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef VNFCAP_H
+#define VNFCAP_H
+
+/*
+* Each worker hands frames to the writer through a ring of this many
+* bytes, records are aligned to CAP_REC_ALIGN
+*/
+#define CAP_RING_BYTES (8UL * 1024 * 1024)
+#define CAP_REC_ALIGN  16
+#define CAP_SNAPLEN    65535
+/*
+* A record with this caplen fills the end of the ring, the next one is
+* at the start
+*/
+#define CAP_REC_WRAP   UINT32_MAX
+/*
+* The writer sleeps this long when the rings are empty and writes what
+* it collected at least every CAP_FLUSH_MS
+*/
+#define CAP_IDLE_US    1000
+#define CAP_FLUSH_MS   200
+
+typedef struct _cap_rec {
+  uint64_t ts_ns;
+  uint32_t caplen;
+  uint32_t len;
+} cap_rec_t;
+
+/*
+* Single producer, single consumer. Positions are byte counts that only
+* grow, the worker owns next and head_cache and publishes tail once per
+* batch, the writer owns head. They sit on different cache lines.
+*/
+typedef struct _cap_ring {
+  uint64_t tail;
+  uint64_t next;
+  uint64_t head_cache;
+  uint64_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+  uint8_t *buf __attribute__((aligned(CACHE_LINE_SIZE)));
+  uint64_t size;
+} cap_ring_t;
+
+/*
+* Set from a signal handler, the forwarding loop pauses or resumes the
+* capture
+*/
+extern volatile sig_atomic_t cap_toggle_requested;
+void cap_toggle(void);
+
+int cap_stage_init(pipe_stage_t *stage, arg_config_t *arg_config, unsigned int worker);
+unsigned int cap_stage(pipe_stage_t *stage, pkt_batch_t *batch);
+void cap_stage_print(pipe_stage_t *stage);
+
+#endif /* VNFCAP_H */
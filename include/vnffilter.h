@@ -0,0 +1,45 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef VNFFILTER_H
+#define VNFFILTER_H
+
+#include <linux/filter.h>
+
+/*
+* Frames a filter accepts are kept whole, FILTER_SNAPLEN is above the
+* largest GSO packet
+*/
+#define FILTER_SNAPLEN 0x40000
+
+typedef struct _filter_prog {
+  struct sock_filter insns[BPF_MAXINSNS];
+  unsigned int len;
+} filter_prog_t;
+
+/*
+* Compile a tcpdump style expression into a classic BPF program. The
+* primitives are ip, ip6, arp, tcp, udp, sctp, icmp, icmp6, vlan [id],
+* inbound, outbound, less and greater, [ip|ip6|arp] [src|dst] host|net,
+* [tcp|udp|sctp] [src|dst] port|portrange, [ip|ip6|ether] proto, ether
+* [src|dst] host, broadcast and multicast, joined with and, or, not and
+* parentheses. Errors are printed and return -1.
+*/
+int filter_compile(const char *expr, filter_prog_t *prog);
+/*
+* Attach a program to a packet socket and drop the frames it queued
+* before the program ran on them
+*/
+int filter_attach(int fd, filter_prog_t *prog);
+
+#endif /* VNFFILTER_H */
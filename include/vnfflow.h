@@ -0,0 +1,159 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef VNFFLOW_H
+#define VNFFLOW_H
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+* Entries per bucket, a bucket keeps the 16 bit signatures of its entries
+* together so one compare checks all of them
+*/
+#define FLOW_WAYS         8
+#define FLOW_SIG_EMPTY    0
+
+/*
+* 5-tuple plus VLAN and ingress port, addresses are left aligned so IPv4
+* and IPv6 share one layout. Padded to three 16 byte words for the SIMD
+* compare. The ACL classifier uses the same layout for keys and masks.
+*/
+typedef struct _flow_key {
+  uint8_t src[16];
+  uint8_t dst[16];
+  uint16_t sport;
+  uint16_t dport;
+  uint16_t ethertype;
+  uint16_t vlan;
+  uint8_t proto;
+  uint8_t in_port;
+  uint8_t pad[6];
+} __attribute__((aligned(16))) flow_key_t;
+
+/*
+* born is the epoch the flow was added in, frames of that epoch are still
+* being classified so the verdict is not final yet
+*/
+typedef struct _flow_entry {
+  flow_key_t key;
+  uint32_t used;
+  uint32_t born;
+  uint8_t verdict;
+  uint8_t out_port;
+} __attribute__((aligned(CACHE_LINE_SIZE))) flow_entry_t;
+
+typedef struct _flow_bucket {
+  uint16_t sig[FLOW_WAYS];
+} flow_bucket_t;
+
+typedef struct _flow_cache {
+  flow_bucket_t *buckets;
+  flow_entry_t *entries;
+  uint64_t mask;
+  uint64_t nflows;
+  size_t map_len;
+  uint32_t epoch;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t full;
+} flow_cache_t;
+
+static inline uint64_t flow_mix(uint64_t h){
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static inline uint64_t flow_hash(flow_key_t *key){
+  uint64_t w[6];
+  uint64_t h = 0x9e3779b97f4a7c15ULL;
+  unsigned int i;
+
+  memcpy(w, key, sizeof(w));
+  for (i = 0; i < 6; i++){
+    h = (h ^ w[i]) * 0x100000001b3ULL;
+    h = (h << 31) | (h >> 33);
+  }
+  return flow_mix(h);
+}
+
+static inline bool flow_key_equal(flow_key_t *a, flow_key_t *b){
+#ifdef __SSE2__
+  __m128i x;
+
+  x = _mm_xor_si128(_mm_load_si128((__m128i *)a), _mm_load_si128((__m128i *)b));
+  x = _mm_or_si128(x, _mm_xor_si128(_mm_load_si128((__m128i *)a + 1), _mm_load_si128((__m128i *)b + 1)));
+  x = _mm_or_si128(x, _mm_xor_si128(_mm_load_si128((__m128i *)a + 2), _mm_load_si128((__m128i *)b + 2)));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) == 0xffff;
+#else
+  return memcmp(a, b, sizeof(*a)) == 0;
+#endif
+}
+
+static inline void flow_key_mask(flow_key_t *dst, flow_key_t *key, flow_key_t *mask){
+#ifdef __SSE2__
+  unsigned int i;
+
+  for (i = 0; i < 3; i++){
+    _mm_store_si128((__m128i *)dst + i, _mm_and_si128(_mm_load_si128((__m128i *)key + i), _mm_load_si128((__m128i *)mask + i)));
+  }
+#else
+  uint64_t *d = (uint64_t *)dst, *k = (uint64_t *)key, *m = (uint64_t *)mask;
+  unsigned int i;
+
+  for (i = 0; i < sizeof(*dst) / sizeof(uint64_t); i++){
+    d[i] = k[i] & m[i];
+  }
+#endif
+}
+
+static inline uint16_t flow_sig(uint64_t hash){
+  uint16_t sig = hash >> 48;
+
+  return (sig == FLOW_SIG_EMPTY) ? 1 : sig;
+}
+/*
+* Classifier stages set verdicts through this so later frames of the flow
+* get the same one without being classified
+*/
+static inline void flow_set_verdict(pkt_desc_t *pkt, uint8_t verdict, uint8_t out_port){
+  pkt->verdict = verdict;
+  pkt->out_port = out_port;
+  if (pkt->flow != NULL){
+    pkt->flow->verdict = verdict;
+    pkt->flow->out_port = out_port;
+  }
+}
+
+int flow_cache_init(flow_cache_t *fc, uint64_t nflows);
+void flow_cache_free(flow_cache_t *fc);
+bool flow_key_from_batch(flow_key_t *key, pkt_batch_t *batch, unsigned int i);
+void flow_prefetch(flow_cache_t *fc, uint64_t hash);
+flow_entry_t *flow_lookup(flow_cache_t *fc, flow_key_t *key, uint64_t hash);
+flow_entry_t *flow_insert(flow_cache_t *fc, flow_key_t *key, uint64_t hash);
+/*
+* n is at most PIPE_BATCH
+*/
+void flow_lookup_batch(flow_cache_t *fc, flow_key_t *keys, uint64_t *hashes, flow_entry_t **entries, unsigned int n);
+
+int flow_stage_init(pipe_stage_t *stage, arg_config_t *arg_config, unsigned int worker);
+unsigned int flow_stage(pipe_stage_t *stage, pkt_batch_t *batch);
+void flow_stage_print(pipe_stage_t *stage);
+
+#endif /* VNFFLOW_H */
@@ -0,0 +1,123 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef VNFLAT_H
+#define VNFLAT_H
+
+#include <time.h>
+#include <signal.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define LAT_HAVE_TSC 1
+#endif
+
+/*
+* Calibrated once by lat_calibrate(), TSC readings are converted to
+* CLOCK_REALTIME, the clock of the RX timestamps, through a per thread
+* anchor that is refreshed every LAT_ANCHOR_NS to follow NTP slewing
+*/
+#define LAT_ANCHOR_NS 100000000ULL
+
+extern bool lat_tsc_ok;
+extern double lat_ns_per_tick;
+extern uint64_t lat_anchor_ticks;
+/*
+* Subtracted from hardware RX stamps to bring a NIC clock on TAI to
+* CLOCK_REALTIME
+*/
+extern uint64_t lat_hw_offset_ns;
+/*
+* Set by SIGUSR1, the forwarding loop prints its histograms
+*/
+extern volatile sig_atomic_t lat_dump_requested;
+
+static inline uint64_t lat_realtime_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void lat_anchor(lat_clock_t *clock);
+
+static inline uint64_t lat_now(lat_clock_t *clock){
+#ifdef LAT_HAVE_TSC
+	uint64_t tsc;
+
+	if (lat_tsc_ok){
+		tsc = __rdtsc();
+		if (tsc - clock->anchor_tsc > lat_anchor_ticks){
+			lat_anchor(clock);
+			tsc = __rdtsc();
+		}
+		return clock->anchor_ns + (uint64_t)((tsc - clock->anchor_tsc) * lat_ns_per_tick);
+	}
+#endif
+	return lat_realtime_ns();
+}
+
+static inline unsigned int lat_bucket(uint64_t ns){
+	unsigned int exp;
+
+	if (ns < LAT_SUB_COUNT){
+		return ns;
+	}
+	exp = 63 - __builtin_clzll(ns);
+	if (exp >= LAT_MAX_EXP){
+		return LAT_BUCKETS - 1;
+	}
+	return (exp - LAT_SUB_BITS + 1) * LAT_SUB_COUNT + ((ns >> (exp - LAT_SUB_BITS)) & (LAT_SUB_COUNT - 1));
+}
+
+static inline void lat_record(lat_hist_t *hist, uint64_t ns){
+	hist->buckets[lat_bucket(ns)]++;
+	hist->count++;
+	hist->sum += ns;
+	if (ns > hist->max){
+		hist->max = ns;
+	}
+	if (ns < hist->min || hist->count == 1){
+		hist->min = ns;
+	}
+}
+/*
+* Remember the RX stamp of a frame queued on the TX ring
+*/
+static inline void lat_queue(lat_state_t *lat, uint64_t rx_ns){
+	if (lat->npending < LAT_PENDING){
+		lat->pending[lat->npending++] = rx_ns;
+	} else {
+		lat->skipped++;
+	}
+}
+/*
+* The kernel accepted the kick, every queued frame has left user space
+*/
+static inline void lat_kick(lat_state_t *lat){
+	uint64_t now = lat_now(&lat->clock);
+	unsigned int i;
+
+	for (i = 0; i < lat->npending; i++){
+		lat_record(&lat->hist, (now > lat->pending[i]) ? now - lat->pending[i] : 0);
+	}
+	lat->npending = 0;
+}
+
+void lat_calibrate(void);
+int lat_set_tai_offset(int tai_offset);
+void lat_merge(lat_hist_t *dst, lat_hist_t *src);
+uint64_t lat_percentile(lat_hist_t *hist, double p);
+void print_lat_hist(char *name, lat_hist_t *hist);
+void print_latency(intf_config_t *config);
+
+#endif /* VNFLAT_H */
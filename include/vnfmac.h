@@ -0,0 +1,83 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef VNFMAC_H
+#define VNFMAC_H
+
+#define MAC_WAYS 4
+/*
+* Set in every key so an all zero key means an empty way
+*/
+#define MAC_KEY_VALID (1ULL << 63)
+/*
+* What mac_learn did with an address
+*/
+#define MAC_LEARN_FRESH   0
+#define MAC_LEARN_NEW     1
+#define MAC_LEARN_MOVED   2
+#define MAC_LEARN_EVICTED 3
+
+/*
+* seq is odd while a writer changes the bucket, readers retry when it was
+* odd or changed under them. seen is the last time the address was learnt
+* in ms, it wraps after 49 days which is fine for ages below 24.
+*/
+typedef struct _mac_bucket {
+  uint64_t key[MAC_WAYS];
+  uint32_t seen[MAC_WAYS];
+  uint8_t port[MAC_WAYS];
+  uint32_t seq;
+} __attribute__((aligned(CACHE_LINE_SIZE))) mac_bucket_t;
+
+typedef struct _mac_table {
+  mac_bucket_t *buckets;
+  uint64_t mask;
+  uint64_t nentries;
+  size_t map_len;
+  uint32_t aging_ms;
+  uint32_t refresh_ms;
+} mac_table_t;
+
+/*
+* MAC address and VLAN id packed in 64 bits
+*/
+static inline uint64_t mac_key(uint8_t *mac, uint16_t vlan){
+  uint64_t key = 0;
+
+  memcpy(&key, mac, 6);
+  return key | ((uint64_t)(vlan & 0x0fff) << 48) | MAC_KEY_VALID;
+}
+
+static inline bool mac_is_group(uint8_t *mac){
+  return (mac[0] & 0x01) != 0;
+}
+
+int mac_table_init(mac_table_t *table, uint64_t nentries, uint32_t aging_ms);
+void mac_table_free(mac_table_t *table);
+void mac_prefetch(mac_table_t *table, uint64_t key);
+/*
+* Port the address was last seen on or PORT_NONE, now is in ms
+*/
+uint8_t mac_lookup(mac_table_t *table, uint64_t key, uint32_t now);
+void mac_lookup_batch(mac_table_t *table, uint64_t *keys, uint8_t *ports, unsigned int n, uint32_t now);
+/*
+* Record that key was seen on port. Adding or moving an address needs
+* can_add, -1 when it was needed but not given.
+*/
+int mac_learn(mac_table_t *table, uint64_t key, uint8_t port, uint32_t now, bool can_add);
+
+int mac_stage_init(pipe_stage_t *stage, arg_config_t *arg_config, unsigned int worker);
+unsigned int mac_stage(pipe_stage_t *stage, pkt_batch_t *batch);
+void mac_stage_print(pipe_stage_t *stage);
+
+#endif /* VNFMAC_H */
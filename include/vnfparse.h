@@ -0,0 +1,54 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef VNFPARSE_H
+#define VNFPARSE_H
+
+/*
+* VLAN tags skipped in front of L3 and IPv6 extension headers walked
+* before giving up on finding L4
+*/
+#define PARSE_MAX_TAGS 2
+#define PARSE_MAX_EXT  8
+
+/*
+* Parsers fill in batch->meta for every frame of a batch. They all give
+* the same result, the vector ones only handle the common header layouts
+* themselves and hand the rest to the scalar one. supported is NULL when
+* the CPU needs nothing special.
+*/
+typedef void (*parse_fn_t)(pkt_batch_t *batch);
+
+typedef struct _parse_impl {
+  const char *name;
+  parse_fn_t parse;
+  bool (*supported)(void);
+} parse_impl_t;
+
+void parse_frame(pkt_meta_t *meta, unsigned int i, uint8_t *p, uint32_t len);
+void parse_scalar(pkt_batch_t *batch);
+/*
+* Implementations from the most to the least capable, NULL past the end
+*/
+const parse_impl_t *parse_impl(unsigned int i);
+/*
+* The named implementation or the best one this CPU runs when name is
+* NULL, NULL when it does not exist or is not supported
+*/
+const parse_impl_t *parse_select(const char *name);
+
+int parse_stage_init(pipe_stage_t *stage, arg_config_t *arg_config, unsigned int worker);
+unsigned int parse_stage(pipe_stage_t *stage, pkt_batch_t *batch);
+void parse_stage_print(pipe_stage_t *stage);
+
+#endif /* VNFPARSE_H */
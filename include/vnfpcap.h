@@ -0,0 +1,83 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef VNFPCAP_H
+#define VNFPCAP_H
+
+#define PCAP_MAGIC_USEC  0xa1b2c3d4
+#define PCAP_MAGIC_NSEC  0xa1b23c4d
+#define PCAPNG_SHB       0x0a0d0d0a
+#define PCAPNG_IDB       0x00000001
+#define PCAPNG_SPB       0x00000003
+#define PCAPNG_EPB       0x00000006
+#define PCAPNG_BYTE_ORDER 0x1a2b3c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+#define PCAP_SNAPLEN     262144
+/*
+* Interfaces of one pcapng section that can be replayed
+*/
+#define PCAP_MAX_IFS     64
+/*
+* The writer collects records and writes them in chunks of this size
+*/
+#define PCAP_WRITE_BUF   (4 * 1024 * 1024)
+
+typedef struct _pcap_global_hdr {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+} pcap_global_hdr_t;
+
+typedef struct _pcap_rec_hdr {
+  uint32_t ts_sec;
+  uint32_t ts_frac;
+  uint32_t incl_len;
+  uint32_t orig_len;
+} pcap_rec_hdr_t;
+
+typedef struct _pcap_file {
+  int fd;
+  char path[PCAP_PATH_SIZE];
+  /*
+  * Reader, the whole file is mapped
+  */
+  uint8_t *map;
+  size_t len;
+  size_t offset;
+  bool ng;
+  bool swapped;
+  bool nsec;
+  uint32_t linktype;
+  unsigned int nifs;
+  uint32_t if_linktype[PCAP_MAX_IFS];
+  uint32_t if_snaplen[PCAP_MAX_IFS];
+  uint8_t if_tsresol[PCAP_MAX_IFS];
+  uint64_t skipped;
+  bool eof;
+  /*
+  * Writer
+  */
+  uint8_t *buf;
+  size_t used;
+} pcap_file_t;
+
+extern const io_backend_t pcap_io;
+
+int pcap_open_read(intf_config_t *config, char *path);
+int pcap_open_write(intf_config_t *config, char *path);
+
+#endif /* VNFPCAP_H */
@@ -0,0 +1,192 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef VNFPIPE_H
+#define VNFPIPE_H
+
+/*
+* Frames handed to the pipeline at once, and how far ahead stages prefetch
+*/
+#define PIPE_BATCH      64
+#define PIPE_PREFETCH   4
+#define PIPE_MAX_STAGES 16
+#define PIPE_MAX_PORTS  MAX_PORTS
+/*
+* Forwarded frames go to the peer of their port, redirected ones to
+* out_port and flooded ones to every port but the one they came in on.
+* A held frame was taken over by a stage, which sends it later on.
+*/
+#define VERDICT_FORWARD  0
+#define VERDICT_DROP     1
+#define VERDICT_REDIRECT 2
+#define VERDICT_FLOOD    3
+#define VERDICT_HELD     4
+
+#define PORT_NONE 0xff
+/*
+* The verdict came from the flow cache, classifiers leave the frame alone
+*/
+#define PKT_CACHED 0x01
+
+struct _flow_entry;
+struct virtio_net_hdr;
+/*
+* A frame still sitting in the RX ring plus what stages decided about it,
+* vnet points at the offload header in front of it when the port has one
+*/
+typedef struct _pkt_desc {
+  uint8_t *data;
+  uint64_t rx_ns;
+  struct _flow_entry *flow;
+  struct virtio_net_hdr *vnet;
+  uint32_t len;
+  uint32_t hash;
+  uint8_t verdict;
+  uint8_t in_port;
+  uint8_t out_port;
+  uint8_t flags;
+} pkt_desc_t;
+
+/*
+* Header metadata filled in by parse, one array per field so a stage reads
+* a field of the whole batch at once. Index i describes pkts[i]. Offsets
+* are from data, 0 when the header was not found. Ports are kept in
+* network byte order and are 0 when the frame has none.
+*/
+typedef struct _pkt_meta {
+  uint16_t ethertype[PIPE_BATCH];
+  uint16_t vlan[PIPE_BATCH];
+  uint16_t l3_offset[PIPE_BATCH];
+  uint16_t l4_offset[PIPE_BATCH];
+  uint16_t sport[PIPE_BATCH];
+  uint16_t dport[PIPE_BATCH];
+  uint8_t ip_proto[PIPE_BATCH];
+} __attribute__((aligned(CACHE_LINE_SIZE))) pkt_meta_t;
+
+typedef struct _pkt_batch {
+  unsigned int count;
+  unsigned int held;
+  pkt_desc_t pkts[PIPE_BATCH];
+  pkt_meta_t meta;
+} pkt_batch_t;
+
+/*
+* A stage sees every frame of a batch that is still alive and returns the
+* number it marked VERDICT_DROP, those are removed before the next stage
+* together with the batch->held frames it marked VERDICT_HELD. counters
+* points at the values of the names in counter_names, they are printed
+* on exit and exported on the stats socket. A stage that holds frames
+* has poll, the loop calls it once due_ns has passed to collect those
+* that are due in a batch of their own.
+*/
+struct _pipe_stage;
+typedef unsigned int (*stage_fn_t)(struct _pipe_stage *stage, pkt_batch_t *batch);
+typedef unsigned int (*stage_poll_fn_t)(struct _pipe_stage *stage, pkt_batch_t *batch, uint64_t now);
+
+typedef struct _pipe_stage {
+  const char *name;
+  stage_fn_t process;
+  stage_poll_fn_t poll;
+  uint64_t due_ns;
+  void (*print)(struct _pipe_stage *stage);
+  void *priv;
+  const char * const *counter_names;
+  uint64_t *counters;
+  uint64_t packets;
+  uint64_t drops;
+} pipe_stage_t;
+
+/*
+* One pipeline per worker, ports are the worker's interfaces
+*/
+typedef struct _pipeline {
+  unsigned int nstages;
+  pipe_stage_t stages[PIPE_MAX_STAGES];
+  unsigned int nports;
+  intf_config_t *ports[PIPE_MAX_PORTS];
+  uint8_t peer[PIPE_MAX_PORTS];
+  bool has_poll;
+  uint64_t bad_redirects;
+  pkt_batch_t batch;
+} __attribute__((aligned(CACHE_LINE_SIZE))) pipeline_t;
+
+/*
+* Stages are looked up by name, init may allocate per worker state.
+* Stages that read the L3 and L4 metadata need parse earlier on.
+*/
+typedef struct _stage_def {
+  const char *name;
+  const char *help;
+  int (*init)(pipe_stage_t *stage, arg_config_t *arg_config, unsigned int worker);
+  stage_fn_t process;
+  void (*print)(pipe_stage_t *stage);
+  const char * const *counter_names;
+  bool needs_parse;
+  stage_poll_fn_t poll;
+} stage_def_t;
+
+/*
+* Descriptor of a frame fresh off a RX source, forwarded unless a stage
+* decides otherwise
+*/
+static inline void pkt_init(pkt_desc_t *pkt, uint8_t *data, uint32_t len, uint64_t rx_ns, unsigned int port){
+  __builtin_prefetch(data);
+  *pkt = (pkt_desc_t){
+    .data = data,
+    .rx_ns = rx_ns,
+    .len = len,
+    .verdict = VERDICT_FORWARD,
+    .in_port = port,
+    .out_port = PORT_NONE,
+  };
+}
+
+static inline void pkt_meta_move(pkt_meta_t *meta, unsigned int to, unsigned int from){
+  meta->ethertype[to] = meta->ethertype[from];
+  meta->vlan[to] = meta->vlan[from];
+  meta->l3_offset[to] = meta->l3_offset[from];
+  meta->l4_offset[to] = meta->l4_offset[from];
+  meta->sport[to] = meta->sport[from];
+  meta->dport[to] = meta->dport[from];
+  meta->ip_proto[to] = meta->ip_proto[from];
+}
+/*
+* Where forwarded frames of a port go
+*/
+static inline intf_config_t *pipe_peer(pipeline_t *pipe, unsigned int port){
+  return pipe->ports[pipe->peer[port]];
+}
+
+static inline void pipe_prefetch(pkt_batch_t *batch, unsigned int i){
+  if (i + PIPE_PREFETCH < batch->count){
+    __builtin_prefetch(batch->pkts[i + PIPE_PREFETCH].data);
+  }
+}
+
+bool pipeline_valid(char *spec);
+void pipeline_help(void);
+pipeline_t *pipeline_create(char *spec, arg_config_t *arg_config, unsigned int worker);
+void pipeline_add_port(pipeline_t *pipe, intf_config_t *config);
+void pipeline_set_peer(pipeline_t *pipe, unsigned int port, unsigned int peer);
+void pipeline_run(pipeline_t *pipe, pkt_batch_t *batch);
+void pipeline_resume(pipeline_t *pipe, pkt_batch_t *batch, unsigned int first);
+uint64_t pipeline_due(pipeline_t *pipe);
+void print_pipeline_stats(pipeline_t *pipe);
+/*
+* In vnfrw.c next to the TX engine
+*/
+void pipeline_output(pipeline_t *pipe, pkt_batch_t *batch, intf_config_t *w_config);
+void pipeline_flush(pipeline_t *pipe);
+void pipeline_poll(pipeline_t *pipe, uint64_t now);
+
+#endif /* VNFPIPE_H */
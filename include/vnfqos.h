@@ -0,0 +1,175 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef VNFQOS_H
+#define VNFQOS_H
+
+#define QOS_LINE_SIZE  256
+#define QOS_MAX_RULES  256
+#define QOS_DSCPS      64
+/*
+* Tokens are bytes times QOS_NS, a bucket earns rate tokens per ns and a
+* shortfall divided by the rate is the wait in ns
+*/
+#define QOS_NS 1000000000ULL
+/*
+* Bursts in bytes, by default the larger of a ms at the rate and
+* QOS_DEFAULT_BURST. Shaping queues in bytes.
+*/
+#define QOS_DEFAULT_BURST (64UL * 1024)
+#define QOS_MIN_BURST     2048
+#define QOS_MAX_BURST     (1UL << 32)
+#define QOS_MAX_RATE      (1000UL * 1000 * 1000 * 1000)
+#define QOS_DEFAULT_QUEUE (1UL << 20)
+#define QOS_MAX_QUEUE     (1UL << 30)
+/*
+* Timer wheel of the shaping queues, a tick is 2^QOS_TICK_SHIFT ns and
+* each level covers QOS_WHEEL_SLOTS ticks of the one below, about 1 ms,
+* 268 ms and 68 s. Later timers fire at the end of the wheel and rearm.
+*/
+#define QOS_TICK_SHIFT   12
+#define QOS_WHEEL_BITS   8
+#define QOS_WHEEL_SLOTS  (1U << QOS_WHEEL_BITS)
+#define QOS_WHEEL_LEVELS 3
+/*
+* Shaping queue entries, and the frame after them, are aligned to this
+*/
+#define QOS_ENTRY_ALIGN 64
+
+/*
+* A rule as written. A port rule limits every frame that comes in on the
+* port, a dscp rule the frames of a DSCP range on one port, or on each
+* port with its own bucket when no port is given. A frame of a class is
+* held to both the class and the port bucket. rate is in bits per second.
+*/
+typedef struct _qos_rule {
+  uint64_t rate;
+  uint64_t burst;
+  uint64_t queue;
+  uint8_t dscp_lo;
+  uint8_t dscp_hi;
+  uint8_t port;
+  bool is_class;
+  bool shape;
+} qos_rule_t;
+
+/*
+* rate is in bytes per second per worker, fill_ns the time an empty
+* bucket takes to fill. Buckets refill lazily when a frame needs them.
+*/
+typedef struct _qos_bucket {
+  uint64_t tokens;
+  uint64_t depth;
+  uint64_t rate;
+  uint64_t fill_ns;
+  uint64_t last_ns;
+  uint64_t passed;
+  uint64_t exceeded;
+  uint16_t parent;
+  uint8_t port;
+  bool shape;
+  const qos_rule_t *rule;
+} qos_bucket_t;
+
+/*
+* Frames held by a shaping queue are copied into a byte ring, the handed
+* entries from head to out were handed out and are freed on the next
+* poll, the pending ones from out to tail wait for tokens. An entry with
+* len 0 marks the unused end of the ring.
+*/
+typedef struct _qos_entry {
+  uint64_t rx_ns;
+  uint32_t len;
+  uint32_t size;
+  uint8_t verdict;
+  uint8_t in_port;
+  uint8_t out_port;
+  uint8_t vnet;
+} qos_entry_t;
+
+typedef struct _qos_queue {
+  uint8_t *buf;
+  uint64_t size;
+  uint64_t head;
+  uint64_t out;
+  uint64_t tail;
+  uint64_t used;
+  uint32_t pending;
+  uint32_t handed;
+  uint64_t due_tick;
+  struct _qos_queue *next;
+  uint16_t leaf;
+  bool armed;
+  bool ready;
+} qos_queue_t;
+
+/*
+* tick is the next tick to run, next a lower bound of the first tick
+* anything on the wheel needs to run at
+*/
+typedef struct _qos_wheel {
+  qos_queue_t *slots[QOS_WHEEL_LEVELS][QOS_WHEEL_SLOTS];
+  uint64_t tick;
+  uint64_t next;
+  unsigned int armed;
+} qos_wheel_t;
+
+/*
+* Per worker state. leaf is the bucket a frame starts at by input port
+* and DSCP, 0 when it is not limited. A leaf has a queue when its bucket
+* or the port bucket above it shapes.
+*/
+typedef struct _qos {
+  uint64_t conformed;
+  uint64_t policed;
+  uint64_t shaped;
+  uint64_t queue_full;
+  uint64_t released;
+  uint64_t oversize;
+  qos_bucket_t *buckets;
+  unsigned int nbuckets;
+  qos_queue_t **queues;
+  uint16_t leaf[PIPE_MAX_PORTS][QOS_DSCPS];
+  qos_wheel_t wheel;
+  qos_queue_t *ready_head;
+  qos_queue_t *ready_tail;
+  qos_queue_t *sent[PIPE_BATCH];
+  unsigned int nsent;
+} qos_t;
+
+int qos_parse_rule(char *line, qos_rule_t *rule);
+int qos_load(char *path, qos_rule_t *rules, unsigned int max_rules);
+int qos_init(qos_t *qos, const qos_rule_t *rules, unsigned int nrules, unsigned int workers);
+void qos_free(qos_t *qos);
+/*
+* Police and shape a batch at time now, returns the number of frames
+* dropped. Held frames get VERDICT_HELD.
+*/
+unsigned int qos_process(qos_t *qos, pkt_batch_t *batch, uint64_t now);
+/*
+* Fill batch with held frames that are due at now, they stay valid until
+* the next call. Returns the number of frames, 0 when none are due.
+*/
+unsigned int qos_poll(qos_t *qos, pkt_batch_t *batch, uint64_t now);
+/*
+* Earliest time a held frame may be due, UINT64_MAX when none is held
+*/
+uint64_t qos_due(qos_t *qos, uint64_t now);
+void qos_print(qos_t *qos);
+
+int qos_stage_init(pipe_stage_t *stage, arg_config_t *arg_config, unsigned int worker);
+unsigned int qos_stage(pipe_stage_t *stage, pkt_batch_t *batch);
+unsigned int qos_stage_poll(pipe_stage_t *stage, pkt_batch_t *batch, uint64_t now);
+void qos_stage_print(pipe_stage_t *stage);
+
+#endif /* VNFQOS_H */
@@ -0,0 +1,68 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef VNFSTATS_H
+#define VNFSTATS_H
+
+/*
+* Shared memory layout, readers map the segment read only:
+*
+*   vnf_stats_header_t
+*   intf_counters_t   counters[workers][ports]   written by the workers
+*   kernel_counters_t kernel[workers][ports]     written by the exporter
+*
+* The header also holds the frames the socket filter kept off the rings
+* of each interface, written by the exporter.
+*/
+#define VNF_STATS_MAGIC   0x564e4653
+#define VNF_STATS_VERSION 3
+#define VNF_STATS_PORTS   16
+#define VNF_STATS_PERIOD_MS 1000
+
+typedef struct _kernel_counters {
+  uint64_t packets;
+  uint64_t drops;
+  uint64_t freeze_q;
+} __attribute__((aligned(CACHE_LINE_SIZE))) kernel_counters_t;
+
+typedef struct _vnf_stats_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t pid;
+  uint32_t workers;
+  uint32_t ports;
+  uint32_t counters_offset;
+  uint32_t kernel_offset;
+  uint64_t update_ns;
+  char names[VNF_STATS_PORTS][IFNAMSIZ];
+  uint64_t filtered[VNF_STATS_PORTS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) vnf_stats_header_t;
+
+static inline intf_counters_t *stats_shm_counters(vnf_stats_header_t *header, unsigned int worker, unsigned int port){
+  return (intf_counters_t *)((uint8_t *)header + header->counters_offset) + worker * header->ports + port;
+}
+
+static inline kernel_counters_t *stats_shm_kernel(vnf_stats_header_t *header, unsigned int worker, unsigned int port){
+  return (kernel_counters_t *)((uint8_t *)header + header->kernel_offset) + worker * header->ports + port;
+}
+
+int stats_init(char *name, unsigned int workers, unsigned int ports, char names[][IFNAMSIZ]);
+intf_counters_t *stats_counters(unsigned int worker, unsigned int port);
+void stats_register_socket(unsigned int worker, unsigned int port, intf_config_t *config);
+void stats_poll_socket(intf_config_t *config);
+void stats_print_filter(void);
+struct _pipeline;
+void stats_register_pipeline(unsigned int worker, struct _pipeline *pipe);
+void stats_start(void);
+
+#endif /* VNFSTATS_H */
@@ -0,0 +1,48 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef VNFTUNE_H
+#define VNFTUNE_H
+
+/*
+* Link speed assumed when the driver does not report one (Mbps)
+*/
+#define TUNE_DEFAULT_SPEED 10000
+/*
+* Minimum Ethernet frame on the wire, preamble and gap included
+*/
+#define TUNE_WIRE_BYTES 84
+/*
+* Blocks are aimed at this size, a ring direction is capped at
+* TUNE_MAX_RING_BYTES
+*/
+#define TUNE_BLOCK_BYTES    (64UL * 1024)
+#define TUNE_MAX_RING_BYTES (64UL * 1024 * 1024)
+/*
+* Drops are sampled once a period
+*/
+#define TUNE_PERIOD_MS 1000
+#define TUNE_PERIOD_NS (TUNE_PERIOD_MS * 1000000ULL)
+
+/*
+* Size the rings of an opened socket before they are created
+*/
+void tune_init(intf_config_t *config, arg_config_t *arg_config);
+/*
+* Sample the drops of the last period, true when a larger geometry is
+* waiting to be applied
+*/
+bool tune_sample(intf_config_t *config, uint64_t now);
+void print_tune_stats(intf_config_t *config);
+
+#endif /* VNFTUNE_H */
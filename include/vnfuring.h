@@ -0,0 +1,84 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef VNFURING_H
+#define VNFURING_H
+
+#include <linux/io_uring.h>
+
+/*
+* Submission queue entries of a worker, the completion queue is twice as
+* large. With SQPOLL the kernel thread sleeps after URING_SQ_IDLE_MS
+* without submissions.
+*/
+#define URING_ENTRIES     256
+#define URING_SQ_IDLE_MS  50
+/*
+* user_data of an entry is its kind in the upper half and the port in the
+* lower one
+*/
+#define URING_POLL 1ULL
+#define URING_KICK 2ULL
+#define URING_DATA(kind, port) (((kind) << 32) | (port))
+#define URING_KIND(data)       ((data) >> 32)
+#define URING_PORT(data)       ((unsigned int)(data))
+
+/*
+* An io_uring set up and mapped without liburing. tail is the next
+* submission queue entry to fill, the kernel sees it on uring_enter().
+*/
+typedef struct _uring {
+  int fd;
+  bool sqpoll;
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t *sq_flags;
+  uint32_t *sq_array;
+  uint32_t sq_mask;
+  struct io_uring_sqe *sqes;
+  uint32_t tail;
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_map;
+  size_t sq_map_len;
+  void *cq_map;
+  size_t cq_map_len;
+  size_t sqes_len;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned int entries, bool sqpoll);
+void uring_free(uring_t *ring);
+/*
+* Next free submission queue entry cleared, NULL when the queue is full.
+* index is its position, see uring_taken().
+*/
+struct io_uring_sqe *uring_sqe(uring_t *ring, uint32_t *index);
+/*
+* True once the kernel took the entry at index off the queue
+*/
+bool uring_taken(uring_t *ring, uint32_t index);
+/*
+* Hand queued entries to the kernel and, with wait, sleep until a
+* completion arrives or timeout_ms passes, -1 waits forever. Returns 1
+* when it made a syscall, 0 when none was needed and -1 on errors.
+*/
+int uring_enter(uring_t *ring, bool wait, int timeout_ms);
+/*
+* Oldest completion not yet seen, NULL when there is none
+*/
+struct io_uring_cqe *uring_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+#endif /* VNFURING_H */
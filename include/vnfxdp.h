@@ -0,0 +1,66 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef VNFXDP_H
+#define VNFXDP_H
+
+#include <linux/if_xdp.h>
+
+/*
+* Single producer / single consumer ring shared with the kernel
+*/
+typedef struct _xsk_ring {
+  uint32_t *producer;
+  uint32_t *consumer;
+  uint32_t *flags;
+  void *ring;
+  uint32_t size;
+  uint32_t mask;
+  void *map;
+  size_t map_len;
+} xsk_ring_t;
+
+typedef struct _xsk_socket {
+  int fd;
+  int ifindex;
+  int map_fd;
+  int prog_fd;
+  int link_fd;
+  char name[IFNAMSIZ];
+  xsk_ring_t rx;
+  xsk_ring_t tx;
+  xsk_ring_t fill;
+  xsk_ring_t comp;
+  intf_counters_t *stats;
+} xsk_socket_t;
+
+/*
+* Both sockets share one UMEM, a frame received on one interface is
+* forwarded by moving its descriptor to the TX ring of the other
+*/
+typedef struct _xdp_config {
+  uint8_t *umem;
+  size_t umem_len;
+  uint32_t frame_size;
+  uint32_t ring_size;
+  bool drv_mode;
+  bool single;
+  xsk_socket_t sock[2];
+} xdp_config_t;
+
+#define XDP_BATCH_SIZE 64
+
+int xdp_setup(xdp_config_t *xdp, intf_config_t *f_config, intf_config_t *s_config, bool drv_mode);
+void xdp_read_write(xdp_config_t *xdp);
+
+#endif /* VNFXDP_H */
@@ -0,0 +1,156 @@
+#!/bin/sh
+#
+# End to end throughput and latency of the VNF on veth pairs
+#
+#   dual:   ns vnfgen (ga0) <-> ga1 [ vnf ] gb1 <-> (gb0) ns vnfgen
+#   single: ns vnfgen (ga0) <-> ga1 [ vnf ]
+#
+# vnf runs in ns vnfbench, vnfgen sends on ga0 and receives on gb0, or on
+# ga0 in single mode, so the payload timestamp times the whole trip.
+# Comparing NUMA nodes for the VNF with vnfgen pinned to a core of one
+# shows the cost of remote placement. Running every test with each event
+# loop compares the syscalls they make per packet.
+# Results are printed as JSON. Must be run as root from the top of the
+# repository after make.
+#
+show_help() {
+cat << EOF
+Usage: ${0##*/} [-h] [-t seconds] [-s "frame lengths"] [-m "modes"] [-M "MTUs"] [-N "NUMA nodes"] [-c cpu] [-R rate] [-E "event loops"] [-a "vnf arguments"] [-o file]
+
+     -h          display this help and exit
+     -t          seconds of traffic per run (default 5)
+     -s          frame lengths (default "64 128 512 1500")
+     -m          VNF modes, single and/or dual (default "single dual")
+     -M          MTUs of the veths, frames longer than one are skipped (default 1500)
+     -N          NUMA nodes of the VNF, auto, off or node numbers (default auto)
+     -c          core to pin vnfgen to (default none)
+     -R          frames per second to send, 0 is as fast as possible (default 0)
+     -E          VNF event loops, epoll, uring and/or sqpoll (default epoll)
+     -a          extra vnf arguments (default "-r 256 -n 4")
+     -o          write the JSON report to a file as well
+EOF
+}
+
+opt_t=5
+opt_s="64 128 512 1500"
+opt_m="single dual"
+opt_M=1500
+opt_N=auto
+opt_c=""
+opt_R=0
+opt_E=epoll
+opt_a="-r 256 -n 4"
+opt_o=""
+while getopts "ht:s:m:M:N:c:R:E:a:o:" opt; do
+    case "$opt" in
+        h)
+            show_help
+            exit 0
+            ;;
+        t) opt_t=$OPTARG
+           ;;
+        s) opt_s=$OPTARG
+           ;;
+        m) opt_m=$OPTARG
+           ;;
+        M) opt_M=$OPTARG
+           ;;
+        N) opt_N=$OPTARG
+           ;;
+        c) opt_c="-c $OPTARG"
+           ;;
+        R) opt_R=$OPTARG
+           ;;
+        E) opt_E=$OPTARG
+           ;;
+        a) opt_a=$OPTARG
+           ;;
+        o) opt_o=$OPTARG
+           ;;
+        '?')
+            show_help
+            exit 1
+            ;;
+    esac
+done
+
+VNF=./bin/vnf
+GEN=./bin/vnfgen
+if [ ! -x "$VNF" ] || [ ! -x "$GEN" ]; then
+        printf "\nERROR: Build the VNF with make first\n"
+        exit 1
+fi
+if [ "$(id -u)" -ne 0 ]; then
+        printf "\nERROR: Must be run as root\n"
+        exit 1
+fi
+
+cleanup() {
+        ip netns pids vnfbench 2>/dev/null | xargs -r kill 2>/dev/null
+        ip netns del vnfgen 2>/dev/null
+        ip netns del vnfbench 2>/dev/null
+}
+trap cleanup EXIT
+
+cleanup
+ip netns add vnfgen
+ip netns add vnfbench
+ip link add ga0 netns vnfgen type veth peer name ga1 netns vnfbench
+ip link add gb0 netns vnfgen type veth peer name gb1 netns vnfbench
+for i in ga0 gb0; do
+        ip -n vnfgen link set $i up
+done
+for i in ga1 gb1; do
+        ip -n vnfbench link set $i up
+done
+
+report=$(mktemp)
+first=1
+printf '{"kernel": "%s", "commit": "%s", "vnf_args": "%s", "seconds": %s, "results": [' \
+        "$(uname -r)" "$(git rev-parse --short HEAD 2>/dev/null)" "$opt_a" "$opt_t" > "$report"
+for mtu in $opt_M; do
+        for i in ga0 gb0; do
+                ip -n vnfgen link set $i mtu $mtu
+        done
+        for i in ga1 gb1; do
+                ip -n vnfbench link set $i mtu $mtu
+        done
+        for numa in $opt_N; do
+                for events in $opt_E; do
+                        for mode in $opt_m; do
+                                if [ "$mode" = "single" ]; then
+                                        vnf_if="-f ga1"
+                                        rx_if=ga0
+                                else
+                                        vnf_if="-f ga1 -s gb1"
+                                        rx_if=gb0
+                                fi
+                                for len in $opt_s; do
+                                        if [ $len -gt $((mtu + 14)) ]; then
+                                                continue
+                                        fi
+                                        ip netns exec vnfbench $VNF $vnf_if -N $numa -E $events $opt_a > /tmp/vnf_bench_$mode.log 2>&1 &
+                                        vnf_pid=$!
+                                        sleep 1
+                                        result=$(ip netns exec vnfgen $GEN $opt_c -m rtt -i ga0 -o $rx_if -t $opt_t -l $len -R $opt_R -F 256)
+                                        kill -INT $vnf_pid 2>/dev/null
+                                        wait $vnf_pid 2>/dev/null
+                                        if [ -z "$result" ]; then
+                                                result='{"frame_len": '$len', "error": "no result"}'
+                                        fi
+                                        syscalls=$(sed -n 's/.*syscalls per packet: \([0-9.]*\).*/\1/p' /tmp/vnf_bench_$mode.log | tail -1)
+                                        [ $first -eq 1 ] || printf ', ' >> "$report"
+                                        first=0
+                                        printf '{"mode": "%s", "mtu": %s, "numa": "%s", "events": "%s", "syscalls_per_packet": %s, %s' \
+                                                "$mode" "$mtu" "$numa" "$events" "${syscalls:-null}" "${result#\{}" >> "$report"
+                                done
+                        done
+                done
+        done
+done
+printf ']}\n' >> "$report"
+cat "$report"
+if [ -n "$opt_o" ]; then
+        cp "$report" "$opt_o"
+fi
+rm -f "$report"
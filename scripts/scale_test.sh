@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# Measure VNF throughput for 1..N fanout workers on a veth pair
+#
+#   ns vnfa (va0) <-> va1 [ vnf ] vb1 <-> (vb0) ns vnfb
+#
+# Must be run as root from the top of the repository after make.
+#
+show_help() {
+cat << EOF
+Usage: ${0##*/} [-h] [-n max workers] [-t seconds] [-l frame length] [-F flows] [-m fanout mode]
+
+     -h          display this help and exit
+     -n          maximum number of workers (default 4)
+     -t          seconds of traffic per run (default 5)
+     -l          frame length (default 64)
+     -F          number of UDP flows (default 256)
+     -m          fanout mode hash, cpu or qm (default hash)
+EOF
+}
+
+opt_n=4
+opt_t=5
+opt_l=64
+opt_F=256
+opt_m=hash
+while getopts "hn:t:l:F:m:" opt; do
+    case "$opt" in
+        h)
+            show_help
+            exit 0
+            ;;
+        n) opt_n=$OPTARG
+           ;;
+        t) opt_t=$OPTARG
+           ;;
+        l) opt_l=$OPTARG
+           ;;
+        F) opt_F=$OPTARG
+           ;;
+        m) opt_m=$OPTARG
+           ;;
+        '?')
+            show_help
+            exit 1
+            ;;
+    esac
+done
+
+VNF=./bin/vnf
+GEN=./bin/vnfgen
+if [ ! -x "$VNF" ] || [ ! -x "$GEN" ]; then
+        printf "\nERROR: Build the VNF with make first\n"
+        exit 1
+fi
+
+cleanup() {
+        ip netns del vnfa 2>/dev/null
+        ip netns del vnfb 2>/dev/null
+        ip link del va1 2>/dev/null
+        ip link del vb1 2>/dev/null
+}
+trap cleanup EXIT
+
+cleanup
+ip netns add vnfa
+ip netns add vnfb
+ip link add va1 type veth peer name va0 netns vnfa
+ip link add vb1 type veth peer name vb0 netns vnfb
+ip link set va1 up
+ip link set vb1 up
+ip -n vnfa link set va0 up
+ip -n vnfb link set vb0 up
+
+ncpu=$(nproc)
+printf "workers,tx_pps,rx_pps,loss_pct\n"
+w=1
+while [ $w -le $opt_n ]; do
+        cpus="0"
+        if [ $w -gt 1 ]; then
+                cpus="0-$(( (w - 1) % ncpu ))"
+        fi
+        $VNF -f va1 -s vb1 -w $w -m $opt_m -c $cpus -r 256 -n 4 > /tmp/vnf_scale_$w.log 2>&1 &
+        vnf_pid=$!
+        sleep 1
+        ip netns exec vnfb $GEN -i vb0 -m rx -t $(( opt_t + 5 )) -l $opt_l > /tmp/vnf_scale_rx.txt &
+        rx_pid=$!
+        sleep 0.5
+        ip netns exec vnfa $GEN -i va0 -m tx -t $opt_t -l $opt_l -F $opt_F > /tmp/vnf_scale_tx.txt
+        wait $rx_pid
+        kill -INT $vnf_pid 2>/dev/null
+        wait $vnf_pid 2>/dev/null
+        tx=$(sed -n 's/.*pps \([0-9]*\).*/\1/p' /tmp/vnf_scale_tx.txt)
+        rx=$(sed -n 's/.*pps \([0-9]*\).*/\1/p' /tmp/vnf_scale_rx.txt)
+        txp=$(sed -n 's/tx: packets \([0-9]*\).*/\1/p' /tmp/vnf_scale_tx.txt)
+        rxp=$(sed -n 's/rx: packets \([0-9]*\).*/\1/p' /tmp/vnf_scale_rx.txt)
+        loss=$(awk -v t="$txp" -v r="$rxp" 'BEGIN { if (t > 0) printf "%.2f", (t - r) * 100 / t; else print "0" }')
+        printf "%d,%s,%s,%s\n" $w "$tx" "$rx" "$loss"
+        w=$(( w + 1 ))
+done
@@ -0,0 +1,129 @@
+#!/bin/sh
+#
+# Bulk TCP throughput through the VNF and the VNF CPU time it costs
+#
+#   ns tcpa (ta0 10.99.0.1) <-> ta1 [ vnf ] tb1 <-> (tb0 10.99.0.2) ns tcpb
+#
+# vnf runs in ns vnfbench, vnfgen sends one TCP stream from tcpa to tcpb.
+# The sender runs with GSO on, handing the VNF packets of up to 64 KB, and
+# off, one segment per packet. Results are printed as JSON. Must be run as
+# root from the top of the repository after make.
+#
+show_help() {
+cat << EOF
+Usage: ${0##*/} [-h] [-t seconds] [-g "gso settings"] [-a "vnf arguments"] [-o file]
+
+     -h          display this help and exit
+     -t          seconds of traffic per run (default 5)
+     -g          sender GSO, on and/or off (default "on off")
+     -a          extra vnf arguments (default "-g")
+     -o          write the JSON report to a file as well
+EOF
+}
+
+opt_t=5
+opt_g="on off"
+opt_a="-g"
+opt_o=""
+while getopts "ht:g:a:o:" opt; do
+    case "$opt" in
+        h)
+            show_help
+            exit 0
+            ;;
+        t) opt_t=$OPTARG
+           ;;
+        g) opt_g=$OPTARG
+           ;;
+        a) opt_a=$OPTARG
+           ;;
+        o) opt_o=$OPTARG
+           ;;
+        '?')
+            show_help
+            exit 1
+            ;;
+    esac
+done
+
+VNF=./bin/vnf
+GEN=./bin/vnfgen
+if [ ! -x "$VNF" ] || [ ! -x "$GEN" ]; then
+        printf "\nERROR: Build the VNF with make first\n"
+        exit 1
+fi
+if [ "$(id -u)" -ne 0 ]; then
+        printf "\nERROR: Must be run as root\n"
+        exit 1
+fi
+
+cleanup() {
+        ip netns pids vnfbench 2>/dev/null | xargs -r kill 2>/dev/null
+        ip netns del tcpa 2>/dev/null
+        ip netns del tcpb 2>/dev/null
+        ip netns del vnfbench 2>/dev/null
+}
+trap cleanup EXIT
+
+#
+# User plus system time of a process in seconds
+#
+cpu_seconds() {
+        awk -v hz="$(getconf CLK_TCK)" '{ print ($14 + $15) / hz }' /proc/$1/stat
+}
+
+cleanup
+ip netns add tcpa
+ip netns add tcpb
+ip netns add vnfbench
+ip link add ta0 netns tcpa type veth peer name ta1 netns vnfbench
+ip link add tb0 netns tcpb type veth peer name tb1 netns vnfbench
+ip -n tcpa addr add 10.99.0.1/24 dev ta0
+ip -n tcpb addr add 10.99.0.2/24 dev tb0
+ip -n tcpa link set ta0 up
+ip -n tcpb link set tb0 up
+for i in ta1 tb1; do
+        ip -n vnfbench link set $i up
+done
+
+report=$(mktemp)
+rx_out=$(mktemp)
+first=1
+printf '{"kernel": "%s", "commit": "%s", "vnf_args": "%s", "seconds": %s, "results": [' \
+        "$(uname -r)" "$(git rev-parse --short HEAD 2>/dev/null)" "$opt_a" "$opt_t" > "$report"
+for gso in $opt_g; do
+        if [ "$gso" = "on" ]; then
+                ip -n tcpa link set ta0 gso_max_segs 65535
+        else
+                ip -n tcpa link set ta0 gso_max_segs 1
+        fi
+        ip netns exec vnfbench $VNF -f ta1 -s tb1 $opt_a > /tmp/vnf_tcp_bench.log 2>&1 &
+        vnf_pid=$!
+        sleep 1
+        ip netns exec tcpb $GEN -m tcp-rx -t $opt_t > "$rx_out" &
+        rx_pid=$!
+        cpu_start=$(cpu_seconds $vnf_pid)
+        ip netns exec tcpa $GEN -m tcp-tx -d 10.99.0.2 -t $opt_t > /dev/null
+        wait $rx_pid
+        cpu_end=$(cpu_seconds $vnf_pid)
+        kill -INT $vnf_pid 2>/dev/null
+        wait $vnf_pid 2>/dev/null
+        result=$(cat "$rx_out")
+        if [ "${result#\{}" = "$result" ]; then
+                result='{"error": "no result"}'
+        else
+                bytes=$(echo "$result" | sed 's/.*"bytes": \([0-9]*\).*/\1/')
+                result=$(awk -v r="$result" -v s="$cpu_start" -v e="$cpu_end" -v b="$bytes" 'BEGIN {
+                        sub(/}$/, "", r)
+                        printf "%s, \"vnf_cpu_s\": %.2f, \"vnf_cpu_s_per_gb\": %.3f}", r, e - s, (b > 0) ? (e - s) * 1e9 / b : 0 }')
+        fi
+        [ $first -eq 1 ] || printf ', ' >> "$report"
+        first=0
+        printf '{"gso": "%s", %s' "$gso" "${result#\{}" >> "$report"
+done
+printf ']}\n' >> "$report"
+cat "$report"
+if [ -n "$opt_o" ]; then
+        cp "$report" "$opt_o"
+fi
+rm -f "$report" "$rx_out"
@@ -0,0 +1,852 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*! ACL classifier
+ *
+ * Rules match on source and destination prefixes, port ranges, protocol,
+ * VLAN and input interface. They are compiled for tuple space search:
+ * the rules sharing a field mask go into one hash table, keyed by their
+ * masked fields. Port ranges wider than one port are not part of the key
+ * and are checked on the few rules an entry lists. A lookup probes the
+ * tables in order of the best rule they hold and stops once no table left
+ * can beat the match found. Batches are classified one table at a time so
+ * the probes of a batch overlap.
+ *
+ * Rule file, one rule per line, # starts a comment:
+ *
+ *   <priority> permit|deny|redirect <port> [src <prefix>] [dst <prefix>]
+ *       [sport <lo>[-<hi>]] [dport <lo>[-<hi>]] [proto <name|number>]
+ *       [vlan <id>] [in <port>]
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+//
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnfpipe.h"
+#include "vnfflow.h"
+#include "vnfacl.h"
+
+typedef struct _acl_stage {
+	acl_table_t *acl;
+	uint64_t matched;
+	uint64_t unmatched;
+	uint64_t redirects;
+	flow_key_t keys[PIPE_BATCH];
+	uint32_t rules[PIPE_BATCH];
+	uint8_t index[PIPE_BATCH];
+} acl_stage_t;
+/*
+* Every worker classifies against the same read only rule set
+*/
+static acl_table_t *acl_shared;
+
+static void prefix_mask(uint8_t *mask, unsigned int len){
+	unsigned int i;
+
+	memset(mask, 0, 16);
+	for (i = 0; i < len / 8; i++){
+		mask[i] = 0xff;
+	}
+	if (len % 8){
+		mask[i] = 0xff << (8 - len % 8);
+	}
+}
+
+static bool prefix_match(uint8_t *addr, uint8_t *prefix, unsigned int len){
+	uint8_t mask[16];
+	unsigned int i;
+
+	prefix_mask(mask, len);
+	for (i = 0; i < 16; i++){
+		if ((addr[i] & mask[i]) != prefix[i]){
+			return false;
+		}
+	}
+	return true;
+}
+static inline bool port_keyed(uint16_t lo, uint16_t hi){
+	return lo == hi || (lo == 0 && hi == 65535);
+}
+
+/*
+* The words are multiplied independently so the probes of a lookup do not
+* wait on one long multiply chain each
+*/
+static inline uint64_t acl_hash(flow_key_t *key){
+	static const uint64_t k[6] = {
+		0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL,
+		0xd6e8feb86659fd93ULL, 0xff51afd7ed558ccdULL, 0xc4ceb9fe1a85ec53ULL
+	};
+	uint64_t w[6];
+	uint64_t h = 0;
+	unsigned int i;
+
+	memcpy(w, key, sizeof(w));
+	for (i = 0; i < 6; i++){
+		h += w[i] * k[i];
+	}
+	return flow_mix(h);
+}
+
+static inline bool acl_ports_match(acl_rule_t *rule, flow_key_t *key){
+	uint16_t sport = ntohs(key->sport), dport = ntohs(key->dport);
+
+	return sport >= rule->sport_lo && sport <= rule->sport_hi && dport >= rule->dport_lo && dport <= rule->dport_hi;
+}
+
+acl_table_t *acl_new(void){
+	acl_table_t *acl = calloc(1, sizeof(acl_table_t));
+
+	if (acl == NULL){
+		perror("calloc acl");
+	}
+	return acl;
+}
+
+static void acl_free_tuples(acl_table_t *acl){
+	unsigned int t;
+
+	for (t = 0; t < acl->ntuples; t++){
+		free(acl->tuples[t].table);
+	}
+	free(acl->tuples);
+	free(acl->lists);
+	acl->tuples = NULL;
+	acl->ntuples = 0;
+	acl->nentries = 0;
+	acl->lists = NULL;
+	acl->nlists = 0;
+	acl->lists_size = 0;
+}
+
+void acl_free(acl_table_t *acl){
+	acl_free_tuples(acl);
+	free(acl->rules);
+	free(acl);
+}
+
+static int parse_prefix(char *str, acl_rule_t *rule, uint8_t *addr, uint8_t *len){
+	char buf[INET6_ADDRSTRLEN + 4];
+	char *slash;
+	uint8_t mask[16];
+	uint16_t ethertype;
+	unsigned int max, i;
+	long plen;
+
+	strncpy(buf, str, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+	slash = strchr(buf, '/');
+	if (slash != NULL){
+		*slash++ = '\0';
+	}
+	memset(addr, 0, 16);
+	if (inet_pton(AF_INET, buf, addr) == 1){
+		ethertype = ETH_P_IP;
+		max = 32;
+	} else if (inet_pton(AF_INET6, buf, addr) == 1){
+		ethertype = ETH_P_IPV6;
+		max = 128;
+	} else {
+		printf("ERROR: Invalid address: %s\n", str);
+		return -1;
+	}
+	plen = max;
+	if (slash != NULL){
+		errno = 0;
+		plen = strtol(slash, NULL, 10);
+		if (errno != 0 || plen < 0 || plen > max){
+			printf("ERROR: Invalid prefix length: %s\n", str);
+			return -1;
+		}
+	}
+	if (rule->ethertype != 0 && rule->ethertype != ethertype){
+		printf("ERROR: Mixed IPv4 and IPv6 addresses in a rule\n");
+		return -1;
+	}
+	rule->ethertype = ethertype;
+	prefix_mask(mask, plen);
+	for (i = 0; i < 16; i++){
+		addr[i] &= mask[i];
+	}
+	*len = plen;
+	return 0;
+}
+
+static int parse_range(char *str, uint16_t *lo, uint16_t *hi){
+	char *end;
+	unsigned long l, h;
+
+	l = strtoul(str, &end, 10);
+	h = l;
+	if (*end == '-'){
+		h = strtoul(end + 1, &end, 10);
+	}
+	if (*end != '\0' || l > h || h > 65535){
+		printf("ERROR: Invalid port range: %s\n", str);
+		return -1;
+	}
+	*lo = l;
+	*hi = h;
+	return 0;
+}
+
+static int parse_proto(char *str, uint8_t *proto){
+	char *end;
+	unsigned long p;
+
+	if (strcmp(str, "tcp") == 0){
+		*proto = IPPROTO_TCP;
+	} else if (strcmp(str, "udp") == 0){
+		*proto = IPPROTO_UDP;
+	} else if (strcmp(str, "icmp") == 0){
+		*proto = IPPROTO_ICMP;
+	} else if (strcmp(str, "icmpv6") == 0){
+		*proto = IPPROTO_ICMPV6;
+	} else if (strcmp(str, "sctp") == 0){
+		*proto = IPPROTO_SCTP;
+	} else {
+		p = strtoul(str, &end, 10);
+		if (*end != '\0' || p > 255){
+			printf("ERROR: Invalid protocol: %s\n", str);
+			return -1;
+		}
+		*proto = p;
+	}
+	return 0;
+}
+/*
+* Parse one line of a rule file, 1 for blank lines and comments
+*/
+int acl_parse_rule(char *line, acl_rule_t *rule){
+	char *tok, *arg, *save, *end;
+	unsigned long v;
+
+	memset(rule, 0, sizeof(*rule));
+	rule->sport_hi = 65535;
+	rule->dport_hi = 65535;
+	if ((end = strchr(line, '#')) != NULL){
+		*end = '\0';
+	}
+	tok = strtok_r(line, " \t\r\n", &save);
+	if (tok == NULL){
+		return 1;
+	}
+	v = strtoul(tok, &end, 10);
+	if (*end != '\0' || v > UINT32_MAX){
+		printf("ERROR: Invalid priority: %s\n", tok);
+		return -1;
+	}
+	rule->priority = v;
+	tok = strtok_r(NULL, " \t\r\n", &save);
+	if (tok == NULL){
+		printf("ERROR: Missing action\n");
+		return -1;
+	}
+	if (strcmp(tok, "permit") == 0){
+		rule->action = ACL_PERMIT;
+	} else if (strcmp(tok, "deny") == 0){
+		rule->action = ACL_DENY;
+	} else if (strcmp(tok, "redirect") == 0){
+		rule->action = ACL_REDIRECT;
+		arg = strtok_r(NULL, " \t\r\n", &save);
+		if (arg == NULL || (v = strtoul(arg, &end, 10)) >= PORT_NONE || *end != '\0'){
+			printf("ERROR: redirect needs a port number\n");
+			return -1;
+		}
+		rule->port = v;
+	} else {
+		printf("ERROR: Unknown action: %s\n", tok);
+		return -1;
+	}
+	while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL){
+		arg = strtok_r(NULL, " \t\r\n", &save);
+		if (arg == NULL){
+			printf("ERROR: %s needs a value\n", tok);
+			return -1;
+		}
+		if (strcmp(tok, "src") == 0){
+			if (parse_prefix(arg, rule, rule->src, &rule->src_len) == -1){
+				return -1;
+			}
+		} else if (strcmp(tok, "dst") == 0){
+			if (parse_prefix(arg, rule, rule->dst, &rule->dst_len) == -1){
+				return -1;
+			}
+		} else if (strcmp(tok, "sport") == 0){
+			if (parse_range(arg, &rule->sport_lo, &rule->sport_hi) == -1){
+				return -1;
+			}
+		} else if (strcmp(tok, "dport") == 0){
+			if (parse_range(arg, &rule->dport_lo, &rule->dport_hi) == -1){
+				return -1;
+			}
+		} else if (strcmp(tok, "proto") == 0){
+			if (parse_proto(arg, &rule->proto) == -1){
+				return -1;
+			}
+			rule->match |= ACL_MATCH_PROTO;
+		} else if (strcmp(tok, "vlan") == 0){
+			v = strtoul(arg, &end, 10);
+			if (*end != '\0' || v > 4095){
+				printf("ERROR: Invalid VLAN: %s\n", arg);
+				return -1;
+			}
+			rule->vlan = v;
+			rule->match |= ACL_MATCH_VLAN;
+		} else if (strcmp(tok, "in") == 0){
+			v = strtoul(arg, &end, 10);
+			if (*end != '\0' || v >= PORT_NONE){
+				printf("ERROR: Invalid input port: %s\n", arg);
+				return -1;
+			}
+			rule->in_port = v;
+			rule->match |= ACL_MATCH_IN;
+		} else {
+			printf("ERROR: Unknown match: %s\n", tok);
+			return -1;
+		}
+	}
+	return 0;
+}
+/*
+* Write a rule back in the rule file syntax
+*/
+void acl_format_rule(FILE *out, acl_rule_t *rule){
+	char addr[INET6_ADDRSTRLEN];
+	int af = (rule->ethertype == ETH_P_IPV6) ? AF_INET6 : AF_INET;
+
+	fprintf(out, "%u %s", rule->priority, (rule->action == ACL_DENY) ? "deny" : (rule->action == ACL_REDIRECT) ? "redirect" : "permit");
+	if (rule->action == ACL_REDIRECT){
+		fprintf(out, " %u", rule->port);
+	}
+	if (rule->src_len > 0){
+		fprintf(out, " src %s/%u", inet_ntop(af, rule->src, addr, sizeof(addr)), rule->src_len);
+	}
+	if (rule->dst_len > 0){
+		fprintf(out, " dst %s/%u", inet_ntop(af, rule->dst, addr, sizeof(addr)), rule->dst_len);
+	}
+	if (rule->sport_lo != 0 || rule->sport_hi != 65535){
+		fprintf(out, " sport %u-%u", rule->sport_lo, rule->sport_hi);
+	}
+	if (rule->dport_lo != 0 || rule->dport_hi != 65535){
+		fprintf(out, " dport %u-%u", rule->dport_lo, rule->dport_hi);
+	}
+	if (rule->match & ACL_MATCH_PROTO){
+		fprintf(out, " proto %u", rule->proto);
+	}
+	if (rule->match & ACL_MATCH_VLAN){
+		fprintf(out, " vlan %u", rule->vlan);
+	}
+	if (rule->match & ACL_MATCH_IN){
+		fprintf(out, " in %u", rule->in_port);
+	}
+	fprintf(out, "\n");
+}
+
+int acl_add_rule(acl_table_t *acl, acl_rule_t *rule){
+	acl_rule_t *rules;
+	unsigned int size;
+
+	if (acl->nrules == acl->rules_size){
+		size = (acl->rules_size == 0) ? 1024 : acl->rules_size * 2;
+		rules = realloc(acl->rules, size * sizeof(acl_rule_t));
+		if (rules == NULL){
+			perror("realloc acl rules");
+			return -1;
+		}
+		acl->rules = rules;
+		acl->rules_size = size;
+	}
+	acl->rules[acl->nrules++] = *rule;
+	return 0;
+}
+
+static acl_tuple_t *acl_find_tuple(acl_table_t *acl, flow_key_t *mask, unsigned int *cap){
+	acl_tuple_t *tuples;
+	unsigned int t;
+
+	for (t = 0; t < acl->ntuples; t++){
+		if (flow_key_equal(&acl->tuples[t].mask, mask)){
+			return &acl->tuples[t];
+		}
+	}
+	if (acl->ntuples == *cap){
+		*cap = (*cap == 0) ? 64 : *cap * 2;
+		tuples = realloc(acl->tuples, *cap * sizeof(acl_tuple_t));
+		if (tuples == NULL){
+			perror("realloc acl tuples");
+			return NULL;
+		}
+		acl->tuples = tuples;
+	}
+	memset(&acl->tuples[acl->ntuples], 0, sizeof(acl_tuple_t));
+	acl->tuples[acl->ntuples].mask = *mask;
+	return &acl->tuples[acl->ntuples++];
+}
+/*
+* While compiling, table holds one unhashed entry per rule with the rule
+* in list
+*/
+static int acl_tuple_push(acl_tuple_t *tuple, flow_key_t *key, uint64_t rank, uint32_t rule){
+	acl_entry_t *table;
+	unsigned int size;
+
+	if (tuple->nentries == tuple->size){
+		size = (tuple->size == 0) ? 16 : tuple->size * 2;
+		table = realloc(tuple->table, size * sizeof(acl_entry_t));
+		if (table == NULL){
+			perror("realloc acl entries");
+			return -1;
+		}
+		tuple->table = table;
+		tuple->size = size;
+	}
+	tuple->table[tuple->nentries].key = *key;
+	tuple->table[tuple->nentries].rank = rank;
+	tuple->table[tuple->nentries].list = rule;
+	tuple->nentries++;
+	tuple->max_rank = MAX(tuple->max_rank, rank);
+	return 0;
+}
+
+static int acl_list_push(acl_table_t *acl, uint32_t rule){
+	uint32_t *lists;
+	unsigned long size;
+
+	if (acl->nlists == acl->lists_size){
+		size = (acl->lists_size == 0) ? 1024 : acl->lists_size * 2;
+		lists = realloc(acl->lists, size * sizeof(uint32_t));
+		if (lists == NULL){
+			perror("realloc acl lists");
+			return -1;
+		}
+		acl->lists = lists;
+		acl->lists_size = size;
+	}
+	acl->lists[acl->nlists++] = rule;
+	return 0;
+}
+/*
+* Same keys next to each other, best rank first
+*/
+static int acl_entry_cmp(const void *a, const void *b){
+	const acl_entry_t *ea = a, *eb = b;
+	int diff = memcmp(&ea->key, &eb->key, sizeof(flow_key_t));
+
+	if (diff != 0){
+		return diff;
+	}
+	return (ea->rank < eb->rank) - (ea->rank > eb->rank);
+}
+/*
+* One entry per distinct key, open addressing with linear probing at most
+* half full
+*/
+static int acl_tuple_hash(acl_table_t *acl, acl_tuple_t *tuple){
+	acl_entry_t *table, *entry, *first;
+	acl_rule_t *rule;
+	uint64_t size = 4, i;
+	unsigned int e, next, n = 0;
+
+	qsort(tuple->table, tuple->nentries, sizeof(acl_entry_t), acl_entry_cmp);
+	for (e = 0; e < tuple->nentries; e++){
+		if (e == 0 || !flow_key_equal(&tuple->table[e].key, &tuple->table[e - 1].key)){
+			n++;
+		}
+	}
+	while (size < 2ULL * n){
+		size <<= 1;
+	}
+	if (posix_memalign((void **)&table, CACHE_LINE_SIZE, size * sizeof(acl_entry_t)) != 0){
+		perror("posix_memalign acl table");
+		return -1;
+	}
+	memset(table, 0, size * sizeof(acl_entry_t));
+	for (e = 0; e < tuple->nentries; e = next){
+		first = &tuple->table[e];
+		for (i = acl_hash(&first->key) & (size - 1); table[i].count != 0; i = (i + 1) & (size - 1));
+		entry = &table[i];
+		entry->key = first->key;
+		entry->rank = first->rank;
+		entry->list = acl->nlists;
+		rule = &acl->rules[first->list];
+		entry->ranged = !port_keyed(rule->sport_lo, rule->sport_hi) || !port_keyed(rule->dport_lo, rule->dport_hi);
+		for (next = e; next < tuple->nentries && flow_key_equal(&tuple->table[next].key, &first->key); next++){
+			if (acl_list_push(acl, tuple->table[next].list) == -1){
+				free(table);
+				return -1;
+			}
+			entry->count++;
+		}
+	}
+	free(tuple->table);
+	tuple->table = table;
+	tuple->tmask = size - 1;
+	tuple->size = size;
+	tuple->nentries = n;
+	return 0;
+}
+
+static int acl_tuple_cmp(const void *a, const void *b){
+	const acl_tuple_t *ta = a, *tb = b;
+
+	return (ta->max_rank < tb->max_rank) - (ta->max_rank > tb->max_rank);
+}
+/*
+* Turn the rules into hash tables, tables with the best rules come first
+*/
+int acl_compile(acl_table_t *acl){
+	acl_rule_t *rule;
+	acl_tuple_t *tuple;
+	flow_key_t key, mask;
+	unsigned int r, cap = 0, t;
+
+	acl_free_tuples(acl);
+	for (r = 0; r < acl->nrules; r++){
+		rule = &acl->rules[r];
+		memset(&key, 0, sizeof(key));
+		memset(&mask, 0, sizeof(mask));
+		prefix_mask(mask.src, rule->src_len);
+		prefix_mask(mask.dst, rule->dst_len);
+		memcpy(key.src, rule->src, 16);
+		memcpy(key.dst, rule->dst, 16);
+		if (rule->ethertype != 0){
+			key.ethertype = rule->ethertype;
+			mask.ethertype = 0xffff;
+		}
+		/*
+		* Keys carry the ports as they are on the wire
+		*/
+		if (rule->sport_lo == rule->sport_hi){
+			key.sport = htons(rule->sport_lo);
+			mask.sport = 0xffff;
+		}
+		if (rule->dport_lo == rule->dport_hi){
+			key.dport = htons(rule->dport_lo);
+			mask.dport = 0xffff;
+		}
+		if (rule->match & ACL_MATCH_PROTO){
+			key.proto = rule->proto;
+			mask.proto = 0xff;
+		}
+		if (rule->match & ACL_MATCH_VLAN){
+			key.vlan = rule->vlan;
+			mask.vlan = 0xffff;
+		}
+		if (rule->match & ACL_MATCH_IN){
+			key.in_port = rule->in_port;
+			mask.in_port = 0xff;
+		}
+		tuple = acl_find_tuple(acl, &mask, &cap);
+		if (tuple == NULL || acl_tuple_push(tuple, &key, acl_rank(acl, r), r) == -1){
+			return -1;
+		}
+	}
+	for (t = 0; t < acl->ntuples; t++){
+		if (acl_tuple_hash(acl, &acl->tuples[t]) == -1){
+			return -1;
+		}
+		acl->nentries += acl->tuples[t].nentries;
+	}
+	qsort(acl->tuples, acl->ntuples, sizeof(acl_tuple_t), acl_tuple_cmp);
+	return 0;
+}
+
+acl_table_t *acl_load(char *path){
+	acl_table_t *acl;
+	acl_rule_t rule;
+	char line[ACL_LINE_SIZE];
+	unsigned int lineno = 0;
+	int status;
+	FILE *in;
+
+	in = fopen(path, "r");
+	if (in == NULL){
+		perror(path);
+		return NULL;
+	}
+	acl = acl_new();
+	if (acl == NULL){
+		fclose(in);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), in) != NULL){
+		lineno++;
+		status = acl_parse_rule(line, &rule);
+		if (status == 1){
+			continue;
+		}
+		if (status == -1 || acl_add_rule(acl, &rule) == -1){
+			printf("ERROR: %s line %u\n", path, lineno);
+			fclose(in);
+			acl_free(acl);
+			return NULL;
+		}
+	}
+	fclose(in);
+	if (acl_compile(acl) == -1){
+		acl_free(acl);
+		return NULL;
+	}
+	return acl;
+}
+/*
+* Frames that are not IP still match on VLAN and input interface
+*/
+void acl_key_from_batch(flow_key_t *key, pkt_batch_t *batch, unsigned int i){
+	if (flow_key_from_batch(key, batch, i)){
+		return;
+	}
+	memset(key, 0, sizeof(*key));
+	key->ethertype = batch->meta.ethertype[i];
+	key->vlan = batch->meta.vlan[i];
+	key->in_port = batch->pkts[i].in_port;
+}
+
+static inline acl_entry_t *acl_probe(acl_tuple_t *tuple, flow_key_t *masked, uint64_t hash){
+	acl_entry_t *entry;
+	uint64_t i;
+
+	for (i = hash & tuple->tmask; ; i = (i + 1) & tuple->tmask){
+		entry = &tuple->table[i];
+		if (entry->count == 0){
+			return NULL;
+		}
+		if (flow_key_equal(&entry->key, masked)){
+			return entry;
+		}
+	}
+}
+/*
+* Best rule of an entry that matches the ports of key and beats
+* best_rank, its rank is returned and 0 if there is none
+*/
+static inline uint64_t acl_entry_rank(acl_table_t *acl, acl_entry_t *entry, flow_key_t *key, uint64_t best_rank){
+	uint64_t rank;
+	uint32_t rule;
+	unsigned int i;
+
+	if (entry->rank <= best_rank){
+		return 0;
+	}
+	if (!entry->ranged){
+		return entry->rank;
+	}
+	for (i = 0; i < entry->count; i++){
+		rule = acl->lists[entry->list + i];
+		rank = acl_rank(acl, rule);
+		if (rank <= best_rank){
+			break;
+		}
+		if (acl_ports_match(&acl->rules[rule], key)){
+			return rank;
+		}
+	}
+	return 0;
+}
+
+uint32_t acl_classify(acl_table_t *acl, flow_key_t *key){
+	acl_tuple_t *tuple;
+	acl_entry_t *entry;
+	flow_key_t masked;
+	uint64_t best_rank = 0, rank;
+	unsigned int t;
+
+	for (t = 0; t < acl->ntuples; t++){
+		tuple = &acl->tuples[t];
+		if (tuple->max_rank <= best_rank){
+			break;
+		}
+		flow_key_mask(&masked, key, &tuple->mask);
+		entry = acl_probe(tuple, &masked, acl_hash(&masked));
+		if (entry != NULL && (rank = acl_entry_rank(acl, entry, key, best_rank)) != 0){
+			best_rank = rank;
+		}
+	}
+	return (best_rank == 0) ? ACL_NO_MATCH : acl_rank_rule(best_rank);
+}
+/*
+* True when the key has every field the rule matches on
+*/
+bool acl_rule_match(acl_rule_t *rule, flow_key_t *key){
+	if (rule->ethertype != 0 && rule->ethertype != key->ethertype){
+		return false;
+	}
+	if (!prefix_match(key->src, rule->src, rule->src_len) || !prefix_match(key->dst, rule->dst, rule->dst_len)){
+		return false;
+	}
+	if (!acl_ports_match(rule, key)){
+		return false;
+	}
+	if ((rule->match & ACL_MATCH_PROTO) && rule->proto != key->proto){
+		return false;
+	}
+	if ((rule->match & ACL_MATCH_VLAN) && rule->vlan != key->vlan){
+		return false;
+	}
+	if ((rule->match & ACL_MATCH_IN) && rule->in_port != key->in_port){
+		return false;
+	}
+	return true;
+}
+/*
+* Reference classifier, every rule is checked
+*/
+uint32_t acl_classify_linear(acl_table_t *acl, flow_key_t *key){
+	uint64_t best_rank = 0;
+	uint32_t best = ACL_NO_MATCH;
+	unsigned int r;
+
+	for (r = 0; r < acl->nrules; r++){
+		if (acl_rank(acl, r) > best_rank && acl_rule_match(&acl->rules[r], key)){
+			best_rank = acl_rank(acl, r);
+			best = r;
+		}
+	}
+	return best;
+}
+/*
+* One table at a time for the whole batch: the probe of every key still
+* able to improve is prefetched before the first one is read
+*/
+void acl_classify_batch(acl_table_t *acl, flow_key_t *keys, uint32_t *rules, unsigned int n){
+	acl_tuple_t *tuple;
+	acl_entry_t *entry;
+	flow_key_t masked[PIPE_BATCH];
+	uint64_t hashes[PIPE_BATCH];
+	uint64_t best_rank[PIPE_BATCH];
+	uint64_t rank;
+	uint8_t live[PIPE_BATCH];
+	unsigned int t, i, j, nlive;
+
+	for (i = 0; i < n; i++){
+		best_rank[i] = 0;
+	}
+	for (t = 0; t < acl->ntuples; t++){
+		tuple = &acl->tuples[t];
+		nlive = 0;
+		for (i = 0; i < n; i++){
+			if (best_rank[i] >= tuple->max_rank){
+				continue;
+			}
+			flow_key_mask(&masked[nlive], &keys[i], &tuple->mask);
+			hashes[nlive] = acl_hash(&masked[nlive]);
+			__builtin_prefetch(&tuple->table[hashes[nlive] & tuple->tmask]);
+			live[nlive++] = i;
+		}
+		/*
+		* Tables are sorted, none of the rest can beat what was found
+		*/
+		if (nlive == 0){
+			break;
+		}
+		for (j = 0; j < nlive; j++){
+			i = live[j];
+			entry = acl_probe(tuple, &masked[j], hashes[j]);
+			if (entry != NULL && (rank = acl_entry_rank(acl, entry, &keys[i], best_rank[i])) != 0){
+				best_rank[i] = rank;
+			}
+		}
+	}
+	for (i = 0; i < n; i++){
+		rules[i] = (best_rank[i] == 0) ? ACL_NO_MATCH : acl_rank_rule(best_rank[i]);
+	}
+}
+
+int acl_stage_init(pipe_stage_t *stage, arg_config_t *arg_config, unsigned int worker){
+	acl_stage_t *as;
+
+	if (arg_config->acl_path[0] == '\0'){
+		printf("ERROR: The acl stage needs a rule file (--acl)\n");
+		return -1;
+	}
+	if (acl_shared == NULL){
+		acl_shared = acl_load(arg_config->acl_path);
+		if (acl_shared == NULL){
+			return -1;
+		}
+		printf("ACL: %u rules in %u tables, %lu entries\n", acl_shared->nrules, acl_shared->ntuples, acl_shared->nentries);
+	}
+	if (posix_memalign((void **)&as, CACHE_LINE_SIZE, sizeof(acl_stage_t)) != 0){
+		perror("posix_memalign acl stage");
+		return -1;
+	}
+	memset(as, 0, sizeof(*as));
+	as->acl = acl_shared;
+	stage->priv = as;
+	/*
+	* Same order as the counter names in the stage table
+	*/
+	stage->counters = &as->matched;
+	return 0;
+}
+/*
+* Frames with a cached verdict are skipped, the verdict of the others is
+* stored in their flow entry when the flow stage runs first. Frames no
+* rule matches are forwarded.
+*/
+unsigned int acl_stage(pipe_stage_t *stage, pkt_batch_t *batch){
+	acl_stage_t *as = stage->priv;
+	acl_rule_t *rule;
+	pkt_desc_t *pkt;
+	unsigned int i, n = 0, dropped = 0;
+
+	for (i = 0; i < batch->count; i++){
+		pipe_prefetch(batch, i);
+		if (batch->pkts[i].flags & PKT_CACHED){
+			continue;
+		}
+		acl_key_from_batch(&as->keys[n], batch, i);
+		as->index[n++] = i;
+	}
+	acl_classify_batch(as->acl, as->keys, as->rules, n);
+	for (i = 0; i < n; i++){
+		pkt = &batch->pkts[as->index[i]];
+		if (as->rules[i] == ACL_NO_MATCH){
+			as->unmatched++;
+			continue;
+		}
+		as->matched++;
+		rule = &as->acl->rules[as->rules[i]];
+		switch (rule->action){
+			case ACL_DENY:
+				flow_set_verdict(pkt, VERDICT_DROP, PORT_NONE);
+				dropped++;
+				break;
+			case ACL_REDIRECT:
+				flow_set_verdict(pkt, VERDICT_REDIRECT, rule->port);
+				as->redirects++;
+				break;
+			default:
+				flow_set_verdict(pkt, VERDICT_FORWARD, PORT_NONE);
+				break;
+		}
+	}
+	return dropped;
+}
+
+void acl_stage_print(pipe_stage_t *stage){
+	acl_stage_t *as = stage->priv;
+
+	printf("ACL: %u rules in %u tables, %lu entries\n", as->acl->nrules, as->acl->ntuples, as->acl->nentries);
+}
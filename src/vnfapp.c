@@ -20,10 +20,15 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <pthread.h>
 
 
 
 #include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <linux/virtio_net.h>
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
@@ -32,152 +37,307 @@
 #include <net/ethernet.h>
 
 #include "vnfapp.h"
+#include "vnfxdp.h"
+#include "vnfstats.h"
+#include "vnflat.h"
+#include "vnfpcap.h"
+#include "vnfpipe.h"
+#include "vnftune.h"
+#include "vnfcap.h"
+#include "vnfuring.h"
+#include "vnffilter.h"
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
 
 bool set_promiscous_mode(int fd, char *intf_name);
 bool get_interface_status(int fd, char *intf_name);
 int set_pmap(intf_config_t *config, uint8_t **read_ring, uint8_t **write_ring);
-void *read_write_one(intf_config_t *f_config);
-void *read_write_two(intf_config_t *f_config, intf_config_t *s_config);
+void read_write(pipeline_t *pipe);
+void print_burst_stats(intf_config_t *config);
+void print_poll_stats(intf_config_t *config);
+void print_event_stats(pipeline_t *pipe);
+void print_tx_stats(intf_config_t *config);
+void read_write_replay(intf_config_t *r_config, intf_config_t *w_config);
+extern const io_backend_t ring_io;
 int set_socket_non_blocking(int fd);
 int get_mtu_size(int fd, char *name);
+unsigned long frame_size_for_mtu(unsigned int mtu_size);
+int get_intf_numa_node(char *name);
+int get_numa_nodes(void);
+int get_numa_node_cpus(int node, int *cpus, unsigned int max_cpus);
+int set_numa_policy(int node);
+/*
+* Worker state is cache line aligned so workers never share a line
+*/
+typedef struct _worker_config {
+    intf_config_t *ports;
+    pipeline_t *pipe;
+    pthread_t thread;
+    unsigned int id;
+    int cpu;
+} __attribute__((aligned(CACHE_LINE_SIZE))) worker_config_t;
+/*
+* Compiled once, every RX socket gets a copy
+*/
+static filter_prog_t rx_filter;
 
-void vnfapp(arg_config_t *arg_config){
-	
-	int tstatus, ec;
-    intf_config_t f_config, s_config;
+volatile sig_atomic_t stop_requested = 0;
+
+/*
+* Interrupt the wait so the forwarding loop can print statistics on exit,
+* the io_uring loop may only see the flag
+*/
+static void stop_handler(int sig){
+    stop_requested = 1;
+}
+/*
+* SIGUSR1 asks the forwarding loop to print the latency histograms
+*/
+static void dump_handler(int sig){
+    lat_dump_requested = 1;
+}
+/*
+* SIGUSR2 pauses or resumes the capture stage
+*/
+static void capture_handler(int sig){
+    cap_toggle_requested = 1;
+}
+
+static void set_stop_handler(void){
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = dump_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = capture_handler;
+    sigaction(SIGUSR2, &sa, NULL);
+}
+
+/*
+* Fill the interface configuration from the command line arguments
+*/
+static void init_intf_config(intf_config_t *config, char *name, arg_config_t *arg_config, bool single){
+    memset(config,0,sizeof(*config));
+    config->io = &ring_io;
+    strncpy(config->name,name,IFNAMSIZ-1);
+    config->max_ring_frames = arg_config->max_ring_frames;
+    config->max_ring_blocks = arg_config->max_ring_blocks;
+    config->max_frame_size = arg_config->max_frame_size;
+    config->tpacket_version = (arg_config->tpacket_version == 3) ? TPACKET_V3 : TPACKET_V2;
+    config->block_timeout = arg_config->block_timeout;
+    config->tx_batch = arg_config->tx_batch;
+    config->rx_budget = arg_config->rx_budget;
+    config->busy_poll_us = arg_config->busy_poll_us;
+    config->event_loop = arg_config->event_loop;
+    config->tx_policy = arg_config->tx_policy;
+    config->tx_wait_us = arg_config->tx_wait_us;
+    config->latency = arg_config->latency;
+    config->mtu_size = 1514;
+    config->single = single;
+    config->vnet_hdr = arg_config->vnet_hdr;
+}
+/*
+* Interface configurations of every port, with the ring sizes of each
+*/
+static intf_config_t *init_ports(arg_config_t *arg_config){
+    intf_config_t *ports;
+    port_config_t *port;
+    unsigned int i;
+
+    if (posix_memalign((void **)&ports, CACHE_LINE_SIZE, arg_config->nports * sizeof(intf_config_t)) != 0) {
+        perror("posix_memalign ports");
+        exit(-1);
+    }
+    for (i = 0; i < arg_config->nports; i++) {
+        port = &arg_config->ports[i];
+        init_intf_config(&ports[i], port->name, arg_config, arg_config->nports == 1);
+        ports[i].max_ring_frames = port->max_ring_frames;
+        ports[i].max_ring_blocks = port->max_ring_blocks;
+        ports[i].max_frame_size = port->max_frame_size;
+    }
+    return ports;
+}
+/*
+* Enable RX hardware timestamps on the device and the socket
+*/
+static void set_hw_timestamps(intf_config_t *config){
+    struct hwtstamp_config hwconfig;
+    struct ifreq ifr;
+    int req = SOF_TIMESTAMPING_RAW_HARDWARE;
+
+    memset(&hwconfig, 0, sizeof(hwconfig));
+    hwconfig.tx_type = HWTSTAMP_TX_OFF;
+    hwconfig.rx_filter = HWTSTAMP_FILTER_ALL;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, config->name, sizeof(ifr.ifr_name)-1);
+    ifr.ifr_data = (void *)&hwconfig;
+    if (ioctl(config->fd, SIOCSHWTSTAMP, &ifr) == -1) {
+        printf("WARNING: No hardware timestamps on: %s, its frames are not timed\n", config->name);
+        return;
+    }
+    if (setsockopt(config->fd, SOL_PACKET, PACKET_TIMESTAMP, &req, sizeof(req)) == -1) {
+        perror("PACKET_TIMESTAMP");
+    }
+}
+/*
+* Create, configure and bind the packet socket of an interface. When
+* fanout_id is not -1 the socket joins that PACKET_FANOUT group.
+*/
+static void open_interface(intf_config_t *config, arg_config_t *arg_config, int fanout_id){
+    int tstatus, ec;
     struct sockaddr_ll saddr;
     struct ifreq ifr; 
     int mtu_size;
+    unsigned int max_packet;
+    int n = 1;
+    int fanout_arg;
     socklen_t bufSize;
 #ifdef DEBUG
     unsigned int rcvBufferSize;
     unsigned int sndBufferSize;
 #endif
 
-    if ( (strcmp(arg_config->first, "") == 0)  || (strcmp(arg_config->second, "") == 0)  || (strcmp(arg_config->first,arg_config->second) == 0) ){
-        if  (strcmp(arg_config->first, "") != 0){
-            memset(&f_config,0,sizeof(f_config));
-            strncpy(f_config.name,arg_config->first,IFNAMSIZ-1);
-            f_config.max_ring_frames = arg_config->max_ring_frames;
-            f_config.max_ring_blocks = arg_config->max_ring_blocks;
-            f_config.max_frame_size = arg_config->max_frame_size;
-            f_config.mtu_size = 1514;
-            f_config.single = true;
-        } else if (strcmp(arg_config->first, "") != 0){
-            memset(&s_config,0,sizeof(s_config));
-            strncpy(s_config.name,arg_config->second,IFNAMSIZ-1);
-            s_config.max_ring_frames = arg_config->max_ring_frames;
-            s_config.max_ring_blocks = arg_config->max_ring_blocks;
-            s_config.max_frame_size = arg_config->max_frame_size;
-            s_config.mtu_size = 1514;
-        } else {
-            printf("Interface not set\n");
+    config->fd = socket(PF_PACKET,SOCK_RAW,htons(ETH_P_ALL));
+	if (config->fd == -1){
+		perror("Opening socket");
+		exit(-1);
+	}
+    /*
+    * The filter runs before a frame is copied, so rejected frames never
+    * take a ring slot. It goes on first, before the ring is mapped.
+    */
+    if (arg_config->filter[0] != '\0') {
+        if (filter_attach(config->fd, &rx_filter) == -1) {
             exit(-1);
         }
-
-    } else {
-        memset(&f_config,0,sizeof(f_config));
-        strncpy(f_config.name,arg_config->first,IFNAMSIZ-1);
-        f_config.max_ring_frames = arg_config->max_ring_frames;
-        f_config.max_ring_blocks = arg_config->max_ring_blocks;
-        f_config.max_frame_size = arg_config->max_frame_size;
-        f_config.mtu_size = 1514;
-        f_config.single = false;
-
-        memset(&s_config,0,sizeof(s_config));
-        strncpy(s_config.name,arg_config->second,IFNAMSIZ-1);
-        s_config.max_ring_frames = arg_config->max_ring_frames;
-        s_config.max_ring_blocks = arg_config->max_ring_blocks;
-        s_config.max_frame_size = arg_config->max_frame_size;
-        s_config.mtu_size = 1514;
-        f_config.single = false;
-    }
-    if (f_config.single == true) {
-        printf("Initializing Single Interface VNF APP for interface: %s\n", arg_config->first);
-    } else {
-        printf("Initializing Dual Interface VNF APP for interfaces: %s and %s\n", arg_config->first,arg_config->second);
+        config->filtered = true;
     }
-	/*
-	* Create sockets
-	*/
-    int n = 1;
-    f_config.fd = socket(PF_PACKET,SOCK_RAW,htons(ETH_P_ALL));
-	if (f_config.fd == -1){
-		perror("Opening first socket");
-		exit(-1);
-	}
-    mtu_size = get_mtu_size(f_config.fd, f_config.name);
+    mtu_size = get_mtu_size(config->fd, config->name);
     if (mtu_size == -1 ){
-        printf("ERROR: Getting MTU size for: %s\n", f_config.name);
+        printf("ERROR: Getting MTU size for: %s\n", config->name);
         exit(-1);
     } else {
         mtu_size = mtu_size + sizeof(struct ethhdr);
-        f_config.mtu_size = mtu_size;
+        config->mtu_size = mtu_size;
+    }
+    /*
+    * Size frames from the MTU unless given, a block is at least a page
+    */
+    max_packet = config->vnet_hdr ? MAX(config->mtu_size, VNET_MAX_PACKET) + sizeof(struct virtio_net_hdr) : config->mtu_size;
+    if (config->max_frame_size == AUTO_FRAME_SIZE) {
+        config->max_frame_size = frame_size_for_mtu(max_packet);
+        while (config->max_ring_frames * config->max_frame_size < (unsigned long)getpagesize()) {
+            config->max_ring_frames <<= 1;
+        }
+    } else if (config->max_frame_size < frame_size_for_mtu(max_packet)) {
+        printf("WARNING: Frame size: %lu is too small for the MTU of: %s, longer frames are dropped\n",
+            config->max_frame_size, config->name);
     }
-    if (setsockopt(f_config.fd, SOL_SOCKET, SO_BROADCAST, &n, sizeof n) < 0) {
+    printf("Interface: %s MTU: %u, frame size: %lu\n", config->name, config->mtu_size - (unsigned int)sizeof(struct ethhdr), config->max_frame_size);
+    if (arg_config->autotune_us > 0) {
+        tune_init(config, arg_config);
+    }
+    if (setsockopt(config->fd, SOL_SOCKET, SO_BROADCAST, &n, sizeof n) < 0) {
         perror("SO_BROADCAST");
         exit(-1);
     }
     /*
     * Configure interfaces for promiscous mode
     */
-
-    if (set_promiscous_mode(f_config.fd,f_config.name) == true){
-        if (get_interface_status(f_config.fd,f_config.name) ==true) {
-            printf("Interface: %s is in promiscous mode\n",f_config.name);
+    if (set_promiscous_mode(config->fd,config->name) == true){
+        if (get_interface_status(config->fd,config->name) ==true) {
+            printf("Interface: %s is in promiscous mode\n",config->name);
         }
     } else {
-        printf("ERROR:Setting promiscous (read) mode on: %s\n", f_config.name);
+        printf("ERROR:Setting promiscous mode on: %s\n", config->name);
         exit(-1);
     }
-    tstatus = set_socket_non_blocking (f_config.fd);
+    tstatus = set_socket_non_blocking (config->fd);
     if (tstatus == -1) {
-        perror("Setting non-blocking on first interface");
+        perror("Setting non-blocking on interface");
         exit(-1);
     }
-    tstatus = set_pmap(&f_config, &(f_config.r_ring), &(f_config.w_ring));
+    /*
+    * PACKET_LOSS must be set before the rings exist
+    */
+    if (arg_config->tx_loss) {
+        if (setsockopt(config->fd, SOL_PACKET, PACKET_LOSS, &n, sizeof(n)) == -1) {
+            perror("PACKET_LOSS");
+            exit(-1);
+        }
+    }
+    if (arg_config->qdisc_bypass) {
+        if (setsockopt(config->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &n, sizeof(n)) == -1) {
+            perror("PACKET_QDISC_BYPASS");
+            exit(-1);
+        }
+    }
+    /*
+    * GSO packets and partial checksums come with an offload header and
+    * go back out with it, so they are forwarded whole
+    */
+    if (config->vnet_hdr) {
+        if (setsockopt(config->fd, SOL_PACKET, PACKET_VNET_HDR, &n, sizeof(n)) == -1) {
+            perror("PACKET_VNET_HDR");
+            exit(-1);
+        }
+    }
+    tstatus = set_pmap(config, &(config->r_ring), &(config->w_ring));
     if (tstatus == -1){
-        printf("ERROR: Configuring first pmap on: %s\n", f_config.name);
+        printf("ERROR: Configuring pmap on: %s\n", config->name);
         exit(-1);
     }
+    printf("Interface: %s using TPACKET_V%d rings\n", config->name, (config->tpacket_version == TPACKET_V3) ? 3 : 2);
+    if (config->tx_policy == TX_POLICY_DROP_OLDEST) {
+        config->backlog.data = malloc(TX_BACKLOG_FRAMES * config->max_frame_size);
+        if (config->backlog.data == NULL) {
+            perror("malloc TX backlog");
+            exit(-1);
+        }
+    }
 #ifdef DEBUG
     bufSize = sizeof(rcvBufferSize);
-    getsockopt(f_config.fd, SOL_SOCKET, SO_RCVBUF, &rcvBufferSize, &bufSize);
+    getsockopt(config->fd, SOL_SOCKET, SO_RCVBUF, &rcvBufferSize, &bufSize);
     printf("initial socket receive buf %d\n", rcvBufferSize);
 #endif
-    bufSize = arg_config->max_ring_frames * arg_config->max_frame_size;
-    if (setsockopt(f_config.fd, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize)) == -1) {
+    bufSize = config->max_ring_frames * config->max_frame_size;
+    if (setsockopt(config->fd, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize)) == -1) {
         perror("SO_RCVBUF");
         exit(-1);
     }
 #ifdef DEBUG
     bufSize = sizeof(rcvBufferSize);
-    getsockopt(f_config.fd, SOL_SOCKET, SO_RCVBUF, &rcvBufferSize, &bufSize);
+    getsockopt(config->fd, SOL_SOCKET, SO_RCVBUF, &rcvBufferSize, &bufSize);
     printf("after set socket receive buf %d\n", rcvBufferSize);
 #endif
 
 #ifdef DEBUG
     bufSize = sizeof(sndBufferSize);
-    getsockopt(f_config.fd, SOL_SOCKET, SO_SNDBUF, &sndBufferSize, &bufSize);
+    getsockopt(config->fd, SOL_SOCKET, SO_SNDBUF, &sndBufferSize, &bufSize);
     printf("initial socket send buf %d\n", sndBufferSize);
 #endif
-    //n = pmmap_tx_buf_num*PAN_PACKET_MMAP_FRAME_SIZE; // To improve performance
-    bufSize= arg_config->max_ring_frames * arg_config->max_frame_size;
-    if (setsockopt(f_config.fd, SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof(bufSize)) == -1) {
+    bufSize= config->max_ring_frames * config->max_frame_size;
+    if (setsockopt(config->fd, SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof(bufSize)) == -1) {
         perror("SO_SNDBUF");
         exit(-1);
     }
 #ifdef DEBUG
     bufSize = sizeof(sndBufferSize);
-    getsockopt(f_config.fd, SOL_SOCKET, SO_SNDBUF, &sndBufferSize, &bufSize);
+    getsockopt(config->fd, SOL_SOCKET, SO_SNDBUF, &sndBufferSize, &bufSize);
     printf("after set socket send buf %d\n", sndBufferSize);
 #endif
     /* convert interface name to index (in ifr.ifr_ifindex) */
     memset(&ifr,0,sizeof(ifr));
-    strncpy(ifr.ifr_name, f_config.name, sizeof(ifr.ifr_name));
-    ec = ioctl(f_config.fd, SIOCGIFINDEX, &ifr);
+    strncpy(ifr.ifr_name, config->name, sizeof(ifr.ifr_name));
+    ec = ioctl(config->fd, SIOCGIFINDEX, &ifr);
     if (ec < 0) {
-        printf("Error: failed to find interface %s\n",f_config.name);
+        printf("Error: failed to find interface %s\n",config->name);
         exit(-1);
     }
     /* Bind the interface */
@@ -185,104 +345,434 @@ void vnfapp(arg_config_t *arg_config){
     saddr.sll_family = PF_PACKET;
     saddr.sll_protocol = htons(ETH_P_ALL);
     saddr.sll_ifindex = ifr.ifr_ifindex;
-    if (bind(f_config.fd, (struct sockaddr*)&saddr, sizeof(saddr)) < 0) {
-        perror("bind failed for first read socket\n");
+    if (bind(config->fd, (struct sockaddr*)&saddr, sizeof(saddr)) < 0) {
+        perror("bind failed for read socket\n");
         exit(-1);
     }
-    if (f_config.single == false) {
-        s_config.fd = socket(PF_PACKET,SOCK_RAW,htons(ETH_P_ALL));
-        if (s_config.fd == -1){
-    		perror("Opening second socket");
-    		exit(-1);
-    	}
-        mtu_size = get_mtu_size(s_config.fd, s_config.name);
-        if (mtu_size == -1 ){
-            printf("ERROR: Getting MTU size for: %s\n", s_config.name);
+    /*
+    * Ask the NIC to stamp every received frame, the ring carries the raw
+    * hardware stamp when there is one, frames without are not timed
+    */
+    if (arg_config->latency == LATENCY_HW) {
+        set_hw_timestamps(config);
+    }
+    /*
+    * Let the kernel busy poll the device queue as well
+    */
+    if (arg_config->sock_busy_poll && arg_config->busy_poll_us > 0) {
+        n = arg_config->busy_poll_us;
+        if (setsockopt(config->fd, SOL_SOCKET, SO_BUSY_POLL, &n, sizeof(n)) == -1) {
+            perror("SO_BUSY_POLL");
+        }
+        n = 1;
+        if (setsockopt(config->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &n, sizeof(n)) == -1) {
+            perror("SO_PREFER_BUSY_POLL");
+        }
+    }
+    /*
+    * Fanout can only be joined by a bound socket
+    */
+    if (fanout_id >= 0) {
+        fanout_arg = (fanout_id & 0xffff) | (arg_config->fanout_mode << 16);
+        if (arg_config->fanout_mode == PACKET_FANOUT_HASH) {
+            fanout_arg |= PACKET_FANOUT_FLAG_DEFRAG << 16;
+        }
+        if (setsockopt(config->fd, SOL_PACKET, PACKET_FANOUT, &fanout_arg, sizeof(fanout_arg)) == -1) {
+            perror("PACKET_FANOUT");
             exit(-1);
+        }
+    }
+}
+/*
+* Open the socket of every port of a worker and hand them to its pipeline
+* along with the forwarding map. fanout holds a group id per port, NULL
+* when the worker is alone.
+*/
+static void open_ports(pipeline_t *pipe, intf_config_t *ports, arg_config_t *arg_config, unsigned int worker, int *fanout){
+    unsigned int i;
+
+    for (i = 0; i < arg_config->nports; i++) {
+        open_interface(&ports[i], arg_config, (fanout != NULL) ? fanout[i] : -1);
+        stats_register_socket(worker, i, &ports[i]);
+        pipeline_add_port(pipe, &ports[i]);
+    }
+    for (i = 0; i < arg_config->nports; i++) {
+        pipeline_set_peer(pipe, i, arg_config->ports[i].peer);
+    }
+}
+/*
+* Pin the calling thread to a core
+*/
+static void pin_thread(int cpu){
+    cpu_set_t cpuset;
+    int status;
+
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    status = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (status != 0) {
+        printf("WARNING: Unable to pin thread to cpu: %d, error: %d\n", cpu, status);
+    }
+}
+/*
+* Run to completion worker, owns one socket and ring pair per interface
+*/
+static void *worker_loop(void *arg){
+    worker_config_t *worker = (worker_config_t *)arg;
+
+    if (worker->cpu >= 0) {
+        pin_thread(worker->cpu);
+    }
+    read_write(worker->pipe);
+    return NULL;
+}
+/*
+* Merge the latency histograms of every worker per interface
+*/
+static void print_worker_latency(worker_config_t **workers, unsigned int nworkers, unsigned int nports){
+    lat_hist_t *hist;
+    uint64_t unstamped;
+    unsigned int i, p;
+
+    if (workers[0]->ports[0].latency == LATENCY_OFF) {
+        return;
+    }
+    hist = malloc(sizeof(lat_hist_t));
+    if (hist == NULL) {
+        perror("malloc latency");
+        exit(-1);
+    }
+    for (p = 0; p < nports; p++) {
+        memset(hist, 0, sizeof(lat_hist_t));
+        unstamped = 0;
+        for (i = 0; i < nworkers; i++) {
+            lat_merge(hist, &workers[i]->ports[p].lat.hist);
+            unstamped += workers[i]->ports[p].lat.unstamped;
+        }
+        print_lat_hist(workers[0]->ports[p].name, hist);
+        if (unstamped > 0) {
+            printf("RX frames not hardware stamped: %lu\n", unstamped);
+        }
+    }
+    fflush(stdout);
+    free(hist);
+}
+/*
+* Put the workers on the NUMA node most interfaces hang off, or the one
+* given. Memory is preferred from that node from here on, which covers
+* the rings, the stats segment and the pipeline state of every worker
+* as they are all set up by this thread or its workers. Without -c the
+* workers are pinned to the cores of the node in turn.
+*/
+static void place_numa(arg_config_t *arg_config){
+    int nodes[MAX_PORTS];
+    int cpus[MAX_NODE_CPUS];
+    int node = arg_config->numa_node;
+    int ncpus, votes, best = 0;
+    unsigned int i, j;
+    bool found;
+
+    if (node == NUMA_OFF) {
+        return;
+    }
+    printf("NUMA: nodes: %d", get_numa_nodes());
+    for (i = 0; i < arg_config->nports; i++) {
+        nodes[i] = get_intf_numa_node(arg_config->ports[i].name);
+        if (nodes[i] >= 0) {
+            printf(", %s: node %d", arg_config->ports[i].name, nodes[i]);
         } else {
-            mtu_size = mtu_size + sizeof(struct ethhdr);
-            s_config.mtu_size = mtu_size;
+            printf(", %s: no node", arg_config->ports[i].name);
         }
-        if (setsockopt(s_config.fd, SOL_SOCKET, SO_BROADCAST, &n, sizeof n) < 0) {
-            perror("SO_BROADCAST");
-            exit(-1);
+    }
+    printf("\n");
+    if (node == NUMA_AUTO) {
+        for (i = 0; i < arg_config->nports; i++) {
+            for (j = 0, votes = 0; j < arg_config->nports; j++) {
+                votes += (nodes[i] >= 0 && nodes[j] == nodes[i]);
+            }
+            if (votes > best) {
+                best = votes;
+                node = nodes[i];
+            }
+        }
+        if (node == NUMA_AUTO || get_numa_nodes() == 1) {
+            printf("NUMA: placement left to the kernel\n");
+            return;
         }
-        if (set_promiscous_mode(s_config.fd,s_config.name) == true){
-            if (get_interface_status(s_config.fd,s_config.name) ==true) {
-                printf("Interface: %s is in promiscous mode\n",s_config.name);
+    }
+    ncpus = get_numa_node_cpus(node, cpus, MAX_NODE_CPUS);
+    if (ncpus <= 0) {
+        printf("ERROR: NUMA node: %d has no cores\n", node);
+        exit(-1);
+    }
+    if (set_numa_policy(node) == -1) {
+        perror("set_mempolicy");
+    }
+    if (arg_config->ncpus == 0) {
+        arg_config->ncpus = MIN(ncpus, MAX_WORKERS);
+        memcpy(arg_config->cpus, cpus, arg_config->ncpus * sizeof(int));
+    } else {
+        for (i = 0; i < arg_config->ncpus; i++) {
+            for (j = 0, found = false; j < (unsigned int)ncpus && !found; j++) {
+                found = (cpus[j] == arg_config->cpus[i]);
             }
-        } else {
-            printf("ERROR:Setting promiscous (write) mode on: %s\n", s_config.name);
-            exit(-1);
+            if (!found) {
+                printf("WARNING: cpu: %d is not on NUMA node: %d\n", arg_config->cpus[i], node);
+            }
+        }
+    }
+    for (i = 0; i < arg_config->nports; i++) {
+        if (nodes[i] >= 0 && nodes[i] != node) {
+            printf("WARNING: %s is on NUMA node: %d, its frames cross to node: %d\n", arg_config->ports[i].name, nodes[i], node);
         }
-        tstatus = set_socket_non_blocking (s_config.fd);
-        if (tstatus == -1) {
-            perror("Setting non-blocking on second interface");
+    }
+    printf("NUMA: workers and memory on node: %d, cpus:", node);
+    for (i = 0; i < MIN(arg_config->ncpus, arg_config->workers); i++) {
+        printf(" %d", arg_config->cpus[i]);
+    }
+    printf("\n");
+}
+/*
+* Start one worker per fanout socket and wait for SIGINT or SIGTERM,
+* SIGUSR1 prints the merged latency histograms and SIGUSR2 pauses or
+* resumes the capture
+*/
+static void run_workers(arg_config_t *arg_config){
+    worker_config_t **workers;
+    unsigned int i, p;
+    int fanout[MAX_PORTS];
+    sigset_t stop_set;
+    int sig;
+
+    workers = calloc(arg_config->workers, sizeof(worker_config_t *));
+    if (workers == NULL) {
+        perror("calloc workers");
+        exit(-1);
+    }
+    /*
+    * Fanout group ids are per network namespace, each interface needs its own
+    */
+    for (p = 0; p < arg_config->nports; p++) {
+        fanout[p] = (getpid() + if_nametoindex(arg_config->ports[p].name)) & 0xffff;
+    }
+    /*
+    * Workers inherit a blocked stop signal so only this thread handles it
+    */
+    sigemptyset(&stop_set);
+    sigaddset(&stop_set, SIGINT);
+    sigaddset(&stop_set, SIGTERM);
+    sigaddset(&stop_set, SIGUSR1);
+    sigaddset(&stop_set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &stop_set, NULL);
+    for (i = 0; i < arg_config->workers; i++) {
+        if (posix_memalign((void **)&workers[i], CACHE_LINE_SIZE, sizeof(worker_config_t)) != 0) {
+            perror("posix_memalign worker");
             exit(-1);
         }
-        tstatus = set_pmap(&s_config, &(s_config.r_ring), &(s_config.w_ring));
-        if (tstatus == -1){
-            printf("ERROR: Configuring second pmap on: %s\n", s_config.name);
+        memset(workers[i], 0, sizeof(worker_config_t));
+        workers[i]->id = i;
+        workers[i]->cpu = (arg_config->ncpus > 0) ? arg_config->cpus[i % arg_config->ncpus] : -1;
+        workers[i]->pipe = pipeline_create(arg_config->pipeline, arg_config, i);
+        stats_register_pipeline(i, workers[i]->pipe);
+        workers[i]->ports = init_ports(arg_config);
+        open_ports(workers[i]->pipe, workers[i]->ports, arg_config, i, fanout);
+        if (pthread_create(&workers[i]->thread, NULL, worker_loop, workers[i]) != 0) {
+            perror("pthread_create");
             exit(-1);
-        } 
-#ifdef DEBUG
-        bufSize = sizeof(rcvBufferSize);
-        getsockopt(s_config.fd, SOL_SOCKET, SO_RCVBUF, &rcvBufferSize, &bufSize);
-        printf("initial socket receive buf %d\n", rcvBufferSize);
-#endif
-        n = arg_config->max_ring_frames * arg_config->max_frame_size;
-        if (setsockopt(s_config.fd, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n)) == -1) {
-            perror("SO_RCVBUF");
+        }
+        printf("Worker: %u started on cpu: %d\n", i, workers[i]->cpu);
+    }
+    stats_start();
+    while (sigwait(&stop_set, &sig) == 0 && (sig == SIGUSR1 || sig == SIGUSR2)) {
+        if (sig == SIGUSR2) {
+            cap_toggle();
+            continue;
+        }
+        print_worker_latency(workers, arg_config->workers, arg_config->nports);
+    }
+    for (i = 0; i < arg_config->workers; i++) {
+        printf("\n---- Worker: %u ----", i);
+        for (p = 0; p < arg_config->nports; p++) {
+            print_burst_stats(&workers[i]->ports[p]);
+        }
+        for (p = 0; p < arg_config->nports; p++) {
+            print_tx_stats(&workers[i]->ports[p]);
+        }
+        print_poll_stats(&workers[i]->ports[0]);
+        print_event_stats(workers[i]->pipe);
+        print_pipeline_stats(workers[i]->pipe);
+    }
+    stats_print_filter();
+    print_worker_latency(workers, arg_config->workers, arg_config->nports);
+    exit(-1);
+}
+
+/*
+* Replay a capture into a pcap file or onto the second interface
+*/
+static void run_replay(arg_config_t *arg_config){
+    intf_config_t *r_config, *w_config;
+    pipeline_t *pipe;
+    char names[2][IFNAMSIZ];
+
+    r_config = calloc(1, sizeof(intf_config_t));
+    w_config = calloc(1, sizeof(intf_config_t));
+    if (r_config == NULL || w_config == NULL) {
+        perror("calloc replay");
+        exit(-1);
+    }
+    init_intf_config(r_config, "pcap-in", arg_config, false);
+    if (arg_config->pcap_out[0] != '\0') {
+        init_intf_config(w_config, "pcap-out", arg_config, false);
+    } else if (arg_config->second[0] != '\0') {
+        init_intf_config(w_config, arg_config->second, arg_config, false);
+    } else {
+        printf("ERROR: Replay needs an output pcap file or a second interface\n");
+        exit(-1);
+    }
+    memset(names, 0, sizeof(names));
+    strncpy(names[0], r_config->name, IFNAMSIZ-1);
+    strncpy(names[1], w_config->name, IFNAMSIZ-1);
+    if (stats_init(arg_config->stats_name, 1, 2, names) == -1) {
+        printf("ERROR: Setting up stats\n");
+        exit(-1);
+    }
+    r_config->stats = stats_counters(0, 0);
+    w_config->stats = stats_counters(0, 1);
+    if (pcap_open_read(r_config, arg_config->pcap_in) == -1) {
+        exit(-1);
+    }
+    if (arg_config->pcap_out[0] != '\0') {
+        if (pcap_open_write(w_config, arg_config->pcap_out) == -1) {
             exit(-1);
         }
-#ifdef DEBUG
-        bufSize = sizeof(rcvBufferSize);
-        getsockopt(s_config.fd, SOL_SOCKET, SO_RCVBUF, &rcvBufferSize, &bufSize);
-        printf("after set socket receive buf %d\n", rcvBufferSize);
-#endif
+    } else {
+        open_interface(w_config, arg_config, -1);
+        stats_register_socket(0, 1, w_config);
+    }
+    pipe = pipeline_create(arg_config->pipeline, arg_config, 0);
+    stats_register_pipeline(0, pipe);
+    pipeline_add_port(pipe, r_config);
+    pipeline_add_port(pipe, w_config);
+    stats_start();
+    read_write_replay(r_config, w_config);
+}
 
-#ifdef DEBUG
-        bufSize = sizeof(sndBufferSize);
-        getsockopt(s_config.fd, SOL_SOCKET, SO_SNDBUF, &sndBufferSize, &bufSize);
-        printf("initial socket send buf %d\n", sndBufferSize);
-#endif
-    //n = pmmap_tx_buf_num*PAN_PACKET_MMAP_FRAME_SIZE; // To improve performance
-        n = arg_config->max_ring_frames * arg_config->max_frame_size;
-        if (setsockopt(s_config.fd, SOL_SOCKET, SO_SNDBUF, &n, sizeof(n)) == -1) {
-            perror("SO_SNDBUF");
+void vnfapp(arg_config_t *arg_config){
+    intf_config_t *ports;
+    xdp_config_t xdp_config;
+    pipeline_t *pipe;
+    char names[MAX_PORTS][IFNAMSIZ];
+    unsigned int i;
+
+    if (arg_config->pcap_in[0] != '\0') {
+        if (arg_config->latency != LATENCY_OFF) {
+            printf("WARNING: Latency is not measured when replaying a capture\n");
+            arg_config->latency = LATENCY_OFF;
+        }
+        if (arg_config->filter[0] != '\0') {
+            printf("WARNING: The filter only applies to live interfaces\n");
+            arg_config->filter[0] = '\0';
+        }
+        run_replay(arg_config);
+        return;
+    }
+    if (arg_config->nports == 0) {
+        printf("Interface not set\n");
+        exit(-1);
+    }
+    if (arg_config->nports == 1) {
+        printf("Initializing Single Interface VNF APP for interface: %s\n", arg_config->ports[0].name);
+    } else if (arg_config->nports == 2) {
+        printf("Initializing Dual Interface VNF APP for interfaces: %s and %s\n", arg_config->ports[0].name, arg_config->ports[1].name);
+    } else {
+        printf("Initializing VNF APP for %u interfaces:", arg_config->nports);
+        for (i = 0; i < arg_config->nports; i++) {
+            printf(" %s", arg_config->ports[i].name);
+        }
+        printf("\n");
+    }
+    if (arg_config->filter[0] != '\0') {
+        if (filter_compile(arg_config->filter, &rx_filter) == -1) {
             exit(-1);
         }
+        printf("Filter: compiled to %u BPF instructions\n", rx_filter.len);
 #ifdef DEBUG
-        bufSize = sizeof(sndBufferSize);
-        getsockopt(s_config.fd, SOL_SOCKET, SO_SNDBUF, &sndBufferSize, &bufSize);
-        printf("after set socket send buf %d\n", sndBufferSize);
+        for (i = 0; i < rx_filter.len; i++) {
+            printf("{ 0x%02x, %u, %u, 0x%08x },\n", rx_filter.insns[i].code, rx_filter.insns[i].jt,
+                rx_filter.insns[i].jf, rx_filter.insns[i].k);
+        }
 #endif
-        /* convert interface name to index (in ifr.ifr_ifindex) */
-        memset(&ifr,0,sizeof(ifr));
-        strncpy(ifr.ifr_name, s_config.name, sizeof(ifr.ifr_name));
-        ec = ioctl(s_config.fd, SIOCGIFINDEX, &ifr);
-        if (ec < 0) {
-            printf("Error: failed to find interface %s\n", s_config.name);
-            exit(-1);
+    }
+    place_numa(arg_config);
+    if (arg_config->latency != LATENCY_OFF) {
+        lat_calibrate();
+    }
+    if (arg_config->latency == LATENCY_HW && lat_set_tai_offset(arg_config->tai_offset) == -1) {
+        exit(-1);
+    }
+    /*
+    * Counters of worker 0 back the single threaded and AF_XDP loops
+    */
+    memset(names, 0, sizeof(names));
+    for (i = 0; i < arg_config->nports; i++) {
+        strncpy(names[i], arg_config->ports[i].name, IFNAMSIZ-1);
+    }
+    if (stats_init(arg_config->stats_name, arg_config->workers, arg_config->nports, names) == -1) {
+        printf("ERROR: Setting up stats\n");
+        exit(-1);
+    }
+    /*
+    * Multiple workers each own a socket per interface in a fanout group
+    */
+    if (arg_config->workers > 1 && arg_config->backend != BACKEND_XDP) {
+        run_workers(arg_config);
+        return;
+    }
+    ports = init_ports(arg_config);
+    for (i = 0; i < arg_config->nports; i++) {
+        ports[i].stats = stats_counters(0, i);
+    }
+    /*
+    * AF_XDP backend, fall back to packet mmap if it cannot be set up
+    */
+    if (arg_config->backend == BACKEND_XDP) {
+        if (arg_config->workers > 1) {
+            printf("WARNING: AF_XDP backend uses a single worker\n");
         }
-        /* 
-        * Bind the interfaces
-        */
-        memset(&saddr, 0, sizeof(saddr));
-        saddr.sll_family = PF_PACKET;
-        saddr.sll_protocol = htons(ETH_P_ALL);
-        saddr.sll_ifindex = ifr.ifr_ifindex;
-        if (bind(s_config.fd, (struct sockaddr*)&saddr, sizeof(saddr)) < 0) {
-            perror("bind failed for second read socket\n");
-            exit(-1);
+        if (strcmp(arg_config->pipeline, DEFAULT_PIPELINE) != 0) {
+            printf("WARNING: AF_XDP backend only forwards, the pipeline is not run\n");
+        }
+        if (arg_config->nports > 2) {
+            printf("WARNING: AF_XDP backend supports at most two interfaces\n");
+        } else if (xdp_setup(&xdp_config, &ports[0], &ports[arg_config->nports - 1], arg_config->xdp_drv_mode) == 0) {
+            if (arg_config->filter[0] != '\0') {
+                printf("WARNING: AF_XDP backend does not run the filter\n");
+            }
+            stats_start();
+            xdp_read_write(&xdp_config);
+            return;
+        }
+        printf("WARNING: AF_XDP not available, falling back to packet mmap\n");
+        if (arg_config->workers > 1) {
+            free(ports);
+            run_workers(arg_config);
+            return;
         }
     }
 	/*
-	* Read from interface and write to other interface
+	* Create sockets
 	*/
-    if (f_config.single == false) {
-        read_write_two(&f_config, &s_config);
-    } else {
-        read_write_one(&f_config);
+    pipe = pipeline_create(arg_config->pipeline, arg_config, 0);
+    stats_register_pipeline(0, pipe);
+    open_ports(pipe, ports, arg_config, 0, NULL);
+    stats_start();
+    if (arg_config->ncpus > 0) {
+        pin_thread(arg_config->cpus[0]);
     }
+	/*
+	* Read from every interface and write to its peer
+	*/
+    set_stop_handler();
+    read_write(pipe);
 }
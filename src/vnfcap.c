@@ -0,0 +1,440 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*! Capture tap
+ *
+ * The capture stage copies the frames that reach it, all of them or one
+ * in capture_sample of those matching a filter, into a ring of its
+ * worker. A single writer thread empties the rings of every worker into
+ * a large buffer and writes it out as nanosecond pcap, starting a new
+ * file every capture_mb MB and removing the oldest beyond capture_files.
+ * Workers never wait: a frame that does not fit in the ring is counted
+ * as a capture drop and forwarded all the same. SIGUSR2 pauses and
+ * resumes the capture.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+//
+#include <sys/stat.h>
+//
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnfpipe.h"
+#include "vnfflow.h"
+#include "vnfacl.h"
+#include "vnfpcap.h"
+#include "vnfcap.h"
+
+/*
+* Per worker counters, in the order of the counter names, and selection
+*/
+typedef struct _cap_stage {
+	uint64_t captured;
+	uint64_t skipped;
+	uint64_t drops;
+	cap_ring_t *ring;
+	acl_rule_t *filter;
+	unsigned long sample;
+	unsigned long countdown;
+} cap_stage_t;
+
+typedef struct _cap_writer {
+	char path[PCAP_PATH_SIZE];
+	uint64_t max_bytes;
+	unsigned int max_files;
+	int fd;
+	unsigned int file;
+	uint64_t file_bytes;
+	uint8_t *buf;
+	size_t used;
+	uint64_t last_ns;
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t errors;
+	bool stop;
+	pthread_t thread;
+} cap_writer_t;
+
+volatile sig_atomic_t cap_toggle_requested = 0;
+/*
+* Every worker feeds the same writer, rings are added before the workers
+* start and read by the writer up to cap_nrings
+*/
+static cap_writer_t *cap_writer;
+static cap_ring_t *cap_rings[MAX_WORKERS];
+static unsigned int cap_nrings;
+static acl_rule_t cap_filter;
+static volatile bool cap_active = true;
+
+static inline uint64_t cap_align(uint64_t n){
+	return (n + CAP_REC_ALIGN - 1) & ~(uint64_t)(CAP_REC_ALIGN - 1);
+}
+
+static inline uint64_t cap_now_ns(clockid_t clock){
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void cap_toggle(void){
+	if (cap_writer == NULL){
+		printf("Capture: not set up, the pipeline has no capture stage\n");
+		return;
+	}
+	cap_active = !cap_active;
+	printf("Capture: %s\n", cap_active ? "resumed" : "paused");
+}
+/*
+* Copy a frame to the ring without publishing it, false when it does not
+* fit. A frame that does not fit before the end of the ring goes to its
+* start, behind a record that fills the rest.
+*/
+static inline bool cap_push(cap_ring_t *ring, pkt_desc_t *pkt, uint64_t ts_ns){
+	uint32_t caplen = MIN(pkt->len, CAP_SNAPLEN);
+	uint64_t need = cap_align(sizeof(cap_rec_t) + caplen);
+	uint64_t off = ring->next & (ring->size - 1);
+	uint64_t pad = (ring->size - off < need) ? ring->size - off : 0;
+	cap_rec_t *rec;
+
+	if (ring->size - (ring->next - ring->head_cache) < need + pad){
+		ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (ring->size - (ring->next - ring->head_cache) < need + pad){
+			return false;
+		}
+	}
+	if (pad > 0){
+		((cap_rec_t *)(ring->buf + off))->caplen = CAP_REC_WRAP;
+		ring->next += pad;
+		off = 0;
+	}
+	rec = (cap_rec_t *)(ring->buf + off);
+	rec->ts_ns = ts_ns;
+	rec->caplen = caplen;
+	rec->len = pkt->len;
+	memcpy(rec + 1, pkt->data, caplen);
+	ring->next += need;
+	return true;
+}
+/*
+* Drop files beyond max_files and start the next one
+*/
+static int cap_open(cap_writer_t *w){
+	char path[PCAP_PATH_SIZE + 16];
+	pcap_global_hdr_t hdr;
+
+	if (w->max_files > 0 && w->file >= w->max_files){
+		snprintf(path, sizeof(path), "%s.%u", w->path, w->file - w->max_files);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s.%u", w->path, w->file);
+	w->fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (w->fd == -1){
+		perror(path);
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = PCAP_MAGIC_NSEC;
+	hdr.version_major = 2;
+	hdr.version_minor = 4;
+	hdr.snaplen = CAP_SNAPLEN;
+	hdr.linktype = PCAP_LINKTYPE_ETHERNET;
+	if (write(w->fd, &hdr, sizeof(hdr)) != sizeof(hdr)){
+		perror(path);
+		close(w->fd);
+		w->fd = -1;
+		return -1;
+	}
+	w->file_bytes = sizeof(hdr);
+	w->file++;
+	return 0;
+}
+/*
+* Write the buffer to the current file, or a new one when the last was
+* closed. A failed write loses the buffer, it is only counted.
+*/
+static void cap_drain(cap_writer_t *w){
+	size_t done = 0;
+	ssize_t n;
+
+	if (w->used == 0){
+		return;
+	}
+	if (w->fd == -1 && cap_open(w) == -1){
+		w->errors++;
+		w->used = 0;
+		return;
+	}
+	while (done < w->used){
+		n = write(w->fd, w->buf + done, w->used - done);
+		if (n == -1){
+			if (errno == EINTR){
+				continue;
+			}
+			if (w->errors++ == 0){
+				perror("capture write");
+			}
+			break;
+		}
+		done += n;
+	}
+	w->file_bytes += done;
+	w->bytes += done;
+	w->used = 0;
+	w->last_ns = cap_now_ns(CLOCK_MONOTONIC);
+}
+/*
+* Move the published records of every ring into the buffer as pcap
+* records, returns the number of frames moved. The buffer is written out
+* when it is full and the file closed when the next record would take it
+* past max_bytes.
+*/
+static uint64_t cap_collect(cap_writer_t *w){
+	unsigned int r, nrings = __atomic_load_n(&cap_nrings, __ATOMIC_ACQUIRE);
+	uint64_t head, tail, off, moved = 0;
+	size_t need;
+	pcap_rec_hdr_t hdr;
+	cap_ring_t *ring;
+	cap_rec_t *rec;
+
+	for (r = 0; r < nrings; r++){
+		ring = cap_rings[r];
+		head = ring->head;
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		while (head != tail){
+			off = head & (ring->size - 1);
+			rec = (cap_rec_t *)(ring->buf + off);
+			if (rec->caplen == CAP_REC_WRAP){
+				head += ring->size - off;
+				continue;
+			}
+			need = sizeof(hdr) + rec->caplen;
+			if (w->used + need > PCAP_WRITE_BUF || w->file_bytes + w->used + need > w->max_bytes){
+				__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+				cap_drain(w);
+				if (w->fd != -1 && w->file_bytes + need > w->max_bytes && w->file_bytes > sizeof(pcap_global_hdr_t)){
+					close(w->fd);
+					w->fd = -1;
+					w->file_bytes = sizeof(pcap_global_hdr_t);
+				}
+			}
+			hdr.ts_sec = rec->ts_ns / 1000000000ULL;
+			hdr.ts_frac = rec->ts_ns % 1000000000ULL;
+			hdr.incl_len = rec->caplen;
+			hdr.orig_len = rec->len;
+			memcpy(w->buf + w->used, &hdr, sizeof(hdr));
+			memcpy(w->buf + w->used + sizeof(hdr), rec + 1, rec->caplen);
+			w->used += sizeof(hdr) + rec->caplen;
+			head += cap_align(sizeof(cap_rec_t) + rec->caplen);
+			moved++;
+		}
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	}
+	w->frames += moved;
+	return moved;
+}
+
+static void *cap_loop(void *arg){
+	cap_writer_t *w = arg;
+	struct timespec idle = { .tv_sec = 0, .tv_nsec = CAP_IDLE_US * 1000 };
+	bool stop;
+
+	while (true){
+		stop = __atomic_load_n(&w->stop, __ATOMIC_ACQUIRE);
+		if (cap_collect(w) > 0){
+			continue;
+		}
+		if (stop){
+			break;
+		}
+		if (w->used > 0 && cap_now_ns(CLOCK_MONOTONIC) - w->last_ns >= CAP_FLUSH_MS * 1000000ULL){
+			cap_drain(w);
+		}
+		nanosleep(&idle, NULL);
+	}
+	cap_drain(w);
+	return NULL;
+}
+/*
+* On exit the writer takes what is left in the rings and closes the file
+*/
+static void cap_stop(void){
+	cap_writer_t *w = cap_writer;
+
+	__atomic_store_n(&w->stop, true, __ATOMIC_RELEASE);
+	pthread_join(w->thread, NULL);
+	if (w->fd != -1){
+		close(w->fd);
+	}
+	printf("\n---- Capture ----\n");
+	printf("Frames: %lu, bytes: %lu, files: %u, last: %s.%u, write errors: %lu\n", w->frames, w->bytes, w->file, w->path,
+		w->file - 1, w->errors);
+}
+/*
+* Start the writer with stop signals blocked, they belong to the
+* forwarding threads
+*/
+static int cap_start(arg_config_t *arg_config){
+	cap_writer_t *w;
+	sigset_t stop_set, old_set;
+	int status;
+
+	w = calloc(1, sizeof(cap_writer_t));
+	if (w == NULL || (w->buf = malloc(PCAP_WRITE_BUF)) == NULL){
+		perror("malloc capture");
+		free(w);
+		return -1;
+	}
+	strncpy(w->path, arg_config->capture_path, PCAP_PATH_SIZE-1);
+	w->max_bytes = arg_config->capture_mb * 1024 * 1024;
+	w->max_files = arg_config->capture_files;
+	w->fd = -1;
+	if (cap_open(w) == -1){
+		free(w->buf);
+		free(w);
+		return -1;
+	}
+	w->last_ns = cap_now_ns(CLOCK_MONOTONIC);
+	sigemptyset(&stop_set);
+	sigaddset(&stop_set, SIGINT);
+	sigaddset(&stop_set, SIGTERM);
+	sigaddset(&stop_set, SIGUSR1);
+	sigaddset(&stop_set, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &stop_set, &old_set);
+	status = pthread_create(&w->thread, NULL, cap_loop, w);
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	if (status != 0){
+		printf("ERROR: pthread_create capture: %s\n", strerror(status));
+		close(w->fd);
+		free(w->buf);
+		free(w);
+		return -1;
+	}
+	cap_writer = w;
+	atexit(cap_stop);
+	if (w->max_files > 0){
+		printf("Capture: %s.N, files of %lu MB, the last %u are kept\n", w->path, arg_config->capture_mb, w->max_files);
+	} else {
+		printf("Capture: %s.N, files of %lu MB, all are kept\n", w->path, arg_config->capture_mb);
+	}
+	return 0;
+}
+
+int cap_stage_init(pipe_stage_t *stage, arg_config_t *arg_config, unsigned int worker){
+	char line[CAPTURE_FILTER_SIZE + 16];
+	cap_stage_t *cs;
+	cap_ring_t *ring;
+
+	if (arg_config->capture_path[0] == '\0'){
+		printf("ERROR: The capture stage needs a file (--capture)\n");
+		return -1;
+	}
+	if (cap_writer == NULL){
+		if (arg_config->capture_filter[0] != '\0'){
+			/*
+			* A filter is the match part of an acl rule
+			*/
+			snprintf(line, sizeof(line), "0 permit %s", arg_config->capture_filter);
+			if (acl_parse_rule(line, &cap_filter) != 0){
+				printf("ERROR: Invalid capture filter: %s\n", arg_config->capture_filter);
+				return -1;
+			}
+		}
+		if (cap_start(arg_config) == -1){
+			return -1;
+		}
+	}
+	if (posix_memalign((void **)&cs, CACHE_LINE_SIZE, sizeof(cap_stage_t)) != 0 ||
+		posix_memalign((void **)&ring, CACHE_LINE_SIZE, sizeof(cap_ring_t)) != 0){
+		perror("posix_memalign capture stage");
+		return -1;
+	}
+	memset(cs, 0, sizeof(*cs));
+	memset(ring, 0, sizeof(*ring));
+	ring->size = CAP_RING_BYTES;
+	if (posix_memalign((void **)&ring->buf, CACHE_LINE_SIZE, ring->size) != 0){
+		perror("posix_memalign capture ring");
+		return -1;
+	}
+	cs->ring = ring;
+	cs->filter = (arg_config->capture_filter[0] != '\0') ? &cap_filter : NULL;
+	cs->sample = arg_config->capture_sample;
+	cs->countdown = cs->sample;
+	cap_rings[cap_nrings] = ring;
+	__atomic_store_n(&cap_nrings, cap_nrings + 1, __ATOMIC_RELEASE);
+	stage->priv = cs;
+	/*
+	* Same order as the counter names in the stage table
+	*/
+	stage->counters = &cs->captured;
+	return 0;
+}
+/*
+* Frames are copied as they reach the stage and the batch is published
+* at once, the timestamp is the RX one when there is one
+*/
+unsigned int cap_stage(pipe_stage_t *stage, pkt_batch_t *batch){
+	cap_stage_t *cs = stage->priv;
+	cap_ring_t *ring = cs->ring;
+	pkt_desc_t *pkt;
+	flow_key_t key;
+	uint64_t now = 0;
+	unsigned int i;
+
+	if (!cap_active){
+		return 0;
+	}
+	for (i = 0; i < batch->count; i++){
+		pkt = &batch->pkts[i];
+		if (cs->filter != NULL){
+			acl_key_from_batch(&key, batch, i);
+			if (!acl_rule_match(cs->filter, &key)){
+				cs->skipped++;
+				continue;
+			}
+		}
+		if (--cs->countdown > 0){
+			cs->skipped++;
+			continue;
+		}
+		cs->countdown = cs->sample;
+		if (pkt->rx_ns == 0 && now == 0){
+			now = cap_now_ns(CLOCK_REALTIME);
+		}
+		if (cap_push(ring, pkt, pkt->rx_ns != 0 ? pkt->rx_ns : now)){
+			cs->captured++;
+		} else {
+			cs->drops++;
+		}
+	}
+	if (ring->next != ring->tail){
+		__atomic_store_n(&ring->tail, ring->next, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+void cap_stage_print(pipe_stage_t *stage){
+	cap_stage_t *cs = stage->priv;
+
+	printf("Capture ring: %lu KB, %s\n", cs->ring->size >> 10, cap_active ? "capturing" : "paused");
+}
@@ -0,0 +1,833 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+* Socket filter compiler. A tcpdump style expression is parsed into a tree
+* of single field tests and emitted as classic BPF, each node jumping
+* straight to the true or false target of its parent so there is no
+* boolean evaluation at run time. The kernel runs the program before a
+* frame is copied into the ring, frames it rejects cost no slot.
+*/
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+//
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+//
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnffilter.h"
+
+#define FILTER_MAX_NODES  1024
+#define FILTER_MAX_LABELS (FILTER_MAX_NODES + 2)
+#define FILTER_TOKEN_SIZE 64
+#define NO_LABEL          0xffff
+/*
+* Offsets in the frame. The kernel moves the VLAN tag out of the frame
+* before the filter runs, it is read from the ancillary data instead.
+*/
+#define OFF_ETH_DST   0
+#define OFF_ETH_SRC   6
+#define OFF_ETH_TYPE  12
+#define OFF_IP        14
+#define OFF_IP_FRAG   20
+#define OFF_IP_PROTO  23
+#define OFF_IP_SRC    26
+#define OFF_IP_DST    30
+#define OFF_ARP_SPA   28
+#define OFF_ARP_TPA   38
+#define OFF_IP6_NEXT  20
+#define OFF_IP6_SRC   22
+#define OFF_IP6_DST   38
+#define OFF_IP6_SPORT 54
+#define OFF_IP6_DPORT 56
+/*
+* Ports behind an IPv4 header are loaded relative to X, its length
+*/
+#define OFF_L4_SPORT  (OFF_IP + 0)
+#define OFF_L4_DPORT  (OFF_IP + 2)
+
+#define NODE_TEST 0
+#define NODE_AND  1
+#define NODE_OR   2
+#define NODE_NOT  3
+
+#define LOAD_ABS  0
+#define LOAD_L4   1
+#define LOAD_AUX  2
+#define LOAD_LEN  3
+
+#define DIR_ANY   0
+#define DIR_SRC   1
+#define DIR_DST   2
+
+/*
+* A test loads size bytes at offset, masks them unless mask is all ones
+* and compares with value. AND, OR and NOT combine left and right.
+*/
+typedef struct _filter_node {
+	uint8_t type;
+	uint8_t load;
+	uint8_t size;
+	uint8_t jmp;
+	uint32_t offset;
+	uint32_t mask;
+	uint32_t value;
+	int left;
+	int right;
+} filter_node_t;
+
+typedef struct _filter_parser {
+	const char *pos;
+	char tok[FILTER_TOKEN_SIZE];
+	filter_node_t nodes[FILTER_MAX_NODES];
+	int nnodes;
+	bool failed;
+} filter_parser_t;
+/*
+* Jumps hold labels until the program is laid out, labels[] is where
+* each one ended up
+*/
+typedef struct _filter_gen {
+	filter_prog_t *prog;
+	uint16_t jt[BPF_MAXINSNS];
+	uint16_t jf[BPF_MAXINSNS];
+	unsigned int labels[FILTER_MAX_LABELS];
+	unsigned int nlabels;
+	bool failed;
+} filter_gen_t;
+
+static void filter_error(filter_parser_t *p, const char *msg){
+	if (!p->failed && p->tok[0] == '\0'){
+		printf("ERROR: Filter: %s at the end\n", msg);
+	} else if (!p->failed){
+		printf("ERROR: Filter: %s near '%s'\n", msg, p->tok);
+	}
+	p->failed = true;
+}
+
+static void next_token(filter_parser_t *p){
+	size_t n = 0;
+
+	while (isspace((unsigned char)*p->pos)){
+		p->pos++;
+	}
+	if (*p->pos == '(' || *p->pos == ')' || (*p->pos == '!' && p->pos[1] != '=')){
+		p->tok[n++] = *p->pos++;
+	} else if ((p->pos[0] == '&' && p->pos[1] == '&') || (p->pos[0] == '|' && p->pos[1] == '|')){
+		p->tok[n++] = *p->pos++;
+		p->tok[n++] = *p->pos++;
+	} else {
+		while (*p->pos != '\0' && !isspace((unsigned char)*p->pos) && strchr("()!&|", *p->pos) == NULL){
+			if (n < sizeof(p->tok) - 1){
+				p->tok[n++] = *p->pos;
+			}
+			p->pos++;
+		}
+		/*
+		* A lone & or | or a != would end the expression here
+		*/
+		if (n == 0 && *p->pos != '\0'){
+			p->tok[n++] = *p->pos;
+			p->tok[n] = '\0';
+			filter_error(p, "unexpected character");
+			return;
+		}
+	}
+	p->tok[n] = '\0';
+}
+
+static inline bool is_token(filter_parser_t *p, const char *word){
+	return strcmp(p->tok, word) == 0;
+}
+
+static int node_new(filter_parser_t *p, uint8_t type, int left, int right){
+	filter_node_t *node;
+
+	if (left < 0 || (type != NODE_NOT && type != NODE_TEST && right < 0)){
+		return -1;
+	}
+	if (p->nnodes == FILTER_MAX_NODES){
+		filter_error(p, "expression too long");
+		return -1;
+	}
+	node = &p->nodes[p->nnodes];
+	memset(node, 0, sizeof(*node));
+	node->type = type;
+	node->left = left;
+	node->right = right;
+	return p->nnodes++;
+}
+
+static int test(filter_parser_t *p, uint8_t load, uint8_t size, uint32_t offset, uint32_t mask, uint8_t jmp, uint32_t value){
+	int n = node_new(p, NODE_TEST, 0, 0);
+
+	if (n >= 0){
+		p->nodes[n].load = load;
+		p->nodes[n].size = size;
+		p->nodes[n].offset = offset;
+		p->nodes[n].mask = mask;
+		p->nodes[n].jmp = jmp;
+		p->nodes[n].value = value;
+	}
+	return n;
+}
+
+static inline int both(filter_parser_t *p, int left, int right){
+	return node_new(p, NODE_AND, left, right);
+}
+
+static inline int either(filter_parser_t *p, int left, int right){
+	return node_new(p, NODE_OR, left, right);
+}
+
+static inline int negate(filter_parser_t *p, int child){
+	return node_new(p, NODE_NOT, child, 0);
+}
+
+static inline int equals(filter_parser_t *p, uint8_t load, uint8_t size, uint32_t offset, uint32_t value){
+	return test(p, load, size, offset, UINT32_MAX, BPF_JEQ, value);
+}
+
+static inline int ethertype(filter_parser_t *p, uint16_t type){
+	return equals(p, LOAD_ABS, BPF_H, OFF_ETH_TYPE, type);
+}
+/*
+* The source, destination or either field of a pair
+*/
+static int directed(filter_parser_t *p, int dir, int src, int dst){
+	if (dir == DIR_SRC){
+		return src;
+	} else if (dir == DIR_DST){
+		return dst;
+	}
+	return either(p, src, dst);
+}
+/*
+* IP protocol at offset, 0 is any protocol with ports
+*/
+static int l4_proto(filter_parser_t *p, uint32_t offset, uint8_t proto){
+	if (proto != 0){
+		return equals(p, LOAD_ABS, BPF_B, offset, proto);
+	}
+	return either(p, either(p, equals(p, LOAD_ABS, BPF_B, offset, IPPROTO_TCP), equals(p, LOAD_ABS, BPF_B, offset, IPPROTO_UDP)),
+		equals(p, LOAD_ABS, BPF_B, offset, IPPROTO_SCTP));
+}
+/*
+* IPv4 or IPv6 packets of a protocol, family 0 is both
+*/
+static int ip_proto(filter_parser_t *p, int family, uint8_t proto){
+	int v4, v6;
+
+	v4 = both(p, ethertype(p, ETH_P_IP), equals(p, LOAD_ABS, BPF_B, OFF_IP_PROTO, proto));
+	v6 = both(p, ethertype(p, ETH_P_IPV6), equals(p, LOAD_ABS, BPF_B, OFF_IP6_NEXT, proto));
+	if (family == 4){
+		return v4;
+	} else if (family == 6){
+		return v6;
+	}
+	return either(p, v4, v6);
+}
+
+static uint32_t prefix_word(unsigned int len){
+	return (len == 0) ? 0 : UINT32_MAX << (32 - len);
+}
+/*
+* A prefix of an address at offset, every word it covers is compared
+* under its mask
+*/
+static int prefix_test(filter_parser_t *p, uint32_t offset, const uint8_t *addr, unsigned int len){
+	uint32_t word, mask;
+	unsigned int i, bits;
+	int n = -1, t;
+
+	for (i = 0; i == 0 || i * 32 < len; i++){
+		bits = (len > i * 32 + 32) ? 32 : len - i * 32;
+		mask = prefix_word(bits);
+		memcpy(&word, addr + i * 4, sizeof(word));
+		t = test(p, LOAD_ABS, BPF_W, offset + i * 4, mask, BPF_JEQ, ntohl(word) & mask);
+		n = (n < 0) ? t : both(p, n, t);
+	}
+	return n;
+}
+/*
+* host and net. IPv4 ones without a protocol also match the ARP sender
+* and target as tcpdump does.
+*/
+static int addr_test(filter_parser_t *p, const char *qual, int dir, const char *value, bool net){
+	char buf[INET6_ADDRSTRLEN + 4];
+	uint8_t addr[16];
+	char *slash, *end;
+	unsigned long len;
+	int ip = -1, arp = -1;
+
+	strncpy(buf, value, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+	slash = strchr(buf, '/');
+	if (slash != NULL){
+		*slash++ = '\0';
+		if (!net){
+			filter_error(p, "a host has no prefix length");
+			return -1;
+		}
+	}
+	memset(addr, 0, sizeof(addr));
+	if (inet_pton(AF_INET, buf, addr) == 1){
+		len = 32;
+	} else if (inet_pton(AF_INET6, buf, addr) == 1){
+		len = 128;
+	} else {
+		filter_error(p, "invalid address");
+		return -1;
+	}
+	if (slash != NULL){
+		errno = 0;
+		len = strtoul(slash, &end, 10);
+		if (errno != 0 || *end != '\0' || *slash == '\0' || len > ((strchr(buf, ':') != NULL) ? 128 : 32)){
+			filter_error(p, "invalid prefix length");
+			return -1;
+		}
+	}
+	if (strchr(buf, ':') != NULL){
+		if (qual != NULL && strcmp(qual, "ip6") != 0){
+			filter_error(p, "IPv6 address with an IPv4 protocol");
+			return -1;
+		}
+		return both(p, ethertype(p, ETH_P_IPV6),
+			directed(p, dir, prefix_test(p, OFF_IP6_SRC, addr, len), prefix_test(p, OFF_IP6_DST, addr, len)));
+	}
+	if (qual != NULL && strcmp(qual, "ip") != 0 && strcmp(qual, "arp") != 0){
+		filter_error(p, "IPv4 address with an IPv6 protocol");
+		return -1;
+	}
+	if (qual == NULL || strcmp(qual, "ip") == 0){
+		ip = both(p, ethertype(p, ETH_P_IP),
+			directed(p, dir, prefix_test(p, OFF_IP_SRC, addr, len), prefix_test(p, OFF_IP_DST, addr, len)));
+	}
+	if (qual == NULL || strcmp(qual, "arp") == 0){
+		arp = both(p, ethertype(p, ETH_P_ARP),
+			directed(p, dir, prefix_test(p, OFF_ARP_SPA, addr, len), prefix_test(p, OFF_ARP_TPA, addr, len)));
+	}
+	if (qual == NULL){
+		return either(p, ip, arp);
+	}
+	return (ip >= 0) ? ip : arp;
+}
+
+static int range_test(filter_parser_t *p, uint8_t load, uint32_t offset, uint16_t lo, uint16_t hi){
+	if (lo == hi){
+		return equals(p, load, BPF_H, offset, lo);
+	}
+	return both(p, test(p, load, BPF_H, offset, UINT32_MAX, BPF_JGE, lo),
+		negate(p, test(p, load, BPF_H, offset, UINT32_MAX, BPF_JGT, hi)));
+}
+/*
+* port and portrange, proto 0 is TCP, UDP or SCTP. Only first IPv4
+* fragments carry the ports and IPv6 extension headers are not walked.
+*/
+static int port_test(filter_parser_t *p, uint8_t proto, int dir, uint16_t lo, uint16_t hi){
+	int v4, v6;
+
+	v4 = both(p, both(p, ethertype(p, ETH_P_IP), l4_proto(p, OFF_IP_PROTO, proto)),
+		both(p, negate(p, test(p, LOAD_ABS, BPF_H, OFF_IP_FRAG, UINT32_MAX, BPF_JSET, 0x1fff)),
+			directed(p, dir, range_test(p, LOAD_L4, OFF_L4_SPORT, lo, hi), range_test(p, LOAD_L4, OFF_L4_DPORT, lo, hi))));
+	v6 = both(p, both(p, ethertype(p, ETH_P_IPV6), l4_proto(p, OFF_IP6_NEXT, proto)),
+		directed(p, dir, range_test(p, LOAD_ABS, OFF_IP6_SPORT, lo, hi), range_test(p, LOAD_ABS, OFF_IP6_DPORT, lo, hi)));
+	return either(p, v4, v6);
+}
+
+static int mac_test(filter_parser_t *p, uint32_t offset, const uint8_t *mac){
+	return both(p, equals(p, LOAD_ABS, BPF_W, offset, ((uint32_t)mac[0] << 24) | (mac[1] << 16) | (mac[2] << 8) | mac[3]),
+		equals(p, LOAD_ABS, BPF_H, offset + 4, (mac[4] << 8) | mac[5]));
+}
+
+static int parse_number(filter_parser_t *p, unsigned long max, unsigned long *value){
+	char *end;
+
+	errno = 0;
+	*value = strtoul(p->tok, &end, 0);
+	if (errno != 0 || end == p->tok || *end != '\0' || *value > max){
+		filter_error(p, "invalid number");
+		return -1;
+	}
+	return 0;
+}
+/*
+* A port is a number or a service name, a range two numbers
+*/
+static int parse_ports(filter_parser_t *p, bool range, uint16_t *lo, uint16_t *hi){
+	struct servent *serv;
+	unsigned long l, h;
+	char *end;
+
+	if (!range && !isdigit((unsigned char)p->tok[0])){
+		serv = getservbyname(p->tok, NULL);
+		if (serv == NULL){
+			filter_error(p, "unknown service");
+			return -1;
+		}
+		*lo = *hi = ntohs(serv->s_port);
+		return 0;
+	}
+	l = strtoul(p->tok, &end, 10);
+	h = l;
+	if (range && *end == '-'){
+		h = strtoul(end + 1, &end, 10);
+	}
+	if (*end != '\0' || end == p->tok || l > h || h > 65535){
+		filter_error(p, range ? "invalid port range" : "invalid port");
+		return -1;
+	}
+	*lo = l;
+	*hi = h;
+	return 0;
+}
+
+static int parse_ip_proto(filter_parser_t *p, uint8_t *proto){
+	unsigned long n;
+
+	if (is_token(p, "tcp")){
+		*proto = IPPROTO_TCP;
+	} else if (is_token(p, "udp")){
+		*proto = IPPROTO_UDP;
+	} else if (is_token(p, "icmp")){
+		*proto = IPPROTO_ICMP;
+	} else if (is_token(p, "icmp6")){
+		*proto = IPPROTO_ICMPV6;
+	} else if (is_token(p, "sctp")){
+		*proto = IPPROTO_SCTP;
+	} else if (parse_number(p, 255, &n) == 0){
+		*proto = n;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_ethertype(filter_parser_t *p, uint16_t *type){
+	unsigned long n;
+
+	if (is_token(p, "ip")){
+		*type = ETH_P_IP;
+	} else if (is_token(p, "ip6")){
+		*type = ETH_P_IPV6;
+	} else if (is_token(p, "arp")){
+		*type = ETH_P_ARP;
+	} else if (parse_number(p, 0xffff, &n) == 0){
+		*type = n;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_mac(filter_parser_t *p, uint8_t *mac){
+	unsigned int b[6];
+	unsigned int i;
+	char c;
+
+	if (sscanf(p->tok, "%x:%x:%x:%x:%x:%x%c", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &c) != 6){
+		filter_error(p, "invalid MAC address");
+		return -1;
+	}
+	for (i = 0; i < 6; i++){
+		if (b[i] > 0xff){
+			filter_error(p, "invalid MAC address");
+			return -1;
+		}
+		mac[i] = b[i];
+	}
+	return 0;
+}
+/*
+* Protocol primitives that also qualify the one after them
+*/
+static int proto_primitive(filter_parser_t *p, const char *qual){
+	if (strcmp(qual, "ip") == 0){
+		return ethertype(p, ETH_P_IP);
+	} else if (strcmp(qual, "ip6") == 0){
+		return ethertype(p, ETH_P_IPV6);
+	} else if (strcmp(qual, "arp") == 0){
+		return ethertype(p, ETH_P_ARP);
+	} else if (strcmp(qual, "tcp") == 0){
+		return ip_proto(p, 0, IPPROTO_TCP);
+	} else if (strcmp(qual, "udp") == 0){
+		return ip_proto(p, 0, IPPROTO_UDP);
+	} else if (strcmp(qual, "sctp") == 0){
+		return ip_proto(p, 0, IPPROTO_SCTP);
+	}
+	filter_error(p, "ether needs host, proto, broadcast or multicast after it");
+	return -1;
+}
+/*
+* Everything but the protocol primitives needs a value, kind says what
+* it is and qual and dir narrow it down
+*/
+static int value_primitive(filter_parser_t *p, const char *qual, int dir, const char *kind){
+	static const uint8_t broadcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+	bool ether = (qual != NULL && strcmp(qual, "ether") == 0);
+	uint8_t mac[6], proto = 0;
+	uint16_t lo, hi, type;
+
+	if (strcmp(kind, "broadcast") == 0 || strcmp(kind, "multicast") == 0){
+		if (dir != DIR_ANY || (qual != NULL && !ether)){
+			filter_error(p, "broadcast and multicast only take ether");
+			return -1;
+		}
+		if (kind[0] == 'b'){
+			return mac_test(p, OFF_ETH_DST, broadcast);
+		}
+		return test(p, LOAD_ABS, BPF_B, OFF_ETH_DST, UINT32_MAX, BPF_JSET, 0x01);
+	}
+	if (p->tok[0] == '\0' || strchr("()!&|", p->tok[0]) != NULL || is_token(p, "and") || is_token(p, "or")){
+		filter_error(p, "missing value");
+		return -1;
+	}
+	if (strcmp(kind, "proto") == 0){
+		if (dir != DIR_ANY){
+			filter_error(p, "proto has no direction");
+			return -1;
+		}
+		if (ether){
+			return (parse_ethertype(p, &type) == 0) ? ethertype(p, type) : -1;
+		}
+		if (qual != NULL && strcmp(qual, "ip") != 0 && strcmp(qual, "ip6") != 0){
+			filter_error(p, "proto only takes ip, ip6 or ether");
+			return -1;
+		}
+		if (parse_ip_proto(p, &proto) == -1){
+			return -1;
+		}
+		return ip_proto(p, (qual == NULL) ? 0 : (qual[2] == '6') ? 6 : 4, proto);
+	}
+	if (strcmp(kind, "host") == 0 || strcmp(kind, "net") == 0){
+		if (ether){
+			if (kind[0] == 'n' || parse_mac(p, mac) == -1){
+				filter_error(p, "ether takes a MAC address");
+				return -1;
+			}
+			return directed(p, dir, mac_test(p, OFF_ETH_SRC, mac), mac_test(p, OFF_ETH_DST, mac));
+		}
+		if (qual != NULL && strcmp(qual, "ip") != 0 && strcmp(qual, "ip6") != 0 && strcmp(qual, "arp") != 0){
+			filter_error(p, "host and net only take ip, ip6, arp or ether");
+			return -1;
+		}
+		return addr_test(p, qual, dir, p->tok, kind[0] == 'n');
+	}
+	if (qual != NULL){
+		if (strcmp(qual, "tcp") == 0){
+			proto = IPPROTO_TCP;
+		} else if (strcmp(qual, "udp") == 0){
+			proto = IPPROTO_UDP;
+		} else if (strcmp(qual, "sctp") == 0){
+			proto = IPPROTO_SCTP;
+		} else {
+			filter_error(p, "port only takes tcp, udp or sctp");
+			return -1;
+		}
+	}
+	if (parse_ports(p, strcmp(kind, "portrange") == 0, &lo, &hi) == -1){
+		return -1;
+	}
+	return port_test(p, proto, dir, lo, hi);
+}
+
+static int parse_primitive(filter_parser_t *p){
+	static const char *quals[] = { "ether", "ip", "ip6", "arp", "tcp", "udp", "sctp", NULL };
+	static const char *kinds[] = { "host", "net", "port", "portrange", "proto", "broadcast", "multicast", NULL };
+	char qual[FILTER_TOKEN_SIZE], kind[FILTER_TOKEN_SIZE];
+	bool has_qual = false;
+	unsigned long n;
+	int dir = DIR_ANY, node, present, i;
+
+	if (p->tok[0] == '\0'){
+		filter_error(p, "expression ends early");
+		return -1;
+	}
+	if (is_token(p, "icmp") || is_token(p, "icmp6")){
+		node = is_token(p, "icmp") ? ip_proto(p, 4, IPPROTO_ICMP) : ip_proto(p, 6, IPPROTO_ICMPV6);
+		next_token(p);
+		return node;
+	}
+	if (is_token(p, "inbound") || is_token(p, "outbound")){
+		node = equals(p, LOAD_AUX, BPF_W, SKF_AD_PKTTYPE, PACKET_OUTGOING);
+		node = is_token(p, "inbound") ? negate(p, node) : node;
+		next_token(p);
+		return node;
+	}
+	if (is_token(p, "vlan")){
+		next_token(p);
+		present = equals(p, LOAD_AUX, BPF_W, SKF_AD_VLAN_TAG_PRESENT, 1);
+		if (!isdigit((unsigned char)p->tok[0])){
+			return present;
+		}
+		if (parse_number(p, 4095, &n) == -1){
+			return -1;
+		}
+		next_token(p);
+		return both(p, present, test(p, LOAD_AUX, BPF_W, SKF_AD_VLAN_TAG, 0x0fff, BPF_JEQ, n));
+	}
+	if (is_token(p, "less") || is_token(p, "greater")){
+		i = is_token(p, "less");
+		next_token(p);
+		if (parse_number(p, UINT32_MAX, &n) == -1){
+			return -1;
+		}
+		next_token(p);
+		node = test(p, LOAD_LEN, BPF_W, 0, UINT32_MAX, i ? BPF_JGT : BPF_JGE, n);
+		return i ? negate(p, node) : node;
+	}
+	for (i = 0; quals[i] != NULL; i++){
+		if (is_token(p, quals[i])){
+			strcpy(qual, p->tok);
+			has_qual = true;
+			next_token(p);
+			break;
+		}
+	}
+	if (is_token(p, "src") || is_token(p, "dst")){
+		dir = is_token(p, "src") ? DIR_SRC : DIR_DST;
+		next_token(p);
+	}
+	for (i = 0; kinds[i] != NULL; i++){
+		if (is_token(p, kinds[i])){
+			break;
+		}
+	}
+	if (kinds[i] != NULL){
+		strcpy(kind, p->tok);
+		next_token(p);
+	} else if (dir != DIR_ANY){
+		strcpy(kind, "host");
+	} else if (has_qual){
+		return proto_primitive(p, qual);
+	} else {
+		filter_error(p, "unknown primitive");
+		return -1;
+	}
+	node = value_primitive(p, has_qual ? qual : NULL, dir, kind);
+	if (node >= 0 && strcmp(kind, "broadcast") != 0 && strcmp(kind, "multicast") != 0){
+		next_token(p);
+	}
+	return node;
+}
+
+static int parse_or(filter_parser_t *p);
+
+static int parse_not(filter_parser_t *p){
+	int node;
+
+	if (is_token(p, "not") || is_token(p, "!")){
+		next_token(p);
+		return negate(p, parse_not(p));
+	}
+	if (is_token(p, "(")){
+		next_token(p);
+		node = parse_or(p);
+		if (node >= 0 && !is_token(p, ")")){
+			filter_error(p, "missing )");
+			return -1;
+		}
+		next_token(p);
+		return node;
+	}
+	return parse_primitive(p);
+}
+
+static int parse_and(filter_parser_t *p){
+	int node = parse_not(p);
+
+	while (node >= 0 && (is_token(p, "and") || is_token(p, "&&"))){
+		next_token(p);
+		node = both(p, node, parse_not(p));
+	}
+	return node;
+}
+
+static int parse_or(filter_parser_t *p){
+	int node = parse_and(p);
+
+	while (node >= 0 && (is_token(p, "or") || is_token(p, "||"))){
+		next_token(p);
+		node = either(p, node, parse_and(p));
+	}
+	return node;
+}
+
+static unsigned int label_new(filter_gen_t *g){
+	return g->nlabels++;
+}
+
+static void label_place(filter_gen_t *g, unsigned int label){
+	g->labels[label] = g->prog->len;
+}
+
+static void emit(filter_gen_t *g, uint16_t code, uint32_t k, unsigned int jt, unsigned int jf){
+	struct sock_filter *insn;
+
+	if (g->prog->len == BPF_MAXINSNS){
+		g->failed = true;
+		return;
+	}
+	insn = &g->prog->insns[g->prog->len];
+	insn->code = code;
+	insn->jt = 0;
+	insn->jf = 0;
+	insn->k = k;
+	g->jt[g->prog->len] = jt;
+	g->jf[g->prog->len] = jf;
+	g->prog->len++;
+}
+
+static void gen_test(filter_gen_t *g, filter_node_t *node, unsigned int t, unsigned int f){
+	switch (node->load){
+		case LOAD_L4:
+			emit(g, BPF_LDX | BPF_B | BPF_MSH, OFF_IP, NO_LABEL, NO_LABEL);
+			emit(g, BPF_LD | node->size | BPF_IND, node->offset, NO_LABEL, NO_LABEL);
+			break;
+		case LOAD_AUX:
+			emit(g, BPF_LD | BPF_W | BPF_ABS, (uint32_t)SKF_AD_OFF + node->offset, NO_LABEL, NO_LABEL);
+			break;
+		case LOAD_LEN:
+			emit(g, BPF_LD | BPF_W | BPF_LEN, 0, NO_LABEL, NO_LABEL);
+			break;
+		default:
+			emit(g, BPF_LD | node->size | BPF_ABS, node->offset, NO_LABEL, NO_LABEL);
+	}
+	if (node->mask != UINT32_MAX){
+		emit(g, BPF_ALU | BPF_AND | BPF_K, node->mask, NO_LABEL, NO_LABEL);
+	}
+	emit(g, BPF_JMP | node->jmp | BPF_K, node->value, t, f);
+}
+/*
+* Code of a node ends in jumps to t when it holds and to f otherwise, the
+* right side of AND and OR starts where the left one falls through
+*/
+static void gen_node(filter_parser_t *p, filter_gen_t *g, int n, unsigned int t, unsigned int f){
+	filter_node_t *node = &p->nodes[n];
+	unsigned int next;
+
+	switch (node->type){
+		case NODE_AND:
+			next = label_new(g);
+			gen_node(p, g, node->left, next, f);
+			label_place(g, next);
+			gen_node(p, g, node->right, t, f);
+			break;
+		case NODE_OR:
+			next = label_new(g);
+			gen_node(p, g, node->left, t, next);
+			label_place(g, next);
+			gen_node(p, g, node->right, t, f);
+			break;
+		case NODE_NOT:
+			gen_node(p, g, node->left, f, t);
+			break;
+		default:
+			gen_test(g, node, t, f);
+	}
+}
+/*
+* Labels only ever point forward, conditional jumps reach 255 instructions
+*/
+static int gen_resolve(filter_gen_t *g){
+	unsigned int i, jt, jf;
+
+	for (i = 0; i < g->prog->len; i++){
+		if (g->jt[i] == NO_LABEL){
+			continue;
+		}
+		jt = g->labels[g->jt[i]] - (i + 1);
+		jf = g->labels[g->jf[i]] - (i + 1);
+		if (jt > 255 || jf > 255){
+			printf("ERROR: Filter: expression too long for the jumps of classic BPF\n");
+			return -1;
+		}
+		g->prog->insns[i].jt = jt;
+		g->prog->insns[i].jf = jf;
+	}
+	return 0;
+}
+
+int filter_compile(const char *expr, filter_prog_t *prog){
+	filter_parser_t *p;
+	filter_gen_t *g;
+	unsigned int t, f;
+	int root, status = -1;
+
+	p = calloc(1, sizeof(filter_parser_t));
+	g = calloc(1, sizeof(filter_gen_t));
+	if (p == NULL || g == NULL){
+		perror("calloc filter");
+		free(p);
+		free(g);
+		return -1;
+	}
+	p->pos = expr;
+	next_token(p);
+	if (p->tok[0] == '\0'){
+		printf("ERROR: Filter: empty expression\n");
+		goto out;
+	}
+	root = parse_or(p);
+	if (root >= 0 && (p->tok[0] != '\0' || *p->pos != '\0')){
+		filter_error(p, "unexpected token");
+	}
+	if (root < 0 || p->failed){
+		goto out;
+	}
+	g->prog = prog;
+	prog->len = 0;
+	t = label_new(g);
+	f = label_new(g);
+	gen_node(p, g, root, t, f);
+	label_place(g, t);
+	emit(g, BPF_RET | BPF_K, FILTER_SNAPLEN, NO_LABEL, NO_LABEL);
+	label_place(g, f);
+	emit(g, BPF_RET | BPF_K, 0, NO_LABEL, NO_LABEL);
+	if (g->failed){
+		printf("ERROR: Filter: longer than %d instructions\n", BPF_MAXINSNS);
+		goto out;
+	}
+	status = gen_resolve(g);
+out:
+	free(p);
+	free(g);
+	return status;
+}
+
+int filter_attach(int fd, filter_prog_t *prog){
+	struct sock_fprog fprog;
+	char byte;
+
+	fprog.len = prog->len;
+	fprog.filter = prog->insns;
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) == -1){
+		perror("SO_ATTACH_FILTER");
+		return -1;
+	}
+	while (recv(fd, &byte, sizeof(byte), MSG_DONTWAIT | MSG_TRUNC) >= 0){
+		;
+	}
+	return 0;
+}
@@ -0,0 +1,303 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*! Exact match flow cache
+ *
+ * Open addressing over buckets of FLOW_WAYS entries. A bucket keeps the
+ * 16 bit signatures of its entries in 16 bytes, a lookup compares all of
+ * them at once and only reads the entries whose signature matches. Every
+ * entry fills one cache line. A full bucket evicts the entry that was
+ * used the longest ago. Lookups run a batch at a time: hashes and bucket
+ * prefetches first, then signatures, then the keys.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+//
+#include <sys/mman.h>
+//
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnfpipe.h"
+#include "vnfflow.h"
+
+/*
+* Per worker shard of the cache plus scratch space for one batch
+*/
+typedef struct _flow_stage {
+	flow_cache_t cache;
+	flow_key_t keys[PIPE_BATCH];
+	uint64_t hashes[PIPE_BATCH];
+	flow_entry_t *entries[PIPE_BATCH];
+	uint8_t index[PIPE_BATCH];
+} flow_stage_t;
+
+/*
+* Bit 2i of the result is set when way i carries sig
+*/
+static inline unsigned int flow_sig_match(flow_bucket_t *bucket, uint16_t sig){
+#ifdef __SSE2__
+	__m128i sigs = _mm_loadu_si128((__m128i *)bucket->sig);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi16(sigs, _mm_set1_epi16(sig))) & 0x5555;
+#else
+	unsigned int i, match = 0;
+
+	for (i = 0; i < FLOW_WAYS; i++){
+		if (bucket->sig[i] == sig){
+			match |= 1U << (2 * i);
+		}
+	}
+	return match;
+#endif
+}
+
+static inline flow_bucket_t *flow_bucket(flow_cache_t *fc, uint64_t hash){
+	return &fc->buckets[hash & fc->mask];
+}
+
+static inline flow_entry_t *flow_ways(flow_cache_t *fc, uint64_t hash){
+	return &fc->entries[(hash & fc->mask) * FLOW_WAYS];
+}
+/*
+* Size the cache for nflows entries, rounded up to a power of two. The
+* tables are one anonymous mapping backed by huge pages when possible.
+*/
+int flow_cache_init(flow_cache_t *fc, uint64_t nflows){
+	uint64_t nbuckets;
+	size_t buckets_len;
+
+	memset(fc, 0, sizeof(*fc));
+	nflows = MAX(nflows, FLOW_WAYS * 4);
+	nbuckets = 1;
+	while (nbuckets * FLOW_WAYS < nflows){
+		nbuckets <<= 1;
+	}
+	buckets_len = nbuckets * sizeof(flow_bucket_t);
+	fc->map_len = buckets_len + nbuckets * FLOW_WAYS * sizeof(flow_entry_t);
+	fc->buckets = mmap(NULL, fc->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (fc->buckets == MAP_FAILED){
+		perror("mmap flow cache");
+		fc->buckets = NULL;
+		return -1;
+	}
+	madvise(fc->buckets, fc->map_len, MADV_HUGEPAGE);
+	fc->entries = (flow_entry_t *)((uint8_t *)fc->buckets + buckets_len);
+	fc->mask = nbuckets - 1;
+	fc->nflows = nbuckets * FLOW_WAYS;
+	return 0;
+}
+
+void flow_cache_free(flow_cache_t *fc){
+	if (fc->buckets != NULL){
+		munmap(fc->buckets, fc->map_len);
+		fc->buckets = NULL;
+	}
+}
+/*
+* Build the key of parsed frame i of a batch when it is IPv4 or IPv6
+*/
+bool flow_key_from_batch(flow_key_t *key, pkt_batch_t *batch, unsigned int i){
+	pkt_meta_t *meta = &batch->meta;
+	uint8_t *l3;
+
+	if (meta->l3_offset[i] == 0){
+		return false;
+	}
+	memset(key, 0, sizeof(*key));
+	l3 = batch->pkts[i].data + meta->l3_offset[i];
+	if (meta->ethertype[i] == ETH_P_IP){
+		memcpy(key->src, l3 + 12, 4);
+		memcpy(key->dst, l3 + 16, 4);
+	} else {
+		memcpy(key->src, l3 + 8, 16);
+		memcpy(key->dst, l3 + 24, 16);
+	}
+	key->sport = meta->sport[i];
+	key->dport = meta->dport[i];
+	key->ethertype = meta->ethertype[i];
+	key->vlan = meta->vlan[i];
+	key->proto = meta->ip_proto[i];
+	key->in_port = batch->pkts[i].in_port;
+	return true;
+}
+
+void flow_prefetch(flow_cache_t *fc, uint64_t hash){
+	__builtin_prefetch(flow_bucket(fc, hash));
+}
+
+flow_entry_t *flow_lookup(flow_cache_t *fc, flow_key_t *key, uint64_t hash){
+	flow_entry_t *ways = flow_ways(fc, hash);
+	unsigned int match, way;
+
+	match = flow_sig_match(flow_bucket(fc, hash), flow_sig(hash));
+	while (match != 0){
+		way = __builtin_ctz(match) / 2;
+		if (flow_key_equal(&ways[way].key, key)){
+			return &ways[way];
+		}
+		match &= match - 1;
+	}
+	return NULL;
+}
+/*
+* Add a flow that missed, an empty way is used first, otherwise the way
+* used the longest ago. Flows added in the current epoch may still be
+* referenced by frames being classified and are never evicted.
+*/
+flow_entry_t *flow_insert(flow_cache_t *fc, flow_key_t *key, uint64_t hash){
+	flow_bucket_t *bucket = flow_bucket(fc, hash);
+	flow_entry_t *ways = flow_ways(fc, hash);
+	flow_entry_t *entry;
+	uint32_t age, oldest = 0;
+	int victim = -1;
+	unsigned int i;
+
+	for (i = 0; i < FLOW_WAYS; i++){
+		if (bucket->sig[i] == FLOW_SIG_EMPTY){
+			victim = i;
+			break;
+		}
+		if (ways[i].born == fc->epoch){
+			continue;
+		}
+		age = fc->epoch - ways[i].used;
+		if (victim == -1 || age > oldest){
+			victim = i;
+			oldest = age;
+		}
+	}
+	if (victim == -1){
+		fc->full++;
+		return NULL;
+	}
+	if (bucket->sig[victim] != FLOW_SIG_EMPTY){
+		fc->evictions++;
+	}
+	entry = &ways[victim];
+	entry->key = *key;
+	entry->used = fc->epoch;
+	entry->born = fc->epoch;
+	entry->verdict = VERDICT_FORWARD;
+	entry->out_port = PORT_NONE;
+	bucket->sig[victim] = flow_sig(hash);
+	return entry;
+}
+/*
+* Look up n keys, the memory of every bucket is requested before the
+* first one is read so the misses overlap. hashes are filled in.
+*/
+void flow_lookup_batch(flow_cache_t *fc, flow_key_t *keys, uint64_t *hashes, flow_entry_t **entries, unsigned int n){
+	unsigned int i, way;
+	unsigned int match[PIPE_BATCH];
+	flow_entry_t *ways;
+
+	for (i = 0; i < n; i++){
+		hashes[i] = flow_hash(&keys[i]);
+		flow_prefetch(fc, hashes[i]);
+	}
+	for (i = 0; i < n; i++){
+		match[i] = flow_sig_match(flow_bucket(fc, hashes[i]), flow_sig(hashes[i]));
+		if (match[i] != 0){
+			__builtin_prefetch(&flow_ways(fc, hashes[i])[__builtin_ctz(match[i]) / 2]);
+		}
+	}
+	for (i = 0; i < n; i++){
+		entries[i] = NULL;
+		ways = flow_ways(fc, hashes[i]);
+		while (match[i] != 0){
+			way = __builtin_ctz(match[i]) / 2;
+			if (flow_key_equal(&ways[way].key, &keys[i])){
+				entries[i] = &ways[way];
+				break;
+			}
+			match[i] &= match[i] - 1;
+		}
+	}
+}
+
+int flow_stage_init(pipe_stage_t *stage, arg_config_t *arg_config, unsigned int worker){
+	flow_stage_t *fs;
+
+	if (posix_memalign((void **)&fs, CACHE_LINE_SIZE, sizeof(flow_stage_t)) != 0){
+		perror("posix_memalign flow stage");
+		return -1;
+	}
+	memset(fs, 0, sizeof(*fs));
+	if (flow_cache_init(&fs->cache, arg_config->flows) == -1){
+		free(fs);
+		return -1;
+	}
+	stage->priv = fs;
+	/*
+	* Same order as the counter names in the stage table
+	*/
+	stage->counters = &fs->cache.hits;
+	return 0;
+}
+/*
+* Frames of a known flow take the verdict of its first frame and are not
+* classified again. The others are added and carry their entry along so
+* the classifier can fill in the verdict. Frames that are not IP bypass
+* the cache.
+*/
+unsigned int flow_stage(pipe_stage_t *stage, pkt_batch_t *batch){
+	flow_stage_t *fs = stage->priv;
+	flow_cache_t *fc = &fs->cache;
+	flow_entry_t *entry;
+	pkt_desc_t *pkt;
+	unsigned int i, n = 0, dropped = 0;
+
+	fc->epoch++;
+	for (i = 0; i < batch->count; i++){
+		pipe_prefetch(batch, i);
+		if (flow_key_from_batch(&fs->keys[n], batch, i)){
+			fs->index[n++] = i;
+		}
+	}
+	flow_lookup_batch(fc, fs->keys, fs->hashes, fs->entries, n);
+	for (i = 0; i < n; i++){
+		pkt = &batch->pkts[fs->index[i]];
+		pkt->hash = fs->hashes[i];
+		entry = fs->entries[i];
+		if (entry != NULL && entry->born != fc->epoch){
+			fc->hits++;
+			entry->used = fc->epoch;
+			pkt->verdict = entry->verdict;
+			pkt->out_port = entry->out_port;
+			pkt->flags |= PKT_CACHED;
+			if (pkt->verdict == VERDICT_DROP){
+				dropped++;
+			}
+			continue;
+		}
+		fc->misses++;
+		if (entry == NULL){
+			entry = flow_insert(fc, &fs->keys[i], fs->hashes[i]);
+		}
+		pkt->flow = entry;
+	}
+	return dropped;
+}
+
+void flow_stage_print(pipe_stage_t *stage){
+	flow_stage_t *fs = stage->priv;
+
+	printf("Flow cache: %lu flows, %lu MB\n", fs->cache.nflows, fs->cache.map_len >> 20);
+}
@@ -0,0 +1,566 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*! Packet mmap traffic generator and sink used to measure the VNF, plus
+ *  a bulk TCP sender and receiver for forwarding through real sockets
+ *
+ */
+#define _GNU_SOURCE
+#include <sched.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+//
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+//
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+//
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnflat.h"
+
+#define GEN_FRAME_SIZE  2048
+#define GEN_MAX_FRAME   16384
+#define GEN_FRAME_NR    1024
+#define GEN_BATCH       64
+#define GEN_UDP_PORT    7777
+#define GEN_MAGIC       0x564e4647
+#define GEN_TCP_PORT    7778
+#define GEN_TCP_BUF     (256 * 1024)
+
+typedef struct _gen_config {
+	char name[IFNAMSIZ];
+	bool tx;
+	unsigned int duration;
+	unsigned int frame_len;
+	unsigned int frame_size;
+	unsigned int flows;
+	unsigned long rate;
+	int cpu;
+	int fd;
+	struct in_addr dest;
+	uint8_t *ring;
+	/*
+	* Results
+	*/
+	uint64_t packets;
+	uint64_t bytes;
+	double seconds;
+	lat_hist_t hist;
+} gen_config_t;
+/*
+* Payload following the UDP header, ts is the CLOCK_MONOTONIC send time
+* which every namespace of the host shares
+*/
+typedef struct _gen_payload {
+	uint32_t magic;
+	uint32_t seq;
+	uint64_t ts;
+} gen_payload_t;
+
+static double now(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint16_t ip_checksum(void *data, int len){
+	uint32_t sum = 0;
+	uint16_t *p = data;
+
+	while (len > 1){
+		sum += *p++;
+		len -= 2;
+	}
+	while (sum >> 16){
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return ~sum;
+}
+/*
+* Open a packet socket on the interface with a TPACKET_V2 TX or RX ring
+*/
+static void gen_open(gen_config_t *config){
+	struct tpacket_req treq;
+	struct sockaddr_ll saddr;
+	int v = TPACKET_V2;
+	int one = 1;
+
+	config->fd = socket(PF_PACKET, SOCK_RAW, config->tx ? 0 : htons(ETH_P_IP));
+	if (config->fd == -1){
+		perror("socket");
+		exit(1);
+	}
+	if (setsockopt(config->fd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) == -1){
+		perror("PACKET_VERSION");
+		exit(1);
+	}
+	/*
+	* Ring slots grow in powers of two to hold jumbo frames
+	*/
+	config->frame_size = GEN_FRAME_SIZE;
+	while (config->frame_size < config->frame_len + TPACKET2_HDRLEN + 64){
+		config->frame_size <<= 1;
+	}
+	memset(&treq, 0, sizeof(treq));
+	treq.tp_block_size = config->frame_size * 32;
+	treq.tp_block_nr = GEN_FRAME_NR / 32;
+	treq.tp_frame_size = config->frame_size;
+	treq.tp_frame_nr = GEN_FRAME_NR;
+	if (setsockopt(config->fd, SOL_PACKET, config->tx ? PACKET_TX_RING : PACKET_RX_RING, &treq, sizeof(treq)) == -1){
+		perror("PACKET_RING");
+		exit(1);
+	}
+	if (config->tx){
+		setsockopt(config->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+	} else {
+		/*
+		* Looped back frames of our own TX socket are not traffic
+		*/
+		setsockopt(config->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+	}
+	config->ring = mmap(NULL, (size_t)config->frame_size * GEN_FRAME_NR, PROT_READ | PROT_WRITE, MAP_SHARED, config->fd, 0);
+	if (config->ring == MAP_FAILED){
+		perror("mmap");
+		exit(1);
+	}
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sll_family = PF_PACKET;
+	saddr.sll_protocol = config->tx ? 0 : htons(ETH_P_IP);
+	saddr.sll_ifindex = if_nametoindex(config->name);
+	if (saddr.sll_ifindex == 0 || bind(config->fd, (struct sockaddr *)&saddr, sizeof(saddr)) == -1){
+		perror("bind");
+		exit(1);
+	}
+}
+/*
+* Build an Ethernet/IPv4/UDP frame of frame_len bytes
+*/
+static void gen_build(gen_config_t *config, uint8_t *frame, uint32_t flow, uint64_t seq){
+	struct ether_header *eth = (struct ether_header *)frame;
+	struct iphdr *ip = (struct iphdr *)(eth + 1);
+	struct udphdr *udp = (struct udphdr *)(ip + 1);
+	gen_payload_t *payload = (gen_payload_t *)(udp + 1);
+	unsigned int ip_len = config->frame_len - sizeof(*eth);
+
+	memset(frame, 0, config->frame_len);
+	memset(eth->ether_dhost, 0xff, ETH_ALEN);
+	eth->ether_shost[0] = 0x02;
+	eth->ether_shost[5] = 0x01;
+	eth->ether_type = htons(ETHERTYPE_IP);
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->tot_len = htons(ip_len);
+	ip->ttl = 64;
+	ip->protocol = IPPROTO_UDP;
+	ip->saddr = htonl(0x0a090001);
+	ip->daddr = htonl(0x0a090002);
+	ip->check = ip_checksum(ip, sizeof(*ip));
+	udp->source = htons(1024 + (flow & 0x7fff));
+	udp->dest = htons(GEN_UDP_PORT);
+	udp->len = htons(ip_len - sizeof(*ip));
+	payload->magic = htonl(GEN_MAGIC);
+	payload->seq = seq;
+	payload->ts = now_ns();
+}
+
+static void gen_tx(gen_config_t *config){
+	struct tpacket2_hdr *hdr;
+	unsigned int offset = 0;
+	unsigned int pending = 0;
+	unsigned int data_start = TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+	uint64_t seq = 0;
+	double start, end;
+
+	start = now();
+	end = start + config->duration;
+	while (true){
+		/*
+		* Pace whole batches when a rate is set
+		*/
+		if (config->rate > 0 && pending == 0){
+			while (now() < start + (double)seq / config->rate){
+			}
+		}
+		hdr = (struct tpacket2_hdr *)(config->ring + offset * config->frame_size);
+		if (hdr->tp_status != TP_STATUS_AVAILABLE){
+			sendto(config->fd, NULL, 0, 0, NULL, 0);
+			pending = 0;
+			continue;
+		}
+		gen_build(config, (uint8_t *)hdr + data_start, seq % config->flows, seq);
+		hdr->tp_len = config->frame_len;
+		hdr->tp_status = TP_STATUS_SEND_REQUEST;
+		offset = (offset + 1) % GEN_FRAME_NR;
+		seq++;
+		if (++pending == GEN_BATCH){
+			sendto(config->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+			pending = 0;
+			if (now() >= end){
+				break;
+			}
+		}
+	}
+	end = now();
+	config->packets = seq;
+	config->seconds = end - start;
+}
+/*
+* Count generator frames, the rate is taken from the first to the last frame
+*/
+static void gen_rx(gen_config_t *config){
+	struct tpacket2_hdr *hdr;
+	struct pollfd pfd;
+	gen_payload_t *payload;
+	unsigned int offset = 0;
+	unsigned int payload_off = sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct udphdr);
+	uint64_t packets = 0, bytes = 0, t;
+	double first = 0, last = 0, deadline;
+
+	pfd.fd = config->fd;
+	pfd.events = POLLIN;
+	deadline = now() + config->duration;
+	while (true){
+		hdr = (struct tpacket2_hdr *)(config->ring + offset * config->frame_size);
+		if (!(hdr->tp_status & TP_STATUS_USER)){
+			/*
+			* Stop one second after traffic ends or at the deadline
+			*/
+			if ((packets > 0 && now() - last > 1.0) || now() > deadline){
+				break;
+			}
+			poll(&pfd, 1, 100);
+			continue;
+		}
+		payload = (gen_payload_t *)((uint8_t *)hdr + hdr->tp_mac + payload_off);
+		if (hdr->tp_snaplen >= payload_off + sizeof(*payload) && payload->magic == htonl(GEN_MAGIC)){
+			t = now_ns();
+			last = t / 1e9;
+			if (packets == 0){
+				first = last;
+			}
+			packets++;
+			bytes += hdr->tp_len;
+			lat_record(&config->hist, (t > payload->ts) ? t - payload->ts : 0);
+		}
+		hdr->tp_status = TP_STATUS_KERNEL;
+		offset = (offset + 1) % GEN_FRAME_NR;
+	}
+	if (last <= first){
+		last = first + 1e-9;
+	}
+	config->packets = packets;
+	config->bytes = bytes;
+	config->seconds = last - first;
+}
+
+/*
+* Receive one bulk TCP stream and time it from the first to the last byte
+*/
+static void gen_tcp_rx(gen_config_t *config){
+	struct sockaddr_in addr;
+	struct pollfd pfd;
+	uint8_t *buf;
+	ssize_t n;
+	double first = 0, last = 0;
+	int lfd, one = 1;
+
+	buf = malloc(GEN_TCP_BUF);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (buf == NULL || lfd == -1){
+		perror("tcp socket");
+		exit(1);
+	}
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(GEN_TCP_PORT);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(lfd, 1) == -1){
+		perror("tcp listen");
+		exit(1);
+	}
+	pfd.fd = lfd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, (config->duration + 5) * 1000) != 1){
+		printf("ERROR: No TCP connection\n");
+		exit(1);
+	}
+	config->fd = accept(lfd, NULL, NULL);
+	close(lfd);
+	if (config->fd == -1){
+		perror("tcp accept");
+		exit(1);
+	}
+	while ((n = recv(config->fd, buf, GEN_TCP_BUF, 0)) > 0){
+		last = now();
+		if (config->bytes == 0){
+			first = last;
+		}
+		config->bytes += n;
+	}
+	close(config->fd);
+	free(buf);
+	config->seconds = (last > first) ? last - first : 1e-9;
+}
+/*
+* Send one bulk TCP stream to dest for the duration
+*/
+static void gen_tcp_tx(gen_config_t *config){
+	struct sockaddr_in addr;
+	struct timeval tv = {.tv_sec = 1};
+	uint8_t *buf;
+	ssize_t n;
+	double start, end;
+	int tries;
+
+	buf = calloc(1, GEN_TCP_BUF);
+	if (buf == NULL){
+		perror("calloc");
+		exit(1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(GEN_TCP_PORT);
+	addr.sin_addr = config->dest;
+	/*
+	* The receiver may still be starting up, the send timeout bounds a
+	* connect that gets no answer
+	*/
+	for (tries = 0; ; tries++){
+		config->fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (config->fd == -1){
+			perror("tcp socket");
+			exit(1);
+		}
+		setsockopt(config->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (connect(config->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0){
+			break;
+		}
+		close(config->fd);
+		if (tries == 5){
+			perror("tcp connect");
+			exit(1);
+		}
+		usleep(100000);
+	}
+	start = now();
+	end = start + config->duration;
+	while (now() < end){
+		n = send(config->fd, buf, GEN_TCP_BUF, 0);
+		if (n == -1){
+			perror("tcp send");
+			break;
+		}
+		config->bytes += n;
+	}
+	config->seconds = now() - start;
+	close(config->fd);
+	free(buf);
+}
+
+static void gen_pin(int cpu){
+	cpu_set_t cpuset;
+
+	if (cpu < 0){
+		return;
+	}
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+	sched_setaffinity(0, sizeof(cpuset), &cpuset);
+}
+
+static void *gen_rx_thread(void *arg){
+	gen_rx((gen_config_t *)arg);
+	return NULL;
+}
+/*
+* Send on one interface and receive what the VNF forwards on another, or
+* the same one, and report rates, loss and latency as JSON. Both ends sit
+* in one namespace so the payload timestamp gives the trip through the VNF.
+*/
+static void gen_rtt(gen_config_t *tx_config, gen_config_t *rx_config){
+	pthread_t thread;
+	double loss;
+
+	if (pthread_create(&thread, NULL, gen_rx_thread, rx_config) != 0){
+		perror("pthread_create");
+		exit(1);
+	}
+	/*
+	* Only the sender is pinned, the receiver keeps its own core
+	*/
+	gen_pin(tx_config->cpu);
+	usleep(100000);
+	gen_tx(tx_config);
+	pthread_join(thread, NULL);
+	loss = (tx_config->packets > 0) ? (double)(tx_config->packets - MIN(rx_config->packets, tx_config->packets)) * 100 / tx_config->packets : 0;
+	printf("{\"frame_len\": %u, \"tx_packets\": %lu, \"rx_packets\": %lu, \"seconds\": %.3f, "
+		"\"tx_pps\": %.0f, \"rx_pps\": %.0f, \"rx_gbps\": %.3f, \"loss_pct\": %.3f, "
+		"\"rtt_us\": {\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}}\n",
+		tx_config->frame_len, tx_config->packets, rx_config->packets, rx_config->seconds,
+		tx_config->packets / tx_config->seconds, rx_config->packets / rx_config->seconds,
+		rx_config->bytes * 8 / rx_config->seconds / 1e9, loss,
+		lat_percentile(&rx_config->hist, 0.5) / 1e3, lat_percentile(&rx_config->hist, 0.99) / 1e3,
+		lat_percentile(&rx_config->hist, 0.999) / 1e3, rx_config->hist.max / 1e3);
+}
+
+int main(int argc, char **argv){
+	gen_config_t config, rx_config;
+	char rx_name[IFNAMSIZ];
+	bool rtt = false;
+	bool tcp = false;
+	int c;
+	static struct option longopts[] = {
+		{"interface", required_argument, 0, 'i'},
+		{"mode", required_argument, 0, 'm'},
+		{"time", required_argument, 0, 't'},
+		{"length", required_argument, 0, 'l'},
+		{"flows", required_argument, 0, 'F'},
+		{"cpu", required_argument, 0, 'c'},
+		{"output", required_argument, 0, 'o'},
+		{"rate", required_argument, 0, 'R'},
+		{"dest", required_argument, 0, 'd'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	memset(&config, 0, sizeof(config));
+	config.tx = true;
+	config.duration = 5;
+	config.frame_len = 64;
+	config.flows = 1;
+	config.cpu = -1;
+	rx_name[0] = '\0';
+	while ((c = getopt_long(argc, argv, "i:m:t:l:F:c:o:R:d:h", longopts, NULL)) != -1){
+		switch (c){
+			case 'i':
+				strncpy(config.name, optarg, IFNAMSIZ-1);
+				break;
+			case 'm':
+				config.tx = (strcmp(optarg, "rx") != 0 && strcmp(optarg, "tcp-rx") != 0);
+				rtt = (strcmp(optarg, "rtt") == 0);
+				tcp = (strncmp(optarg, "tcp-", 4) == 0);
+				break;
+			case 'd':
+				if (inet_pton(AF_INET, optarg, &config.dest) != 1){
+					printf("ERROR: Invalid destination: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'o':
+				strncpy(rx_name, optarg, IFNAMSIZ-1);
+				rx_name[IFNAMSIZ-1] = '\0';
+				break;
+			case 'R':
+				config.rate = strtoul(optarg, NULL, 10);
+				break;
+			case 't':
+				config.duration = strtoul(optarg, NULL, 10);
+				break;
+			case 'l':
+				config.frame_len = strtoul(optarg, NULL, 10);
+				break;
+			case 'F':
+				config.flows = strtoul(optarg, NULL, 10);
+				break;
+			case 'c':
+				config.cpu = strtol(optarg, NULL, 10);
+				break;
+			case 'h':
+			default:
+				printf("Command line arguments: \n");
+				printf("-i, --interface Interface to send or receive on \n");
+				printf("-m, --mode      tx, rx or rtt (send and receive, JSON report), or tcp-tx and tcp-rx \n");
+				printf("                for one bulk TCP stream on port %d (JSON report) \n", GEN_TCP_PORT);
+				printf("-t, --time      Seconds to send, or to wait for traffic \n");
+				printf("-l, --length    Frame length without FCS \n");
+				printf("-F, --flows     Number of UDP flows \n");
+				printf("-c, --cpu       Core to pin to \n");
+				printf("-o, --output    Interface the VNF forwards to in rtt mode, default -i \n");
+				printf("-R, --rate      Frames per second to send, 0 is line rate \n");
+				printf("-d, --dest      IPv4 address tcp-tx connects to \n");
+				exit(1);
+		}
+	}
+	if (tcp){
+		gen_pin(config.cpu);
+		if (config.tx){
+			if (config.dest.s_addr == 0){
+				printf("ERROR: Destination not set\n");
+				exit(1);
+			}
+			gen_tcp_tx(&config);
+		} else {
+			gen_tcp_rx(&config);
+		}
+		printf("{\"mode\": \"%s\", \"bytes\": %lu, \"seconds\": %.3f, \"gbps\": %.3f}\n", config.tx ? "tcp-tx" : "tcp-rx",
+			config.bytes, config.seconds, config.bytes * 8 / config.seconds / 1e9);
+		return 0;
+	}
+	if (config.name[0] == '\0'){
+		printf("ERROR: Interface not set\n");
+		exit(1);
+	}
+	if (config.frame_len < 60 || config.frame_len > GEN_MAX_FRAME - TPACKET2_HDRLEN - 64 || config.flows == 0){
+		printf("ERROR: Invalid frame length: %u or flows: %u\n", config.frame_len, config.flows);
+		exit(1);
+	}
+	if (rtt){
+		rx_config = config;
+		rx_config.tx = false;
+		rx_config.duration = config.duration + 2;
+		if (rx_name[0] != '\0'){
+			strncpy(rx_config.name, rx_name, IFNAMSIZ);
+		}
+		gen_open(&rx_config);
+		gen_open(&config);
+		gen_rtt(&config, &rx_config);
+		return 0;
+	}
+	gen_pin(config.cpu);
+	gen_open(&config);
+	if (config.tx){
+		gen_tx(&config);
+		printf("tx: packets %lu, seconds %.3f, pps %.0f\n", config.packets, config.seconds, config.packets / config.seconds);
+	} else {
+		gen_rx(&config);
+		printf("rx: packets %lu, seconds %.3f, pps %.0f, gbps %.3f\n", config.packets, config.seconds,
+			config.packets / config.seconds, config.bytes * 8 / config.seconds / 1e9);
+	}
+	return 0;
+}
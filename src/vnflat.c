@@ -0,0 +1,207 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*! Latency clock and histograms
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+//
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnflat.h"
+
+#define LAT_CALIBRATE_NS 50000000ULL
+
+bool lat_tsc_ok = false;
+double lat_ns_per_tick = 1.0;
+uint64_t lat_anchor_ticks = UINT64_MAX;
+uint64_t lat_hw_offset_ns = 0;
+volatile sig_atomic_t lat_dump_requested = 0;
+
+static uint64_t monotonic_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+/*
+* The TSC is only usable when it ticks at a constant rate in every
+* C state and is synchronised across cores
+*/
+static bool tsc_invariant(void){
+	FILE *fp;
+	char line[4096];
+	bool constant = false, nonstop = false;
+
+	fp = fopen("/proc/cpuinfo", "r");
+	if (fp == NULL){
+		return false;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL){
+		if (strncmp(line, "flags", 5) == 0){
+			constant = (strstr(line, " constant_tsc") != NULL);
+			nonstop = (strstr(line, " nonstop_tsc") != NULL);
+			break;
+		}
+	}
+	fclose(fp);
+	return constant && nonstop;
+}
+
+void lat_anchor(lat_clock_t *clock){
+#ifdef LAT_HAVE_TSC
+	uint64_t before, after;
+
+	before = __rdtsc();
+	clock->anchor_ns = lat_realtime_ns();
+	after = __rdtsc();
+	clock->anchor_tsc = before + (after - before) / 2;
+#endif
+}
+/*
+* Measure the TSC rate against CLOCK_MONOTONIC_RAW
+*/
+void lat_calibrate(void){
+#ifdef LAT_HAVE_TSC
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = LAT_CALIBRATE_NS };
+	uint64_t t0, t1, c0, c1;
+
+	if (tsc_invariant() == false){
+		printf("Latency: TSC not invariant, using clock_gettime\n");
+		return;
+	}
+	t0 = monotonic_ns();
+	c0 = __rdtsc();
+	nanosleep(&ts, NULL);
+	t1 = monotonic_ns();
+	c1 = __rdtsc();
+	if (c1 <= c0 || t1 <= t0){
+		printf("Latency: TSC calibration failed, using clock_gettime\n");
+		return;
+	}
+	lat_ns_per_tick = (double)(t1 - t0) / (c1 - c0);
+	lat_anchor_ticks = LAT_ANCHOR_NS / lat_ns_per_tick;
+	lat_tsc_ok = true;
+	printf("Latency: TSC at %.3f GHz\n", 1.0 / lat_ns_per_tick);
+#else
+	printf("Latency: using clock_gettime\n");
+#endif
+}
+
+/*
+* A NIC clock run by ptp4l is on TAI, the kernel knows the TAI offset
+* once phc2sys or ntpd set it
+*/
+int lat_set_tai_offset(int tai_offset){
+	struct timespec tai, utc;
+
+	if (tai_offset == LAT_TAI_KERNEL){
+		clock_gettime(CLOCK_TAI, &tai);
+		clock_gettime(CLOCK_REALTIME, &utc);
+		tai_offset = ((int64_t)(tai.tv_sec - utc.tv_sec) * 1000000000LL + tai.tv_nsec - utc.tv_nsec + 500000000LL) / 1000000000LL;
+		if (tai_offset <= 0){
+			printf("ERROR: The kernel TAI offset is not set, give it with -H hw-tai=seconds\n");
+			return -1;
+		}
+	}
+	lat_hw_offset_ns = (uint64_t)tai_offset * 1000000000ULL;
+	if (tai_offset > 0){
+		printf("Latency: NIC clock %d s ahead on TAI\n", tai_offset);
+	}
+	return 0;
+}
+
+void lat_merge(lat_hist_t *dst, lat_hist_t *src){
+	unsigned int i;
+
+	if (src->count == 0){
+		return;
+	}
+	if (dst->count == 0 || src->min < dst->min){
+		dst->min = src->min;
+	}
+	dst->max = MAX(dst->max, src->max);
+	dst->count += src->count;
+	dst->sum += src->sum;
+	for (i = 0; i < LAT_BUCKETS; i++){
+		dst->buckets[i] += src->buckets[i];
+	}
+}
+/*
+* Highest value of a bucket
+*/
+static uint64_t lat_bucket_top(unsigned int bucket){
+	unsigned int exp;
+	uint64_t sub;
+
+	if (bucket < LAT_SUB_COUNT){
+		return bucket;
+	}
+	exp = bucket / LAT_SUB_COUNT + LAT_SUB_BITS - 1;
+	sub = bucket % LAT_SUB_COUNT;
+	return ((LAT_SUB_COUNT + sub + 1) << (exp - LAT_SUB_BITS)) - 1;
+}
+/*
+* Upper bound of the bucket holding the p quantile, never above the max
+*/
+uint64_t lat_percentile(lat_hist_t *hist, double p){
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	if (hist->count == 0){
+		return 0;
+	}
+	rank = (uint64_t)(p * hist->count + 0.5);
+	rank = MAX(rank, 1);
+	for (i = 0; i < LAT_BUCKETS; i++){
+		seen += hist->buckets[i];
+		if (seen >= rank){
+			return MIN(lat_bucket_top(i), hist->max);
+		}
+	}
+	return hist->max;
+}
+
+void print_lat_hist(char *name, lat_hist_t *hist){
+	printf("\n---- Latency RX to TX kick: %s ----\n", name);
+	if (hist->count == 0){
+		printf("No samples\n");
+		return;
+	}
+	printf("Samples: %lu, min: %.3f us, mean: %.3f us\n", hist->count, hist->min / 1e3, (double)hist->sum / hist->count / 1e3);
+	printf("p50: %.3f us, p99: %.3f us, p99.9: %.3f us, max: %.3f us\n",
+		lat_percentile(hist, 0.5) / 1e3, lat_percentile(hist, 0.99) / 1e3,
+		lat_percentile(hist, 0.999) / 1e3, hist->max / 1e3);
+}
+/*
+* Histogram of the frames sent on an interface
+*/
+void print_latency(intf_config_t *config){
+	if (config->latency == LATENCY_OFF){
+		return;
+	}
+	print_lat_hist(config->name, &config->lat.hist);
+	if (config->lat.skipped > 0){
+		printf("Not timed: %lu\n", config->lat.skipped);
+	}
+	if (config->lat.unstamped > 0){
+		printf("RX frames not hardware stamped: %lu\n", config->lat.unstamped);
+	}
+	fflush(stdout);
+}
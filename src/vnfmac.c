@@ -0,0 +1,423 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*! Learning bridge
+ *
+ * The MAC table maps a MAC address and VLAN to the port it was last seen
+ * on. It is shared by every worker: a bucket of MAC_WAYS addresses fills
+ * one cache line and carries a sequence counter, writers take it by
+ * making it odd and readers never lock, they retry when a writer ran
+ * under them. An address may live in either of two buckets and new ones
+ * go to the emptier, which keeps evictions of live stations rare up to
+ * high load. Learning an address again within refresh_ms of the last
+ * time does not write at all, so the steady state only reads. Entries
+ * age out aging_ms after they were last seen, nothing sweeps the table:
+ * expired entries stop matching and are the first to be reused.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+//
+#include <sys/mman.h>
+//
+#include <linux/if_ether.h>
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnfpipe.h"
+#include "vnfflow.h"
+#include "vnfmac.h"
+
+/*
+* Per worker counters, learn rate bucket and scratch space for one batch.
+* tokens are in thousandths of a learn so slow rates still refill.
+*/
+typedef struct _mac_stage {
+	mac_table_t *table;
+	uint64_t learned;
+	uint64_t moved;
+	uint64_t evicted;
+	uint64_t limited;
+	uint64_t known;
+	uint64_t filtered;
+	uint64_t flooded;
+	uint64_t rate;
+	uint64_t tokens;
+	uint32_t last_ms;
+	uint64_t keys[PIPE_BATCH];
+	uint8_t ports[PIPE_BATCH];
+	uint8_t index[PIPE_BATCH];
+} mac_stage_t;
+/*
+* Every worker learns into and forwards from the same table
+*/
+static mac_table_t *mac_shared;
+
+/*
+* The two buckets an address may live in, the same one when the halves
+* of the hash collide
+*/
+static inline mac_bucket_t *mac_bucket(mac_table_t *table, uint64_t key, unsigned int choice){
+	uint64_t hash = flow_mix(key);
+
+	return &table->buckets[(choice ? hash >> 32 : hash) & table->mask];
+}
+
+static inline void mac_relax(void){
+#ifdef __x86_64__
+	__builtin_ia32_pause();
+#endif
+}
+
+static inline uint32_t mac_now_ms(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+/*
+* Size the table for nentries addresses, rounded up to a power of two
+* buckets, backed by huge pages when possible
+*/
+int mac_table_init(mac_table_t *table, uint64_t nentries, uint32_t aging_ms){
+	uint64_t nbuckets;
+
+	memset(table, 0, sizeof(*table));
+	nentries = MAX(nentries, MAC_WAYS * 4);
+	nbuckets = 1;
+	while (nbuckets * MAC_WAYS < nentries){
+		nbuckets <<= 1;
+	}
+	table->map_len = nbuckets * sizeof(mac_bucket_t);
+	table->buckets = mmap(NULL, table->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (table->buckets == MAP_FAILED){
+		perror("mmap mac table");
+		table->buckets = NULL;
+		return -1;
+	}
+	madvise(table->buckets, table->map_len, MADV_HUGEPAGE);
+	table->mask = nbuckets - 1;
+	table->nentries = nbuckets * MAC_WAYS;
+	table->aging_ms = aging_ms;
+	table->refresh_ms = MAX(aging_ms / 16, 1);
+	return 0;
+}
+
+void mac_table_free(mac_table_t *table){
+	if (table->buckets != NULL){
+		munmap(table->buckets, table->map_len);
+		table->buckets = NULL;
+	}
+}
+
+void mac_prefetch(mac_table_t *table, uint64_t key){
+	__builtin_prefetch(mac_bucket(table, key, 0), 0, 3);
+	__builtin_prefetch(mac_bucket(table, key, 1), 0, 3);
+}
+/*
+* Way of key in a bucket or MAC_WAYS, port is PORT_NONE when the address
+* has aged out
+*/
+static inline unsigned int mac_bucket_find(mac_table_t *table, mac_bucket_t *bucket, uint64_t key, uint32_t now, uint8_t *port){
+	uint32_t seq;
+	unsigned int i;
+
+	for (;;){
+		seq = __atomic_load_n(&bucket->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1){
+			mac_relax();
+			continue;
+		}
+		*port = PORT_NONE;
+		for (i = 0; i < MAC_WAYS; i++){
+			if (__atomic_load_n(&bucket->key[i], __ATOMIC_RELAXED) == key){
+				if (now - __atomic_load_n(&bucket->seen[i], __ATOMIC_RELAXED) < table->aging_ms){
+					*port = __atomic_load_n(&bucket->port[i], __ATOMIC_RELAXED);
+				}
+				break;
+			}
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&bucket->seq, __ATOMIC_RELAXED) == seq){
+			return i;
+		}
+	}
+}
+/*
+* Addresses never move between their two buckets, so each can be read
+* on its own
+*/
+uint8_t mac_lookup(mac_table_t *table, uint64_t key, uint32_t now){
+	uint8_t port;
+
+	if (mac_bucket_find(table, mac_bucket(table, key, 0), key, now, &port) == MAC_WAYS){
+		mac_bucket_find(table, mac_bucket(table, key, 1), key, now, &port);
+	}
+	return port;
+}
+/*
+* Prefetch every bucket first so the misses of a batch overlap, n is at
+* most PIPE_BATCH
+*/
+void mac_lookup_batch(mac_table_t *table, uint64_t *keys, uint8_t *ports, unsigned int n, uint32_t now){
+	unsigned int i;
+
+	for (i = 0; i < n; i++){
+		mac_prefetch(table, keys[i]);
+	}
+	for (i = 0; i < n; i++){
+		ports[i] = mac_lookup(table, keys[i], now);
+	}
+}
+/*
+* Readers may see the bucket change at any point, the counter only has to
+* be odd before the first store and even again after the last one
+*/
+static inline uint32_t mac_bucket_lock(mac_bucket_t *bucket){
+	uint32_t seq;
+
+	for (;;){
+		seq = __atomic_load_n(&bucket->seq, __ATOMIC_RELAXED);
+		if ((seq & 1) == 0 &&
+			__atomic_compare_exchange_n(&bucket->seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			return seq;
+		}
+		mac_relax();
+	}
+}
+
+static inline void mac_bucket_unlock(mac_bucket_t *bucket, uint32_t seq){
+	__atomic_store_n(&bucket->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static inline void mac_way_set(mac_bucket_t *bucket, unsigned int way, uint64_t key, uint8_t port, uint32_t now){
+	__atomic_store_n(&bucket->key[way], key, __ATOMIC_RELAXED);
+	__atomic_store_n(&bucket->seen[way], now, __ATOMIC_RELAXED);
+	__atomic_store_n(&bucket->port[way], port, __ATOMIC_RELAXED);
+}
+/*
+* Both buckets are locked lowest address first so writers never wait on
+* each other in a circle. A new address goes to the bucket with the most
+* empty or expired ways, when both are full it replaces the address seen
+* the longest ago.
+*/
+int mac_learn(mac_table_t *table, uint64_t key, uint8_t port, uint32_t now, bool can_add){
+	mac_bucket_t *bucket[2], *victim = NULL;
+	uint32_t seq[2], age, oldest = 0;
+	unsigned int nfree[2] = {0, 0}, first[2] = {0, 0};
+	unsigned int b, i, way = 0, nbuckets;
+	int ret = MAC_LEARN_EVICTED;
+
+	bucket[0] = mac_bucket(table, key, 0);
+	bucket[1] = mac_bucket(table, key, 1);
+	nbuckets = (bucket[0] == bucket[1]) ? 1 : 2;
+	/*
+	* Unlocked peek, a stale answer only costs one more write
+	*/
+	for (b = 0; b < nbuckets; b++){
+		for (i = 0; i < MAC_WAYS; i++){
+			if (__atomic_load_n(&bucket[b]->key[i], __ATOMIC_RELAXED) == key){
+				if (__atomic_load_n(&bucket[b]->port[i], __ATOMIC_RELAXED) == port &&
+					now - __atomic_load_n(&bucket[b]->seen[i], __ATOMIC_RELAXED) < table->refresh_ms){
+					return MAC_LEARN_FRESH;
+				}
+			}
+		}
+	}
+	if (nbuckets == 2 && bucket[1] < bucket[0]){
+		victim = bucket[0];
+		bucket[0] = bucket[1];
+		bucket[1] = victim;
+		victim = NULL;
+	}
+	for (b = 0; b < nbuckets; b++){
+		seq[b] = mac_bucket_lock(bucket[b]);
+	}
+	for (b = 0; b < nbuckets && victim == NULL; b++){
+		for (i = 0; i < MAC_WAYS; i++){
+			if (bucket[b]->key[i] == key){
+				if (now - bucket[b]->seen[i] >= table->aging_ms){
+					ret = MAC_LEARN_NEW;
+				} else if (bucket[b]->port[i] == port){
+					ret = MAC_LEARN_FRESH;
+				} else {
+					ret = MAC_LEARN_MOVED;
+				}
+				victim = bucket[b];
+				way = i;
+				break;
+			}
+		}
+	}
+	for (b = 0; b < nbuckets && victim == NULL; b++){
+		for (i = 0; i < MAC_WAYS; i++){
+			age = now - bucket[b]->seen[i];
+			if (bucket[b]->key[i] == 0 || age >= table->aging_ms){
+				nfree[b]++;
+				if (nfree[b] == 1){
+					first[b] = i;
+				}
+			} else if (age >= oldest){
+				oldest = age;
+				way = b * MAC_WAYS + i;
+			}
+		}
+	}
+	if (victim == NULL){
+		if (nfree[0] != 0 || nfree[1] != 0){
+			ret = MAC_LEARN_NEW;
+			b = (nfree[1] > nfree[0]);
+			way = first[b];
+		} else {
+			b = way / MAC_WAYS;
+			way %= MAC_WAYS;
+		}
+		victim = bucket[b];
+	}
+	if (ret == MAC_LEARN_FRESH || can_add){
+		mac_way_set(victim, way, key, port, now);
+	} else {
+		ret = -1;
+	}
+	for (b = 0; b < nbuckets; b++){
+		mac_bucket_unlock(bucket[b], seq[b]);
+	}
+	return ret;
+}
+
+int mac_stage_init(pipe_stage_t *stage, arg_config_t *arg_config, unsigned int worker){
+	mac_stage_t *ms;
+
+	if (mac_shared == NULL){
+		mac_shared = malloc(sizeof(mac_table_t));
+		if (mac_shared == NULL){
+			perror("malloc mac table");
+			return -1;
+		}
+		if (mac_table_init(mac_shared, arg_config->mac_entries, arg_config->mac_aging * 1000) == -1){
+			free(mac_shared);
+			mac_shared = NULL;
+			return -1;
+		}
+	}
+	if (posix_memalign((void **)&ms, CACHE_LINE_SIZE, sizeof(mac_stage_t)) != 0){
+		perror("posix_memalign bridge stage");
+		return -1;
+	}
+	memset(ms, 0, sizeof(*ms));
+	ms->table = mac_shared;
+	ms->rate = arg_config->learn_rate;
+	ms->tokens = ms->rate * 1000;
+	ms->last_ms = mac_now_ms();
+	stage->priv = ms;
+	/*
+	* Same order as the counter names in the stage table
+	*/
+	stage->counters = &ms->learned;
+	return 0;
+}
+/*
+* Learn the sources of a batch up to the learn rate, then send every
+* forwarded frame with a known destination to its port. Frames for an
+* address on the port they came in on are dropped, unknown and group
+* destinations are flooded.
+*/
+unsigned int mac_stage(pipe_stage_t *stage, pkt_batch_t *batch){
+	mac_stage_t *ms = stage->priv;
+	mac_table_t *table = ms->table;
+	pkt_desc_t *pkt;
+	uint32_t now = mac_now_ms();
+	unsigned int i, n = 0, dropped = 0;
+	bool can_add;
+
+	if (ms->rate != 0 && now != ms->last_ms){
+		ms->tokens = MIN(ms->tokens + (uint64_t)(now - ms->last_ms) * ms->rate, ms->rate * 1000);
+		ms->last_ms = now;
+	}
+	for (i = 0; i < batch->count; i++){
+		pipe_prefetch(batch, i);
+		pkt = &batch->pkts[i];
+		if (pkt->len < ETH_HLEN){
+			continue;
+		}
+		ms->keys[i] = mac_key(pkt->data + ETH_ALEN, batch->meta.vlan[i]);
+		mac_prefetch(table, ms->keys[i]);
+	}
+	for (i = 0; i < batch->count; i++){
+		pkt = &batch->pkts[i];
+		if (pkt->len < ETH_HLEN || mac_is_group(pkt->data + ETH_ALEN)){
+			continue;
+		}
+		can_add = (ms->rate == 0 || ms->tokens >= 1000);
+		switch (mac_learn(table, ms->keys[i], pkt->in_port, now, can_add)){
+			case MAC_LEARN_FRESH:
+				continue;
+			case MAC_LEARN_MOVED:
+				ms->moved++;
+				break;
+			case MAC_LEARN_EVICTED:
+				ms->evicted++;
+				/* fall through */
+			case MAC_LEARN_NEW:
+				ms->learned++;
+				break;
+			default:
+				ms->limited++;
+				continue;
+		}
+		if (ms->rate != 0){
+			ms->tokens -= 1000;
+		}
+	}
+	for (i = 0; i < batch->count; i++){
+		pkt = &batch->pkts[i];
+		if (pkt->len < ETH_HLEN || pkt->verdict != VERDICT_FORWARD){
+			continue;
+		}
+		if (mac_is_group(pkt->data)){
+			pkt->verdict = VERDICT_FLOOD;
+			ms->flooded++;
+			continue;
+		}
+		ms->keys[n] = mac_key(pkt->data, batch->meta.vlan[i]);
+		ms->index[n++] = i;
+	}
+	mac_lookup_batch(table, ms->keys, ms->ports, n, now);
+	for (i = 0; i < n; i++){
+		pkt = &batch->pkts[ms->index[i]];
+		if (ms->ports[i] == PORT_NONE){
+			pkt->verdict = VERDICT_FLOOD;
+			ms->flooded++;
+		} else if (ms->ports[i] == pkt->in_port){
+			pkt->verdict = VERDICT_DROP;
+			ms->filtered++;
+			dropped++;
+		} else {
+			pkt->verdict = VERDICT_REDIRECT;
+			pkt->out_port = ms->ports[i];
+			ms->known++;
+		}
+	}
+	return dropped;
+}
+
+void mac_stage_print(pipe_stage_t *stage){
+	mac_stage_t *ms = stage->priv;
+
+	printf("MAC table: %lu entries, %lu MB, aging %u s\n", ms->table->nentries, ms->table->map_len >> 20, ms->table->aging_ms / 1000);
+}
@@ -0,0 +1,173 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*! Read the VNF stats segment and print per interface rates
+ *
+ * The segment is mapped read only, the forwarding threads never see
+ * the reader.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+//
+#include <sys/mman.h>
+#include <sys/stat.h>
+//
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnfstats.h"
+
+/*
+* Sum over workers of one interface
+*/
+typedef struct _mon_sample {
+	uint64_t rx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_packets;
+	uint64_t tx_bytes;
+	uint64_t tx_drops;
+	uint64_t kernel_drops;
+	uint64_t filtered;
+} mon_sample_t;
+
+static double now(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static vnf_stats_header_t *mon_open(char *name){
+	char shm_name[STATS_NAME_SIZE + 1];
+	vnf_stats_header_t *header;
+	struct stat st;
+	int fd;
+
+	snprintf(shm_name, sizeof(shm_name), "/%s", name);
+	fd = shm_open(shm_name, O_RDONLY, 0);
+	if (fd == -1){
+		perror("shm_open");
+		exit(1);
+	}
+	if (fstat(fd, &st) == -1 || st.st_size < sizeof(vnf_stats_header_t)){
+		printf("ERROR: %s is not a VNF stats segment\n", shm_name);
+		exit(1);
+	}
+	header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED){
+		perror("mmap");
+		exit(1);
+	}
+	if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != VNF_STATS_MAGIC || header->version != VNF_STATS_VERSION ||
+		header->ports > VNF_STATS_PORTS || header->kernel_offset + header->workers * header->ports * sizeof(kernel_counters_t) > st.st_size){
+		printf("ERROR: %s is not a VNF stats segment of version %d\n", shm_name, VNF_STATS_VERSION);
+		exit(1);
+	}
+	return header;
+}
+
+static void mon_sample(vnf_stats_header_t *header, mon_sample_t *sample){
+	volatile intf_counters_t *counters;
+	volatile kernel_counters_t *kernel;
+	unsigned int i, j;
+
+	memset(sample, 0, sizeof(*sample) * header->ports);
+	for (j = 0; j < header->ports; j++){
+		for (i = 0; i < header->workers; i++){
+			counters = stats_shm_counters(header, i, j);
+			kernel = stats_shm_kernel(header, i, j);
+			sample[j].rx_packets += counters->rx_packets;
+			sample[j].rx_bytes += counters->rx_bytes;
+			sample[j].tx_packets += counters->tx_packets;
+			sample[j].tx_bytes += counters->tx_bytes;
+			sample[j].tx_drops += counters->tx_drops;
+			sample[j].kernel_drops += kernel->drops;
+		}
+		sample[j].filtered = *(volatile uint64_t *)&header->filtered[j];
+	}
+}
+
+int main(int argc, char **argv){
+	vnf_stats_header_t *header;
+	mon_sample_t prev[VNF_STATS_PORTS], cur[VNF_STATS_PORTS];
+	char name[STATS_NAME_SIZE];
+	unsigned int interval = 1;
+	unsigned int count = 0;
+	unsigned int n, j;
+	double t_prev, t_cur, dt;
+	int c;
+	static struct option longopts[] = {
+		{"stats", required_argument, 0, 'S'},
+		{"interval", required_argument, 0, 'i'},
+		{"count", required_argument, 0, 'n'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	name[0] = '\0';
+	while ((c = getopt_long(argc, argv, "S:i:n:h", longopts, NULL)) != -1){
+		switch (c){
+			case 'S':
+				strncpy(name, optarg, STATS_NAME_SIZE-1);
+				name[STATS_NAME_SIZE-1] = '\0';
+				break;
+			case 'i':
+				interval = strtoul(optarg, NULL, 10);
+				break;
+			case 'n':
+				count = strtoul(optarg, NULL, 10);
+				break;
+			case 'h':
+			default:
+				printf("Command line arguments: \n");
+				printf("-S, --stats     Stats name given to vnf -S \n");
+				printf("-i, --interval  Seconds between samples \n");
+				printf("-n, --count     Number of samples, 0 runs until interrupted \n");
+				exit(1);
+		}
+	}
+	if (name[0] == '\0' || interval == 0){
+		printf("ERROR: Stats name not set or interval is zero\n");
+		exit(1);
+	}
+	header = mon_open(name);
+	printf("VNF pid: %u, workers: %u, interfaces: %u\n", header->pid, header->workers, header->ports);
+	mon_sample(header, prev);
+	t_prev = now();
+	for (n = 0; count == 0 || n < count; n++){
+		sleep(interval);
+		mon_sample(header, cur);
+		t_cur = now();
+		dt = t_cur - t_prev;
+		for (j = 0; j < header->ports; j++){
+			printf("%-10s rx: %10.0f pps %8.3f Gbps, tx: %10.0f pps %8.3f Gbps, tx drops: %8.0f/s, kernel drops: %8.0f/s, filtered: %8.0f/s\n",
+				header->names[j],
+				(cur[j].rx_packets - prev[j].rx_packets) / dt, (cur[j].rx_bytes - prev[j].rx_bytes) * 8 / dt / 1e9,
+				(cur[j].tx_packets - prev[j].tx_packets) / dt, (cur[j].tx_bytes - prev[j].tx_bytes) * 8 / dt / 1e9,
+				(cur[j].tx_drops - prev[j].tx_drops) / dt, (cur[j].kernel_drops - prev[j].kernel_drops) / dt,
+				(cur[j].filtered - prev[j].filtered) / dt);
+		}
+		fflush(stdout);
+		memcpy(prev, cur, sizeof(prev));
+		t_prev = t_cur;
+	}
+	return 0;
+}
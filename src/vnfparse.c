@@ -0,0 +1,420 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*! Batch header parser
+ *
+ * Fills in the L2, L3 and L4 metadata of a batch as arrays. The scalar
+ * parser handles everything: stacked VLAN tags, IPv4 options and
+ * fragments, IPv6 extension headers, and never reads past the length of
+ * a frame. The SSE4.1 and AVX2 parsers work on 4 and 8 frames at once for
+ * untagged or single tagged frames carrying IPv4 without options or IPv6
+ * straight to TCP, UDP, SCTP or ICMPv6, the other frames go through the
+ * scalar parser. Frames sit at unrelated addresses, so the header words
+ * are gathered per lane, AVX2 with masked gathers that skip the lanes a
+ * frame is too short for. The best parser the CPU supports is picked at
+ * startup.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+//
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "vnfapp.h"
+#include "vnfpipe.h"
+#include "vnfparse.h"
+
+static inline bool parse_has_ports(uint8_t proto){
+	return proto == IPPROTO_TCP || proto == IPPROTO_UDP || proto == IPPROTO_SCTP;
+}
+
+static inline bool parse_ipv6_ext(uint8_t next){
+	return next == IPPROTO_HOPOPTS || next == IPPROTO_ROUTING || next == IPPROTO_FRAGMENT ||
+		next == IPPROTO_AH || next == IPPROTO_DSTOPTS || next == IPPROTO_MH;
+}
+/*
+* Metadata of frame i, up to two VLAN tags are skipped and the outer VLAN
+* id is kept. Later IPv4 and IPv6 fragments get no L4 offset.
+*/
+void parse_frame(pkt_meta_t *meta, unsigned int i, uint8_t *p, uint32_t len){
+	uint32_t off = ETH_HLEN, l4 = 0, hlen;
+	uint16_t type;
+	uint8_t proto;
+	unsigned int ihl, tags, ext;
+
+	meta->ethertype[i] = 0;
+	meta->vlan[i] = 0;
+	meta->l3_offset[i] = 0;
+	meta->l4_offset[i] = 0;
+	meta->sport[i] = 0;
+	meta->dport[i] = 0;
+	meta->ip_proto[i] = 0;
+	if (len < ETH_HLEN){
+		return;
+	}
+	type = (p[12] << 8) | p[13];
+	for (tags = 0; tags < PARSE_MAX_TAGS && (type == ETH_P_8021Q || type == ETH_P_8021AD); tags++){
+		if (len < off + 4){
+			return;
+		}
+		if (tags == 0){
+			meta->vlan[i] = ((p[off] << 8) | p[off + 1]) & 0x0fff;
+		}
+		type = (p[off + 2] << 8) | p[off + 3];
+		off += 4;
+	}
+	meta->ethertype[i] = type;
+	if (type == ETH_P_IP){
+		if (len < off + 20){
+			return;
+		}
+		ihl = (p[off] & 0x0f) * 4;
+		if ((p[off] >> 4) != 4 || ihl < 20 || len < off + ihl){
+			return;
+		}
+		proto = p[off + 9];
+		/*
+		* Only the first fragment carries the L4 header
+		*/
+		if ((((p[off + 6] << 8) | p[off + 7]) & 0x1fff) == 0){
+			l4 = off + ihl;
+		}
+	} else if (type == ETH_P_IPV6){
+		if (len < off + 40 || (p[off] >> 4) != 6){
+			return;
+		}
+		proto = p[off + 6];
+		l4 = off + 40;
+		for (ext = 0; parse_ipv6_ext(proto); ext++){
+			if (ext == PARSE_MAX_EXT || len < l4 + 8){
+				l4 = 0;
+				break;
+			}
+			if (proto == IPPROTO_FRAGMENT){
+				hlen = 8;
+				if ((((p[l4 + 2] << 8) | p[l4 + 3]) & 0xfff8) != 0){
+					proto = p[l4];
+					l4 = 0;
+					break;
+				}
+			} else if (proto == IPPROTO_AH){
+				hlen = (p[l4 + 1] + 2) * 4;
+			} else {
+				hlen = (p[l4 + 1] + 1) * 8;
+			}
+			proto = p[l4];
+			l4 += hlen;
+		}
+	} else {
+		return;
+	}
+	meta->l3_offset[i] = off;
+	meta->ip_proto[i] = proto;
+	if (l4 == 0 || l4 >= len || l4 > UINT16_MAX){
+		return;
+	}
+	meta->l4_offset[i] = l4;
+	if (parse_has_ports(proto) && l4 + 4 <= len){
+		memcpy(&meta->sport[i], p + l4, 2);
+		memcpy(&meta->dport[i], p + l4 + 2, 2);
+	}
+}
+
+void parse_scalar(pkt_batch_t *batch){
+	unsigned int i;
+
+	for (i = 0; i < batch->count; i++){
+		pipe_prefetch(batch, i);
+		parse_frame(&batch->meta, i, batch->pkts[i].data, batch->pkts[i].len);
+	}
+}
+
+#ifdef __x86_64__
+/*
+* Ethertypes as a little endian load of the two bytes on the wire sees them
+*/
+#define PARSE_LE_8021Q  0x0081
+#define PARSE_LE_8021AD 0xa888
+#define PARSE_LE_IP     0x0008
+#define PARSE_LE_IPV6   0xdd86
+/*
+* Header words at offset 12 and 16 are read from frames of at least this
+* many bytes, shorter ones go through the scalar parser
+*/
+#define PARSE_MIN_LEN   20
+/*
+* Lanes with nothing to load read from here instead of the frame
+*/
+static const uint8_t parse_zero[64] __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static inline uint32_t parse_load32(const uint8_t *p){
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static bool parse_has_sse41(void){
+	return __builtin_cpu_supports("sse4.1");
+}
+
+static bool parse_has_avx2(void){
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i parse_in4(__m128i x, uint32_t a, uint32_t b, uint32_t c, uint32_t d){
+	return _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi32(x, _mm_set1_epi32(a)), _mm_cmpeq_epi32(x, _mm_set1_epi32(b))),
+		_mm_or_si128(_mm_cmpeq_epi32(x, _mm_set1_epi32(c)), _mm_cmpeq_epi32(x, _mm_set1_epi32(d))));
+}
+/*
+* 32 bits at frame + off + delta of the lanes set in mask, 0 elsewhere
+*/
+#define PARSE_LANE(pkts, off, mask, delta, k) \
+	parse_load32((((mask) >> (k)) & 1) ? (pkts)[k].data + _mm_extract_epi32(off, k) + (delta) : parse_zero)
+
+__attribute__((target("sse4.1")))
+static inline __m128i parse_load4(pkt_desc_t *pkts, __m128i off, unsigned int mask, unsigned int delta){
+	return _mm_set_epi32(PARSE_LANE(pkts, off, mask, delta, 3), PARSE_LANE(pkts, off, mask, delta, 2),
+		PARSE_LANE(pkts, off, mask, delta, 1), PARSE_LANE(pkts, off, mask, delta, 0));
+}
+/*
+* Four frames per round, header words are loaded per lane only where the
+* frame is long enough
+*/
+__attribute__((target("sse4.1")))
+static void parse_sse41(pkt_batch_t *batch){
+	pkt_meta_t *meta = &batch->meta;
+	pkt_desc_t *pkts;
+	__m128i len, va, vb, vc, vd, ve, vf, et, et0, tagged, vlan, l3, l4, hl, v4, v6, ip, slow, frag, proto, ports;
+	__m128i ffff = _mm_set1_epi32(0xffff), zero = _mm_setzero_si128();
+	unsigned int i, k, mask;
+
+	for (i = 0; i + 4 <= batch->count; i += 4){
+		pkts = &batch->pkts[i];
+		for (k = 0; k < 4; k++){
+			pipe_prefetch(batch, i + k);
+		}
+		len = _mm_set_epi32(pkts[3].len, pkts[2].len, pkts[1].len, pkts[0].len);
+		slow = _mm_cmplt_epi32(len, _mm_set1_epi32(PARSE_MIN_LEN));
+		mask = _mm_movemask_ps(_mm_castsi128_ps(slow)) ^ 0xf;
+		va = parse_load4(pkts, zero, mask, 12);
+		vb = parse_load4(pkts, zero, mask, 16);
+		et0 = _mm_and_si128(va, ffff);
+		tagged = _mm_or_si128(_mm_cmpeq_epi32(et0, _mm_set1_epi32(PARSE_LE_8021Q)), _mm_cmpeq_epi32(et0, _mm_set1_epi32(PARSE_LE_8021AD)));
+		vlan = _mm_and_si128(tagged, _mm_or_si128(_mm_and_si128(_mm_srli_epi32(va, 8), _mm_set1_epi32(0x0f00)), _mm_srli_epi32(va, 24)));
+		et = _mm_blendv_epi8(et0, _mm_and_si128(vb, ffff), tagged);
+		/*
+		* A second tag is left to the scalar parser
+		*/
+		slow = _mm_or_si128(slow, _mm_and_si128(tagged, _mm_or_si128(_mm_cmpeq_epi32(et, _mm_set1_epi32(PARSE_LE_8021Q)),
+			_mm_cmpeq_epi32(et, _mm_set1_epi32(PARSE_LE_8021AD)))));
+		l3 = _mm_add_epi32(_mm_set1_epi32(ETH_HLEN), _mm_and_si128(tagged, _mm_set1_epi32(4)));
+		v4 = _mm_cmpeq_epi32(et, _mm_set1_epi32(PARSE_LE_IP));
+		v6 = _mm_cmpeq_epi32(et, _mm_set1_epi32(PARSE_LE_IPV6));
+		ip = _mm_or_si128(v4, v6);
+		hl = _mm_sub_epi32(_mm_set1_epi32(40), _mm_and_si128(v4, _mm_set1_epi32(20)));
+		slow = _mm_or_si128(slow, _mm_and_si128(ip, _mm_cmpgt_epi32(_mm_add_epi32(l3, hl), len)));
+		mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(slow, ip)));
+		vc = parse_load4(pkts, l3, mask, 0);
+		vd = parse_load4(pkts, l3, mask, 4);
+		ve = parse_load4(pkts, l3, mask, 8);
+		/*
+		* IPv4 with options and IPv6 with extension headers take the long way
+		*/
+		slow = _mm_or_si128(slow, _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(vc, _mm_set1_epi32(0xff)), _mm_set1_epi32(0x45)), v4));
+		slow = _mm_or_si128(slow, _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(vc, _mm_set1_epi32(0xf0)), _mm_set1_epi32(0x60)), v6));
+		proto = _mm_blendv_epi8(_mm_srli_epi32(vd, 16), _mm_srli_epi32(ve, 8), v4);
+		proto = _mm_and_si128(_mm_and_si128(proto, _mm_set1_epi32(0xff)), ip);
+		slow = _mm_or_si128(slow, _mm_andnot_si128(parse_in4(proto, IPPROTO_TCP, IPPROTO_UDP, IPPROTO_SCTP, IPPROTO_ICMPV6), v6));
+		frag = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(vd, _mm_set1_epi32(0xff1f0000)), zero), v4);
+		l4 = _mm_add_epi32(l3, hl);
+		l4 = _mm_and_si128(l4, _mm_andnot_si128(frag, _mm_and_si128(ip, _mm_cmpgt_epi32(len, l4))));
+		ports = _mm_andnot_si128(_mm_cmpeq_epi32(l4, zero), parse_in4(proto, IPPROTO_TCP, IPPROTO_UDP, IPPROTO_SCTP, IPPROTO_SCTP));
+		ports = _mm_and_si128(ports, _mm_cmpgt_epi32(len, _mm_add_epi32(l4, _mm_set1_epi32(3))));
+		mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(slow, ports)));
+		vf = parse_load4(pkts, l4, mask, 0);
+		et = _mm_and_si128(_mm_or_si128(_mm_slli_epi32(et, 8), _mm_srli_epi32(et, 8)), ffff);
+		_mm_storel_epi64((__m128i *)&meta->ethertype[i], _mm_packus_epi32(et, zero));
+		_mm_storel_epi64((__m128i *)&meta->vlan[i], _mm_packus_epi32(vlan, zero));
+		_mm_storel_epi64((__m128i *)&meta->l3_offset[i], _mm_packus_epi32(_mm_and_si128(l3, ip), zero));
+		_mm_storel_epi64((__m128i *)&meta->l4_offset[i], _mm_packus_epi32(l4, zero));
+		_mm_storel_epi64((__m128i *)&meta->sport[i], _mm_packus_epi32(_mm_and_si128(vf, ffff), zero));
+		_mm_storel_epi64((__m128i *)&meta->dport[i], _mm_packus_epi32(_mm_srli_epi32(vf, 16), zero));
+		k = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packus_epi32(proto, zero), zero));
+		memcpy(&meta->ip_proto[i], &k, 4);
+		mask = _mm_movemask_ps(_mm_castsi128_ps(slow));
+		while (mask != 0){
+			k = __builtin_ctz(mask);
+			parse_frame(meta, i + k, pkts[k].data, pkts[k].len);
+			mask &= mask - 1;
+		}
+	}
+	for (; i < batch->count; i++){
+		parse_frame(meta, i, batch->pkts[i].data, batch->pkts[i].len);
+	}
+}
+
+__attribute__((target("avx2")))
+static inline __m256i parse_in8(__m256i x, uint32_t a, uint32_t b, uint32_t c, uint32_t d){
+	return _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi32(x, _mm256_set1_epi32(a)), _mm256_cmpeq_epi32(x, _mm256_set1_epi32(b))),
+		_mm256_or_si256(_mm256_cmpeq_epi32(x, _mm256_set1_epi32(c)), _mm256_cmpeq_epi32(x, _mm256_set1_epi32(d))));
+}
+/*
+* 32 bits at frame + off of the lanes set in mask, 0 elsewhere. The
+* frame addresses are the gather indexes, the base is 0.
+*/
+__attribute__((target("avx2")))
+static inline __m256i parse_gather(__m256i ptr_lo, __m256i ptr_hi, __m256i off, __m256i mask){
+	__m128i lo, hi;
+
+	lo = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), (const int *)0,
+		_mm256_add_epi64(ptr_lo, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(off))), _mm256_castsi256_si128(mask), 1);
+	hi = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), (const int *)0,
+		_mm256_add_epi64(ptr_hi, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(off, 1))), _mm256_extracti128_si256(mask, 1), 1);
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+__attribute__((target("avx2")))
+static inline void parse_store16(uint16_t *dst, __m256i x){
+	_mm_storeu_si128((__m128i *)dst, _mm_packus_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1)));
+}
+/*
+* Eight frames per round, same steps as the SSE4.1 parser
+*/
+__attribute__((target("avx2")))
+static void parse_avx2(pkt_batch_t *batch){
+	pkt_meta_t *meta = &batch->meta;
+	pkt_desc_t *pkts;
+	__m256i ptr_lo, ptr_hi, len, va, vb, vc, vd, ve, vf, et, et0, tagged, vlan, l3, l4, hl, v4, v6, ip, slow, frag, proto, ports, load;
+	__m256i ffff = _mm256_set1_epi32(0xffff), zero = _mm256_setzero_si256();
+	__m128i proto8;
+	unsigned int i, k, mask;
+
+	for (i = 0; i + 8 <= batch->count; i += 8){
+		pkts = &batch->pkts[i];
+		for (k = 0; k < 8; k++){
+			pipe_prefetch(batch, i + k);
+		}
+		ptr_lo = _mm256_set_epi64x((uintptr_t)pkts[3].data, (uintptr_t)pkts[2].data, (uintptr_t)pkts[1].data, (uintptr_t)pkts[0].data);
+		ptr_hi = _mm256_set_epi64x((uintptr_t)pkts[7].data, (uintptr_t)pkts[6].data, (uintptr_t)pkts[5].data, (uintptr_t)pkts[4].data);
+		len = _mm256_set_epi32(pkts[7].len, pkts[6].len, pkts[5].len, pkts[4].len, pkts[3].len, pkts[2].len, pkts[1].len, pkts[0].len);
+		slow = _mm256_cmpgt_epi32(_mm256_set1_epi32(PARSE_MIN_LEN), len);
+		load = _mm256_xor_si256(slow, _mm256_set1_epi32(-1));
+		va = parse_gather(ptr_lo, ptr_hi, _mm256_set1_epi32(12), load);
+		vb = parse_gather(ptr_lo, ptr_hi, _mm256_set1_epi32(16), load);
+		et0 = _mm256_and_si256(va, ffff);
+		tagged = _mm256_or_si256(_mm256_cmpeq_epi32(et0, _mm256_set1_epi32(PARSE_LE_8021Q)), _mm256_cmpeq_epi32(et0, _mm256_set1_epi32(PARSE_LE_8021AD)));
+		vlan = _mm256_and_si256(tagged, _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(va, 8), _mm256_set1_epi32(0x0f00)), _mm256_srli_epi32(va, 24)));
+		et = _mm256_blendv_epi8(et0, _mm256_and_si256(vb, ffff), tagged);
+		slow = _mm256_or_si256(slow, _mm256_and_si256(tagged, _mm256_or_si256(_mm256_cmpeq_epi32(et, _mm256_set1_epi32(PARSE_LE_8021Q)),
+			_mm256_cmpeq_epi32(et, _mm256_set1_epi32(PARSE_LE_8021AD)))));
+		l3 = _mm256_add_epi32(_mm256_set1_epi32(ETH_HLEN), _mm256_and_si256(tagged, _mm256_set1_epi32(4)));
+		v4 = _mm256_cmpeq_epi32(et, _mm256_set1_epi32(PARSE_LE_IP));
+		v6 = _mm256_cmpeq_epi32(et, _mm256_set1_epi32(PARSE_LE_IPV6));
+		ip = _mm256_or_si256(v4, v6);
+		hl = _mm256_sub_epi32(_mm256_set1_epi32(40), _mm256_and_si256(v4, _mm256_set1_epi32(20)));
+		slow = _mm256_or_si256(slow, _mm256_and_si256(ip, _mm256_cmpgt_epi32(_mm256_add_epi32(l3, hl), len)));
+		load = _mm256_andnot_si256(slow, ip);
+		vc = parse_gather(ptr_lo, ptr_hi, l3, load);
+		vd = parse_gather(ptr_lo, ptr_hi, _mm256_add_epi32(l3, _mm256_set1_epi32(4)), load);
+		ve = parse_gather(ptr_lo, ptr_hi, _mm256_add_epi32(l3, _mm256_set1_epi32(8)), load);
+		slow = _mm256_or_si256(slow, _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_and_si256(vc, _mm256_set1_epi32(0xff)), _mm256_set1_epi32(0x45)), v4));
+		slow = _mm256_or_si256(slow, _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_and_si256(vc, _mm256_set1_epi32(0xf0)), _mm256_set1_epi32(0x60)), v6));
+		proto = _mm256_blendv_epi8(_mm256_srli_epi32(vd, 16), _mm256_srli_epi32(ve, 8), v4);
+		proto = _mm256_and_si256(_mm256_and_si256(proto, _mm256_set1_epi32(0xff)), ip);
+		slow = _mm256_or_si256(slow, _mm256_andnot_si256(parse_in8(proto, IPPROTO_TCP, IPPROTO_UDP, IPPROTO_SCTP, IPPROTO_ICMPV6), v6));
+		frag = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_and_si256(vd, _mm256_set1_epi32(0xff1f0000)), zero), v4);
+		l4 = _mm256_add_epi32(l3, hl);
+		l4 = _mm256_and_si256(l4, _mm256_andnot_si256(frag, _mm256_and_si256(ip, _mm256_cmpgt_epi32(len, l4))));
+		ports = _mm256_andnot_si256(_mm256_cmpeq_epi32(l4, zero), parse_in8(proto, IPPROTO_TCP, IPPROTO_UDP, IPPROTO_SCTP, IPPROTO_SCTP));
+		ports = _mm256_and_si256(ports, _mm256_cmpgt_epi32(len, _mm256_add_epi32(l4, _mm256_set1_epi32(3))));
+		vf = parse_gather(ptr_lo, ptr_hi, l4, _mm256_andnot_si256(slow, ports));
+		et = _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi32(et, 8), _mm256_srli_epi32(et, 8)), ffff);
+		parse_store16(&meta->ethertype[i], et);
+		parse_store16(&meta->vlan[i], vlan);
+		parse_store16(&meta->l3_offset[i], _mm256_and_si256(l3, ip));
+		parse_store16(&meta->l4_offset[i], l4);
+		parse_store16(&meta->sport[i], _mm256_and_si256(vf, ffff));
+		parse_store16(&meta->dport[i], _mm256_srli_epi32(vf, 16));
+		proto8 = _mm_packus_epi32(_mm256_castsi256_si128(proto), _mm256_extracti128_si256(proto, 1));
+		_mm_storel_epi64((__m128i *)&meta->ip_proto[i], _mm_packus_epi16(proto8, proto8));
+		mask = _mm256_movemask_ps(_mm256_castsi256_ps(slow));
+		while (mask != 0){
+			k = __builtin_ctz(mask);
+			parse_frame(meta, i + k, pkts[k].data, pkts[k].len);
+			mask &= mask - 1;
+		}
+	}
+	for (; i < batch->count; i++){
+		parse_frame(meta, i, batch->pkts[i].data, batch->pkts[i].len);
+	}
+}
+#endif
+
+static const parse_impl_t parse_impls[] = {
+#ifdef __x86_64__
+	{"avx2", parse_avx2, parse_has_avx2},
+	{"sse4.1", parse_sse41, parse_has_sse41},
+#endif
+	{"scalar", parse_scalar, NULL},
+};
+
+#define NUM_PARSE_IMPLS (sizeof(parse_impls) / sizeof(parse_impls[0]))
+
+const parse_impl_t *parse_impl(unsigned int i){
+	return (i < NUM_PARSE_IMPLS) ? &parse_impls[i] : NULL;
+}
+
+const parse_impl_t *parse_select(const char *name){
+	unsigned int i;
+
+	for (i = 0; i < NUM_PARSE_IMPLS; i++){
+		if (name != NULL && strcmp(parse_impls[i].name, name) != 0){
+			continue;
+		}
+		if (parse_impls[i].supported == NULL || parse_impls[i].supported()){
+			return &parse_impls[i];
+		}
+		if (name != NULL){
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+int parse_stage_init(pipe_stage_t *stage, arg_config_t *arg_config, unsigned int worker){
+	stage->priv = (void *)parse_select(NULL);
+	return 0;
+}
+
+unsigned int parse_stage(pipe_stage_t *stage, pkt_batch_t *batch){
+	const parse_impl_t *impl = stage->priv;
+
+	impl->parse(batch);
+	return 0;
+}
+
+void parse_stage_print(pipe_stage_t *stage){
+	const parse_impl_t *impl = stage->priv;
+
+	printf("Parser: %s\n", impl->name);
+}
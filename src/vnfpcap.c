@@ -0,0 +1,431 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*! pcap file I/O backend
+ *
+ * A mapped pcap or pcapng file is a RX source, a buffered pcap writer is
+ * a TX sink. Only Ethernet frames are replayed, other link types are
+ * counted and skipped.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+//
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+//
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnfpcap.h"
+#include "vnfpipe.h"
+
+static inline uint32_t pcap_u32(pcap_file_t *pf, uint8_t *p){
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return pf->swapped ? __builtin_bswap32(v) : v;
+}
+
+static inline uint16_t pcap_u16(pcap_file_t *pf, uint8_t *p){
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return pf->swapped ? __builtin_bswap16(v) : v;
+}
+/*
+* pcapng if_tsresol, the high bit selects a power of two instead of ten
+*/
+static uint64_t pcapng_ts_ns(uint64_t ts, uint8_t tsresol){
+	unsigned int exp = tsresol & 0x7f;
+	uint64_t div = 1;
+
+	if (tsresol & 0x80){
+		if (exp >= 64){
+			return 0;
+		}
+		return (ts >> exp) * 1000000000ULL + (((ts & ((1ULL << exp) - 1)) * 1000000000ULL) >> exp);
+	}
+	if (exp <= 9){
+		while (exp++ < 9){
+			div *= 10;
+		}
+		return ts * div;
+	}
+	while (exp-- > 9 && div < 1000000000000000000ULL){
+		div *= 10;
+	}
+	return ts / div;
+}
+
+static void pcapng_idb(pcap_file_t *pf, uint8_t *p, uint32_t blen){
+	uint8_t *opt = p + 16;
+	uint8_t *end = p + blen - 4;
+	uint16_t code, len;
+	unsigned int i = pf->nifs++;
+
+	if (i >= PCAP_MAX_IFS){
+		return;
+	}
+	pf->if_linktype[i] = pcap_u16(pf, p + 8);
+	pf->if_snaplen[i] = pcap_u32(pf, p + 12);
+	pf->if_tsresol[i] = 6;
+	while (opt + 4 <= end){
+		code = pcap_u16(pf, opt);
+		len = pcap_u16(pf, opt + 2);
+		if (code == 0 || opt + 4 + len > end){
+			break;
+		}
+		if (code == 9 && len >= 1){
+			pf->if_tsresol[i] = opt[4];
+		}
+		opt += 4 + ((len + 3) & ~3);
+	}
+}
+/*
+* Next Ethernet frame of a pcapng file, false at the end or on a
+* malformed block
+*/
+static bool pcapng_next(pcap_file_t *pf, uint8_t **data, uint32_t *caplen, uint64_t *ts_ns){
+	uint8_t *p;
+	uint32_t type, blen, bom, ifid, len;
+	uint64_t ts;
+
+	while (pf->offset + 12 <= pf->len){
+		p = pf->map + pf->offset;
+		memcpy(&type, p, sizeof(type));
+		if (type == PCAPNG_SHB){
+			memcpy(&bom, p + 8, sizeof(bom));
+			if (bom == PCAPNG_BYTE_ORDER){
+				pf->swapped = false;
+			} else if (bom == __builtin_bswap32(PCAPNG_BYTE_ORDER)){
+				pf->swapped = true;
+			} else {
+				return false;
+			}
+			pf->nifs = 0;
+		}
+		type = pcap_u32(pf, p);
+		blen = pcap_u32(pf, p + 4);
+		if (blen < 12 || (blen & 3) != 0 || blen > pf->len - pf->offset){
+			return false;
+		}
+		pf->offset += blen;
+		switch (type){
+			case PCAPNG_IDB:
+				if (blen >= 20){
+					pcapng_idb(pf, p, blen);
+				}
+				break;
+			case PCAPNG_EPB:
+				if (blen < 32){
+					break;
+				}
+				ifid = pcap_u32(pf, p + 8);
+				len = pcap_u32(pf, p + 20);
+				if (ifid >= pf->nifs || ifid >= PCAP_MAX_IFS || pf->if_linktype[ifid] != PCAP_LINKTYPE_ETHERNET || len > blen - 32){
+					pf->skipped++;
+					break;
+				}
+				ts = ((uint64_t)pcap_u32(pf, p + 12) << 32) | pcap_u32(pf, p + 16);
+				*data = p + 28;
+				*caplen = len;
+				*ts_ns = pcapng_ts_ns(ts, pf->if_tsresol[ifid]);
+				return true;
+			case PCAPNG_SPB:
+				if (blen < 16){
+					break;
+				}
+				if (pf->nifs == 0 || pf->if_linktype[0] != PCAP_LINKTYPE_ETHERNET){
+					pf->skipped++;
+					break;
+				}
+				len = MIN(pcap_u32(pf, p + 8), blen - 16);
+				if (pf->if_snaplen[0] > 0){
+					len = MIN(len, pf->if_snaplen[0]);
+				}
+				*data = p + 12;
+				*caplen = len;
+				*ts_ns = 0;
+				return true;
+			default:
+				break;
+		}
+	}
+	return false;
+}
+
+static bool pcap_next(pcap_file_t *pf, uint8_t **data, uint32_t *caplen, uint64_t *ts_ns){
+	uint8_t *p;
+	uint32_t len, frac;
+
+	if (pf->ng){
+		return pcapng_next(pf, data, caplen, ts_ns);
+	}
+	if (pf->offset + sizeof(pcap_rec_hdr_t) > pf->len){
+		return false;
+	}
+	p = pf->map + pf->offset;
+	len = pcap_u32(pf, p + 8);
+	if (len > pf->len - pf->offset - sizeof(pcap_rec_hdr_t)){
+		return false;
+	}
+	frac = pcap_u32(pf, p + 4);
+	*ts_ns = pcap_u32(pf, p) * 1000000000ULL + (pf->nsec ? frac : frac * 1000ULL);
+	*data = p + sizeof(pcap_rec_hdr_t);
+	*caplen = len;
+	pf->offset += sizeof(pcap_rec_hdr_t) + len;
+	return true;
+}
+/*
+* Forward up to rx_budget frames of the file in pipeline batches, 0 once
+* it is exhausted. The file stays mapped so frames need no copy.
+*/
+static unsigned int pcap_read(intf_config_t *r_config, intf_config_t *w_config){
+	pcap_file_t *pf = r_config->pcap;
+	pipeline_t *pipe = r_config->pipe;
+	pkt_batch_t *batch = &pipe->batch;
+	unsigned int count = 0;
+	unsigned int want, n;
+	uint8_t *data;
+	uint32_t caplen;
+	uint64_t ts_ns;
+
+	while (count < r_config->rx_budget && !pf->eof){
+		want = MIN(PIPE_BATCH, r_config->rx_budget - count);
+		for (n = 0; n < want; n++){
+			if (pcap_next(pf, &data, &caplen, &ts_ns) == false){
+				if (pf->offset < pf->len){
+					printf("WARNING: %s is truncated or malformed at offset %lu\n", pf->path, pf->offset);
+				}
+				pf->eof = true;
+				break;
+			}
+			r_config->stats->rx_bytes += caplen;
+			pkt_init(&batch->pkts[n], data, caplen, ts_ns, r_config->port);
+		}
+		if (n == 0){
+			break;
+		}
+		r_config->stats->rx_packets += n;
+		batch->count = n;
+		pipeline_run(pipe, batch);
+		pipeline_output(pipe, batch, w_config);
+		count += n;
+	}
+	return count;
+}
+
+static void pcap_drain(pcap_file_t *pf){
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < pf->used){
+		n = write(pf->fd, pf->buf + done, pf->used - done);
+		if (n == -1){
+			if (errno == EINTR){
+				continue;
+			}
+			perror("pcap write");
+			exit(1);
+		}
+		done += n;
+	}
+	pf->used = 0;
+}
+/*
+* Append a record, the input timestamp is kept so replaying the same
+* capture twice gives the same file. Offloads are not applied, a GSO
+* packet is written whole with its partial checksum as tcpdump does.
+*/
+static void pcap_write(intf_config_t *config, const struct virtio_net_hdr *vnet, uint8_t *data, size_t len, uint64_t rx_ns){
+	pcap_file_t *pf = config->pcap;
+	pcap_rec_hdr_t rec;
+	struct timespec ts;
+
+	/*
+	* A capture being replayed cannot take frames
+	*/
+	if (pf->buf == NULL){
+		config->stats->tx_drops++;
+		return;
+	}
+	len = MIN(len, PCAP_SNAPLEN);
+	if (pf->used + sizeof(rec) + len > PCAP_WRITE_BUF){
+		pcap_drain(pf);
+	}
+	if (rx_ns == 0){
+		clock_gettime(CLOCK_REALTIME, &ts);
+		rx_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+	rec.ts_sec = rx_ns / 1000000000ULL;
+	rec.ts_frac = rx_ns % 1000000000ULL;
+	rec.incl_len = len;
+	rec.orig_len = len;
+	memcpy(pf->buf + pf->used, &rec, sizeof(rec));
+	memcpy(pf->buf + pf->used + sizeof(rec), data, len);
+	pf->used += sizeof(rec) + len;
+	config->stats->tx_packets++;
+	config->stats->tx_bytes += len;
+}
+/*
+* Records are written when the buffer fills and on close
+*/
+static void pcap_flush(intf_config_t *config){
+}
+
+static void pcap_close(intf_config_t *config){
+	pcap_file_t *pf = config->pcap;
+
+	if (pf == NULL){
+		return;
+	}
+	if (pf->buf != NULL){
+		pcap_drain(pf);
+		free(pf->buf);
+	}
+	if (pf->map != NULL){
+		munmap(pf->map, pf->len);
+	}
+	if (pf->skipped > 0){
+		printf("%s: skipped %lu frames that are not Ethernet\n", pf->path, pf->skipped);
+	}
+	close(pf->fd);
+	free(pf);
+	config->pcap = NULL;
+}
+
+const io_backend_t pcap_io = {
+	.name = "pcap",
+	.read = pcap_read,
+	.write = pcap_write,
+	.flush = pcap_flush,
+	.close = pcap_close,
+};
+
+static pcap_file_t *pcap_alloc(char *path){
+	pcap_file_t *pf;
+
+	pf = calloc(1, sizeof(*pf));
+	if (pf == NULL){
+		perror("calloc pcap");
+		return NULL;
+	}
+	strncpy(pf->path, path, PCAP_PATH_SIZE-1);
+	pf->fd = -1;
+	return pf;
+}
+/*
+* Map a pcap or pcapng file as the RX source of config
+*/
+int pcap_open_read(intf_config_t *config, char *path){
+	pcap_file_t *pf;
+	struct stat st;
+	uint32_t magic;
+
+	if ((pf = pcap_alloc(path)) == NULL){
+		return -1;
+	}
+	pf->fd = open(path, O_RDONLY);
+	if (pf->fd == -1 || fstat(pf->fd, &st) == -1){
+		perror(path);
+		goto fail;
+	}
+	pf->len = st.st_size;
+	if (pf->len < sizeof(pcap_global_hdr_t)){
+		printf("ERROR: %s is too short for a capture\n", path);
+		goto fail;
+	}
+	pf->map = mmap(NULL, pf->len, PROT_READ, MAP_PRIVATE, pf->fd, 0);
+	if (pf->map == MAP_FAILED){
+		pf->map = NULL;
+		perror("mmap pcap");
+		goto fail;
+	}
+	madvise(pf->map, pf->len, MADV_SEQUENTIAL | MADV_WILLNEED);
+	memcpy(&magic, pf->map, sizeof(magic));
+	if (magic == PCAPNG_SHB){
+		pf->ng = true;
+	} else if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC){
+		pf->nsec = (magic == PCAP_MAGIC_NSEC);
+	} else if (magic == __builtin_bswap32(PCAP_MAGIC_USEC) || magic == __builtin_bswap32(PCAP_MAGIC_NSEC)){
+		pf->swapped = true;
+		pf->nsec = (magic == __builtin_bswap32(PCAP_MAGIC_NSEC));
+	} else {
+		printf("ERROR: %s is not a pcap or pcapng file\n", path);
+		goto fail;
+	}
+	if (pf->ng == false){
+		pf->linktype = pcap_u32(pf, pf->map + offsetof(pcap_global_hdr_t, linktype));
+		if (pf->linktype != PCAP_LINKTYPE_ETHERNET){
+			printf("ERROR: %s has link type %u, only Ethernet is supported\n", path, pf->linktype);
+			goto fail;
+		}
+		pf->offset = sizeof(pcap_global_hdr_t);
+	}
+	config->pcap = pf;
+	config->io = &pcap_io;
+	printf("Reading: %s, %s, %lu bytes\n", path, pf->ng ? "pcapng" : "pcap", pf->len);
+	return 0;
+fail:
+	if (pf->map != NULL){
+		munmap(pf->map, pf->len);
+	}
+	if (pf->fd != -1){
+		close(pf->fd);
+	}
+	free(pf);
+	return -1;
+}
+/*
+* Create a nanosecond pcap file as the TX sink of config
+*/
+int pcap_open_write(intf_config_t *config, char *path){
+	pcap_file_t *pf;
+	pcap_global_hdr_t hdr;
+
+	if ((pf = pcap_alloc(path)) == NULL){
+		return -1;
+	}
+	pf->fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	pf->buf = malloc(PCAP_WRITE_BUF);
+	if (pf->fd == -1 || pf->buf == NULL){
+		perror(path);
+		if (pf->fd != -1){
+			close(pf->fd);
+		}
+		free(pf->buf);
+		free(pf);
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = PCAP_MAGIC_NSEC;
+	hdr.version_major = 2;
+	hdr.version_minor = 4;
+	hdr.snaplen = PCAP_SNAPLEN;
+	hdr.linktype = PCAP_LINKTYPE_ETHERNET;
+	memcpy(pf->buf, &hdr, sizeof(hdr));
+	pf->used = sizeof(hdr);
+	config->pcap = pf;
+	config->io = &pcap_io;
+	printf("Writing: %s\n", path);
+	return 0;
+}
@@ -0,0 +1,699 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*! Microbenchmarks of the pipeline data structures
+ *
+ * Every benchmark runs single threaded on synthetic keys and prints one
+ * JSON object per table size.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+//
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnfpipe.h"
+#include "vnfflow.h"
+#include "vnfacl.h"
+#include "vnfparse.h"
+#include "vnfmac.h"
+#include "vnfqos.h"
+
+#define PERF_MAX_SIZES  16
+#define PERF_MAX_SAMPLE (1UL << 20)
+#define PERF_MAX_VERIFY 20000
+#define PERF_FRAME_SIZE 128
+/*
+* The qos benchmark offers PERF_QOS_PPS frames a second of simulated time
+*/
+#define PERF_QOS_PPS    10000000ULL
+
+typedef struct _perf_config {
+	uint64_t sizes[PERF_MAX_SIZES];
+	unsigned int nsizes;
+	uint64_t lookups;
+	char *rules_out;
+} perf_config_t;
+
+typedef struct _perf_bench {
+	const char *name;
+	const char *help;
+	const char *sizes;
+	uint64_t lookups;
+	void (*run)(perf_config_t *config, uint64_t size);
+} perf_bench_t;
+
+static double now(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t perf_rand(uint64_t *state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+/*
+* UDP over IPv4 flow number i, the same i always gives the same key
+*/
+static void perf_flow_key(flow_key_t *key, uint64_t i){
+	uint64_t r = flow_mix(i + 1);
+
+	memset(key, 0, sizeof(*key));
+	memcpy(key->src, &r, 4);
+	r >>= 32;
+	memcpy(key->dst, &r, 4);
+	key->sport = i & 0xffff;
+	key->dport = (i >> 16) & 0xffff;
+	key->ethertype = ETH_P_IP;
+	key->proto = IPPROTO_UDP;
+}
+/*
+* Fill a cache with size flows, then time batched and single lookups of
+* random known flows. The cache gets a quarter more slots than flows.
+*/
+static void perf_flow(perf_config_t *config, uint64_t size){
+	flow_cache_t fc;
+	flow_key_t key;
+	flow_key_t *sample;
+	uint64_t hashes[PIPE_BATCH];
+	flow_entry_t *entries[PIPE_BATCH];
+	uint64_t i, nsample, done, hits, rng = 88172645463325252ULL;
+	unsigned int j, n;
+	double start, insert_s, batch_s, single_s;
+
+	if (flow_cache_init(&fc, size + size / 4) == -1){
+		exit(1);
+	}
+	start = now();
+	for (i = 0; i < size; i++){
+		if ((i % PIPE_BATCH) == 0){
+			fc.epoch++;
+		}
+		perf_flow_key(&key, i);
+		flow_insert(&fc, &key, flow_hash(&key));
+	}
+	insert_s = now() - start;
+	nsample = MIN(size, PERF_MAX_SAMPLE);
+	if (posix_memalign((void **)&sample, CACHE_LINE_SIZE, nsample * sizeof(flow_key_t)) != 0){
+		perror("posix_memalign sample");
+		exit(1);
+	}
+	for (i = 0; i < nsample; i++){
+		perf_flow_key(&sample[i], perf_rand(&rng) % size);
+	}
+	hits = 0;
+	start = now();
+	for (done = 0; done < config->lookups; done += n){
+		i = done % nsample;
+		n = MIN(PIPE_BATCH, nsample - i);
+		flow_lookup_batch(&fc, &sample[i], hashes, entries, n);
+		for (j = 0; j < n; j++){
+			hits += (entries[j] != NULL);
+		}
+	}
+	batch_s = now() - start;
+	start = now();
+	for (done = 0; done < config->lookups; done++){
+		i = done % nsample;
+		hits += (flow_lookup(&fc, &sample[i], flow_hash(&sample[i])) != NULL);
+	}
+	single_s = now() - start;
+	printf("{\"bench\": \"flow\", \"flows\": %lu, \"capacity\": %lu, \"memory_mb\": %lu, \"insert_ns\": %.1f, "
+		"\"lookup_ns\": %.1f, \"lookup_single_ns\": %.1f, \"mlookups_per_s\": %.2f, \"hit_pct\": %.3f, \"evictions\": %lu}\n",
+		size, fc.nflows, fc.map_len >> 20, insert_s * 1e9 / size,
+		batch_s * 1e9 / done, single_s * 1e9 / done, done / batch_s / 1e6,
+		hits * 100.0 / (2 * done), fc.evictions);
+	fflush(stdout);
+	free(sample);
+	flow_cache_free(&fc);
+}
+
+static const uint8_t perf_acl_lens[] = {0, 8, 16, 24, 24, 28, 32, 32};
+static const uint16_t perf_acl_ports[] = {22, 25, 53, 80, 123, 443, 3306, 8080};
+
+static uint32_t perf_prefix(uint64_t r, unsigned int len){
+	uint32_t addr = 0x0a000000 | (r & 0xffffff);
+
+	return (len == 0) ? 0 : htonl(addr & (0xffffffffU << (32 - len)));
+}
+/*
+* IPv4 firewall rule in the spirit of ClassBench: prefixes of a few
+* common lengths within 10/8, mostly wildcard source ports, well known
+* or wide destination port ranges
+*/
+static void perf_acl_rule(acl_rule_t *rule, uint64_t *rng){
+	uint64_t r = perf_rand(rng);
+	uint32_t addr;
+
+	memset(rule, 0, sizeof(*rule));
+	rule->src_len = perf_acl_lens[r & 7];
+	rule->dst_len = perf_acl_lens[(r >> 3) & 7];
+	addr = perf_prefix(perf_rand(rng), rule->src_len);
+	memcpy(rule->src, &addr, 4);
+	addr = perf_prefix(perf_rand(rng), rule->dst_len);
+	memcpy(rule->dst, &addr, 4);
+	if (rule->src_len != 0 || rule->dst_len != 0){
+		rule->ethertype = ETH_P_IP;
+	}
+	rule->sport_hi = 65535;
+	if (((r >> 6) & 3) == 0){
+		rule->sport_lo = 1024;
+	}
+	switch ((r >> 8) & 7){
+		case 0:
+		case 1:
+		case 2:
+			rule->dport_hi = 65535;
+			break;
+		case 6:
+			rule->dport_lo = 1024;
+			rule->dport_hi = 65535;
+			break;
+		case 7:
+			rule->dport_lo = (r >> 16) & 0xffff;
+			rule->dport_hi = MIN(65535, rule->dport_lo + ((r >> 32) & 0x3ff));
+			break;
+		default:
+			rule->dport_lo = perf_acl_ports[(r >> 16) & 7];
+			rule->dport_hi = rule->dport_lo;
+			break;
+	}
+	if (((r >> 11) & 3) != 0){
+		rule->proto = (((r >> 11) & 3) == 3) ? IPPROTO_UDP : IPPROTO_TCP;
+		rule->match |= ACL_MATCH_PROTO;
+	}
+	rule->action = (((r >> 13) & 3) == 0) ? ACL_DENY : ACL_PERMIT;
+}
+/*
+* Half the keys fall inside a random rule, the rest are random
+*/
+static void perf_acl_key(flow_key_t *key, acl_table_t *acl, uint64_t *rng){
+	acl_rule_t *rule = &acl->rules[perf_rand(rng) % acl->nrules];
+	uint64_t r = perf_rand(rng);
+	uint32_t addr, mask;
+	uint16_t port;
+
+	memset(key, 0, sizeof(*key));
+	key->ethertype = ETH_P_IP;
+	addr = perf_prefix(perf_rand(rng), 32);
+	memcpy(key->src, &addr, 4);
+	addr = perf_prefix(perf_rand(rng), 32);
+	memcpy(key->dst, &addr, 4);
+	key->sport = htons(r & 0xffff);
+	key->dport = htons((r >> 16) & 0xffff);
+	key->proto = ((r >> 32) & 1) ? IPPROTO_UDP : IPPROTO_TCP;
+	if ((r >> 33) & 1){
+		return;
+	}
+	mask = (rule->src_len == 0) ? 0 : htonl(0xffffffffU << (32 - rule->src_len));
+	memcpy(&addr, key->src, 4);
+	addr = (addr & ~mask) | *(uint32_t *)rule->src;
+	memcpy(key->src, &addr, 4);
+	mask = (rule->dst_len == 0) ? 0 : htonl(0xffffffffU << (32 - rule->dst_len));
+	memcpy(&addr, key->dst, 4);
+	addr = (addr & ~mask) | *(uint32_t *)rule->dst;
+	memcpy(key->dst, &addr, 4);
+	port = rule->sport_lo + (r >> 34) % (rule->sport_hi - rule->sport_lo + 1);
+	key->sport = htons(port);
+	port = rule->dport_lo + (r >> 50) % (rule->dport_hi - rule->dport_lo + 1);
+	key->dport = htons(port);
+	if (rule->match & ACL_MATCH_PROTO){
+		key->proto = rule->proto;
+	}
+}
+/*
+* Compile size synthetic rules, then time batched, single and linear
+* scan lookups. The batched results are checked against the linear scan.
+*/
+static void perf_acl(perf_config_t *config, uint64_t size){
+	acl_table_t *acl;
+	acl_rule_t rule;
+	flow_key_t *sample;
+	uint32_t *expect;
+	uint32_t rules[PIPE_BATCH];
+	uint64_t i, nsample, nverify, done, matched = 0, mismatches = 0, rng = 88172645463325252ULL;
+	unsigned int j, n;
+	double start, compile_s, batch_s, single_s, linear_s;
+	char path[512];
+	FILE *out = NULL;
+
+	acl = acl_new();
+	if (acl == NULL){
+		exit(1);
+	}
+	if (config->rules_out != NULL){
+		snprintf(path, sizeof(path), "%s.%lu", config->rules_out, size);
+		out = fopen(path, "w");
+		if (out == NULL){
+			perror(path);
+			exit(1);
+		}
+	}
+	for (i = 0; i < size; i++){
+		perf_acl_rule(&rule, &rng);
+		if (acl_add_rule(acl, &rule) == -1){
+			exit(1);
+		}
+		if (out != NULL){
+			acl_format_rule(out, &rule);
+		}
+	}
+	if (out != NULL){
+		fclose(out);
+	}
+	start = now();
+	if (acl_compile(acl) == -1){
+		exit(1);
+	}
+	compile_s = now() - start;
+	nsample = MIN(config->lookups, PERF_MAX_SAMPLE);
+	nverify = MIN(nsample, PERF_MAX_VERIFY);
+	if (posix_memalign((void **)&sample, CACHE_LINE_SIZE, nsample * sizeof(flow_key_t)) != 0 ||
+		(expect = malloc(nverify * sizeof(uint32_t))) == NULL){
+		perror("alloc sample");
+		exit(1);
+	}
+	for (i = 0; i < nsample; i++){
+		perf_acl_key(&sample[i], acl, &rng);
+	}
+	start = now();
+	for (done = 0; done < config->lookups; done += n){
+		i = done % nsample;
+		n = MIN(PIPE_BATCH, nsample - i);
+		acl_classify_batch(acl, &sample[i], rules, n);
+		for (j = 0; j < n; j++){
+			matched += (rules[j] != ACL_NO_MATCH);
+			if (i + j < nverify){
+				expect[i + j] = rules[j];
+			}
+		}
+	}
+	batch_s = now() - start;
+	start = now();
+	for (done = 0; done < config->lookups; done++){
+		i = done % nsample;
+		matched += (acl_classify(acl, &sample[i]) != ACL_NO_MATCH);
+	}
+	single_s = now() - start;
+	start = now();
+	for (i = 0; i < nverify; i++){
+		mismatches += (acl_classify_linear(acl, &sample[i]) != expect[i]);
+	}
+	linear_s = now() - start;
+	printf("{\"bench\": \"acl\", \"rules\": %lu, \"tuples\": %u, \"entries\": %lu, \"compile_ms\": %.1f, "
+		"\"lookup_ns\": %.1f, \"lookup_single_ns\": %.1f, \"mlookups_per_s\": %.2f, \"linear_ns\": %.1f, "
+		"\"match_pct\": %.3f, \"mismatches\": %lu}\n",
+		size, acl->ntuples, acl->nentries, compile_s * 1e3,
+		batch_s * 1e9 / done, single_s * 1e9 / done, done / batch_s / 1e6, linear_s * 1e9 / nverify,
+		matched * 100.0 / (2 * done), mismatches);
+	fflush(stdout);
+	free(expect);
+	free(sample);
+	acl_free(acl);
+}
+
+static uint32_t perf_put16(uint8_t *p, uint32_t off, uint16_t v){
+	p[off] = v >> 8;
+	p[off + 1] = v & 0xff;
+	return off + 2;
+}
+/*
+* A frame of a mix of mostly well formed traffic: plain, VLAN and QinQ
+* tagged IPv4, IPv6 with and without extension headers, IPv4 options and
+* fragments, ARP. One in twenty is truncated or has random bytes.
+*/
+static uint32_t perf_parse_frame(uint8_t *p, uint64_t r){
+	unsigned int kind = r % 100, tags = 0, t, ihl = 20;
+	uint8_t proto = ((r >> 8) & 1) ? IPPROTO_UDP : IPPROTO_TCP;
+	uint32_t off, l3, l4, len, i;
+	uint64_t junk;
+
+	memset(p, 0, PERF_FRAME_SIZE);
+	memset(p, 0xaa, 12);
+	if ((kind >= 55 && kind < 65) || (kind >= 70 && kind < 85 && ((r >> 9) & 1))){
+		tags = 1;
+	} else if (kind >= 65 && kind < 70){
+		tags = 2;
+	}
+	off = 12;
+	for (t = 0; t < tags; t++){
+		off = perf_put16(p, off, (t + 1 < tags) ? ETH_P_8021AD : ETH_P_8021Q);
+		off = perf_put16(p, off, (r >> 16) & 0x0fff);
+	}
+	l3 = off + 2;
+	if (kind < 70 || (kind >= 85 && kind < 90)){
+		perf_put16(p, off, ETH_P_IP);
+		if (kind >= 85 && ((r >> 10) & 1)){
+			ihl = 24;
+		} else if (kind >= 85){
+			p[l3 + 6] = ((r >> 11) & 1) ? 0x20 : 0x01;
+		}
+		p[l3] = 0x40 | (ihl / 4);
+		p[l3 + 9] = proto;
+		memcpy(p + l3 + 12, &r, 8);
+		l4 = l3 + ihl;
+	} else if (kind < 85){
+		perf_put16(p, off, ETH_P_IPV6);
+		p[l3] = 0x60;
+		p[l3 + 6] = proto;
+		memcpy(p + l3 + 8, &r, 8);
+		memcpy(p + l3 + 24, &r, 8);
+		l4 = l3 + 40;
+		if (kind >= 80){
+			p[l3 + 6] = IPPROTO_HOPOPTS;
+			p[l4] = IPPROTO_FRAGMENT;
+			p[l4 + 8] = proto;
+			p[l4 + 11] = ((r >> 12) & 1) ? 0x08 : 0x01;
+			l4 += 16;
+		}
+	} else {
+		perf_put16(p, off, ETH_P_ARP);
+		l4 = l3 + 28;
+	}
+	memcpy(p + l4, &r, 4);
+	len = MIN(PERF_FRAME_SIZE, MAX(60, l4 + 8 + ((r >> 20) % 40)));
+	if (kind >= 95){
+		junk = flow_mix(r);
+		if (junk & 1){
+			len = (junk >> 8) % (len + 1);
+		} else {
+			for (i = 12; i < len; i += 8){
+				junk = flow_mix(junk);
+				memcpy(p + i, &junk, MIN(8, len - i));
+			}
+		}
+	}
+	return len;
+}
+/*
+* Parse size synthetic frames in batches with every parser the CPU runs,
+* each result is compared with the scalar parser
+*/
+static void perf_parse(perf_config_t *config, uint64_t size){
+	const parse_impl_t *impl;
+	pkt_batch_t *batches, ref;
+	uint8_t *frames;
+	uint64_t i, nbatches, done, mismatches, rng = 88172645463325252ULL;
+	unsigned int b, k, n;
+	double start, parse_s;
+
+	nbatches = (size + PIPE_BATCH - 1) / PIPE_BATCH;
+	if (posix_memalign((void **)&frames, CACHE_LINE_SIZE, size * PERF_FRAME_SIZE) != 0 ||
+		posix_memalign((void **)&batches, CACHE_LINE_SIZE, nbatches * sizeof(pkt_batch_t)) != 0){
+		perror("posix_memalign frames");
+		exit(1);
+	}
+	for (i = 0; i < size; i++){
+		b = i / PIPE_BATCH;
+		k = i % PIPE_BATCH;
+		memset(&batches[b].pkts[k], 0, sizeof(pkt_desc_t));
+		batches[b].pkts[k].data = frames + i * PERF_FRAME_SIZE;
+		batches[b].pkts[k].len = perf_parse_frame(batches[b].pkts[k].data, perf_rand(&rng));
+		batches[b].count = k + 1;
+	}
+	for (n = 0; (impl = parse_impl(n)) != NULL; n++){
+		if (impl->supported != NULL && !impl->supported()){
+			continue;
+		}
+		mismatches = 0;
+		for (b = 0; b < nbatches; b++){
+			ref.count = batches[b].count;
+			memcpy(ref.pkts, batches[b].pkts, sizeof(ref.pkts));
+			parse_scalar(&ref);
+			impl->parse(&batches[b]);
+			for (k = 0; k < ref.count; k++){
+				mismatches += ref.meta.ethertype[k] != batches[b].meta.ethertype[k] || ref.meta.vlan[k] != batches[b].meta.vlan[k] ||
+					ref.meta.l3_offset[k] != batches[b].meta.l3_offset[k] || ref.meta.l4_offset[k] != batches[b].meta.l4_offset[k] ||
+					ref.meta.sport[k] != batches[b].meta.sport[k] || ref.meta.dport[k] != batches[b].meta.dport[k] ||
+					ref.meta.ip_proto[k] != batches[b].meta.ip_proto[k];
+			}
+		}
+		start = now();
+		for (done = 0, b = 0; done < config->lookups; done += batches[b].count, b = (b + 1) % nbatches){
+			impl->parse(&batches[b]);
+		}
+		parse_s = now() - start;
+		printf("{\"bench\": \"parse\", \"frames\": %lu, \"impl\": \"%s\", \"ns_per_pkt\": %.2f, \"mpps\": %.1f, \"mismatches\": %lu}\n",
+			size, impl->name, parse_s * 1e9 / done, done / parse_s / 1e6, mismatches);
+		fflush(stdout);
+	}
+	free(batches);
+	free(frames);
+}
+
+/*
+* Unicast address and VLAN of station i, the same i always gives the same
+* key
+*/
+static uint64_t perf_mac_key(uint64_t i){
+	uint64_t r = flow_mix(i + 1);
+	uint8_t mac[6];
+
+	memcpy(mac, &r, 6);
+	mac[0] &= ~0x01;
+	return mac_key(mac, (r >> 48) & 0xfff);
+}
+/*
+* Learn size stations, learn them again as every frame of a known station
+* does, then time batched and single lookups of random known stations.
+* The table gets a quarter more slots than stations.
+*/
+static void perf_mac(perf_config_t *config, uint64_t size){
+	mac_table_t table;
+	uint64_t *sample;
+	uint8_t ports[PIPE_BATCH];
+	uint64_t i, nsample, done, hits, evictions = 0, rng = 88172645463325252ULL;
+	uint32_t ms = 1000;
+	unsigned int j, n;
+	double start, learn_s, refresh_s, batch_s, single_s;
+
+	if (mac_table_init(&table, size + size / 4, DEFAULT_MAC_AGING * 1000) == -1){
+		exit(1);
+	}
+	start = now();
+	for (i = 0; i < size; i++){
+		evictions += (mac_learn(&table, perf_mac_key(i), i % 8, ms, true) == MAC_LEARN_EVICTED);
+	}
+	learn_s = now() - start;
+	nsample = MIN(size, PERF_MAX_SAMPLE);
+	if (posix_memalign((void **)&sample, CACHE_LINE_SIZE, nsample * sizeof(uint64_t)) != 0){
+		perror("posix_memalign sample");
+		exit(1);
+	}
+	for (i = 0; i < nsample; i++){
+		sample[i] = perf_mac_key(perf_rand(&rng) % size);
+	}
+	start = now();
+	for (done = 0; done < config->lookups; done++){
+		i = done % nsample;
+		mac_learn(&table, sample[i], 0, ms, true);
+	}
+	refresh_s = now() - start;
+	hits = 0;
+	start = now();
+	for (done = 0; done < config->lookups; done += n){
+		i = done % nsample;
+		n = MIN(PIPE_BATCH, nsample - i);
+		mac_lookup_batch(&table, &sample[i], ports, n, ms);
+		for (j = 0; j < n; j++){
+			hits += (ports[j] != PORT_NONE);
+		}
+	}
+	batch_s = now() - start;
+	start = now();
+	for (done = 0; done < config->lookups; done++){
+		i = done % nsample;
+		hits += (mac_lookup(&table, sample[i], ms) != PORT_NONE);
+	}
+	single_s = now() - start;
+	printf("{\"bench\": \"mac\", \"stations\": %lu, \"capacity\": %lu, \"memory_mb\": %lu, \"learn_ns\": %.1f, \"refresh_ns\": %.1f, "
+		"\"lookup_ns\": %.1f, \"lookup_single_ns\": %.1f, \"mlookups_per_s\": %.2f, \"hit_pct\": %.3f, \"evictions\": %lu}\n",
+		size, table.nentries, table.map_len >> 20, learn_s * 1e9 / size, refresh_s * 1e9 / done,
+		batch_s * 1e9 / done, single_s * 1e9 / done, done / batch_s / 1e6,
+		hits * 100.0 / (2 * done), evictions);
+	fflush(stdout);
+	free(sample);
+	mac_table_free(&table);
+}
+
+/*
+* Offer PERF_QOS_PPS frames of PERF_FRAME_SIZE bytes to a port limited to
+* mbps, first policed and then shaped, on a simulated clock so the rate
+* that passes only depends on the buckets. Shaped frames are collected
+* after every batch as the loop would.
+*/
+static void perf_qos_run(perf_config_t *config, uint64_t mbps, bool shape){
+	char line[QOS_LINE_SIZE];
+	qos_rule_t rule;
+	qos_t qos;
+	pkt_batch_t *batch, *out;
+	uint8_t *frames;
+	uint64_t done, bytes = 0, sim = 0;
+	unsigned int k, n;
+	double start, run_s;
+
+	snprintf(line, sizeof(line), "port 0 rate %lum%s", mbps, shape ? " shape" : "");
+	if (qos_parse_rule(line, &rule) != 0 || qos_init(&qos, &rule, 1, 1) == -1){
+		exit(1);
+	}
+	if (posix_memalign((void **)&frames, CACHE_LINE_SIZE, PIPE_BATCH * PERF_FRAME_SIZE) != 0 ||
+		posix_memalign((void **)&batch, CACHE_LINE_SIZE, sizeof(pkt_batch_t)) != 0 ||
+		posix_memalign((void **)&out, CACHE_LINE_SIZE, sizeof(pkt_batch_t)) != 0){
+		perror("posix_memalign frames");
+		exit(1);
+	}
+	memset(frames, 0, PIPE_BATCH * PERF_FRAME_SIZE);
+	memset(batch, 0, sizeof(pkt_batch_t));
+	start = now();
+	for (done = 0; done < config->lookups; done += PIPE_BATCH){
+		for (k = 0; k < PIPE_BATCH; k++){
+			pkt_init(&batch->pkts[k], frames + k * PERF_FRAME_SIZE, PERF_FRAME_SIZE, 0, 0);
+		}
+		batch->count = PIPE_BATCH;
+		batch->held = 0;
+		qos_process(&qos, batch, sim);
+		for (k = 0; k < PIPE_BATCH; k++){
+			bytes += (batch->pkts[k].verdict == VERDICT_FORWARD) ? batch->pkts[k].len : 0;
+		}
+		sim += PIPE_BATCH * (1000000000ULL / PERF_QOS_PPS);
+		while (qos_due(&qos, sim) <= sim && (n = qos_poll(&qos, out, sim)) > 0){
+			for (k = 0; k < n; k++){
+				bytes += out->pkts[k].len;
+			}
+		}
+	}
+	run_s = now() - start;
+	printf("{\"bench\": \"qos\", \"mode\": \"%s\", \"rate_mbps\": %lu, \"offered_mbps\": %.0f, \"ns_per_pkt\": %.2f, "
+		"\"passed_mbps\": %.2f, \"accuracy_pct\": %.3f, \"conformed\": %lu, \"policed\": %lu, \"shaped\": %lu, "
+		"\"queue_full\": %lu, \"released\": %lu}\n",
+		shape ? "shape" : "police", mbps, PERF_QOS_PPS * PERF_FRAME_SIZE * 8 / 1e6, run_s * 1e9 / done,
+		bytes * 8 * 1e3 / sim, bytes * 8 * 1e3 / sim * 100 / mbps, qos.conformed, qos.policed, qos.shaped,
+		qos.queue_full, qos.released);
+	fflush(stdout);
+	qos_free(&qos);
+	free(out);
+	free(batch);
+	free(frames);
+}
+
+static void perf_qos(perf_config_t *config, uint64_t size){
+	perf_qos_run(config, size, false);
+	perf_qos_run(config, size, true);
+}
+
+static const perf_bench_t benches[] = {
+	{"flow", "flow cache insert and lookup", "1000000,10000000", 20000000, perf_flow},
+	{"acl", "ACL compile and classify", "1000,10000,50000", 2000000, perf_acl},
+	{"parse", "header parsers on a traffic mix", "4096,1048576", 50000000, perf_parse},
+	{"mac", "bridge MAC table learn and lookup", "100000,1000000", 20000000, perf_mac},
+	{"qos", "policer and shaper at 10 Mpps, sizes are rates in Mbps", "100,1000,5000", 20000000, perf_qos},
+};
+
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static unsigned int parse_sizes(char *list, uint64_t *sizes){
+	char buf[256];
+	char *tok, *save;
+	unsigned int n = 0;
+
+	strncpy(buf, list, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+	for (tok = strtok_r(buf, ",", &save); tok != NULL && n < PERF_MAX_SIZES; tok = strtok_r(NULL, ",", &save)){
+		sizes[n] = strtoull(tok, NULL, 10);
+		if (sizes[n] == 0){
+			printf("ERROR: Invalid size: %s\n", tok);
+			exit(1);
+		}
+		n++;
+	}
+	return n;
+}
+
+int main(int argc, char **argv){
+	perf_config_t config;
+	const perf_bench_t *bench = &benches[0];
+	char *sizes = NULL;
+	unsigned int i;
+	int c;
+	static struct option longopts[] = {
+		{"bench", required_argument, 0, 'b'},
+		{"sizes", required_argument, 0, 'n'},
+		{"lookups", required_argument, 0, 'l'},
+		{"rules-out", required_argument, 0, 'o'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	memset(&config, 0, sizeof(config));
+	while ((c = getopt_long(argc, argv, "b:n:l:o:h", longopts, NULL)) != -1){
+		switch (c){
+			case 'b':
+				bench = NULL;
+				for (i = 0; i < NUM_BENCHES; i++){
+					if (strcmp(benches[i].name, optarg) == 0){
+						bench = &benches[i];
+					}
+				}
+				if (bench == NULL){
+					printf("ERROR: Unknown benchmark: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'n':
+				sizes = optarg;
+				break;
+			case 'l':
+				config.lookups = strtoull(optarg, NULL, 10);
+				if (config.lookups == 0){
+					printf("ERROR: Lookups must be at least 1\n");
+					exit(1);
+				}
+				break;
+			case 'o':
+				config.rules_out = optarg;
+				break;
+			case 'h':
+			default:
+				printf("Command line arguments: \n");
+				printf("-b, --bench     Benchmark to run: \n");
+				for (i = 0; i < NUM_BENCHES; i++){
+					printf("                %-8s %s (default sizes %s)\n", benches[i].name, benches[i].help, benches[i].sizes);
+				}
+				printf("-n, --sizes     Comma separated table sizes \n");
+				printf("-l, --lookups   Lookups timed per size (default per benchmark) \n");
+				printf("-o, --rules-out Write the generated ACL rules to <file>.<size> \n");
+				exit(1);
+		}
+	}
+	config.nsizes = parse_sizes((sizes != NULL) ? sizes : (char *)bench->sizes, config.sizes);
+	if (config.lookups == 0){
+		config.lookups = bench->lookups;
+	}
+	for (i = 0; i < config.nsizes; i++){
+		bench->run(&config, config.sizes[i]);
+	}
+	return 0;
+}
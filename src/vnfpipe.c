@@ -0,0 +1,290 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*! Batch packet processing pipeline
+ *
+ * RX sources hand frames over as batches of descriptors that still point
+ * into the RX ring. Every stage of the pipeline walks the whole batch
+ * before the next one runs, so a stage costs one call per batch and its
+ * code and tables stay hot. Stages set a verdict per frame, dropped frames
+ * are removed between stages and the survivors are forwarded to the peer
+ * port or redirected to the port a stage picked.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+//
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+//
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnfpipe.h"
+#include "vnfflow.h"
+#include "vnfacl.h"
+#include "vnfparse.h"
+#include "vnfmac.h"
+#include "vnfqos.h"
+#include "vnfcap.h"
+
+/*
+* Bump in the wire, every frame goes out of the peer port untouched
+*/
+static unsigned int bitw_stage(pipe_stage_t *stage, pkt_batch_t *batch){
+	return 0;
+}
+
+static const char * const flow_counters[] = {"hits", "misses", "evictions", "full", NULL};
+static const char * const acl_counters[] = {"matched", "unmatched", "redirects", NULL};
+static const char * const mac_counters[] = {"learned", "moved", "evicted", "limited", "known", "filtered", "flooded", NULL};
+static const char * const qos_counters[] = {"conformed", "policed", "shaped", "queue_full", "released", "oversize", NULL};
+static const char * const cap_counters[] = {"captured", "skipped", "capture_drops", NULL};
+
+static const stage_def_t stage_defs[] = {
+	{"bitw", "forward every frame to the peer port", NULL, bitw_stage, NULL, NULL, false},
+	{"parse", "fill in VLAN, L3 and L4 metadata", parse_stage_init, parse_stage, parse_stage_print, NULL, false},
+	{"flow", "reuse the verdict of the first frame of a flow (--flows)", flow_stage_init, flow_stage, flow_stage_print, flow_counters, true},
+	{"acl", "permit, deny or redirect frames by rule (--acl)", acl_stage_init, acl_stage, acl_stage_print, acl_counters, true},
+	{"bridge", "learn MAC addresses and forward to their port (--mac-table)", mac_stage_init, mac_stage, mac_stage_print, mac_counters, true},
+	{"qos", "police and shape by input port and DSCP (--qos)", qos_stage_init, qos_stage, qos_stage_print, qos_counters, true, qos_stage_poll},
+	{"capture", "copy frames to rotating pcap files in the background (--capture)", cap_stage_init, cap_stage, cap_stage_print, cap_counters, true},
+};
+
+#define NUM_STAGE_DEFS (sizeof(stage_defs) / sizeof(stage_defs[0]))
+
+static const stage_def_t *find_stage(char *name){
+	unsigned int i;
+
+	for (i = 0; i < NUM_STAGE_DEFS; i++){
+		if (strcmp(stage_defs[i].name, name) == 0){
+			return &stage_defs[i];
+		}
+	}
+	return NULL;
+}
+/*
+* Check every stage of a comma separated list exists and comes after the
+* stages it depends on
+*/
+bool pipeline_valid(char *spec){
+	char buf[PIPELINE_SIZE];
+	char *name, *save;
+	const stage_def_t *def;
+	unsigned int nstages = 0;
+	bool parsed = false, classified = false;
+
+	strncpy(buf, spec, PIPELINE_SIZE-1);
+	buf[PIPELINE_SIZE-1] = '\0';
+	for (name = strtok_r(buf, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)){
+		def = find_stage(name);
+		if (def == NULL){
+			printf("ERROR: Unknown pipeline stage: %s\n", name);
+			return false;
+		}
+		if (def->needs_parse && !parsed){
+			printf("ERROR: Pipeline stage: %s needs parse before it\n", name);
+			return false;
+		}
+		/*
+		* A flow entry takes the verdict of the classifiers after it
+		*/
+		if (def->process == flow_stage && classified){
+			printf("ERROR: Pipeline stage: %s has to come before acl and bridge\n", name);
+			return false;
+		}
+		parsed |= (def->process == parse_stage);
+		classified |= (def->process == acl_stage || def->process == mac_stage);
+		nstages++;
+	}
+	if (nstages == 0 || nstages > PIPE_MAX_STAGES){
+		printf("ERROR: Pipeline needs between 1 and %d stages\n", PIPE_MAX_STAGES);
+		return false;
+	}
+	return true;
+}
+
+void pipeline_help(void){
+	unsigned int i;
+
+	for (i = 0; i < NUM_STAGE_DEFS; i++){
+		printf("                %-8s %s\n", stage_defs[i].name, stage_defs[i].help);
+	}
+}
+/*
+* Build the pipeline of a worker, the spec must have passed pipeline_valid
+*/
+pipeline_t *pipeline_create(char *spec, arg_config_t *arg_config, unsigned int worker){
+	pipeline_t *pipe;
+	pipe_stage_t *stage;
+	const stage_def_t *def;
+	char buf[PIPELINE_SIZE];
+	char *name, *save;
+
+	if (posix_memalign((void **)&pipe, CACHE_LINE_SIZE, sizeof(pipeline_t)) != 0){
+		perror("posix_memalign pipeline");
+		exit(-1);
+	}
+	memset(pipe, 0, sizeof(pipeline_t));
+	strncpy(buf, spec, PIPELINE_SIZE-1);
+	buf[PIPELINE_SIZE-1] = '\0';
+	for (name = strtok_r(buf, ",", &save); name != NULL && pipe->nstages < PIPE_MAX_STAGES; name = strtok_r(NULL, ",", &save)){
+		def = find_stage(name);
+		if (def == NULL){
+			printf("ERROR: Unknown pipeline stage: %s\n", name);
+			exit(-1);
+		}
+		stage = &pipe->stages[pipe->nstages++];
+		stage->name = def->name;
+		stage->process = def->process;
+		stage->print = def->print;
+		stage->poll = def->poll;
+		stage->due_ns = UINT64_MAX;
+		stage->counter_names = def->counter_names;
+		pipe->has_poll |= (def->poll != NULL);
+		if (def->init != NULL && def->init(stage, arg_config, worker) == -1){
+			printf("ERROR: Setting up pipeline stage: %s\n", name);
+			exit(-1);
+		}
+	}
+	return pipe;
+}
+/*
+* Ports are numbered in the order they are added, redirects use the number.
+* Until told otherwise ports forward in pairs, 0 to 1 and 1 to 0 and so on,
+* a port without a partner sends frames back out.
+*/
+void pipeline_add_port(pipeline_t *pipe, intf_config_t *config){
+	unsigned int port = pipe->nports;
+
+	if (port == PIPE_MAX_PORTS){
+		printf("ERROR: Pipeline supports at most %d ports\n", PIPE_MAX_PORTS);
+		exit(-1);
+	}
+	config->pipe = pipe;
+	config->port = port;
+	pipe->ports[port] = config;
+	pipe->peer[port] = port;
+	if (port & 1){
+		pipe->peer[port] = port - 1;
+		pipe->peer[port - 1] = port;
+	}
+	pipe->nports++;
+}
+
+void pipeline_set_peer(pipeline_t *pipe, unsigned int port, unsigned int peer){
+	if (port >= pipe->nports || peer >= pipe->nports){
+		printf("ERROR: Pipeline has no port: %u\n", MAX(port, peer));
+		exit(-1);
+	}
+	pipe->peer[port] = peer;
+}
+/*
+* Squeeze dropped and held frames out of a batch, the order of the rest
+* is kept
+*/
+static void pipe_compact(pkt_batch_t *batch){
+	unsigned int i, j = 0;
+
+	for (i = 0; i < batch->count; i++){
+		if (batch->pkts[i].verdict == VERDICT_DROP || batch->pkts[i].verdict == VERDICT_HELD){
+			continue;
+		}
+		if (i != j){
+			batch->pkts[j] = batch->pkts[i];
+			pkt_meta_move(&batch->meta, j, i);
+		}
+		j++;
+	}
+	batch->count = j;
+	batch->held = 0;
+}
+/*
+* Run the stages from first on over a batch, stops early once nothing is
+* left
+*/
+static void pipe_run_from(pipeline_t *pipe, pkt_batch_t *batch, unsigned int first){
+	pipe_stage_t *stage;
+	unsigned int s, dropped;
+
+	for (s = first; s < pipe->nstages && batch->count > 0; s++){
+		stage = &pipe->stages[s];
+		stage->packets += batch->count;
+		dropped = stage->process(stage, batch);
+		stage->drops += dropped;
+		if (dropped > 0 || batch->held > 0){
+			pipe_compact(batch);
+		}
+	}
+}
+
+void pipeline_run(pipeline_t *pipe, pkt_batch_t *batch){
+	pipe_run_from(pipe, batch, 0);
+}
+/*
+* Frames a stage held come back without metadata, the parse stage before
+* first fills it in again, uncounted, and the stages from first on run
+*/
+void pipeline_resume(pipeline_t *pipe, pkt_batch_t *batch, unsigned int first){
+	pipe_stage_t *stage;
+	unsigned int s;
+
+	if (first >= pipe->nstages || batch->count == 0){
+		return;
+	}
+	for (s = first; s-- > 0;){
+		stage = &pipe->stages[s];
+		if (stage->process == parse_stage){
+			stage->process(stage, batch);
+			break;
+		}
+	}
+	pipe_run_from(pipe, batch, first);
+}
+/*
+* Earliest time a stage holding frames wants to be polled
+*/
+uint64_t pipeline_due(pipeline_t *pipe){
+	uint64_t due = UINT64_MAX;
+	unsigned int s;
+
+	for (s = 0; s < pipe->nstages; s++){
+		due = MIN(due, pipe->stages[s].due_ns);
+	}
+	return due;
+}
+
+void print_pipeline_stats(pipeline_t *pipe){
+	pipe_stage_t *stage;
+	unsigned int s, c;
+
+	printf("\n---- Pipeline ----\n");
+	for (s = 0; s < pipe->nstages; s++){
+		stage = &pipe->stages[s];
+		printf("%s: packets: %lu, drops: %lu", stage->name, stage->packets, stage->drops);
+		for (c = 0; stage->counter_names != NULL && stage->counter_names[c] != NULL; c++){
+			printf(", %s: %lu", stage->counter_names[c], stage->counters[c]);
+		}
+		printf("\n");
+		if (stage->print != NULL){
+			stage->print(stage);
+		}
+	}
+	if (pipe->bad_redirects > 0){
+		printf("Redirects to a missing port: %lu\n", pipe->bad_redirects);
+	}
+}
@@ -0,0 +1,924 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*! QoS policing and shaping
+ *
+ * Frames are held to token buckets picked by their input port and DSCP.
+ * A port bucket takes every frame that comes in on the port, a class
+ * bucket the frames of a DSCP range and sits below the port bucket, so
+ * a frame of a class has to conform to both. A policing bucket drops
+ * what does not conform. A shaping bucket holds it back instead: the
+ * frame is copied into the byte ring of its class and sent once the
+ * tokens are there, in arrival order, or dropped when the ring is full.
+ * Queues waiting for tokens sit on a hierarchical timer wheel and the
+ * loop polls the stage when the first of them is due.
+ *
+ * Every worker has its own buckets and gets an equal share of each rate,
+ * with PACKET_FANOUT spreading flows evenly the total stays close to the
+ * configured rate. Bursts are not divided.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <ctype.h>
+
+#include <linux/if_ether.h>
+#include <linux/virtio_net.h>
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnfpipe.h"
+#include "vnfqos.h"
+
+/*
+* Rules are read once and every worker builds its buckets from them
+*/
+static qos_rule_t *qos_rules;
+static unsigned int qos_nrules;
+static unsigned int qos_workers;
+
+/*
+* A number with an optional k, m or g suffix, in steps of scale
+*/
+static int parse_scaled(char *str, uint64_t scale, uint64_t max, uint64_t *value){
+	unsigned long long v;
+	uint64_t mult = 1;
+	char *end;
+
+	if (!isdigit((unsigned char)*str)){
+		return -1;
+	}
+	errno = 0;
+	v = strtoull(str, &end, 10);
+	if (errno != 0){
+		return -1;
+	}
+	switch (*end){
+		case 'k':
+		case 'K':
+			mult = scale;
+			end++;
+			break;
+		case 'm':
+		case 'M':
+			mult = scale * scale;
+			end++;
+			break;
+		case 'g':
+		case 'G':
+			mult = scale * scale * scale;
+			end++;
+			break;
+	}
+	if (*end != '\0' || v > max / mult){
+		return -1;
+	}
+	*value = v * mult;
+	return 0;
+}
+
+static int parse_dscp(char *str, qos_rule_t *rule){
+	char *end;
+	unsigned long lo, hi;
+
+	lo = strtoul(str, &end, 10);
+	hi = lo;
+	if (*end == '-'){
+		hi = strtoul(end + 1, &end, 10);
+	}
+	if (end == str || *end != '\0' || lo > hi || hi >= QOS_DSCPS){
+		printf("ERROR: Invalid DSCP range: %s\n", str);
+		return -1;
+	}
+	rule->dscp_lo = lo;
+	rule->dscp_hi = hi;
+	return 0;
+}
+
+static int parse_port(char *str, qos_rule_t *rule){
+	char *end;
+	unsigned long v;
+
+	v = strtoul(str, &end, 10);
+	if (end == str || *end != '\0' || v >= PIPE_MAX_PORTS){
+		printf("ERROR: Invalid port: %s\n", str);
+		return -1;
+	}
+	rule->port = v;
+	return 0;
+}
+/*
+* Parse one line of a rule file, 1 for blank lines and comments
+*/
+int qos_parse_rule(char *line, qos_rule_t *rule){
+	char *tok, *arg, *save, *end;
+
+	memset(rule, 0, sizeof(*rule));
+	rule->port = PORT_NONE;
+	if ((end = strchr(line, '#')) != NULL){
+		*end = '\0';
+	}
+	tok = strtok_r(line, " \t\r\n", &save);
+	if (tok == NULL){
+		return 1;
+	}
+	arg = strtok_r(NULL, " \t\r\n", &save);
+	if (arg == NULL){
+		printf("ERROR: %s needs a value\n", tok);
+		return -1;
+	}
+	if (strcmp(tok, "port") == 0){
+		if (parse_port(arg, rule) == -1){
+			return -1;
+		}
+	} else if (strcmp(tok, "dscp") == 0){
+		if (parse_dscp(arg, rule) == -1){
+			return -1;
+		}
+		rule->is_class = true;
+	} else {
+		printf("ERROR: Unknown rule: %s\n", tok);
+		return -1;
+	}
+	while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL){
+		if (strcmp(tok, "shape") == 0){
+			rule->shape = true;
+			continue;
+		}
+		arg = strtok_r(NULL, " \t\r\n", &save);
+		if (arg == NULL){
+			printf("ERROR: %s needs a value\n", tok);
+			return -1;
+		}
+		if (strcmp(tok, "port") == 0 && rule->is_class){
+			if (parse_port(arg, rule) == -1){
+				return -1;
+			}
+		} else if (strcmp(tok, "rate") == 0){
+			if (parse_scaled(arg, 1000, QOS_MAX_RATE, &rule->rate) == -1 || rule->rate < 8){
+				printf("ERROR: Invalid rate: %s\n", arg);
+				return -1;
+			}
+		} else if (strcmp(tok, "burst") == 0){
+			if (parse_scaled(arg, 1024, QOS_MAX_BURST, &rule->burst) == -1 || rule->burst < QOS_MIN_BURST){
+				printf("ERROR: Invalid burst: %s, between %u and %lu bytes\n", arg, QOS_MIN_BURST, QOS_MAX_BURST);
+				return -1;
+			}
+		} else if (strcmp(tok, "queue") == 0){
+			if (parse_scaled(arg, 1024, QOS_MAX_QUEUE, &rule->queue) == -1 || rule->queue < QOS_MIN_BURST){
+				printf("ERROR: Invalid queue: %s, between %u and %lu bytes\n", arg, QOS_MIN_BURST, QOS_MAX_QUEUE);
+				return -1;
+			}
+		} else {
+			printf("ERROR: Unknown option: %s\n", tok);
+			return -1;
+		}
+	}
+	if (rule->rate == 0){
+		printf("ERROR: Rule needs a rate\n");
+		return -1;
+	}
+	if (rule->queue != 0 && !rule->shape){
+		printf("ERROR: Only a shaping rule has a queue\n");
+		return -1;
+	}
+	if (rule->burst == 0){
+		rule->burst = MAX(rule->rate / 8 / 1000, QOS_DEFAULT_BURST);
+		rule->burst = MIN(rule->burst, QOS_MAX_BURST);
+	}
+	if (rule->shape && rule->queue == 0){
+		rule->queue = QOS_DEFAULT_QUEUE;
+	}
+	return 0;
+}
+/*
+* Read a rule file, returns the number of rules
+*/
+int qos_load(char *path, qos_rule_t *rules, unsigned int max_rules){
+	char line[QOS_LINE_SIZE];
+	unsigned int lineno = 0, n = 0;
+	int status;
+	FILE *in;
+
+	in = fopen(path, "r");
+	if (in == NULL){
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), in) != NULL){
+		lineno++;
+		if (n == max_rules){
+			printf("ERROR: %s has more than %u rules\n", path, max_rules);
+			fclose(in);
+			return -1;
+		}
+		status = qos_parse_rule(line, &rules[n]);
+		if (status == 1){
+			continue;
+		}
+		if (status == -1){
+			printf("ERROR: %s line %u\n", path, lineno);
+			fclose(in);
+			return -1;
+		}
+		n++;
+	}
+	fclose(in);
+	if (n == 0){
+		printf("ERROR: %s has no rules\n", path);
+		return -1;
+	}
+	return n;
+}
+
+static unsigned int qos_add_bucket(qos_t *qos, const qos_rule_t *rule, unsigned int port, unsigned int parent, unsigned int workers){
+	qos_bucket_t *bucket = &qos->buckets[qos->nbuckets];
+
+	bucket->rate = MAX(rule->rate / 8 / workers, 1);
+	bucket->depth = rule->burst * QOS_NS;
+	bucket->tokens = bucket->depth;
+	bucket->fill_ns = bucket->depth / bucket->rate;
+	bucket->parent = parent;
+	bucket->port = port;
+	bucket->shape = rule->shape;
+	bucket->rule = rule;
+	return qos->nbuckets++;
+}
+/*
+* The leaf bucket and the port bucket above it, returns how many
+*/
+static inline unsigned int qos_chain(qos_t *qos, unsigned int leaf, qos_bucket_t **chain){
+	chain[0] = &qos->buckets[leaf];
+	if (chain[0]->parent == 0){
+		return 1;
+	}
+	chain[1] = &qos->buckets[chain[0]->parent];
+	return 2;
+}
+
+static int qos_add_queue(qos_t *qos, unsigned int leaf){
+	qos_bucket_t *chain[2];
+	qos_queue_t *queue;
+	uint64_t size = 0;
+	unsigned int i, n;
+
+	n = qos_chain(qos, leaf, chain);
+	for (i = 0; i < n; i++){
+		if (chain[i]->shape){
+			size = MAX(size, chain[i]->rule->queue);
+		}
+	}
+	if (size == 0){
+		return 0;
+	}
+	if (posix_memalign((void **)&queue, CACHE_LINE_SIZE, sizeof(qos_queue_t)) != 0){
+		perror("posix_memalign qos queue");
+		return -1;
+	}
+	memset(queue, 0, sizeof(*queue));
+	queue->size = (size + QOS_ENTRY_ALIGN - 1) & ~(uint64_t)(QOS_ENTRY_ALIGN - 1);
+	/*
+	* Only the part of the ring that is ever filled gets backed by memory
+	*/
+	if (posix_memalign((void **)&queue->buf, QOS_ENTRY_ALIGN, queue->size) != 0){
+		perror("posix_memalign qos queue");
+		free(queue);
+		return -1;
+	}
+	queue->leaf = leaf;
+	qos->queues[leaf] = queue;
+	return 0;
+}
+/*
+* Build the buckets of a worker. A DSCP goes to the first class rule of
+* its port that covers it, the port bucket takes the rest.
+*/
+int qos_init(qos_t *qos, const qos_rule_t *rules, unsigned int nrules, unsigned int workers){
+	uint16_t port_bucket[PIPE_MAX_PORTS];
+	bool claimed[PIPE_MAX_PORTS][QOS_DSCPS];
+	const qos_rule_t *rule;
+	unsigned int r, p, d, b, max_buckets = 1;
+
+	memset(qos, 0, sizeof(*qos));
+	memset(port_bucket, 0, sizeof(port_bucket));
+	memset(claimed, 0, sizeof(claimed));
+	for (r = 0; r < nrules; r++){
+		max_buckets += (rules[r].port == PORT_NONE) ? PIPE_MAX_PORTS : 1;
+	}
+	qos->buckets = calloc(max_buckets, sizeof(qos_bucket_t));
+	qos->queues = calloc(max_buckets, sizeof(qos_queue_t *));
+	if (qos->buckets == NULL || qos->queues == NULL){
+		perror("calloc qos buckets");
+		qos_free(qos);
+		return -1;
+	}
+	qos->nbuckets = 1;
+	for (r = 0; r < nrules; r++){
+		rule = &rules[r];
+		if (rule->is_class){
+			continue;
+		}
+		if (port_bucket[rule->port] != 0){
+			printf("ERROR: QoS port %u has more than one port rule\n", rule->port);
+			qos_free(qos);
+			return -1;
+		}
+		b = qos_add_bucket(qos, rule, rule->port, 0, workers);
+		port_bucket[rule->port] = b;
+		for (d = 0; d < QOS_DSCPS; d++){
+			qos->leaf[rule->port][d] = b;
+		}
+	}
+	for (r = 0; r < nrules; r++){
+		rule = &rules[r];
+		if (!rule->is_class){
+			continue;
+		}
+		for (p = 0; p < PIPE_MAX_PORTS; p++){
+			if (rule->port != PORT_NONE && rule->port != p){
+				continue;
+			}
+			b = qos_add_bucket(qos, rule, p, port_bucket[p], workers);
+			for (d = rule->dscp_lo; d <= rule->dscp_hi; d++){
+				if (!claimed[p][d]){
+					claimed[p][d] = true;
+					qos->leaf[p][d] = b;
+				}
+			}
+		}
+	}
+	for (p = 0; p < PIPE_MAX_PORTS; p++){
+		for (d = 0; d < QOS_DSCPS; d++){
+			b = qos->leaf[p][d];
+			if (b != 0 && qos->queues[b] == NULL && qos_add_queue(qos, b) == -1){
+				qos_free(qos);
+				return -1;
+			}
+		}
+	}
+	qos->wheel.next = UINT64_MAX;
+	return 0;
+}
+
+void qos_free(qos_t *qos){
+	unsigned int b;
+
+	if (qos->queues != NULL){
+		for (b = 0; b < qos->nbuckets; b++){
+			if (qos->queues[b] != NULL){
+				free(qos->queues[b]->buf);
+				free(qos->queues[b]);
+			}
+		}
+	}
+	free(qos->queues);
+	free(qos->buckets);
+	qos->queues = NULL;
+	qos->buckets = NULL;
+	qos->nbuckets = 0;
+}
+
+static inline void qos_refill(qos_bucket_t *bucket, uint64_t now){
+	uint64_t elapsed;
+
+	if (now <= bucket->last_ns){
+		return;
+	}
+	elapsed = now - bucket->last_ns;
+	bucket->last_ns = now;
+	if (elapsed >= bucket->fill_ns){
+		bucket->tokens = bucket->depth;
+	} else {
+		bucket->tokens = MIN(bucket->depth, bucket->tokens + elapsed * bucket->rate);
+	}
+}
+/*
+* True when every policer of the chain has the tokens for a frame
+*/
+static inline bool qos_police(qos_bucket_t **chain, unsigned int n, uint64_t cost, uint64_t now){
+	unsigned int i;
+
+	for (i = 0; i < n; i++){
+		if (chain[i]->shape){
+			continue;
+		}
+		qos_refill(chain[i], now);
+		if (chain[i]->tokens < cost){
+			chain[i]->exceeded++;
+			return false;
+		}
+	}
+	return true;
+}
+/*
+* How long until every shaper of the chain has the tokens for a frame,
+* 0 when they have them now
+*/
+static inline uint64_t qos_wait(qos_bucket_t **chain, unsigned int n, uint64_t cost, uint64_t now){
+	uint64_t wait = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++){
+		if (!chain[i]->shape){
+			continue;
+		}
+		qos_refill(chain[i], now);
+		if (chain[i]->tokens < cost){
+			chain[i]->exceeded++;
+			wait = MAX(wait, (cost - chain[i]->tokens + chain[i]->rate - 1) / chain[i]->rate);
+		}
+	}
+	return wait;
+}
+
+static inline void qos_take(qos_bucket_t **chain, unsigned int n, uint64_t cost, bool policers, bool shapers){
+	unsigned int i;
+
+	for (i = 0; i < n; i++){
+		if (chain[i]->shape ? shapers : policers){
+			chain[i]->tokens -= cost;
+			chain[i]->passed++;
+		}
+	}
+}
+/*
+* DSCP of an IPv4 or IPv6 frame, other frames count as 0
+*/
+static inline unsigned int qos_dscp(pkt_batch_t *batch, unsigned int i){
+	uint8_t *l3;
+
+	if (batch->meta.l3_offset[i] == 0){
+		return 0;
+	}
+	l3 = batch->pkts[i].data + batch->meta.l3_offset[i];
+	if (batch->meta.ethertype[i] == ETH_P_IP){
+		return l3[1] >> 2;
+	}
+	return ((l3[0] & 0x0f) << 2) | (l3[1] >> 6);
+}
+
+static inline uint64_t qos_align(uint64_t n){
+	return (n + QOS_ENTRY_ALIGN - 1) & ~(uint64_t)(QOS_ENTRY_ALIGN - 1);
+}
+/*
+* Room for need bytes at the tail of a queue, wrapping to the start when
+* the end is too short. NULL when the queue is full.
+*/
+static qos_entry_t *qos_queue_reserve(qos_queue_t *queue, uint64_t need){
+	uint64_t at;
+
+	if (queue->used == 0){
+		queue->head = 0;
+		queue->out = 0;
+		queue->tail = 0;
+	}
+	if (queue->tail > queue->head || queue->used == 0){
+		if (queue->size - queue->tail >= need){
+			at = queue->tail;
+		} else if (queue->head >= need){
+			((qos_entry_t *)(queue->buf + queue->tail))->len = 0;
+			queue->used += queue->size - queue->tail;
+			at = 0;
+		} else {
+			return NULL;
+		}
+	} else if (queue->tail < queue->head && queue->head - queue->tail >= need){
+		at = queue->tail;
+	} else {
+		return NULL;
+	}
+	queue->tail = at + need;
+	if (queue->tail == queue->size){
+		queue->tail = 0;
+	}
+	queue->used += need;
+	return (qos_entry_t *)(queue->buf + at);
+}
+
+static bool qos_queue_push(qos_queue_t *queue, pkt_desc_t *pkt){
+	uint64_t need = QOS_ENTRY_ALIGN + qos_align(pkt->len);
+	qos_entry_t *entry;
+	uint8_t *data;
+
+	entry = qos_queue_reserve(queue, need);
+	if (entry == NULL){
+		return false;
+	}
+	entry->rx_ns = pkt->rx_ns;
+	entry->len = pkt->len;
+	entry->size = need;
+	entry->verdict = pkt->verdict;
+	entry->in_port = pkt->in_port;
+	entry->out_port = pkt->out_port;
+	entry->vnet = (pkt->vnet != NULL);
+	data = (uint8_t *)entry + QOS_ENTRY_ALIGN;
+	if (pkt->vnet != NULL){
+		memcpy(data - sizeof(struct virtio_net_hdr), pkt->vnet, sizeof(struct virtio_net_hdr));
+	}
+	memcpy(data, pkt->data, pkt->len);
+	queue->pending++;
+	return true;
+}
+/*
+* The oldest pending entry, past the end marker when there is one
+*/
+static inline qos_entry_t *qos_queue_peek(qos_queue_t *queue){
+	qos_entry_t *entry = (qos_entry_t *)(queue->buf + queue->out);
+
+	if (entry->len == 0){
+		queue->out = 0;
+		entry = (qos_entry_t *)queue->buf;
+	}
+	return entry;
+}
+/*
+* Free the entries handed out by the last poll
+*/
+static void qos_queue_release(qos_queue_t *queue){
+	qos_entry_t *entry;
+
+	while (queue->handed > 0){
+		entry = (qos_entry_t *)(queue->buf + queue->head);
+		if (entry->len == 0){
+			queue->used -= queue->size - queue->head;
+			queue->head = 0;
+			continue;
+		}
+		queue->used -= entry->size;
+		queue->head += entry->size;
+		if (queue->head == queue->size){
+			queue->head = 0;
+		}
+		queue->handed--;
+	}
+}
+
+static inline void qos_ready_push(qos_t *qos, qos_queue_t *queue){
+	queue->next = NULL;
+	queue->ready = true;
+	if (qos->ready_head == NULL){
+		qos->ready_head = queue;
+	} else {
+		qos->ready_tail->next = queue;
+	}
+	qos->ready_tail = queue;
+}
+
+static inline void qos_ready_pop(qos_t *qos){
+	qos_queue_t *queue = qos->ready_head;
+
+	qos->ready_head = queue->next;
+	queue->next = NULL;
+	queue->ready = false;
+}
+/*
+* File a queue on the level whose slots are fine enough for its tick, a
+* slot of a higher level is cascaded down when the wheel gets to it
+*/
+static void qos_wheel_add(qos_wheel_t *wheel, qos_queue_t *queue, uint64_t t){
+	qos_queue_t **slot;
+	unsigned int level = 0;
+	uint64_t delta, first;
+
+	t = MAX(t, wheel->tick);
+	delta = t - wheel->tick;
+	while (level < QOS_WHEEL_LEVELS - 1 && delta >= (1ULL << (QOS_WHEEL_BITS * (level + 1)))){
+		level++;
+	}
+	if (delta >= (1ULL << (QOS_WHEEL_BITS * QOS_WHEEL_LEVELS))){
+		t = wheel->tick + (1ULL << (QOS_WHEEL_BITS * QOS_WHEEL_LEVELS)) - 1;
+	}
+	queue->due_tick = t;
+	slot = &wheel->slots[level][(t >> (QOS_WHEEL_BITS * level)) & (QOS_WHEEL_SLOTS - 1)];
+	queue->next = *slot;
+	*slot = queue;
+	first = (t >> (QOS_WHEEL_BITS * level)) << (QOS_WHEEL_BITS * level);
+	wheel->next = MIN(wheel->next, first);
+}
+/*
+* Wait for the tokens of the head of a queue that found none
+*/
+static void qos_arm(qos_t *qos, qos_queue_t *queue, uint64_t now, uint64_t wait){
+	qos_wheel_t *wheel = &qos->wheel;
+
+	if (wheel->armed == 0){
+		wheel->tick = MAX(wheel->tick, now >> QOS_TICK_SHIFT);
+	}
+	qos_wheel_add(wheel, queue, (now + wait) >> QOS_TICK_SHIFT);
+	queue->armed = true;
+	wheel->armed++;
+}
+/*
+* The first tick a slot of the wheel needs, a slot of a higher level is
+* due when it cascades
+*/
+static uint64_t qos_wheel_next(qos_wheel_t *wheel){
+	unsigned int level, j;
+	uint64_t base;
+
+	if (wheel->armed == 0){
+		return UINT64_MAX;
+	}
+	for (j = 0; j < QOS_WHEEL_SLOTS; j++){
+		if (wheel->slots[0][(wheel->tick + j) & (QOS_WHEEL_SLOTS - 1)] != NULL){
+			return wheel->tick + j;
+		}
+	}
+	for (level = 1; level < QOS_WHEEL_LEVELS; level++){
+		base = wheel->tick >> (QOS_WHEEL_BITS * level);
+		for (j = 1; j <= QOS_WHEEL_SLOTS; j++){
+			if (wheel->slots[level][(base + j) & (QOS_WHEEL_SLOTS - 1)] != NULL){
+				return (base + j) << (QOS_WHEEL_BITS * level);
+			}
+		}
+	}
+	return wheel->tick;
+}
+/*
+* Run the wheel up to and including tick target, queues whose tick came
+* go on the ready list
+*/
+static void qos_wheel_run(qos_t *qos, uint64_t target){
+	qos_wheel_t *wheel = &qos->wheel;
+	qos_queue_t *queue, *next;
+	unsigned int level;
+	uint64_t t;
+
+	while (wheel->tick <= target){
+		if (wheel->armed == 0){
+			wheel->tick = target + 1;
+			break;
+		}
+		t = wheel->tick;
+		for (level = QOS_WHEEL_LEVELS - 1; level > 0; level--){
+			if ((t & ((1ULL << (QOS_WHEEL_BITS * level)) - 1)) != 0){
+				continue;
+			}
+			queue = wheel->slots[level][(t >> (QOS_WHEEL_BITS * level)) & (QOS_WHEEL_SLOTS - 1)];
+			wheel->slots[level][(t >> (QOS_WHEEL_BITS * level)) & (QOS_WHEEL_SLOTS - 1)] = NULL;
+			for (; queue != NULL; queue = next){
+				next = queue->next;
+				qos_wheel_add(wheel, queue, queue->due_tick);
+			}
+		}
+		queue = wheel->slots[0][t & (QOS_WHEEL_SLOTS - 1)];
+		wheel->slots[0][t & (QOS_WHEEL_SLOTS - 1)] = NULL;
+		wheel->tick = t + 1;
+		for (; queue != NULL; queue = next){
+			next = queue->next;
+			queue->armed = false;
+			wheel->armed--;
+			qos_ready_push(qos, queue);
+		}
+	}
+	wheel->next = qos_wheel_next(wheel);
+}
+/*
+* Frames of an unlimited class pass untouched. A frame larger than the
+* burst of one of its buckets could never conform and is dropped. A
+* frame that a policer has no tokens for is dropped, the others pass the
+* policers and, when nothing of their class waits and the shapers have
+* the tokens, go on right away. The rest join the queue of their class.
+*/
+unsigned int qos_process(qos_t *qos, pkt_batch_t *batch, uint64_t now){
+	qos_bucket_t *chain[2];
+	qos_queue_t *queue;
+	pkt_desc_t *pkt;
+	uint64_t cost, wait = 0;
+	unsigned int i, c, n, leaf, dropped = 0;
+
+	for (i = 0; i < batch->count; i++){
+		pkt = &batch->pkts[i];
+		leaf = qos->leaf[pkt->in_port][qos_dscp(batch, i)];
+		if (leaf == 0){
+			continue;
+		}
+		n = qos_chain(qos, leaf, chain);
+		cost = (uint64_t)pkt->len * QOS_NS;
+		for (c = 0; c < n; c++){
+			if (cost > chain[c]->depth){
+				break;
+			}
+		}
+		if (c < n){
+			qos->oversize++;
+			pkt->verdict = VERDICT_DROP;
+			dropped++;
+			continue;
+		}
+		if (!qos_police(chain, n, cost, now)){
+			qos->policed++;
+			pkt->verdict = VERDICT_DROP;
+			dropped++;
+			continue;
+		}
+		queue = qos->queues[leaf];
+		if (queue == NULL){
+			qos_take(chain, n, cost, true, true);
+			qos->conformed++;
+			continue;
+		}
+		if (queue->pending == 0){
+			wait = qos_wait(chain, n, cost, now);
+			if (wait == 0){
+				qos_take(chain, n, cost, true, true);
+				qos->conformed++;
+				continue;
+			}
+		}
+		if (!qos_queue_push(queue, pkt)){
+			qos->queue_full++;
+			pkt->verdict = VERDICT_DROP;
+			dropped++;
+			continue;
+		}
+		qos_take(chain, n, cost, true, false);
+		pkt->verdict = VERDICT_HELD;
+		batch->held++;
+		qos->shaped++;
+		if (queue->pending == 1){
+			qos_arm(qos, queue, now, wait);
+		}
+	}
+	return dropped;
+}
+/*
+* Ready queues take turns a frame at a time, a queue whose head still
+* lacks tokens goes back on the wheel
+*/
+unsigned int qos_poll(qos_t *qos, pkt_batch_t *batch, uint64_t now){
+	qos_bucket_t *chain[2];
+	qos_queue_t *queue;
+	qos_entry_t *entry;
+	uint8_t *data;
+	uint64_t cost, wait;
+	unsigned int i, n, count = 0;
+
+	for (i = 0; i < qos->nsent; i++){
+		qos_queue_release(qos->sent[i]);
+	}
+	qos->nsent = 0;
+	qos_wheel_run(qos, now >> QOS_TICK_SHIFT);
+	while ((queue = qos->ready_head) != NULL && count < PIPE_BATCH){
+		n = qos_chain(qos, queue->leaf, chain);
+		entry = qos_queue_peek(queue);
+		cost = (uint64_t)entry->len * QOS_NS;
+		wait = qos_wait(chain, n, cost, now);
+		qos_ready_pop(qos);
+		if (wait > 0){
+			qos_arm(qos, queue, now, wait);
+			continue;
+		}
+		qos_take(chain, n, cost, false, true);
+		data = (uint8_t *)entry + QOS_ENTRY_ALIGN;
+		batch->pkts[count++] = (pkt_desc_t){
+			.data = data,
+			.rx_ns = entry->rx_ns,
+			.vnet = entry->vnet ? (struct virtio_net_hdr *)(data - sizeof(struct virtio_net_hdr)) : NULL,
+			.len = entry->len,
+			.verdict = entry->verdict,
+			.in_port = entry->in_port,
+			.out_port = entry->out_port,
+		};
+		queue->out += entry->size;
+		if (queue->out == queue->size){
+			queue->out = 0;
+		}
+		queue->pending--;
+		if (queue->handed++ == 0){
+			qos->sent[qos->nsent++] = queue;
+		}
+		qos->released++;
+		if (queue->pending > 0){
+			qos_ready_push(qos, queue);
+		}
+	}
+	if (qos->ready_head == NULL){
+		qos->ready_tail = NULL;
+	}
+	batch->count = count;
+	batch->held = 0;
+	return count;
+}
+
+uint64_t qos_due(qos_t *qos, uint64_t now){
+	if (qos->ready_head != NULL){
+		return now;
+	}
+	if (qos->wheel.armed == 0){
+		return UINT64_MAX;
+	}
+	return qos->wheel.next << QOS_TICK_SHIFT;
+}
+/*
+* Buckets that saw traffic, rates as configured
+*/
+void qos_print(qos_t *qos){
+	qos_bucket_t *bucket;
+	qos_queue_t *queue;
+	unsigned int b;
+
+	for (b = 1; b < qos->nbuckets; b++){
+		bucket = &qos->buckets[b];
+		if (bucket->passed == 0 && bucket->exceeded == 0){
+			continue;
+		}
+		printf("  port %u", bucket->port);
+		if (bucket->rule->is_class){
+			printf(" dscp %u-%u", bucket->rule->dscp_lo, bucket->rule->dscp_hi);
+		}
+		printf(": %s %.3f Mbps, burst %lu, passed: %lu, %s: %lu", bucket->shape ? "shape" : "police", bucket->rule->rate / 1e6,
+			bucket->rule->burst, bucket->passed, bucket->shape ? "delayed" : "exceeded", bucket->exceeded);
+		queue = qos->queues[b];
+		if (queue != NULL){
+			printf(", queued: %u", queue->pending);
+		}
+		printf("\n");
+	}
+}
+
+static inline uint64_t qos_now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int qos_stage_init(pipe_stage_t *stage, arg_config_t *arg_config, unsigned int worker){
+	qos_t *qos;
+	int n;
+
+	if (arg_config->qos_path[0] == '\0'){
+		printf("ERROR: The qos stage needs a rule file (--qos)\n");
+		return -1;
+	}
+	if (qos_rules == NULL){
+		qos_rules = calloc(QOS_MAX_RULES, sizeof(qos_rule_t));
+		if (qos_rules == NULL){
+			perror("calloc qos rules");
+			return -1;
+		}
+		n = qos_load(arg_config->qos_path, qos_rules, QOS_MAX_RULES);
+		if (n == -1){
+			free(qos_rules);
+			qos_rules = NULL;
+			return -1;
+		}
+		qos_nrules = n;
+		qos_workers = MAX(arg_config->workers, 1);
+		printf("QoS: %u rules, rates shared by %u workers\n", qos_nrules, qos_workers);
+	}
+	if (posix_memalign((void **)&qos, CACHE_LINE_SIZE, sizeof(qos_t)) != 0){
+		perror("posix_memalign qos stage");
+		return -1;
+	}
+	if (qos_init(qos, qos_rules, qos_nrules, qos_workers) == -1){
+		free(qos);
+		return -1;
+	}
+	stage->priv = qos;
+	/*
+	* Same order as the counter names in the stage table
+	*/
+	stage->counters = &qos->conformed;
+	return 0;
+}
+/*
+* One clock read per batch, the loop polls the stage once due_ns passed
+*/
+unsigned int qos_stage(pipe_stage_t *stage, pkt_batch_t *batch){
+	qos_t *qos = stage->priv;
+	uint64_t now = qos_now_ns();
+	unsigned int dropped;
+
+	dropped = qos_process(qos, batch, now);
+	stage->due_ns = qos_due(qos, now);
+	return dropped;
+}
+
+unsigned int qos_stage_poll(pipe_stage_t *stage, pkt_batch_t *batch, uint64_t now){
+	qos_t *qos = stage->priv;
+	unsigned int count;
+
+	count = qos_poll(qos, batch, now);
+	stage->due_ns = qos_due(qos, now);
+	return count;
+}
+
+void qos_stage_print(pipe_stage_t *stage){
+	qos_print(stage->priv);
+}
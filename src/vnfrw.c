@@ -17,10 +17,15 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
 //
 #include <arpa/inet.h>
 #include <linux/if_packet.h>
+#include <linux/virtio_net.h>
 //
 #include <sys/types.h>
 #include <sys/ioctl.h>
@@ -34,6 +39,12 @@
 #include <net/if.h>
 
 #include "vnfapp.h"
+#include "vnflat.h"
+#include "vnfpipe.h"
+#include "vnftune.h"
+#include "vnfcap.h"
+#include "vnfuring.h"
+#include "vnfstats.h"
 
 #define MAX_BUF 65536
 #define MAX_EVENTS 64
@@ -41,380 +52,1121 @@
 uint16_t display_ethernet(uint8_t *buf);
 uint16_t display_ip(uint8_t *buf);
 void display_icmp(uint8_t *buf);
+int resize_pmap(intf_config_t *config, unsigned long frames, unsigned long blocks);
+extern const io_backend_t ring_io;
 /*
-* Read and write packets between to RAW interfaces
+* TX frames are fixed size for both ring versions, only the frame header
+* differs. Without PACKET_TX_HAS_OFF the kernel expects the data straight
+* after the header.
 */
-void read_write_one(intf_config_t *config){
-	int ready;
-	int j;
-	int ep_fd;
-	struct epoll_event e_evf;
-	struct epoll_event evlist[1];
-	unsigned int ringr_offset = 0;
-	unsigned int ringw_offset = 0;
-	unsigned int data_start = 0;
-	unsigned int data_len = 0;
-	struct tpacket2_hdr *header_r, *header_w;
-	unsigned int len, sent_len;
-	uint8_t *cur_r, *cur_w;
-	size_t sendlen;
-	size_t remlen; 
-	uint8_t *curpos;
+static inline unsigned int tx_data_offset(intf_config_t *config){
+	if (config->tpacket_version == TPACKET_V3){
+		return TPACKET3_HDRLEN - sizeof(struct sockaddr_ll);
+	}
+	return TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+}
+
+/*
+* With PACKET_VNET_HDR every TX frame starts with the offload header
+*/
+static inline unsigned int tx_vnet_len(intf_config_t *config){
+	return config->vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
+}
+
+static inline volatile uint32_t *tx_status(intf_config_t *config, uint8_t *frame){
+	if (config->tpacket_version == TPACKET_V3){
+		return &((struct tpacket3_hdr *)frame)->tp_status;
+	}
+	return &((struct tpacket2_hdr *)frame)->tp_status;
+}
+
+static inline void tx_set_len(intf_config_t *config, uint8_t *frame, unsigned int len){
+	if (config->tpacket_version == TPACKET_V3){
+		struct tpacket3_hdr *h3 = (struct tpacket3_hdr *)frame;
+		h3->tp_next_offset = 0;
+		h3->tp_len = len;
+		h3->tp_snaplen = len;
+	} else {
+		((struct tpacket2_hdr *)frame)->tp_len = len;
+	}
+}
+static inline uint32_t tx_get_len(intf_config_t *config, uint8_t *frame){
+	if (config->tpacket_version == TPACKET_V3){
+		return ((struct tpacket3_hdr *)frame)->tp_len;
+	}
+	return ((struct tpacket2_hdr *)frame)->tp_len;
+}
+
+static inline uint64_t now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned int tx_ring_size(intf_config_t *config){
+	return config->max_ring_frames * config->max_ring_blocks;
+}
+/*
+* Frames stay queued on the ring and go out with the next kick, a
+* rejected frame is picked up by tx_reclaim()
+*/
+static inline bool tx_kick_retry(int error){
+	return error == EAGAIN || error == ENOBUFS || error == EINVAL || error == EMSGSIZE;
+}
+/*
+* With io_uring the kick is a send entry handed over with the next
+* submission. A kick the kernel has not taken yet covers the new frames
+* too. False when the submission queue is full.
+*/
+static bool tx_kick_queue(intf_config_t *config){
+	struct io_uring_sqe *sqe;
+
+	if (config->kick_queued && !uring_taken(config->uring, config->kick_index)){
+		return true;
+	}
+	sqe = uring_sqe(config->uring, &config->kick_index);
+	if (sqe == NULL){
+		return false;
+	}
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = config->fd;
+	sqe->msg_flags = MSG_DONTWAIT;
+	sqe->user_data = URING_DATA(URING_KICK, config->port);
+	config->kick_queued = true;
+	return true;
+}
+/*
+* Completion of a queued kick, on a retryable error the frames wait for
+* the next flush
+*/
+static void tx_kick_done(intf_config_t *config, int res){
+	if (res >= 0){
+		return;
+	}
+	if (tx_kick_retry(-res)){
+		config->stats->tx_kick_errors++;
+		config->tx_pending = MAX(config->tx_pending, 1);
+		return;
+	}
+	printf("Error writing to intf: %s, %s\n", config->name, strerror(-res));
+	exit(1);
+}
+/*
+* Poke kernel to send every frame marked TP_STATUS_SEND_REQUEST
+*/
+static void tx_kick(intf_config_t *config){
+	config->poll.kicks++;
+	if (config->uring == NULL || !tx_kick_queue(config)){
+		config->poll.syscalls++;
+		if (sendto(config->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1) {
+			if (tx_kick_retry(errno)) {
+				config->stats->tx_kick_errors++;
+				return;
+			}
+			perror("write to interface");
+			printf("Error writing to intf: %s, ringw_offset: %u, tx_pending: %u\n", config->name, config->ringw_offset, config->tx_pending);
+			exit(1);
+		}
+	}
+	config->tx_pending = 0;
+	if (config->lat.npending > 0){
+		lat_kick(&config->lat);
+	}
+}
+/*
+* Lazily walk the in flight frames from the oldest and hand completed
+* slots back to the writer. Without PACKET_LOSS the kernel stops at a
+* frame it rejects, so the frame is clamped to a valid length, stripped of
+* offloads, and queued again to keep the ring moving.
+*/
+static void tx_reclaim(intf_config_t *config){
+	uint8_t *cur_c;
+	volatile uint32_t *status_c;
+	uint32_t len;
+
+	while (config->tx_inflight > 0){
+		cur_c = config->w_ring + (config->ringc_offset * config->max_frame_size);
+		status_c = tx_status(config, cur_c);
+		if (*status_c == TP_STATUS_WRONG_FORMAT){
+			config->stats->tx_wrong_format++;
+			len = tx_get_len(config, cur_c);
+			if (config->vnet_hdr){
+				memset(cur_c + tx_data_offset(config), 0, sizeof(struct virtio_net_hdr));
+			}
+			tx_set_len(config, cur_c, MAX(MIN(len, config->mtu_size + tx_vnet_len(config)), ETH_ZLEN + tx_vnet_len(config)));
+			*status_c = TP_STATUS_SEND_REQUEST;
+			config->tx_pending++;
+			break;
+		}
+		if (*status_c != TP_STATUS_AVAILABLE){
+			break;
+		}
+		config->tx_inflight--;
+		config->ringc_offset = (config->ringc_offset + 1) & (tx_ring_size(config) - 1);
+	}
+}
+/*
+* Next free TX slot, or NULL when every slot is in flight
+*/
+static uint8_t *tx_slot(intf_config_t *config){
+	if (config->tx_inflight == tx_ring_size(config)){
+		tx_reclaim(config);
+		if (config->tx_inflight == tx_ring_size(config) && config->uring != NULL){
+			/*
+			* The kick may still sit in the submission queue
+			*/
+			config->poll.syscalls += MAX(uring_enter(config->uring, false, 0), 0);
+			tx_reclaim(config);
+		}
+		if (config->tx_inflight == tx_ring_size(config)){
+			config->stats->tx_ring_full++;
+			return NULL;
+		}
+	}
+	return config->w_ring + (config->ringw_offset * config->max_frame_size);
+}
+
+/*
+* rx_ns is the RX timestamp of the frame, 0 when latency is not measured.
+* The offload header goes along so the kernel or the NIC segments a GSO
+* packet and fills in a partial checksum, a frame without one gets an
+* empty header.
+*/
+static void tx_submit(intf_config_t *config, uint8_t *cur_w, const struct virtio_net_hdr *vnet, uint8_t *data, size_t len, uint64_t rx_ns){
+	uint8_t *tx_data = cur_w + tx_data_offset(config);
+
+	if (config->vnet_hdr){
+		if (vnet != NULL){
+			memcpy(tx_data, vnet, sizeof(*vnet));
+		} else {
+			memset(tx_data, 0, sizeof(*vnet));
+		}
+		tx_data += sizeof(*vnet);
+	}
+	tx_set_len(config, cur_w, len + tx_vnet_len(config));
+	memcpy(tx_data, data, len);
+	*tx_status(config, cur_w) = TP_STATUS_SEND_REQUEST;
+	config->ringw_offset = (config->ringw_offset + 1) & (tx_ring_size(config) - 1);
+	config->tx_inflight++;
+	config->tx_pending++;
+	config->stats->tx_packets++;
+	config->stats->tx_bytes += len;
+	if (rx_ns != 0 && config->latency != LATENCY_OFF){
+		lat_queue(&config->lat, rx_ns);
+	}
+	if (config->tx_pending >= config->tx_batch){
+		tx_kick(config);
+	}
+}
+/*
+* Move frames parked by the drop oldest policy onto the ring, a parked
+* frame is stored behind its offload header when the port has them
+*/
+static void tx_backlog_drain(intf_config_t *config){
+	tx_backlog_t *backlog = &config->backlog;
+	uint8_t *cur_w, *entry;
+
+	while (backlog->count > 0 && (cur_w = tx_slot(config)) != NULL){
+		entry = backlog->data + backlog->head * config->max_frame_size;
+		tx_submit(config, cur_w, config->vnet_hdr ? (struct virtio_net_hdr *)entry : NULL, entry + tx_vnet_len(config),
+			backlog->len[backlog->head], 0);
+		backlog->head = (backlog->head + 1) % TX_BACKLOG_FRAMES;
+		backlog->count--;
+	}
+}
+/*
+* Park a frame when the ring is full, the oldest parked frame is dropped
+* once the backlog is full
+*/
+static void tx_backlog_add(intf_config_t *config, const struct virtio_net_hdr *vnet, uint8_t *data, size_t len){
+	tx_backlog_t *backlog = &config->backlog;
+	uint8_t *entry;
+	unsigned int tail;
+
+	if (backlog->count == TX_BACKLOG_FRAMES){
+		backlog->head = (backlog->head + 1) % TX_BACKLOG_FRAMES;
+		backlog->count--;
+		config->stats->tx_drops++;
+	}
+	tail = (backlog->head + backlog->count) % TX_BACKLOG_FRAMES;
+	entry = backlog->data + tail * config->max_frame_size;
+	if (config->vnet_hdr){
+		if (vnet != NULL){
+			memcpy(entry, vnet, sizeof(*vnet));
+		} else {
+			memset(entry, 0, sizeof(*vnet));
+		}
+	}
+	memcpy(entry + tx_vnet_len(config), data, len);
+	backlog->len[tail] = len;
+	backlog->count++;
+}
+/*
+* Flush a partial batch, called when a RX burst ends
+*/
+static inline void tx_flush(intf_config_t *config){
+	if (config->backlog.count > 0) {
+		tx_backlog_drain(config);
+	}
+	if (config->tx_pending > 0) {
+		tx_kick(config);
+	}
+	tx_reclaim(config);
+}
+/*
+* Bounded wait for a TX slot, keeps poking the kernel while waiting
+*/
+static uint8_t *tx_wait_slot(intf_config_t *config){
+	uint64_t deadline = now_ns() + config->tx_wait_us * 1000ULL;
+	uint8_t *cur_w;
+
+	do {
+		tx_kick(config);
+		if (config->uring != NULL){
+			config->poll.syscalls += MAX(uring_enter(config->uring, false, 0), 0);
+		}
+		if ((cur_w = tx_slot(config)) != NULL){
+			return cur_w;
+		}
+	} while (now_ns() < deadline);
+	return NULL;
+}
+/*
+* Longest frame the kernel takes on the TX ring of config: it must fit in
+* a slot and within the MTU, plus a tag when the frame carries one. A GSO
+* packet is cut to the MTU by the kernel so only has to fit the slot.
+*/
+static inline size_t tx_max_len(intf_config_t *config, const struct virtio_net_hdr *vnet, uint8_t *data, size_t len){
+	size_t slot_len = config->max_frame_size - tx_data_offset(config) - tx_vnet_len(config);
+	size_t max_len = config->mtu_size;
+	uint16_t type;
+
+	if (config->vnet_hdr && vnet != NULL && vnet->gso_type != VIRTIO_NET_HDR_GSO_NONE){
+		return slot_len;
+	}
+	if (len > max_len && len >= ETH_HLEN){
+		type = ntohs(*(uint16_t *)(data + 2 * ETH_ALEN));
+		if (type == ETH_P_8021Q || type == ETH_P_8021AD){
+			max_len += VLAN_TAG_LEN;
+		}
+	}
+	return MIN(max_len, slot_len);
+}
+/*
+* Queue a packet on the TX ring of config, a frame too long for the slot
+* or the MTU is dropped and counted. The kernel is only poked once
+* tx_batch frames are queued. A full ring never blocks the caller beyond
+* tx_wait_us, the overload policy decides what is dropped.
+*/
+static void write_packet(intf_config_t *config, const struct virtio_net_hdr *vnet, uint8_t *data, size_t len, uint64_t rx_ns){
+	uint8_t *cur_w;
+
+	if (len > tx_max_len(config, vnet, data, len)){
+		config->stats->tx_oversize++;
+		return;
+	}
+	if (config->backlog.count > 0){
+		tx_backlog_drain(config);
+	}
+	cur_w = (config->backlog.count > 0) ? NULL : tx_slot(config);
 #ifdef DEBUG
-	uint8_t *buf;
-	uint16_t eth_proto;
-	uint16_t ip_proto;
+	printf("cur_w: %p, ringw_offset: %d, inflight: %u\n", cur_w, config->ringw_offset, config->tx_inflight);
 #endif
+	if (cur_w == NULL){
+		switch (config->tx_policy){
+			case TX_POLICY_DROP_OLDEST:
+				tx_backlog_add(config, vnet, data, len);
+				break;
+			case TX_POLICY_WAIT:
+				cur_w = tx_wait_slot(config);
+				if (cur_w == NULL){
+					config->stats->tx_drops++;
+				}
+				break;
+			default:
+				config->stats->tx_drops++;
+				break;
+		}
+	}
+	if (cur_w != NULL){
+		tx_submit(config, cur_w, vnet, data, len, rx_ns);
+	}
+}
+/*
+* Hand a frame to the writer of the peer, a call the compiler can inline
+* for the common ring to ring case
+*/
+static inline void io_write(intf_config_t *config, const struct virtio_net_hdr *vnet, uint8_t *data, size_t len, uint64_t rx_ns){
+	if (config->io == &ring_io){
+		write_packet(config, vnet, data, len, rx_ns);
+	} else {
+		config->io->write(config, vnet, data, len, rx_ns);
+	}
+}
+/*
+* Print TX engine counters for an interface
+*/
+void print_tx_stats(intf_config_t *config){
+	printf("\n---- TX: %s ----\n", config->name);
+	printf("Packets: %lu, drops: %lu, ring full: %lu, wrong format: %lu, kick errors: %lu, oversize: %lu\n",
+		config->stats->tx_packets, config->stats->tx_drops, config->stats->tx_ring_full,
+		config->stats->tx_wrong_format, config->stats->tx_kick_errors, config->stats->tx_oversize);
+}
+/*
+* Send the frames left in a batch, forwarded ones to the peer, redirected
+* ones to the port the stage picked and flooded ones to every other port
+*/
+void pipeline_output(pipeline_t *pipe, pkt_batch_t *batch, intf_config_t *w_config){
+	pkt_desc_t *pkt;
+	intf_config_t *out;
+	unsigned int i, p;
 
+	for (i = 0; i < batch->count; i++){
+		pkt = &batch->pkts[i];
+		out = w_config;
+		if (pkt->verdict == VERDICT_REDIRECT){
+			if (pkt->out_port >= pipe->nports){
+				pipe->bad_redirects++;
+				continue;
+			}
+			out = pipe->ports[pkt->out_port];
+		} else if (pkt->verdict == VERDICT_FLOOD){
+			for (p = 0; p < pipe->nports; p++){
+				if (p != pkt->in_port){
+					io_write(pipe->ports[p], pkt->vnet, pkt->data, pkt->len, pkt->rx_ns);
+				}
+			}
+			continue;
+		}
+		io_write(out, pkt->vnet, pkt->data, pkt->len, pkt->rx_ns);
+	}
+}
+/*
+* Push out what a batch queued on any port, called when a RX burst ends
+*/
+void pipeline_flush(pipeline_t *pipe){
+	unsigned int i;
 
-	memset(&ep_fd,0,sizeof(ep_fd));
-	ep_fd = epoll_create(1);
-	if ( ep_fd == -1){
-		perror("epoll_create");
-		printf("Error: epoll create failed %d\n", errno);
-		exit(1);
+	for (i = 0; i < pipe->nports; i++){
+		pipe->ports[i]->io->flush(pipe->ports[i]);
 	}
+}
+/*
+* Send the frames stages held back that are due by now. They go through
+* the stages after the one holding them first, forwarded ones go to the
+* peer of the port they came in on.
+*/
+void pipeline_poll(pipeline_t *pipe, uint64_t now){
+	pkt_batch_t *batch = &pipe->batch;
+	pipe_stage_t *stage;
+	pkt_desc_t *pkt;
+	unsigned int s, i;
 
-	memset(&e_evf,0,sizeof(e_evf));
-	e_evf.data.fd = config->fd;
-	e_evf.events = EPOLLIN;
-	if (epoll_ctl(ep_fd,EPOLL_CTL_ADD,config->fd, &e_evf) == -1){
-		perror("epoll_ctl");
-		printf("Error: epoll_ctl failed %d\n", errno);
-		exit(1);
+	for (s = 0; s < pipe->nstages; s++){
+		stage = &pipe->stages[s];
+		if (stage->due_ns > now){
+			continue;
+		}
+		while (stage->poll(stage, batch, now) > 0){
+			pipeline_resume(pipe, batch, s + 1);
+			for (i = 0; i < batch->count; i++){
+				pkt = &batch->pkts[i];
+				if (pkt->verdict == VERDICT_FORWARD){
+					pkt->verdict = VERDICT_REDIRECT;
+					pkt->out_port = pipe->peer[pkt->in_port];
+				}
+			}
+			pipeline_output(pipe, batch, NULL);
+		}
+		pipeline_flush(pipe);
 	}
-	
-	while(true) {
-			
-		ready = epoll_wait( ep_fd, evlist, 1, -1); 
-		if (ready == -1) {
-			if (errno == EINTR) {
-				perror("Interrupt");
-				exit(-1);
-				//continue; 
-			/* Restart if interrupted by signal */ 
-			} else {
-				perror("epoll_wait");
-				printf("Error: epoll_wait failed %d\n", errno);
-				exit(1);
-			} 
+}
+/*
+* RX stamp of a frame on the clock of lat_now, 0 when it is not timed.
+* With hardware stamps a frame the NIC did not stamp carries a software
+* one, it is counted and left out of the histogram.
+*/
+static inline uint64_t rx_stamp(intf_config_t *config, uint32_t status, uint32_t sec, uint32_t nsec){
+	if (config->latency == LATENCY_HW){
+		if ((status & TP_STATUS_TS_RAW_HARDWARE) == 0){
+			config->lat.unstamped++;
+			return 0;
 		}
-		
-		for (j = 0; j < ready; j++) {
+		return sec * 1000000000ULL + nsec - lat_hw_offset_ns;
+	}
+	return sec * 1000000000ULL + nsec;
+}
+/*
+* Descriptor of a frame in the RX ring, with PACKET_VNET_HDR the kernel
+* puts the offload header right in front of the frame
+*/
+static inline void rx_pkt_init(intf_config_t *config, pkt_desc_t *pkt, uint8_t *data, uint32_t len, uint64_t rx_ns){
+	pkt_init(pkt, data, len, rx_ns, config->port);
+	if (config->vnet_hdr){
+		pkt->vnet = (struct virtio_net_hdr *)(data - sizeof(struct virtio_net_hdr));
+	}
+}
+/*
+* Drain a TPACKET_V2 RX ring, keep consuming frames while they belong to
+* user space, up to rx_budget frames. Frames are gathered into batches and
+* only handed back to the kernel once the pipeline is done with them, a
+* batch holds at most half the ring so the kernel can keep filling it.
+* A frame cut short by the slot size is dropped, not forwarded truncated.
+*/
+static unsigned int read_frames_v2(intf_config_t *r_config, intf_config_t *w_config){
+	pipeline_t *pipe = r_config->pipe;
+	pkt_batch_t *batch = &pipe->batch;
+	unsigned int frames = r_config->max_ring_frames * r_config->max_ring_blocks;
+	uint8_t *cur_r;
+	struct tpacket2_hdr *header_r;
+	unsigned int count = 0;
+	unsigned int want, slot, n, i;
+	uint64_t rx_ns;
 #ifdef DEBUG
-			printf(" fd = %d; events: %s %s %s %s\n", evlist[j].data.fd,
-				(evlist[j].events & EPOLLIN)  ? "EPOLLIN "  : "", 
-				(evlist[j].events & EPOLLOUT) ? "EPOLLOUT " : "", 
-				(evlist[j].events & EPOLLHUP) ? "EPOLLHUP " : "", 
-				(evlist[j].events & EPOLLERR) ? "EPOLLERR " : "");
+	uint8_t *buf;
+	uint16_t eth_proto;
+	uint16_t ip_proto;
+#endif
+
+	while (count < r_config->rx_budget){
+		want = MIN(MIN(PIPE_BATCH, frames / 2), r_config->rx_budget - count);
+		for (slot = 0, n = 0; slot < want; slot++){
+			cur_r = r_config->r_ring + (((r_config->ringr_offset + slot) & (frames - 1)) * r_config->max_frame_size);
+			header_r = (struct tpacket2_hdr *)cur_r;
+#ifdef DEBUG
+			printf("cur_r: %p, tp_status: %u, header_len %lu, tp_mac %u, ringr_offset: %d\n", cur_r, header_r->tp_status, TPACKET2_HDRLEN, header_r->tp_mac, r_config->ringr_offset);
+			printf("\nPacket MMAP Header:\t%s,%s,%s,%s,%s,%s,%s\n",
+				(header_r->tp_status & TP_STATUS_KERNEL) ? "STATUS KERNEL " : "",
+				(header_r->tp_status & TP_STATUS_USER) ? "STATUS USER " : "",
+				(header_r->tp_status & TP_STATUS_COPY) ? "STATUS COPY " : "",
+				(header_r->tp_status & TP_STATUS_LOSING) ? "STATUS LOSING " : "",
+				(header_r->tp_status & TP_STATUS_CSUMNOTREADY) ? "STATUS CSUMNOTREADY " : "",
+				(header_r->tp_status & TP_STATUS_VLAN_VALID) ? "STATUS VLAN VALID " : "",
+				(header_r->tp_status & TP_STATUS_BLK_TMO) ? "STATUS BLK_TMO " : ""
+				);
+#endif
+			if (!(header_r->tp_status & TP_STATUS_USER)){
+				break;
+			}
+			if (header_r->tp_status & TP_STATUS_LOSING){
+				r_config->burst.losing++;
+			}
+#ifdef DEBUG
+			buf = cur_r + header_r->tp_mac;
+			eth_proto = display_ethernet(buf);
+			if (eth_proto == 0x0806) {
+				printf("ARP Packet\n");
+			} if (eth_proto == 0x0800) {
+				ip_proto = display_ip(buf);
+				if (ip_proto == 1){
+					display_icmp(buf);
+				}
+			}
 #endif
-			if ((evlist[j].events & EPOLLIN) && (evlist[j].data.fd == config->fd) ){
-				cur_r = config->r_ring + (ringr_offset *  config->max_frame_size);
-				header_r = (struct tpacket2_hdr *)cur_r;
+			r_config->stats->rx_bytes += header_r->tp_len;
+			if (header_r->tp_snaplen < header_r->tp_len){
+				r_config->stats->rx_truncated++;
+				continue;
+			}
+			rx_ns = r_config->latency ? rx_stamp(r_config, header_r->tp_status, header_r->tp_sec, header_r->tp_nsec) : 0;
+			rx_pkt_init(r_config, &batch->pkts[n++], cur_r + header_r->tp_mac, header_r->tp_snaplen, rx_ns);
+		}
+		if (slot == 0){
+			break;
+		}
+		if (n > 0){
+			batch->count = n;
+			pipeline_run(pipe, batch);
+			pipeline_output(pipe, batch, w_config);
+		}
+		/*
+		* update consumer pointer
+		*/
+		for (i = 0; i < slot; i++){
+			header_r = (struct tpacket2_hdr *)(r_config->r_ring + (r_config->ringr_offset * r_config->max_frame_size));
+			header_r->tp_status = TP_STATUS_KERNEL;
+			r_config->ringr_offset = (r_config->ringr_offset + 1) & (frames - 1);
+		}
+		count += slot;
+		if (slot < want){
+			break;
+		}
+	}
+	return count;
+}
+/*
+* Forward every packet of each retired block on a TPACKET_V3 RX ring, whole
+* blocks are consumed until rx_budget packets have been seen. A block goes
+* through the pipeline in batches and is handed back once all are sent,
+* packets cut short by the block size are dropped.
+*/
+static unsigned int read_blocks_v3(intf_config_t *r_config, intf_config_t *w_config){
+	pipeline_t *pipe = r_config->pipe;
+	pkt_batch_t *batch = &pipe->batch;
+	struct tpacket_block_desc *block;
+	struct tpacket3_hdr *ppd;
+	unsigned long block_size;
+	uint32_t num_pkts, i;
+	unsigned int count = 0;
+	unsigned int n;
+	uint64_t rx_ns;
 #ifdef DEBUG
-					printf("ready: %d, j:%d, cur_r: %p, tp_status: %u, ringr_offset: %d\n", ready,j,cur_r, (uint8_t)header_r->tp_status,ringr_offset);
-					printf("cur_r: %lu, tp_status: %u, header_len %u, tp_mac %u\n", cur_r, (uint8_t)header_r->tp_status,TPACKET2_HDRLEN, header_r->tp_mac);
-					printf("\nPacket MMAP Header:\t%s,%s,%s,%s,%s,%s,%s\n",
-						(header_r->tp_status & TP_STATUS_KERNEL) ? "STATUS KERNEL " : "",
-						(header_r->tp_status & TP_STATUS_USER) ? "STATUS USER " : "",
-						(header_r->tp_status & TP_STATUS_COPY) ? "STATUS COPY " : "",
-						(header_r->tp_status & TP_STATUS_LOSING) ? "STATUS LOSING " : "",
-						(header_r->tp_status & TP_STATUS_CSUMNOTREADY) ? "STATUS CSUMNOTREADY " : "",
-						(header_r->tp_status & TP_STATUS_VLAN_VALID) ? "STATUS VLAN VALID " : "",
-						(header_r->tp_status & TP_STATUS_BLK_TMO) ? "STATUS BLK_TMO " : ""
-						);
+	uint8_t *buf;
 #endif
-					len = header_r->tp_len;
+
+	block_size = r_config->max_ring_frames * r_config->max_frame_size;
+	while (count < r_config->rx_budget){
+		block = (struct tpacket_block_desc *)(r_config->r_ring + (r_config->ringr_offset * block_size));
+		if (!(block->hdr.bh1.block_status & TP_STATUS_USER)){
+			break;
+		}
+		num_pkts = block->hdr.bh1.num_pkts;
+		ppd = (struct tpacket3_hdr *)((uint8_t *)block + block->hdr.bh1.offset_to_first_pkt);
 #ifdef DEBUG
-					buf = cur_r + header_r->tp_mac;
-					eth_proto = display_ethernet(buf);
-					if (eth_proto == 0x0806) {
-						printf("ARP Packet\n");
-					} if (eth_proto == 0x0800) {
-						ip_proto = display_ip(buf);
-						if (ip_proto == 1){
-							display_icmp(buf);
-						}
-					}
+		printf("block: %u, num_pkts: %u, %s\n", r_config->ringr_offset, num_pkts,
+			(block->hdr.bh1.block_status & TP_STATUS_BLK_TMO) ? "STATUS BLK_TMO " : "");
 #endif
-	                /*
-	                * buffer over MTU if buffer bigger than MTU
-	                */
-					sendlen = MIN(len, config->mtu_size);
-					remlen = len;
-					curpos = cur_r + header_r->tp_mac;
-					//
-					data_start = TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
-					data_len = config->max_frame_size -  data_start;
-					while (remlen > 0){
-						
-						cur_w = config->w_ring + (ringw_offset * config->max_frame_size);
-						header_w = (struct tpacket2_hdr *)cur_w;
-						header_w->tp_mac = data_start;
+		for (i = 0; i < num_pkts; ){
+			for (n = 0; n < PIPE_BATCH && i < num_pkts; i++){
 #ifdef DEBUG
-						printf("cur_w: %p, tp_status: %u, ringw_offset: %d\n", cur_r, header_w->tp_status, ringr_offset);
+				buf = (uint8_t *)ppd + ppd->tp_mac;
+				display_ethernet(buf);
+				display_ip(buf);
 #endif
-						/*
-						* Wait for buffer to be ready
-						*/
-						while(header_w->tp_status != TP_STATUS_AVAILABLE);
-						header_w->tp_len = sendlen;
-						memset(cur_w + data_start, 0, data_len);
-						memcpy(cur_w + data_start, curpos , header_w->tp_len);
-						header_w->tp_status = TP_STATUS_SEND_REQUEST;
-						/*
-						* Poke kernel to send
-						*/
-						sent_len = sendto(config->fd, NULL, 0,0,NULL,0);
-						if (sent_len == -1) {
-							perror("write to first interface");
-							printf("Error writing to intf: cur_r: %p, tp_status: %u, ringw_offset: %u, remlen %zu, sendlen: %zu, curpos: %p\n", cur_r, header_w->tp_status, ringr_offset,remlen,sendlen,curpos);
-							exit(1);
-						} else {
-							curpos += sent_len;
-							remlen -= sent_len;
-							sendlen = MIN(remlen,config->mtu_size);
-						}
-						ringw_offset = (ringw_offset + 1) & ((config->max_ring_frames * config->max_ring_blocks)- 1);
-					}
-
-				///} else {
-				//	printf("Not for us packet - should never get here\n");
-				//	exit(-1);
-				//} /* if fd */
+				r_config->stats->rx_bytes += ppd->tp_len;
+				if (ppd->tp_snaplen < ppd->tp_len){
+					r_config->stats->rx_truncated++;
+				} else {
+					rx_ns = r_config->latency ? rx_stamp(r_config, ppd->tp_status, ppd->tp_sec, ppd->tp_nsec) : 0;
+					rx_pkt_init(r_config, &batch->pkts[n++], (uint8_t *)ppd + ppd->tp_mac, ppd->tp_snaplen, rx_ns);
+				}
+				ppd = (struct tpacket3_hdr *)((uint8_t *)ppd + ppd->tp_next_offset);
+			}
+			if (n > 0){
+				batch->count = n;
+				pipeline_run(pipe, batch);
+				pipeline_output(pipe, batch, w_config);
+			}
+		}
+		/*
+		* Hand the whole block back to the kernel
+		*/
+		block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		r_config->ringr_offset = (r_config->ringr_offset + 1) & (r_config->max_ring_blocks - 1);
+		count += num_pkts;
+	}
+	return count;
+}
+/*
+* Record the size of a burst in a power of two histogram
+*/
+static void record_burst(burst_stats_t *burst, unsigned int count){
+	unsigned int bucket = 0;
+
+	if (count == 0){
+		burst->empty++;
+		return;
+	}
+	burst->bursts++;
+	burst->packets += count;
+	burst->max = MAX(burst->max, count);
+	while ((count >>= 1) != 0 && bucket < BURST_BUCKETS - 1){
+		bucket++;
+	}
+	burst->hist[bucket]++;
+}
+
+static unsigned int read_ring(intf_config_t *r_config, intf_config_t *w_config){
+	unsigned int count;
+
+	if (r_config->tpacket_version == TPACKET_V3){
+		count = read_blocks_v3(r_config, w_config);
+	} else {
+		count = read_frames_v2(r_config, w_config);
+	}
+	r_config->stats->rx_packets += count;
+	record_burst(&r_config->burst, count);
+	return count;
+}
+
+static void ring_write(intf_config_t *config, const struct virtio_net_hdr *vnet, uint8_t *data, size_t len, uint64_t rx_ns){
+	write_packet(config, vnet, data, len, rx_ns);
+}
+
+static void ring_flush(intf_config_t *config){
+	tx_flush(config);
+}
+
+const io_backend_t ring_io = {
+	.name = "ring",
+	.read = read_ring,
+	.write = ring_write,
+	.flush = ring_flush,
+	.close = NULL,
+};
+/*
+* True when the next RX slot, or V3 block, belongs to user space
+*/
+static inline bool rx_ready(intf_config_t *config){
+	struct tpacket_block_desc *block;
+	struct tpacket2_hdr *header;
+
+	if (config->tpacket_version == TPACKET_V3){
+		block = (struct tpacket_block_desc *)(config->r_ring + (config->ringr_offset * config->max_ring_frames * config->max_frame_size));
+		return (*(volatile uint32_t *)&block->hdr.bh1.block_status & TP_STATUS_USER) != 0;
+	}
+	header = (struct tpacket2_hdr *)(config->r_ring + (config->ringr_offset * config->max_frame_size));
+	return (*(volatile uint32_t *)&header->tp_status & TP_STATUS_USER) != 0;
+}
+
+/*
+* Spin on the next RX slot of each ring for up to the current budget. The
+* budget doubles when traffic shows up while spinning and halves when it
+* runs out, so an idle VNF drifts back to sleeping in epoll_wait.
+*/
+static bool busy_poll(pipeline_t *pipe){
+	intf_config_t *config = pipe->ports[0];
+	poll_stats_t *poll = &config->poll;
+	uint64_t start, elapsed = 0;
+	unsigned int spins = 0;
+	unsigned int i;
+	bool found = false;
+
+	start = now_ns();
+	while (true){
+		for (i = 0; i < pipe->nports && !found; i++){
+			found = rx_ready(pipe->ports[i]);
+		}
+		if (found){
+			break;
+		}
+		/*
+		* Reading the clock costs more than checking a slot
+		*/
+		if ((++spins & 63) == 0){
+			elapsed = now_ns() - start;
+			if (elapsed >= poll->budget_ns){
+				break;
+			}
+		}
+	}
+	elapsed = now_ns() - start;
+	poll->spin_ns += elapsed;
+	if (found){
+		poll->hits++;
+		poll->budget_ns = MIN(poll->budget_ns * 2, config->busy_poll_us * 1000ULL);
+	} else {
+		poll->misses++;
+		poll->budget_ns = MAX(poll->budget_ns / 2, POLL_MIN_BUDGET_NS);
+	}
+	return found;
+}
+
+/*
+* With autotuning the wait wakes up to sample drops on an idle port, and
+* in time for the first frame a stage holds back, rounded up to a ms
+*/
+static int wait_timeout(pipeline_t *pipe){
+	int timeout = (pipe->ports[0]->tune.absorb_us > 0) ? TUNE_PERIOD_MS : -1;
+	uint64_t due, now, ms;
+
+	if (!pipe->has_poll || (due = pipeline_due(pipe)) == UINT64_MAX){
+		return timeout;
+	}
+	now = now_ns();
+	ms = (due > now) ? (due - now + 999999) / 1000000 : 0;
+	if (timeout != -1){
+		ms = MIN(ms, (uint64_t)timeout);
+	}
+	return MIN(ms, INT_MAX);
+}
+
+static int timed_epoll_wait(intf_config_t *config, int ep_fd, struct epoll_event *evlist, int maxevents, int timeout){
+	uint64_t start;
+	int ready;
+
+	config->poll.syscalls++;
+	if (config->busy_poll_us == 0){
+		return epoll_wait(ep_fd, evlist, maxevents, timeout);
+	}
+	start = now_ns();
+	ready = epoll_wait(ep_fd, evlist, maxevents, timeout);
+	config->poll.sleep_ns += now_ns() - start;
+	config->poll.sleeps++;
+	return ready;
+}
+/*
+* Print how the busy poll loop split its time between spinning and sleeping
+*/
+void print_poll_stats(intf_config_t *config){
+	poll_stats_t *poll = &config->poll;
+
+	if (config->busy_poll_us == 0){
+		return;
+	}
+	printf("\n---- Busy poll: %s ----\n", config->name);
+	printf("Spinning: %.3f s, hits: %lu, misses: %lu\n", poll->spin_ns / 1e9, poll->hits, poll->misses);
+	printf("Sleeping: %.3f s, waits: %lu\n", poll->sleep_ns / 1e9, poll->sleeps);
+	printf("Current budget: %lu us of %u us\n", poll->budget_ns / 1000, config->busy_poll_us);
+}
+/*
+* Print the syscalls the event loop made to wait and kick TX per frame read
+*/
+void print_event_stats(pipeline_t *pipe){
+	static const char * const names[] = {"epoll", "io_uring", "io_uring sqpoll"};
+	unsigned long syscalls = 0, kicks = 0;
+	uint64_t packets = 0;
+	unsigned int i;
+
+	for (i = 0; i < pipe->nports; i++){
+		syscalls += pipe->ports[i]->poll.syscalls;
+		kicks += pipe->ports[i]->poll.kicks;
+		packets += pipe->ports[i]->stats->rx_packets;
+	}
+	printf("\n---- Event loop: %s ----\n", names[pipe->ports[0]->event_loop]);
+	printf("Syscalls: %lu, TX kicks: %lu, RX packets: %lu, syscalls per packet: %.4f\n", syscalls, kicks, packets,
+		(packets > 0) ? (double)syscalls / packets : 0.0);
+}
+/*
+* Print RX burst statistics for an interface
+*/
+void print_burst_stats(intf_config_t *config){
+	burst_stats_t *burst = &config->burst;
+	unsigned int i;
+
+	printf("\n---- RX bursts: %s ----\n", config->name);
+	printf("Bursts: %lu, packets: %lu, empty wakeups: %lu, losing: %lu, truncated: %lu\n", burst->bursts, burst->packets, burst->empty,
+		burst->losing, config->stats->rx_truncated);
+	if (burst->bursts == 0){
+		return;
+	}
+	printf("Average burst: %.1f, max burst: %lu\n", (double)burst->packets / burst->bursts, burst->max);
+	for (i = 0; i < BURST_BUCKETS; i++){
+		if (burst->hist[i] == 0){
+			continue;
+		}
+		if (i == BURST_BUCKETS - 1){
+			printf("  %5u +      : %lu\n", 1U << i, burst->hist[i]);
+		} else {
+			printf("  %5u - %-5u: %lu\n", 1U << i, (2U << i) - 1, burst->hist[i]);
+		}
+	}
+}
+/*
+* Re-create the rings of a port with the geometry autotuning asked for,
+* once nothing is ready on RX and every TX frame went out. Until then
+* the resize is tried again on every pass of the loop. A port that stays
+* busy for a period gives up what is in its RX ring, the kernel refuses
+* to drop a TX ring with frames in flight.
+*/
+static void tune_resize(intf_config_t *config, uint64_t now){
+	tune_state_t *tune = &config->tune;
+
+	tx_flush(config);
+	if (config->tx_inflight > 0 || config->backlog.count > 0){
+		return;
+	}
+	if (rx_ready(config) && now - tune->want_ns < TUNE_PERIOD_NS){
+		return;
+	}
+	if (resize_pmap(config, tune->want_frames, tune->want_blocks) == 0){
+		tune->resizes++;
+		printf("Autotune: %s rings now %lu frames in %lu blocks\n", config->name, config->max_ring_frames, config->max_ring_blocks);
+	} else {
+		printf("WARNING: Autotune could not resize the rings of: %s\n", config->name);
+	}
+	tune->want_frames = 0;
+	tune->want_blocks = 0;
+}
+
+static void tune_ports(pipeline_t *pipe){
+	uint64_t now = now_ns();
+	unsigned int i;
+
+	for (i = 0; i < pipe->nports; i++){
+		if (tune_sample(pipe->ports[i], now)){
+			tune_resize(pipe->ports[i], now);
+		}
+	}
+}
+/*
+* Everything read on a port goes through the pipeline, then whatever it
+* queued on any port is pushed out
+*/
+static inline void read_port(pipeline_t *pipe, unsigned int port){
+	read_ring(pipe->ports[port], pipe_peer(pipe, port));
+	pipeline_flush(pipe);
+}
+
+static void print_rw_stats(pipeline_t *pipe){
+	unsigned int i;
+
+	for (i = 0; i < pipe->nports; i++){
+		print_burst_stats(pipe->ports[i]);
+	}
+	for (i = 0; i < pipe->nports; i++){
+		print_tx_stats(pipe->ports[i]);
+	}
+	stats_print_filter();
+	for (i = 0; i < pipe->nports; i++){
+		print_tune_stats(pipe->ports[i]);
+	}
+	print_poll_stats(pipe->ports[0]);
+	print_event_stats(pipe);
+	print_pipeline_stats(pipe);
+	for (i = 0; i < pipe->nports; i++){
+		print_latency(pipe->ports[i]);
+	}
+}
+/*
+* Requests of the signal handlers and timed work, done on every pass of
+* the event loop
+*/
+static void loop_chores(pipeline_t *pipe){
+	intf_config_t *config = pipe->ports[0];
+	unsigned int i;
 
+	if (lat_dump_requested){
+		lat_dump_requested = 0;
+		for (i = 0; i < pipe->nports; i++){
+			print_latency(pipe->ports[i]);
+		}
+	}
+	if (cap_toggle_requested){
+		cap_toggle_requested = 0;
+		cap_toggle();
+	}
+	if (config->tune.absorb_us > 0){
+		tune_ports(pipe);
+	}
+	if (pipe->has_poll){
+		pipeline_poll(pipe, now_ns());
+	}
+}
+/*
+* A signal ended the wait, only a stop ends the loop
+*/
+static void loop_interrupted(pipeline_t *pipe){
+	if (lat_dump_requested || cap_toggle_requested){
+		return;
+	}
+	print_rw_stats(pipe);
+	exit(-1);
+}
+
+static int timed_uring_wait(intf_config_t *config, uring_t *ring, int timeout){
+	uint64_t start;
+	int status;
+
+	if (config->busy_poll_us == 0){
+		return uring_enter(ring, true, timeout);
+	}
+	start = now_ns();
+	status = uring_enter(ring, true, timeout);
+	config->poll.sleep_ns += now_ns() - start;
+	config->poll.sleeps++;
+	return status;
+}
+/*
+* Event loop on io_uring. Frames are read straight off the rings while
+* there are any and the kicks they queued go to the kernel in one
+* submission per pass, none with SQPOLL while its thread is awake. Ports
+* are only polled for readiness when the loop is about to sleep, the
+* polls go in with the wait.
+*/
+static void read_write_uring(pipeline_t *pipe){
+	intf_config_t *config = pipe->ports[0];
+	bool armed[PIPE_MAX_PORTS];
+	struct io_uring_cqe *cqe;
+	struct io_uring_sqe *sqe;
+	uring_t ring;
+	unsigned int i, port, found;
+	uint32_t index;
+	int status;
+
+	if (uring_init(&ring, URING_ENTRIES, config->event_loop == EVENT_SQPOLL) == -1){
+		printf("Error: io_uring setup failed, use the epoll event loop\n");
+		exit(1);
+	}
+	for (i = 0; i < pipe->nports; i++){
+		pipe->ports[i]->uring = &ring;
+		armed[i] = false;
+	}
+	config->poll.budget_ns = config->busy_poll_us * 1000ULL;
+	while(true){
+		if (stop_requested){
+			print_rw_stats(pipe);
+			exit(-1);
+		}
+		loop_chores(pipe);
+		while ((cqe = uring_cqe(&ring)) != NULL){
+			port = URING_PORT(cqe->user_data);
+			if (URING_KIND(cqe->user_data) == URING_KICK){
+				tx_kick_done(pipe->ports[port], cqe->res);
 			} else {
-				printf("Not for us packet - should never get here\n");
-				if (evlist[j].events & (EPOLLHUP | EPOLLERR)) { 
-				/* After the epoll_wait(), EPOLLIN and EPOLLHUP may both have been set. 
-				 * But we'll only get here, and thus close the file descriptor, if EPOLLIN was not set. 
-				 * This ensures that all outstanding input (possibly more than MAX_BUF bytes) is 
-				 * consumed (by further loop iterations) before the file descriptor is closed. 
-				 */ 
-					printf(" closing fd %d\n", evlist[j].data.fd);
+				armed[port] = false;
+				if (cqe->res < 0 || ((cqe->res & (POLLHUP | POLLERR)) && !(cqe->res & POLLIN))){
+					printf(" closing fd %d\n", pipe->ports[port]->fd);
 					exit(-1);
 				}
-			} /* if evlist EPOLLIN or EPOLLERR */
-			header_r->tp_status = TP_STATUS_KERNEL;
-			ringr_offset = (ringr_offset + 1) & ((config->max_ring_frames * config->max_ring_blocks)- 1);
-			cur_r = config->r_ring + (ringr_offset *  config->max_frame_size);
-		} /* for ready */
-		// update consumer pointer
-	} /* while true */
+			}
+			uring_cqe_seen(&ring);
+		}
+		found = 0;
+		for (i = 0; i < pipe->nports; i++){
+			if (rx_ready(pipe->ports[i])){
+				read_port(pipe, i);
+				found++;
+			}
+		}
+		if (found > 0){
+			status = uring_enter(&ring, false, 0);
+		} else if (config->busy_poll_us > 0 && busy_poll(pipe)){
+			continue;
+		} else {
+			for (i = 0; i < pipe->nports; i++){
+				if (armed[i] || (sqe = uring_sqe(&ring, &index)) == NULL){
+					continue;
+				}
+				sqe->opcode = IORING_OP_POLL_ADD;
+				sqe->fd = pipe->ports[i]->fd;
+				sqe->poll32_events = POLLIN;
+				sqe->user_data = URING_DATA(URING_POLL, i);
+				armed[i] = true;
+			}
+			status = timed_uring_wait(config, &ring, wait_timeout(pipe));
+		}
+		if (status == -1){
+			if (errno == EINTR){
+				loop_interrupted(pipe);
+				continue;
+			}
+			perror("io_uring_enter");
+			printf("Error: io_uring_enter failed %d\n", errno);
+			exit(1);
+		}
+		config->poll.syscalls += status;
+	}
 }
-void read_write_two(intf_config_t *f_config, intf_config_t *s_config){
-
+/*
+* Read and write packets between the RAW interfaces of a pipeline, with a
+* single interface frames go back out of the interface they came in on
+*/
+void read_write(pipeline_t *pipe){
+	intf_config_t *config = pipe->ports[0];
 	int ready;
 	int j;
 	int ep_fd;
-	struct epoll_event e_evf, e_evs;
-	struct epoll_event evlist[2];
-	unsigned int fringr_offset = 0;
-	unsigned int sringr_offset = 0;
-	unsigned int fringw_offset = 0;
-	unsigned int sringw_offset = 0;
-	unsigned int data_start = 0;
-	unsigned int data_len = 0;
-	struct tpacket2_hdr *header, *header_w;
-	unsigned int len, sent_len;
-	uint8_t *cur_sr, *cur_fr, *cur_sw, *cur_fw;
-	size_t sendlen;
-	size_t remlen; 
-	uint8_t *curpos;
-#ifdef DEBUG
-	uint8_t *buf;
-#endif
-	memset(&ep_fd,0,sizeof(ep_fd));
-	ep_fd = epoll_create(2);
+	unsigned int i;
+	struct epoll_event e_ev;
+	struct epoll_event evlist[PIPE_MAX_PORTS];
+
+	if (config->event_loop != EVENT_EPOLL){
+		read_write_uring(pipe);
+		return;
+	}
+	ep_fd = epoll_create(pipe->nports);
 	if ( ep_fd == -1){
 		perror("epoll_create");
 		printf("Error: epoll create failed %d\n", errno);
 		exit(1);
 	}
-
-	memset(&e_evf,0,sizeof(e_evf));
-	e_evf.data.fd = f_config->fd;
-	e_evf.events = EPOLLIN;
-	if (epoll_ctl(ep_fd,EPOLL_CTL_ADD,f_config->fd, &e_evf) == -1){
-		perror("epoll_ctl");
-		printf("Error: epoll_ctl failed %d\n", errno);
-		exit(1);
-	}
-	memset(&e_evs,0,sizeof(e_evs));
-	e_evs.data.fd = s_config->fd;
-	e_evs.events = EPOLLIN;
-	if (epoll_ctl(ep_fd,EPOLL_CTL_ADD,s_config->fd, &e_evs) == -1){
-		perror("epoll_ctl");
-		printf("Error: epoll_ctl failed %d\n", errno);
-		exit(1);
+	for (i = 0; i < pipe->nports; i++){
+		memset(&e_ev,0,sizeof(e_ev));
+		e_ev.data.u32 = i;
+		e_ev.events = EPOLLIN;
+		if (epoll_ctl(ep_fd,EPOLL_CTL_ADD,pipe->ports[i]->fd, &e_ev) == -1){
+			perror("epoll_ctl");
+			printf("Error: epoll_ctl failed %d\n", errno);
+			exit(1);
+		}
 	}
 
+	config->poll.budget_ns = config->busy_poll_us * 1000ULL;
 	while(true){
-
-		ready = epoll_wait( ep_fd, evlist,2, -1); 
+		loop_chores(pipe);
+		if (config->busy_poll_us > 0 && busy_poll(pipe)){
+			for (i = 0; i < pipe->nports; i++){
+				if (rx_ready(pipe->ports[i])){
+					read_port(pipe, i);
+				}
+			}
+			continue;
+		}
+		ready = timed_epoll_wait(config, ep_fd, evlist, pipe->nports, wait_timeout(pipe));
 		if (ready == -1) {
 			if (errno == EINTR) {
-				perror("Interrupt");
-				exit(-1);
-//continue; 
-/* Restart if interrupted by signal */ 
+				loop_interrupted(pipe);
+				continue;
 			} else {
 				perror("epoll_wait");
 				printf("Error: epoll_wait failed %d\n", errno);
 				exit(1);
 			} 
 		}
-/* Deal with returned list of events */ 
+		/* Deal with returned list of events */ 
 		for (j = 0; j < ready; j++) {
 #ifdef DEBUG
-			printf(" fd = %d; events: %s %s %s %s\n", evlist[j].data.fd,
+			printf(" port = %u; events: %s %s %s %s\n", evlist[j].data.u32,
 				(evlist[j].events & EPOLLIN)  ? "EPOLLIN "  : "", 
 				(evlist[j].events & EPOLLOUT) ? "EPOLLOUT " : "", 
 				(evlist[j].events & EPOLLHUP) ? "EPOLLHUP " : "", 
 				(evlist[j].events & EPOLLERR) ? "EPOLLERR " : "");
 #endif
 			if (evlist[j].events & EPOLLIN) { 
-
-				if (evlist[j].data.fd == s_config->fd){
-					cur_sr = s_config->r_ring + (sringr_offset *  s_config->max_frame_size);
-					header = (struct tpacket2_hdr *)cur_sr;
-#ifdef DEBUG
-					printf("Packet-mmap header:\n, %s,%s,%s,%s,%s,%s,%s\n",
-						(header->tp_status & TP_STATUS_KERNEL) ? "STATUS KERNEL " : "",
-						(header->tp_status & TP_STATUS_USER) ? "STATUS USER " : "",
-						(header->tp_status & TP_STATUS_COPY) ? "STATUS COPY " : "",
-						(header->tp_status & TP_STATUS_LOSING) ? "STATUS LOSING " : "",
-						(header->tp_status & TP_STATUS_CSUMNOTREADY) ? "STATUS CSUMNOTREADY " : "",
-						(header->tp_status & TP_STATUS_VLAN_VALID) ? "STATUS VLAN VALID " : "",
-						(header->tp_status & TP_STATUS_BLK_TMO) ? "STATUS BLK_TMO " : ""
-						);
-#endif
-					if (header->tp_status & TP_STATUS_USER){
-						len = header->tp_len;
-						
-#ifdef DEBUG
-						buf = cur_sr + header->tp_mac;
-						display_ethernet(buf);
-						display_ip(buf);
-#endif
-        /*
-        * buffer over MTU if buffer bigger than MTU
-        */
-						sendlen = MIN(len, s_config->mtu_size);
-						remlen = len;
-						curpos = cur_sr + header->tp_mac;
-						data_start = TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
-						data_len = s_config->max_frame_size -  data_start;
-						//
-						while (remlen > 0){
-							cur_sw = f_config->w_ring + (fringw_offset * f_config->max_frame_size);
-							header_w = (struct tpacket2_hdr *)cur_sw;
-							header_w->tp_mac = data_start;
-			/*
-			* Wait for buffer to be ready
-			*/
-							while(header_w->tp_status != TP_STATUS_AVAILABLE){}
-								header_w->tp_len = sendlen;
-								memset(cur_sw + data_start, 0, data_len);
-								memcpy(cur_sw + data_start, curpos , header->tp_len);
-								header_w->tp_status = TP_STATUS_SEND_REQUEST;
-			/*
-			* Poke kernel to send
-			*/
-								sent_len = sendto(f_config->fd, NULL, 0,0,NULL,0);
-								if (sent_len == -1) {
-									perror("write to write_intf");
-									printf("Error writing to read_intf: %s\n",f_config->name);
-									exit(1);
-								} else {
-									curpos += sent_len;
-									remlen -= sent_len;
-									sendlen = MIN(remlen,f_config->mtu_size);
-							}
-							fringw_offset = (fringw_offset + 1) & ((MAX_RING_FRAMES * MAX_RING_BLOCKS)- 1);
-						}
-			 // update consumer pointer
-						header->tp_status = TP_STATUS_KERNEL;
-						sringr_offset = (sringr_offset + 1) & ((MAX_RING_FRAMES * MAX_RING_BLOCKS)- 1);
-
-
-					} else {
-						printf("Header status not user: %u\n", header->tp_status);
-						exit(-1);
-					}
-				} else if ( evlist[j].data.fd == f_config->fd ) {
-					cur_fr = f_config->r_ring + (fringr_offset * f_config->max_frame_size);
-					header = (struct tpacket2_hdr *)cur_fr;
-#ifdef DEBUG
-					printf("Packet-mmap header:\n, %s,%s,%s,%s,%s,%s,%s\n",
-						(header->tp_status & TP_STATUS_KERNEL) ? "STATUS KERNEL " : "",
-						(header->tp_status & TP_STATUS_USER) ? "STATUS USER " : "",
-						(header->tp_status & TP_STATUS_COPY) ? "STATUS COPY " : "",
-						(header->tp_status & TP_STATUS_LOSING) ? "STATUS LOSING " : "",
-						(header->tp_status & TP_STATUS_CSUMNOTREADY) ? "STATUS CSUMNOTREADY " : "",
-						(header->tp_status & TP_STATUS_VLAN_VALID) ? "STATUS VLAN VALID " : "",
-						(header->tp_status & TP_STATUS_BLK_TMO) ? "STATUS BLK_TMO " : ""
-						);
-#endif
-					if (header->tp_status & TP_STATUS_USER){
-						len = header->tp_len;
-						
-#ifdef DEBUG
-						buf = cur_fr + header->tp_mac;
-						display_ethernet(buf);
-						display_ip(buf);
-#endif
-						sendlen = MIN(len, s_config->mtu_size);
-						remlen = len;
-						curpos = cur_fr + header->tp_mac;
-						data_start = TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
-						data_len = f_config->max_frame_size -  data_start;
-						while (remlen > 0){
-							cur_fw = s_config->w_ring + (sringw_offset * s_config->max_frame_size);
-							header_w = (struct tpacket2_hdr *)cur_fw;
-							header_w->tp_mac = data_start;
-							while(header_w->tp_status != TP_STATUS_AVAILABLE){}
-								header_w->tp_len = sendlen;
-								memset(cur_fw + data_start, 0, data_len);
-								memcpy(cur_fw + data_start, curpos, header->tp_len);
-								header_w->tp_status = TP_STATUS_SEND_REQUEST;
-								sent_len = sendto(s_config->fd,NULL, 0,0,NULL,0);
-								if (sent_len == -1) {
-									perror("write to write fd");
-									printf("Error writing to read fd: %s\n",s_config->name);
-									exit(1);
-								} else {
-									curpos += sent_len;
-									remlen -= sent_len;
-									sendlen = MIN(remlen,s_config->mtu_size);
-							}
-							sringw_offset = (sringw_offset + 1) & ((MAX_RING_FRAMES * MAX_RING_BLOCKS)- 1);	       
-						}     		
-						header->tp_status = TP_STATUS_KERNEL;
-		 	// update consumer pointer
-						fringr_offset = (fringr_offset + 1) & ((MAX_RING_FRAMES * MAX_RING_BLOCKS) - 1);
-		//printf("Fringr offset: %u\n", fringr_offset);
-					} else {
-			//header->tp_status = TP_STATUS_KERNEL;
-						printf("Header status is not user: %u\n", header->tp_status);
-			//fringr_offset = (fringr_offset + 1) & ((MAX_RING_FRAMES * MAX_RING_BLOCKS) - 1);
-						exit(-1);
-					}					
-				} else {
-					printf("Not for us packet\n");
+				read_port(pipe, evlist[j].data.u32);
+			} else {
+				if (evlist[j].events & (EPOLLHUP | EPOLLERR)) { 
+				/* After the epoll_wait(), EPOLLIN and EPOLLHUP may both have been set. 
+				 * But we'll only get here, and thus close the file descriptor, if EPOLLIN was not set. 
+				 * This ensures that all outstanding input (possibly more than MAX_BUF bytes) is 
+				 * consumed (by further loop iterations) before the file descriptor is closed. 
+				 */ 
+					printf(" closing fd %d\n", pipe->ports[evlist[j].data.u32]->fd);
 					exit(-1);
-} /* if fd */
-				} else {
-					if (evlist[j].events & (EPOLLHUP | EPOLLERR)) { 
-	/* After the epoll_wait(), EPOLLIN and EPOLLHUP may both have been set. 
-	 * But we'll only get here, and thus close the file descriptor, if EPOLLIN was not set. 
-	 * This ensures that all outstanding input (possibly more than MAX_BUF bytes) is 
-	 * consumed (by further loop iterations) before the file descriptor is closed. 
-	 */ 
-						printf(" closing fd %d\n", evlist[j].data.fd);
-						exit(-1);
-					}
-} /* if evlist EPOLLIN or EPOLLERR */
-} /* for ready */
-} /* while */
-				}
\ No newline at end of file
+				}
+			} /* if evlist EPOLLIN or EPOLLERR */
+		} /* for ready */
+	} /* while */
+}
+/*
+* Push a capture through the forwarding path as fast as the CPU allows and
+* report the rate, the writer sees the same calls as with a live source
+*/
+void read_write_replay(intf_config_t *r_config, intf_config_t *w_config){
+	uint64_t start, elapsed, deadline;
+	unsigned int count;
+
+	start = now_ns();
+	do {
+		count = r_config->io->read(r_config, w_config);
+		record_burst(&r_config->burst, count);
+		pipeline_flush(r_config->pipe);
+	} while (count > 0);
+	/*
+	* Frames a stage still holds go out as they come due
+	*/
+	while (r_config->pipe->has_poll && pipeline_due(r_config->pipe) != UINT64_MAX){
+		pipeline_poll(r_config->pipe, now_ns());
+	}
+	/*
+	* Give the kernel up to a second to send what is left on a TX ring
+	*/
+	if (w_config->io == &ring_io){
+		deadline = now_ns() + 1000000000ULL;
+		while (w_config->tx_inflight > 0 && now_ns() < deadline){
+			tx_flush(w_config);
+		}
+	}
+	elapsed = MAX(now_ns() - start, 1);
+	if (w_config->io->close != NULL){
+		w_config->io->close(w_config);
+	}
+	r_config->io->close(r_config);
+	printf("\n---- Replay ----\n");
+	printf("Packets: %lu, bytes: %lu, seconds: %.3f\n", r_config->stats->rx_packets, r_config->stats->rx_bytes, elapsed / 1e9);
+	printf("Rate: %.0f pps, %.3f Gbps\n", r_config->stats->rx_packets * 1e9 / elapsed, r_config->stats->rx_bytes * 8.0 / elapsed);
+	print_tx_stats(w_config);
+	print_pipeline_stats(r_config->pipe);
+}
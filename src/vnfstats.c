@@ -0,0 +1,529 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*! Dataplane counters exported through shared memory and a UNIX socket
+ *
+ * Workers bump plain counters in their own cache line of a shared memory
+ * segment, external readers map it read only. An exporter thread folds
+ * in the kernel PACKET_STATISTICS once a period and answers every
+ * connection on the stats socket with a Prometheus text dump.
+ *
+ * The kernel counts no frame a socket filter rejects. What the filter
+ * kept off the rings of an interface is its RX counter less what the
+ * sockets took in, ring drops included, since the filter went on.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+//
+#include <linux/if_packet.h>
+//
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+//
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnfstats.h"
+#include "vnflat.h"
+#include "vnfpipe.h"
+
+#define STATS_SOCK_DIR "/tmp"
+
+typedef struct _stats_metric {
+	const char *name;
+	const char *help;
+	size_t offset;
+} stats_metric_t;
+
+static const stats_metric_t intf_metrics[] = {
+	{"vnf_rx_packets_total", "Packets read from the RX ring", offsetof(intf_counters_t, rx_packets)},
+	{"vnf_rx_bytes_total", "Bytes read from the RX ring", offsetof(intf_counters_t, rx_bytes)},
+	{"vnf_tx_packets_total", "Packets queued on the TX ring", offsetof(intf_counters_t, tx_packets)},
+	{"vnf_tx_bytes_total", "Bytes queued on the TX ring", offsetof(intf_counters_t, tx_bytes)},
+	{"vnf_tx_drops_total", "Packets dropped by the TX overload policy", offsetof(intf_counters_t, tx_drops)},
+	{"vnf_tx_ring_full_total", "Times the TX ring had no free slot", offsetof(intf_counters_t, tx_ring_full)},
+	{"vnf_tx_wrong_format_total", "TX frames rejected by the kernel", offsetof(intf_counters_t, tx_wrong_format)},
+	{"vnf_tx_kick_errors_total", "TX kicks that returned an error", offsetof(intf_counters_t, tx_kick_errors)},
+	{"vnf_tx_oversize_total", "TX frames dropped as longer than the MTU or a ring slot", offsetof(intf_counters_t, tx_oversize)},
+	{"vnf_rx_truncated_total", "RX frames dropped as cut short by the ring", offsetof(intf_counters_t, rx_truncated)},
+};
+
+static const stats_metric_t kernel_metrics[] = {
+	{"vnf_kernel_packets_total", "Packets seen by the socket, PACKET_STATISTICS", offsetof(kernel_counters_t, packets)},
+	{"vnf_kernel_drops_total", "Packets dropped because the RX ring was full", offsetof(kernel_counters_t, drops)},
+	{"vnf_kernel_freeze_q_total", "Times the V3 RX ring was frozen", offsetof(kernel_counters_t, freeze_q)},
+};
+
+static vnf_stats_header_t *stats_header;
+static size_t stats_len;
+static bool stats_shared;
+static char stats_shm_name[STATS_NAME_SIZE + 1];
+static char stats_sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int stats_listen_fd = -1;
+static intf_config_t *stats_configs[MAX_WORKERS][VNF_STATS_PORTS];
+static pipeline_t *stats_pipes[MAX_WORKERS];
+static pthread_mutex_t stats_kernel_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool stats_filters[VNF_STATS_PORTS];
+static uint64_t stats_rx_base[VNF_STATS_PORTS];
+
+static uint64_t stats_now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stats_cleanup(void){
+	if (stats_listen_fd != -1){
+		unlink(stats_sock_path);
+	}
+	if (stats_shared){
+		shm_unlink(stats_shm_name);
+	}
+}
+/*
+* Lay out the counters, in shared memory when a name is given and in
+* private memory otherwise so the dataplane never checks
+*/
+int stats_init(char *name, unsigned int workers, unsigned int ports, char names[][IFNAMSIZ]){
+	size_t counters_offset, kernel_offset;
+	unsigned int i, j;
+	int fd;
+
+	if (workers == 0 || workers > MAX_WORKERS || ports == 0 || ports > VNF_STATS_PORTS){
+		printf("ERROR: Stats for %u workers and %u ports not supported\n", workers, ports);
+		return -1;
+	}
+	counters_offset = sizeof(vnf_stats_header_t);
+	kernel_offset = counters_offset + workers * ports * sizeof(intf_counters_t);
+	stats_len = kernel_offset + workers * ports * sizeof(kernel_counters_t);
+	if (name[0] == '\0'){
+		if (posix_memalign((void **)&stats_header, CACHE_LINE_SIZE, stats_len) != 0){
+			perror("posix_memalign stats");
+			return -1;
+		}
+		memset(stats_header, 0, stats_len);
+	} else {
+		snprintf(stats_shm_name, sizeof(stats_shm_name), "/%s", name);
+		fd = shm_open(stats_shm_name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+		if (fd == -1){
+			perror("shm_open");
+			return -1;
+		}
+		if (ftruncate(fd, stats_len) == -1){
+			perror("ftruncate stats");
+			close(fd);
+			shm_unlink(stats_shm_name);
+			return -1;
+		}
+		stats_header = mmap(NULL, stats_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (stats_header == MAP_FAILED){
+			perror("mmap stats");
+			shm_unlink(stats_shm_name);
+			return -1;
+		}
+		stats_shared = true;
+		atexit(stats_cleanup);
+	}
+	stats_header->version = VNF_STATS_VERSION;
+	stats_header->pid = getpid();
+	stats_header->workers = workers;
+	stats_header->ports = ports;
+	stats_header->counters_offset = counters_offset;
+	stats_header->kernel_offset = kernel_offset;
+	for (j = 0; j < ports; j++){
+		strncpy(stats_header->names[j], names[j], IFNAMSIZ - 1);
+	}
+	for (i = 0; i < MAX_WORKERS; i++){
+		for (j = 0; j < VNF_STATS_PORTS; j++){
+			stats_configs[i][j] = NULL;
+		}
+		stats_pipes[i] = NULL;
+	}
+	/*
+	* Readers check the magic last
+	*/
+	__atomic_store_n(&stats_header->magic, VNF_STATS_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+* RX packets of an interface as /proc/net/dev has them, it follows the
+* network namespace of the process where sysfs may not
+*/
+static int stats_dev_rx(const char *name, uint64_t *packets){
+	char line[512], *colon, *dev;
+	unsigned long long rx_bytes, rx_packets;
+	int status = -1;
+	FILE *fp;
+
+	fp = fopen("/proc/net/dev", "r");
+	if (fp == NULL){
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL){
+		colon = strchr(line, ':');
+		if (colon == NULL){
+			continue;
+		}
+		*colon = '\0';
+		dev = line + strspn(line, " ");
+		if (strcmp(dev, name) == 0 && sscanf(colon + 1, "%llu %llu", &rx_bytes, &rx_packets) == 2){
+			*packets = rx_packets;
+			status = 0;
+			break;
+		}
+	}
+	fclose(fp);
+	return status;
+}
+
+intf_counters_t *stats_counters(unsigned int worker, unsigned int port){
+	return stats_shm_counters(stats_header, worker, port);
+}
+/*
+* Sockets whose PACKET_STATISTICS are folded into the kernel counters and
+* whose latency histograms are exported
+*/
+void stats_register_socket(unsigned int worker, unsigned int port, intf_config_t *config){
+	config->stats = stats_counters(worker, port);
+	config->kernel = stats_shm_kernel(stats_header, worker, port);
+	stats_configs[worker][port] = config;
+	/*
+	* Before it joined the fanout group the socket saw every frame of the
+	* interface, those are left out
+	*/
+	if (config->filtered){
+		stats_poll_socket(config);
+		memset(config->kernel, 0, sizeof(kernel_counters_t));
+		if (!stats_filters[port] && stats_dev_rx(config->name, &stats_rx_base[port]) == 0){
+			stats_filters[port] = true;
+		}
+	}
+}
+/*
+* Pipeline whose stage counters are exported
+*/
+void stats_register_pipeline(unsigned int worker, pipeline_t *pipe){
+	stats_pipes[worker] = pipe;
+}
+/*
+* PACKET_STATISTICS resets on read, accumulate. V2 sockets only fill the
+* first two fields. The exporter and the ring autotuning of the worker
+* both fold them in, so a read and its sum happen under a lock.
+*/
+void stats_poll_socket(intf_config_t *config){
+	struct tpacket_stats_v3 st;
+	kernel_counters_t *kernel = config->kernel;
+	socklen_t len;
+
+	memset(&st, 0, sizeof(st));
+	len = sizeof(st);
+	pthread_mutex_lock(&stats_kernel_lock);
+	if (getsockopt(config->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0){
+		kernel->packets += st.tp_packets;
+		kernel->drops += st.tp_drops;
+		kernel->freeze_q += st.tp_freeze_q_cnt;
+	}
+	pthread_mutex_unlock(&stats_kernel_lock);
+}
+
+/*
+* Frames sent on the interface by others are seen by the sockets too, so
+* this is a floor and it never goes back
+*/
+static void stats_poll_filter(unsigned int port){
+	uint64_t rx, taken = 0;
+	unsigned int i;
+
+	if (stats_dev_rx(stats_header->names[port], &rx) == -1){
+		return;
+	}
+	pthread_mutex_lock(&stats_kernel_lock);
+	for (i = 0; i < stats_header->workers; i++){
+		if (stats_configs[i][port] != NULL){
+			taken += stats_configs[i][port]->kernel->packets;
+		}
+	}
+	rx -= stats_rx_base[port];
+	if (rx > taken && rx - taken > stats_header->filtered[port]){
+		stats_header->filtered[port] = rx - taken;
+	}
+	pthread_mutex_unlock(&stats_kernel_lock);
+}
+
+static void stats_poll_kernel(void){
+	unsigned int i, j;
+
+	for (i = 0; i < stats_header->workers; i++){
+		for (j = 0; j < stats_header->ports; j++){
+			if (stats_configs[i][j] != NULL){
+				stats_poll_socket(stats_configs[i][j]);
+			}
+		}
+	}
+	for (j = 0; j < stats_header->ports; j++){
+		if (stats_filters[j]){
+			stats_poll_filter(j);
+		}
+	}
+	stats_header->update_ns = stats_now_ns();
+}
+/*
+* Frames the filter kept off the rings of each interface next to the
+* ones the rings had no room for
+*/
+void stats_print_filter(void){
+	kernel_counters_t *kernel;
+	uint64_t taken, drops;
+	unsigned int i, j;
+	bool header = false;
+
+	stats_poll_kernel();
+	for (j = 0; j < stats_header->ports; j++){
+		if (!stats_filters[j]){
+			continue;
+		}
+		if (header == false){
+			printf("\n---- Socket filter ----\n");
+			header = true;
+		}
+		taken = 0;
+		drops = 0;
+		for (i = 0; i < stats_header->workers; i++){
+			kernel = stats_shm_kernel(stats_header, i, j);
+			taken += kernel->packets;
+			drops += kernel->drops;
+		}
+		printf("%s: accepted: %lu, filtered: %lu, ring drops: %lu\n", stats_header->names[j], taken,
+			stats_header->filtered[j], drops);
+	}
+}
+
+static void stats_write_metrics(FILE *out, const stats_metric_t *metrics, size_t nmetrics, bool kernel){
+	uint8_t *base;
+	size_t m;
+	unsigned int i, j;
+
+	for (m = 0; m < nmetrics; m++){
+		fprintf(out, "# HELP %s %s\n", metrics[m].name, metrics[m].help);
+		fprintf(out, "# TYPE %s counter\n", metrics[m].name);
+		for (j = 0; j < stats_header->ports; j++){
+			for (i = 0; i < stats_header->workers; i++){
+				if (kernel){
+					base = (uint8_t *)stats_shm_kernel(stats_header, i, j);
+				} else {
+					base = (uint8_t *)stats_shm_counters(stats_header, i, j);
+				}
+				fprintf(out, "%s{interface=\"%s\",worker=\"%u\"} %lu\n", metrics[m].name,
+					stats_header->names[j], i, *(volatile uint64_t *)(base + metrics[m].offset));
+			}
+		}
+	}
+}
+/*
+* Latency of the frames sent on each interface, merged over the workers
+*/
+static void stats_write_latency(FILE *out){
+	static const double quantiles[] = { 0.5, 0.99, 0.999 };
+	lat_hist_t *hist;
+	unsigned int i, j, q;
+	bool header = false;
+
+	hist = malloc(sizeof(lat_hist_t));
+	if (hist == NULL){
+		return;
+	}
+	for (j = 0; j < stats_header->ports; j++){
+		memset(hist, 0, sizeof(*hist));
+		for (i = 0; i < stats_header->workers; i++){
+			if (stats_configs[i][j] != NULL && stats_configs[i][j]->latency != LATENCY_OFF){
+				lat_merge(hist, &stats_configs[i][j]->lat.hist);
+			}
+		}
+		if (hist->count == 0){
+			continue;
+		}
+		if (header == false){
+			fprintf(out, "# HELP vnf_latency_ns RX timestamp to TX kick residency\n");
+			fprintf(out, "# TYPE vnf_latency_ns summary\n");
+			header = true;
+		}
+		for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++){
+			fprintf(out, "vnf_latency_ns{interface=\"%s\",quantile=\"%g\"} %lu\n", stats_header->names[j],
+				quantiles[q], lat_percentile(hist, quantiles[q]));
+		}
+		fprintf(out, "vnf_latency_ns{interface=\"%s\",quantile=\"1\"} %lu\n", stats_header->names[j], hist->max);
+		fprintf(out, "vnf_latency_ns_sum{interface=\"%s\"} %lu\n", stats_header->names[j], hist->sum);
+		fprintf(out, "vnf_latency_ns_count{interface=\"%s\"} %lu\n", stats_header->names[j], hist->count);
+	}
+	free(hist);
+}
+/*
+* Frames and drops per pipeline stage and worker, plus the counters a
+* stage names itself. counter selects packets (-2), drops (-1) or a named
+* counter of the stage.
+*/
+static void stats_write_stage_metric(FILE *out, int counter){
+	pipe_stage_t *stage;
+	unsigned int i, s, c;
+
+	for (i = 0; i < stats_header->workers; i++){
+		if (stats_pipes[i] == NULL){
+			continue;
+		}
+		for (s = 0; s < stats_pipes[i]->nstages; s++){
+			stage = &stats_pipes[i]->stages[s];
+			if (counter == -2){
+				fprintf(out, "vnf_stage_packets_total{stage=\"%s\",worker=\"%u\"} %lu\n", stage->name, i, *(volatile uint64_t *)&stage->packets);
+			} else if (counter == -1){
+				fprintf(out, "vnf_stage_drops_total{stage=\"%s\",worker=\"%u\"} %lu\n", stage->name, i, *(volatile uint64_t *)&stage->drops);
+			} else {
+				for (c = 0; stage->counter_names != NULL && stage->counter_names[c] != NULL; c++){
+					fprintf(out, "vnf_stage_events_total{stage=\"%s\",event=\"%s\",worker=\"%u\"} %lu\n", stage->name,
+						stage->counter_names[c], i, *(volatile uint64_t *)&stage->counters[c]);
+				}
+			}
+		}
+	}
+}
+
+static void stats_write_filtered(FILE *out){
+	unsigned int j;
+	bool header = false;
+
+	for (j = 0; j < stats_header->ports; j++){
+		if (!stats_filters[j]){
+			continue;
+		}
+		if (header == false){
+			fprintf(out, "# HELP vnf_filtered_total Frames the socket filter kept off the RX rings\n");
+			fprintf(out, "# TYPE vnf_filtered_total counter\n");
+			header = true;
+		}
+		fprintf(out, "vnf_filtered_total{interface=\"%s\"} %lu\n", stats_header->names[j], *(volatile uint64_t *)&stats_header->filtered[j]);
+	}
+}
+
+static void stats_write_stages(FILE *out){
+	if (stats_pipes[0] == NULL){
+		return;
+	}
+	fprintf(out, "# HELP vnf_stage_packets_total Frames that reached a pipeline stage\n");
+	fprintf(out, "# TYPE vnf_stage_packets_total counter\n");
+	stats_write_stage_metric(out, -2);
+	fprintf(out, "# HELP vnf_stage_drops_total Frames dropped by a pipeline stage\n");
+	fprintf(out, "# TYPE vnf_stage_drops_total counter\n");
+	stats_write_stage_metric(out, -1);
+	fprintf(out, "# HELP vnf_stage_events_total Stage specific counters\n");
+	fprintf(out, "# TYPE vnf_stage_events_total counter\n");
+	stats_write_stage_metric(out, 0);
+}
+/*
+* One Prometheus text exposition per connection
+*/
+static void stats_serve(int fd){
+	struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+	FILE *out;
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	out = fdopen(fd, "w");
+	if (out == NULL){
+		close(fd);
+		return;
+	}
+	stats_poll_kernel();
+	stats_write_metrics(out, intf_metrics, sizeof(intf_metrics) / sizeof(intf_metrics[0]), false);
+	stats_write_metrics(out, kernel_metrics, sizeof(kernel_metrics) / sizeof(kernel_metrics[0]), true);
+	stats_write_filtered(out);
+	stats_write_latency(out);
+	stats_write_stages(out);
+	fclose(out);
+}
+
+static void *stats_loop(void *arg){
+	struct pollfd pfd;
+	int fd, ready;
+
+	pfd.fd = stats_listen_fd;
+	pfd.events = POLLIN;
+	while (true){
+		ready = poll(&pfd, 1, VNF_STATS_PERIOD_MS);
+		if (ready > 0){
+			fd = accept(stats_listen_fd, NULL, NULL);
+			if (fd != -1){
+				stats_serve(fd);
+			}
+		} else {
+			stats_poll_kernel();
+		}
+	}
+	return NULL;
+}
+/*
+* Bind the stats socket and start the exporter, a no-op without a name
+*/
+void stats_start(void){
+	struct sockaddr_un addr;
+	pthread_t thread;
+	sigset_t stop_set, old_set;
+
+	if (stats_shared == false){
+		return;
+	}
+	stats_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (stats_listen_fd == -1){
+		perror("stats socket");
+		return;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(stats_sock_path, sizeof(stats_sock_path), "%s%s.sock", STATS_SOCK_DIR, stats_shm_name);
+	strncpy(addr.sun_path, stats_sock_path, sizeof(addr.sun_path) - 1);
+	unlink(stats_sock_path);
+	if (bind(stats_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(stats_listen_fd, 4) == -1){
+		perror("stats socket bind");
+		close(stats_listen_fd);
+		stats_listen_fd = -1;
+		return;
+	}
+	/*
+	* Stop signals belong to the forwarding threads
+	*/
+	sigemptyset(&stop_set);
+	sigaddset(&stop_set, SIGINT);
+	sigaddset(&stop_set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_set, &old_set);
+	if (pthread_create(&thread, NULL, stats_loop, NULL) != 0){
+		perror("pthread_create stats");
+	} else {
+		pthread_detach(thread);
+		printf("Stats: shared memory %s, socket %s\n", stats_shm_name, stats_sock_path);
+	}
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+}
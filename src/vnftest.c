@@ -24,26 +24,109 @@
 
 #include <net/if.h>
 #include <netinet/in.h>
+#include <linux/if_packet.h>
 
 #include "vnfapp.h"
 /*
  * Declare functions
  */
 int read_config(char*, arg_config_t*);
-double get_clk(void);
 void *vnfapp(arg_config_t *arg);
 bool validate_mmap(arg_config_t *config);
+bool set_ports(arg_config_t *config, char **specs, unsigned int nspecs, char *map);
 bool is_power_two(int n);
+int parse_cpu_list(char *list, int *cpus, unsigned int max_cpus);
+bool pipeline_valid(char *spec);
+void pipeline_help(void);
 /**
  * Print configuration (Debugging utility)
  */
 void print_config(arg_config_t *config){
+    unsigned int i;
+    port_config_t *port;
+
     printf("\n---- VNF Test Utility ----\n");
-    printf("First interface: %s\n", config->first);
-    printf("Second interface: %s\n", config->second);
+    for (i = 0; i < config->nports; i++){
+        port = &config->ports[i];
+        printf("Port %u: %s -> %s",i,port->name,config->ports[port->peer].name);
+        if (port->max_ring_frames != config->max_ring_frames || port->max_ring_blocks != config->max_ring_blocks ||
+            port->max_frame_size != config->max_frame_size){
+            printf(", ring frames: %lu, blocks: %lu, frame size: %lu",port->max_ring_frames,port->max_ring_blocks,port->max_frame_size);
+        }
+        printf("\n");
+    }
     printf("Max Ring Frames: %lu\n", config->max_ring_frames);
     printf("Max Ring Blocks: %lu\n",config->max_ring_blocks);
-    printf("Max Frame Size: %lu\n",config->max_frame_size);
+    if (config->max_frame_size == AUTO_FRAME_SIZE){
+        printf("Max Frame Size: from the MTU\n");
+    } else {
+        printf("Max Frame Size: %lu\n",config->max_frame_size);
+    }
+    if (config->vnet_hdr){
+        printf("Offloads: GSO and checksum via PACKET_VNET_HDR\n");
+    }
+    if (config->autotune_us > 0){
+        printf("Autotune: rings hold %u us at line rate, %s\n",config->autotune_us,
+            config->autotune_apply ? "resized on drops" : "recommended on drops");
+    }
+    printf("Backend: %s\n",(config->backend == BACKEND_XDP) ? (config->xdp_drv_mode ? "AF_XDP driver" : "AF_XDP skb") : "packet mmap");
+    printf("TX Batch: %u\n",config->tx_batch);
+    printf("RX Budget: %u\n",config->rx_budget);
+    if (config->busy_poll_us > 0){
+        printf("Busy Poll: %u us%s\n",config->busy_poll_us, config->sock_busy_poll ? " (socket busy poll)" : "");
+    }
+    if (config->backend == BACKEND_MMAP){
+        printf("Event Loop: %s\n",(config->event_loop == EVENT_SQPOLL) ? "io_uring with SQPOLL" : (config->event_loop == EVENT_URING) ? "io_uring" : "epoll");
+    }
+    printf("TX Policy: %s\n",(config->tx_policy == TX_POLICY_DROP_OLDEST) ? "drop oldest" : (config->tx_policy == TX_POLICY_WAIT) ? "bounded wait" : "drop newest");
+    printf("Workers: %u\n",config->workers);
+    if (config->numa_node == NUMA_OFF){
+        printf("NUMA: off\n");
+    } else if (config->numa_node == NUMA_AUTO){
+        printf("NUMA: from the interfaces\n");
+    } else {
+        printf("NUMA: node %d\n",config->numa_node);
+    }
+    if (config->workers > 1){
+        printf("Fanout Mode: %s\n",(config->fanout_mode == PACKET_FANOUT_CPU) ? "cpu" : (config->fanout_mode == PACKET_FANOUT_QM) ? "qm" : "hash");
+    }
+    if (config->latency != LATENCY_OFF){
+        printf("Latency: %s timestamps\n",(config->latency == LATENCY_HW) ? "hardware" : "software");
+        if (config->tai_offset != 0){
+            printf("Latency: NIC clock on TAI\n");
+        }
+    }
+    if (config->pcap_in[0] != '\0'){
+        printf("Replay: %s -> %s\n",config->pcap_in,(config->pcap_out[0] != '\0') ? config->pcap_out : config->second);
+    }
+    if (config->stats_name[0] != '\0'){
+        printf("Stats: %s\n",config->stats_name);
+    }
+    if (config->filter[0] != '\0'){
+        printf("Filter: %s\n",config->filter);
+    }
+    printf("Pipeline: %s\n",config->pipeline);
+    if (strstr(config->pipeline, "flow") != NULL){
+        printf("Flows: %lu per worker\n",config->flows);
+    }
+    if (config->acl_path[0] != '\0'){
+        printf("ACL: %s\n",config->acl_path);
+    }
+    if (strstr(config->pipeline, "bridge") != NULL){
+        printf("MAC table: %lu entries, aging %u s, learn rate %lu/s\n",config->mac_entries,config->mac_aging,config->learn_rate);
+    }
+    if (config->qos_path[0] != '\0'){
+        printf("QoS: %s\n",config->qos_path);
+    }
+    if (config->capture_path[0] != '\0'){
+        printf("Capture: %s, %s, 1 in %lu frames, files of %lu MB, keep %u\n",config->capture_path,
+            (config->capture_filter[0] != '\0') ? config->capture_filter : "every frame",config->capture_sample,
+            config->capture_mb,config->capture_files);
+    }
+    printf("TPACKET Version: %u\n",config->tpacket_version);
+    if (config->tpacket_version == 3){
+        printf("Block Timeout: %u ms\n",config->block_timeout);
+    }
     printf("----------------------------------------\n");
 }
 /*
@@ -61,6 +144,48 @@ int main(int argc, char ** argv){
     unsigned long max_ring_frames;
     unsigned long max_ring_blocks;
     unsigned long max_frame_size;
+    unsigned int tpacket_version;
+    unsigned int block_timeout;
+    unsigned int tx_batch;
+    unsigned int rx_budget;
+    unsigned int backend;
+    bool xdp_drv_mode;
+    unsigned int busy_poll_us;
+    bool sock_busy_poll;
+    unsigned int event_loop;
+    unsigned int tx_policy;
+    unsigned int tx_wait_us;
+    bool qdisc_bypass;
+    bool tx_loss;
+    bool vnet_hdr;
+    unsigned int autotune_us;
+    bool autotune_apply;
+    unsigned int workers;
+    unsigned int fanout_mode;
+    int cpus[MAX_WORKERS];
+    int ncpus;
+    int numa_node;
+    char stats_name[STATS_NAME_SIZE];
+    unsigned int latency;
+    int tai_offset;
+    char pcap_in[PCAP_PATH_SIZE];
+    char pcap_out[PCAP_PATH_SIZE];
+    char pipeline[PIPELINE_SIZE];
+    unsigned long flows;
+    char acl_path[ACL_PATH_SIZE];
+    unsigned long mac_entries;
+    unsigned int mac_aging;
+    unsigned long learn_rate;
+    char qos_path[QOS_PATH_SIZE];
+    char capture_path[PCAP_PATH_SIZE];
+    char capture_filter[CAPTURE_FILTER_SIZE];
+    unsigned long capture_sample;
+    unsigned long capture_mb;
+    unsigned int capture_files;
+    char filter[FILTER_SIZE];
+    char *port_specs[MAX_PORTS];
+    unsigned int nport_specs;
+    char *port_map;
     char *str_part;
     bool valid;
     /*
@@ -70,7 +195,47 @@ int main(int argc, char ** argv){
     arg_second[0] = '\0';
     max_ring_frames = MAX_RING_FRAMES;
     max_ring_blocks = MAX_RING_BLOCKS;
-    max_frame_size = getpagesize();
+    max_frame_size = AUTO_FRAME_SIZE;
+    tpacket_version = DEFAULT_TPACKET_VERSION;
+    block_timeout = DEFAULT_BLOCK_TIMEOUT;
+    tx_batch = DEFAULT_TX_BATCH;
+    rx_budget = DEFAULT_RX_BUDGET;
+    backend = BACKEND_MMAP;
+    xdp_drv_mode = false;
+    busy_poll_us = 0;
+    sock_busy_poll = false;
+    event_loop = EVENT_EPOLL;
+    tx_policy = TX_POLICY_DROP_NEWEST;
+    tx_wait_us = DEFAULT_TX_WAIT_US;
+    qdisc_bypass = false;
+    tx_loss = false;
+    vnet_hdr = false;
+    autotune_us = 0;
+    autotune_apply = false;
+    workers = 1;
+    fanout_mode = PACKET_FANOUT_HASH;
+    ncpus = 0;
+    numa_node = NUMA_AUTO;
+    stats_name[0] = '\0';
+    latency = LATENCY_OFF;
+    tai_offset = 0;
+    pcap_in[0] = '\0';
+    pcap_out[0] = '\0';
+    strcpy(pipeline, DEFAULT_PIPELINE);
+    flows = DEFAULT_FLOWS;
+    acl_path[0] = '\0';
+    mac_entries = DEFAULT_MAC_ENTRIES;
+    mac_aging = DEFAULT_MAC_AGING;
+    learn_rate = DEFAULT_LEARN_RATE;
+    qos_path[0] = '\0';
+    capture_path[0] = '\0';
+    capture_filter[0] = '\0';
+    capture_sample = 1;
+    capture_mb = DEFAULT_CAPTURE_MB;
+    capture_files = DEFAULT_CAPTURE_FILES;
+    filter[0] = '\0';
+    nport_specs = 0;
+    port_map = NULL;
     arg_config_t config_info;
 
     static struct option longopts[] = {
@@ -79,13 +244,51 @@ int main(int argc, char ** argv){
         {"ring",required_argument,0,'r'},
         {"number",required_argument,0,'n'},
         {"length",required_argument,0,'l'},
+        {"tpacket",required_argument,0,'t'},
+        {"timeout",required_argument,0,'o'},
+        {"xdp",required_argument,0,'x'},
+        {"batch",required_argument,0,'b'},
+        {"budget",required_argument,0,'d'},
+        {"workers",required_argument,0,'w'},
+        {"fanout",required_argument,0,'m'},
+        {"cpus",required_argument,0,'c'},
+        {"numa",required_argument,0,'N'},
+        {"poll",required_argument,0,'p'},
+        {"sock-poll",no_argument,0,'P'},
+        {"events",required_argument,0,'E'},
+        {"tx-policy",required_argument,0,'T'},
+        {"tx-wait",required_argument,0,'W'},
+        {"qdisc-bypass",no_argument,0,'q'},
+        {"vnet-hdr",no_argument,0,'g'},
+        {"autotune",required_argument,0,'u'},
+        {"autotune-apply",no_argument,0,'U'},
+        {"tx-loss",no_argument,0,'L'},
+        {"stats",required_argument,0,'S'},
+        {"latency",required_argument,0,'H'},
+        {"read-pcap",required_argument,0,'i'},
+        {"write-pcap",required_argument,0,'O'},
+        {"pipeline",required_argument,0,'e'},
+        {"flows",required_argument,0,'F'},
+        {"acl",required_argument,0,'A'},
+        {"mac-table",required_argument,0,'M'},
+        {"mac-aging",required_argument,0,'a'},
+        {"learn-rate",required_argument,0,'R'},
+        {"qos",required_argument,0,'Q'},
+        {"capture",required_argument,0,'C'},
+        {"capture-filter",required_argument,0,'K'},
+        {"capture-sample",required_argument,0,'Y'},
+        {"capture-size",required_argument,0,'Z'},
+        {"capture-files",required_argument,0,'J'},
+        {"filter",required_argument,0,'G'},
+        {"port",required_argument,0,'I'},
+        {"port-map",required_argument,0,'X'},
         {"help",no_argument,0,'h'},
     };
     printf("Input: %s\n", argv[0]);
     /*
      * Loop over input
      */
-    while (( c = getopt_long(argc,argv, "f:s:r:n:l:h",longopts,NULL))!=-1){
+    while (( c = getopt_long(argc,argv, "f:s:r:n:l:t:o:x:b:d:w:m:c:p:PT:W:qLS:H:i:O:e:F:A:M:a:R:Q:I:X:gu:UN:C:K:Y:Z:J:E:G:h",longopts,NULL))!=-1){
         switch(c) {
             case 'f':
                 strncpy(arg_first,optarg,IFNAMSIZ-1);
@@ -102,13 +305,267 @@ int main(int argc, char ** argv){
             case 'l':
                 max_frame_size = strtoul(optarg, &str_part,10);
                 break;
+            case 't':
+                tpacket_version = strtoul(optarg, &str_part,10);
+                break;
+            case 'o':
+                block_timeout = strtoul(optarg, &str_part,10);
+                break;
+            case 'b':
+                tx_batch = strtoul(optarg, &str_part,10);
+                break;
+            case 'd':
+                rx_budget = strtoul(optarg, &str_part,10);
+                break;
+            case 'w':
+                workers = strtoul(optarg, &str_part,10);
+                break;
+            case 'm':
+                if (strcmp(optarg, "hash") == 0){
+                    fanout_mode = PACKET_FANOUT_HASH;
+                } else if (strcmp(optarg, "cpu") == 0){
+                    fanout_mode = PACKET_FANOUT_CPU;
+                } else if (strcmp(optarg, "qm") == 0){
+                    fanout_mode = PACKET_FANOUT_QM;
+                } else {
+                    printf("ERROR: Fanout mode: %s must be hash, cpu or qm\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                ncpus = parse_cpu_list(optarg, cpus, MAX_WORKERS);
+                if (ncpus <= 0){
+                    printf("ERROR: Invalid cpu list: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'N':
+                if (strcmp(optarg, "auto") == 0){
+                    numa_node = NUMA_AUTO;
+                } else if (strcmp(optarg, "off") == 0){
+                    numa_node = NUMA_OFF;
+                } else {
+                    numa_node = strtol(optarg, &str_part, 10);
+                    if (str_part == optarg || *str_part != '\0' || numa_node < 0 || numa_node >= MAX_NUMA_NODES){
+                        printf("ERROR: NUMA node: %s must be auto, off or a node number\n", optarg);
+                        exit(1);
+                    }
+                }
+                break;
+            case 'p':
+                busy_poll_us = strtoul(optarg, &str_part,10);
+                break;
+            case 'P':
+                sock_busy_poll = true;
+                break;
+            case 'E':
+                if (strcmp(optarg, "epoll") == 0){
+                    event_loop = EVENT_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0){
+                    event_loop = EVENT_URING;
+                } else if (strcmp(optarg, "sqpoll") == 0){
+                    event_loop = EVENT_SQPOLL;
+                } else {
+                    printf("ERROR: Event loop: %s must be epoll, uring or sqpoll\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'T':
+                if (strcmp(optarg, "newest") == 0){
+                    tx_policy = TX_POLICY_DROP_NEWEST;
+                } else if (strcmp(optarg, "oldest") == 0){
+                    tx_policy = TX_POLICY_DROP_OLDEST;
+                } else if (strcmp(optarg, "wait") == 0){
+                    tx_policy = TX_POLICY_WAIT;
+                } else {
+                    printf("ERROR: TX policy: %s must be newest, oldest or wait\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'W':
+                tx_wait_us = strtoul(optarg, &str_part,10);
+                break;
+            case 'q':
+                qdisc_bypass = true;
+                break;
+            case 'L':
+                tx_loss = true;
+                break;
+            case 'g':
+                vnet_hdr = true;
+                break;
+            case 'u':
+                autotune_us = strtoul(optarg, &str_part,10);
+                break;
+            case 'U':
+                autotune_apply = true;
+                break;
+            case 'S':
+                if (strlen(optarg) >= STATS_NAME_SIZE || strchr(optarg, '/') != NULL){
+                    printf("ERROR: Stats name: %s must be a plain name shorter than %d\n", optarg, STATS_NAME_SIZE);
+                    exit(1);
+                }
+                strncpy(stats_name, optarg, STATS_NAME_SIZE-1);
+                stats_name[STATS_NAME_SIZE-1] = '\0';
+                break;
+            case 'H':
+                if (strcmp(optarg, "sw") == 0){
+                    latency = LATENCY_SW;
+                } else if (strcmp(optarg, "hw") == 0){
+                    latency = LATENCY_HW;
+                } else if (strcmp(optarg, "hw-tai") == 0){
+                    latency = LATENCY_HW;
+                    tai_offset = LAT_TAI_KERNEL;
+                } else if (strncmp(optarg, "hw-tai=", 7) == 0){
+                    latency = LATENCY_HW;
+                    tai_offset = strtol(optarg + 7, &str_part, 10);
+                    if (*str_part != '\0' || tai_offset < 0 || tai_offset > LAT_TAI_MAX){
+                        printf("ERROR: TAI offset: %s must be between 0 and %d seconds\n", optarg + 7, LAT_TAI_MAX);
+                        exit(1);
+                    }
+                } else {
+                    printf("ERROR: Latency timestamps: %s must be sw, hw, hw-tai or hw-tai=seconds\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'i':
+            case 'O':
+                if (strlen(optarg) >= PCAP_PATH_SIZE){
+                    printf("ERROR: pcap path: %s longer than %d\n", optarg, PCAP_PATH_SIZE - 1);
+                    exit(1);
+                }
+                strncpy((c == 'i') ? pcap_in : pcap_out, optarg, PCAP_PATH_SIZE-1);
+                break;
+            case 'e':
+                if (strlen(optarg) >= PIPELINE_SIZE){
+                    printf("ERROR: Pipeline: %s longer than %d\n", optarg, PIPELINE_SIZE - 1);
+                    exit(1);
+                }
+                strncpy(pipeline, optarg, PIPELINE_SIZE-1);
+                pipeline[PIPELINE_SIZE-1] = '\0';
+                break;
+            case 'F':
+                flows = strtoul(optarg, &str_part,10);
+                break;
+            case 'A':
+                if (strlen(optarg) >= ACL_PATH_SIZE){
+                    printf("ERROR: ACL path: %s longer than %d\n", optarg, ACL_PATH_SIZE - 1);
+                    exit(1);
+                }
+                strncpy(acl_path, optarg, ACL_PATH_SIZE-1);
+                break;
+            case 'M':
+                mac_entries = strtoul(optarg, &str_part,10);
+                break;
+            case 'a':
+                mac_aging = strtoul(optarg, &str_part,10);
+                break;
+            case 'R':
+                learn_rate = strtoul(optarg, &str_part,10);
+                break;
+            case 'Q':
+                if (strlen(optarg) >= QOS_PATH_SIZE){
+                    printf("ERROR: QoS path: %s longer than %d\n", optarg, QOS_PATH_SIZE - 1);
+                    exit(1);
+                }
+                strncpy(qos_path, optarg, QOS_PATH_SIZE-1);
+                break;
+            case 'C':
+                if (strlen(optarg) >= PCAP_PATH_SIZE){
+                    printf("ERROR: Capture path: %s longer than %d\n", optarg, PCAP_PATH_SIZE - 1);
+                    exit(1);
+                }
+                strncpy(capture_path, optarg, PCAP_PATH_SIZE-1);
+                break;
+            case 'K':
+                if (strlen(optarg) >= CAPTURE_FILTER_SIZE){
+                    printf("ERROR: Capture filter: %s longer than %d\n", optarg, CAPTURE_FILTER_SIZE - 1);
+                    exit(1);
+                }
+                strncpy(capture_filter, optarg, CAPTURE_FILTER_SIZE-1);
+                break;
+            case 'Y':
+                capture_sample = strtoul(optarg, &str_part,10);
+                break;
+            case 'Z':
+                capture_mb = strtoul(optarg, &str_part,10);
+                break;
+            case 'J':
+                capture_files = strtoul(optarg, &str_part,10);
+                break;
+            case 'G':
+                if (strlen(optarg) >= FILTER_SIZE){
+                    printf("ERROR: Filter: %s longer than %d\n", optarg, FILTER_SIZE - 1);
+                    exit(1);
+                }
+                strncpy(filter, optarg, FILTER_SIZE-1);
+                break;
+            case 'I':
+                if (nport_specs == MAX_PORTS){
+                    printf("ERROR: At most %d ports\n", MAX_PORTS);
+                    exit(1);
+                }
+                port_specs[nport_specs++] = optarg;
+                break;
+            case 'X':
+                port_map = optarg;
+                break;
+            case 'x':
+                backend = BACKEND_XDP;
+                if (strcmp(optarg, "drv") == 0){
+                    xdp_drv_mode = true;
+                } else if (strcmp(optarg, "skb") != 0){
+                    printf("ERROR: AF_XDP mode: %s must be skb or drv\n", optarg);
+                    exit(1);
+                }
+                break;
             case 'h':
                 printf("Command line arguments: \n");
                 printf("-f, --first     First interface \n");
                 printf("-s, --second    Second interface \n");
+                printf("-I, --port      Another interface, as name[:ring=N][:number=N][:length=N] to size its rings \n");
+                printf("-X, --port-map  Where forwarded frames go, as in:out[,in:out...] by name or port number \n");
+                printf("                (default ports forward in pairs: 0 and 1, 2 and 3...) \n");
                 printf("-r, --ring      Number of blocks of frame size \n");
                 printf("-n, --number    Number of rings  \n");
-                printf("-l, --length    Length of a frame \n");
+                printf("-l, --length    Length of a frame, 0 sizes it from the MTU (default) \n");
+                printf("-t, --tpacket   RX ring version 2 (frames) or 3 (blocks) \n");
+                printf("-o, --timeout   V3 block retire timeout in ms \n");
+                printf("-b, --batch     TX frames queued before the kernel is poked \n");
+                printf("-d, --budget    RX frames drained per wakeup \n");
+                printf("-w, --workers   Number of worker threads \n");
+                printf("-m, --fanout    Fanout mode for workers: hash, cpu or qm \n");
+                printf("-c, --cpus      Cores to pin workers to, e.g. 2,3,6-9 \n");
+                printf("-N, --numa      NUMA node of the workers and their memory: auto, off or a node (default auto) \n");
+                printf("-p, --poll      Busy poll the rings for up to this many us before sleeping \n");
+                printf("-P, --sock-poll Also set SO_BUSY_POLL and SO_PREFER_BUSY_POLL \n");
+                printf("-E, --events    Event loop: epoll, uring or sqpoll (io_uring with a kernel submission thread) \n");
+                printf("-T, --tx-policy TX ring full policy: newest, oldest or wait \n");
+                printf("-W, --tx-wait   Maximum us to wait for a TX slot with the wait policy \n");
+                printf("-q, --qdisc-bypass Send directly to the device queue \n");
+                printf("-g, --vnet-hdr  Forward GSO packets whole with their offload header (PACKET_VNET_HDR) \n");
+                printf("-u, --autotune  Size the rings to absorb this many us at line rate, recommend larger ones on drops \n");
+                printf("-U, --autotune-apply Also resize the rings on drops (default %d us when -u is not given) \n", DEFAULT_AUTOTUNE_US);
+                printf("-L, --tx-loss   Let the kernel skip malformed TX frames (PACKET_LOSS) \n");
+                printf("-x, --xdp       Use AF_XDP in skb (generic) or drv mode \n");
+                printf("-S, --stats     Export counters as /dev/shm/<name> and /tmp/<name>.sock \n");
+                printf("-i, --read-pcap Replay a pcap or pcapng file instead of reading the first interface \n");
+                printf("-O, --write-pcap Write frames from --read-pcap to a pcap file instead of the second interface \n");
+                printf("-H, --latency   Histogram RX to TX kick latency from sw or hw RX timestamps, hw-tai[=seconds] for a NIC clock on TAI \n");
+                printf("-e, --pipeline  Comma separated stages every frame goes through (default %s): \n", DEFAULT_PIPELINE);
+                pipeline_help();
+                printf("-F, --flows     Flow cache entries per worker (default %d) \n", DEFAULT_FLOWS);
+                printf("-A, --acl       Rule file of the acl stage \n");
+                printf("-M, --mac-table MAC table entries of the bridge stage (default %d) \n", DEFAULT_MAC_ENTRIES);
+                printf("-a, --mac-aging Seconds a learnt address is kept (default %d) \n", DEFAULT_MAC_AGING);
+                printf("-R, --learn-rate New addresses learnt per second per worker, 0 is unlimited (default %d) \n", DEFAULT_LEARN_RATE);
+                printf("-Q, --qos       Rule file of the qos stage \n");
+                printf("-C, --capture   Capture stage files, written as <path>.0, <path>.1... \n");
+                printf("-K, --capture-filter Capture only frames matching an acl match, e.g. \"proto tcp dport 80\" \n");
+                printf("-Y, --capture-sample Capture 1 in N matching frames (default 1) \n");
+                printf("-Z, --capture-size MB written before the next capture file (default %d) \n", DEFAULT_CAPTURE_MB);
+                printf("-J, --capture-files Capture files kept, 0 keeps all (default %d) \n", DEFAULT_CAPTURE_FILES);
+                printf("-G, --filter    Keep frames not matching a tcpdump style expression off the RX rings, e.g. \"udp or arp\" \n");
                 printf("-h, --help:     Command line help \n");
                 exit(1);
             default:
@@ -134,6 +591,48 @@ int main(int argc, char ** argv){
         config_info.max_ring_frames = max_ring_frames;
         config_info.max_ring_blocks = max_ring_blocks;
         config_info.max_frame_size = max_frame_size;
+        config_info.tpacket_version = tpacket_version;
+        config_info.block_timeout = block_timeout;
+        config_info.tx_batch = tx_batch;
+        config_info.rx_budget = rx_budget;
+        config_info.busy_poll_us = busy_poll_us;
+        config_info.sock_busy_poll = sock_busy_poll;
+        config_info.event_loop = event_loop;
+        config_info.tx_policy = tx_policy;
+        config_info.tx_wait_us = tx_wait_us;
+        config_info.qdisc_bypass = qdisc_bypass;
+        config_info.tx_loss = tx_loss;
+        config_info.vnet_hdr = vnet_hdr;
+        config_info.autotune_us = (autotune_apply && autotune_us == 0) ? DEFAULT_AUTOTUNE_US : autotune_us;
+        config_info.autotune_apply = autotune_apply;
+        config_info.workers = workers;
+        config_info.fanout_mode = fanout_mode;
+        config_info.ncpus = ncpus;
+        config_info.numa_node = numa_node;
+        memcpy(config_info.cpus, cpus, sizeof(cpus));
+        config_info.backend = backend;
+        config_info.xdp_drv_mode = xdp_drv_mode;
+        memcpy(config_info.stats_name, stats_name, sizeof(stats_name));
+        config_info.latency = latency;
+        config_info.tai_offset = tai_offset;
+        memcpy(config_info.pcap_in, pcap_in, sizeof(pcap_in));
+        memcpy(config_info.pcap_out, pcap_out, sizeof(pcap_out));
+        memcpy(config_info.pipeline, pipeline, sizeof(pipeline));
+        config_info.flows = flows;
+        memcpy(config_info.acl_path, acl_path, sizeof(acl_path));
+        config_info.mac_entries = mac_entries;
+        config_info.mac_aging = mac_aging;
+        config_info.learn_rate = learn_rate;
+        memcpy(config_info.qos_path, qos_path, sizeof(qos_path));
+        memcpy(config_info.capture_path, capture_path, sizeof(capture_path));
+        memcpy(config_info.capture_filter, capture_filter, sizeof(capture_filter));
+        config_info.capture_sample = capture_sample;
+        config_info.capture_mb = capture_mb;
+        config_info.capture_files = capture_files;
+        memcpy(config_info.filter, filter, sizeof(filter));
+    }
+    if (!set_ports(&config_info, port_specs, nport_specs, port_map)){
+        exit(-1);
     }
     /*
     * TODO - validate mmap parameters
@@ -163,15 +662,66 @@ int read_config(char *file_name, arg_config_t *config){
     char *second_interface = "em3";
     config->max_ring_frames = MAX_RING_FRAMES;
     config->max_ring_blocks = MAX_RING_BLOCKS;
-    config->max_frame_size = getpagesize();
+    config->max_frame_size = AUTO_FRAME_SIZE;
+    config->tpacket_version = DEFAULT_TPACKET_VERSION;
+    config->block_timeout = DEFAULT_BLOCK_TIMEOUT;
+    config->tx_batch = DEFAULT_TX_BATCH;
+    config->rx_budget = DEFAULT_RX_BUDGET;
+    config->busy_poll_us = 0;
+    config->sock_busy_poll = false;
+    config->event_loop = EVENT_EPOLL;
+    config->tx_policy = TX_POLICY_DROP_NEWEST;
+    config->tx_wait_us = DEFAULT_TX_WAIT_US;
+    config->qdisc_bypass = false;
+    config->tx_loss = false;
+    config->vnet_hdr = false;
+    config->autotune_us = 0;
+    config->autotune_apply = false;
+    config->workers = 1;
+    config->fanout_mode = PACKET_FANOUT_HASH;
+    config->ncpus = 0;
+    config->numa_node = NUMA_AUTO;
+    config->backend = BACKEND_MMAP;
+    config->xdp_drv_mode = false;
+    config->stats_name[0] = '\0';
+    config->latency = LATENCY_OFF;
+    config->tai_offset = 0;
+    config->pcap_in[0] = '\0';
+    config->pcap_out[0] = '\0';
+    strcpy(config->pipeline, DEFAULT_PIPELINE);
+    config->flows = DEFAULT_FLOWS;
+    config->acl_path[0] = '\0';
+    config->mac_entries = DEFAULT_MAC_ENTRIES;
+    config->mac_aging = DEFAULT_MAC_AGING;
+    config->learn_rate = DEFAULT_LEARN_RATE;
+    config->qos_path[0] = '\0';
+    config->capture_path[0] = '\0';
+    config->capture_filter[0] = '\0';
+    config->capture_sample = 1;
+    config->capture_mb = DEFAULT_CAPTURE_MB;
+    config->capture_files = DEFAULT_CAPTURE_FILES;
+    config->filter[0] = '\0';
     strncpy(config->first,first_interface,IFNAMSIZ-1);
     strncpy(config->second, second_interface,IFNAMSIZ-1);
 
     return 0;
 }
 
+/*
+* Frames sized from the MTU are checked once the MTU is known, a block of
+* explicit ones must fill whole pages
+*/
+static bool valid_frame_size(unsigned long frame_size, unsigned long nframes, unsigned long page_size){
+    if (frame_size == AUTO_FRAME_SIZE){
+        return true;
+    }
+    return frame_size <= MAX_FRAME_SIZE && is_power_two(frame_size) && (nframes * frame_size) % page_size == 0;
+}
+
 bool validate_mmap(arg_config_t *config){
     bool status = true;
+    port_config_t *port;
+    unsigned int i;
     unsigned long nframes,nblocks,frame_size, page_size;
     /*
     * System page size
@@ -183,8 +733,9 @@ bool validate_mmap(arg_config_t *config){
     nframes = config->max_ring_frames;
     nblocks = config->max_ring_blocks;    
     frame_size = config->max_frame_size;
-    if (!(frame_size <= page_size && is_power_two(frame_size))){
-        printf("ERROR: Max frame size: %lu is not a power of 2 or is greater than max page size: %lu\n", frame_size,page_size);
+    if (!valid_frame_size(frame_size, nframes, page_size)){
+        printf("ERROR: Max frame size: %lu is not 0 or a power of 2 up to %lu filling whole pages: %lu with %lu frames\n",
+            frame_size, MAX_FRAME_SIZE, page_size, nframes);
         return false;
     }
     if (!is_power_two(nframes)){
@@ -195,9 +746,200 @@ bool validate_mmap(arg_config_t *config){
         printf("ERROR: Max ring blocks: %lu is not a power of 2.\n", nblocks);
         return false;
     }
+    if (config->tx_batch == 0 || config->tx_batch > nframes * nblocks){
+        printf("ERROR: TX batch: %u must be between 1 and the ring size: %lu.\n", config->tx_batch, nframes * nblocks);
+        return false;
+    }
+    if (config->rx_budget == 0){
+        printf("ERROR: RX budget must be at least 1.\n");
+        return false;
+    }
+    if (config->workers == 0 || config->workers > MAX_WORKERS){
+        printf("ERROR: Workers: %u must be between 1 and %d.\n", config->workers, MAX_WORKERS);
+        return false;
+    }
+    if (config->vnet_hdr && config->backend == BACKEND_XDP){
+        printf("ERROR: PACKET_VNET_HDR needs the packet mmap backend.\n");
+        return false;
+    }
+    if (config->autotune_us > MAX_AUTOTUNE_US){
+        printf("ERROR: Autotune: %u us must be at most %d.\n", config->autotune_us, MAX_AUTOTUNE_US);
+        return false;
+    }
+    if (config->autotune_us > 0 && config->backend == BACKEND_XDP){
+        printf("ERROR: Ring autotuning needs the packet mmap backend.\n");
+        return false;
+    }
+    if (config->tpacket_version != 2 && config->tpacket_version != 3){
+        printf("ERROR: TPACKET version: %u must be 2 or 3.\n", config->tpacket_version);
+        return false;
+    }
+    if (!pipeline_valid(config->pipeline)){
+        return false;
+    }
+    if (config->flows == 0 || config->flows > MAX_FLOWS){
+        printf("ERROR: Flows: %lu must be between 1 and %lu.\n", config->flows, MAX_FLOWS);
+        return false;
+    }
+    if (config->mac_entries == 0 || config->mac_entries > MAX_MAC_ENTRIES){
+        printf("ERROR: MAC table: %lu must be between 1 and %lu.\n", config->mac_entries, MAX_MAC_ENTRIES);
+        return false;
+    }
+    if (config->mac_aging == 0 || config->mac_aging > MAX_MAC_AGING){
+        printf("ERROR: MAC aging: %u must be between 1 and %d.\n", config->mac_aging, MAX_MAC_AGING);
+        return false;
+    }
+    if (config->capture_sample == 0){
+        printf("ERROR: Capture sample: must be at least 1.\n");
+        return false;
+    }
+    if (config->capture_mb == 0 || config->capture_mb > MAX_CAPTURE_MB){
+        printf("ERROR: Capture size: %lu must be between 1 and %lu MB.\n", config->capture_mb, (unsigned long)MAX_CAPTURE_MB);
+        return false;
+    }
+    for (i = 0; i < config->nports; i++){
+        port = &config->ports[i];
+        if (!valid_frame_size(port->max_frame_size, port->max_ring_frames, page_size) || !is_power_two(port->max_ring_frames) ||
+            !is_power_two(port->max_ring_blocks) || port->max_ring_blocks == 1 || config->tx_batch > port->max_ring_frames * port->max_ring_blocks){
+            printf("ERROR: Port: %s ring frames and blocks must be powers of 2, with at least 2 blocks and %u frames in all, and the frame size 0 or a power of 2 up to %lu filling whole pages.\n",
+                port->name, config->tx_batch, MAX_FRAME_SIZE);
+            return false;
+        }
+    }
     /*
     *  Validate values (if we do not valaidate mmap will fail).
     */
     return status;
 }
- 
+/*
+* Add a port given as name[:ring=N][:number=N][:length=N], ring settings
+* left out are the ones of -r, -n and -l
+*/
+static bool add_port(arg_config_t *config, char *spec){
+    port_config_t *port;
+    char buf[PORT_SPEC_SIZE];
+    char *field, *value, *save;
+    unsigned int i;
+
+    if (config->nports == MAX_PORTS){
+        printf("ERROR: At most %d ports\n", MAX_PORTS);
+        return false;
+    }
+    strncpy(buf, spec, PORT_SPEC_SIZE-1);
+    buf[PORT_SPEC_SIZE-1] = '\0';
+    field = strtok_r(buf, ":", &save);
+    if (field == NULL || strlen(field) >= IFNAMSIZ){
+        printf("ERROR: Port: %s needs an interface name of at most %d characters\n", spec, IFNAMSIZ - 1);
+        return false;
+    }
+    for (i = 0; i < config->nports; i++){
+        if (strcmp(config->ports[i].name, field) == 0){
+            printf("ERROR: Port: %s given twice\n", field);
+            return false;
+        }
+    }
+    port = &config->ports[config->nports];
+    memset(port, 0, sizeof(*port));
+    strncpy(port->name, field, IFNAMSIZ-1);
+    port->max_ring_frames = config->max_ring_frames;
+    port->max_ring_blocks = config->max_ring_blocks;
+    port->max_frame_size = config->max_frame_size;
+    while ((field = strtok_r(NULL, ":", &save)) != NULL){
+        value = strchr(field, '=');
+        if (value == NULL){
+            printf("ERROR: Port: %s setting: %s has no value\n", spec, field);
+            return false;
+        }
+        *value++ = '\0';
+        if (strcmp(field, "ring") == 0){
+            port->max_ring_frames = strtoul(value, NULL, 10);
+        } else if (strcmp(field, "number") == 0){
+            port->max_ring_blocks = strtoul(value, NULL, 10);
+        } else if (strcmp(field, "length") == 0){
+            port->max_frame_size = strtoul(value, NULL, 10);
+        } else {
+            printf("ERROR: Port: %s unknown setting: %s\n", spec, field);
+            return false;
+        }
+    }
+    config->nports++;
+    return true;
+}
+/*
+* Port number of a name or of a number in range, -1 otherwise
+*/
+static int find_port(arg_config_t *config, char *name){
+    unsigned long n;
+    char *end;
+    unsigned int i;
+
+    for (i = 0; i < config->nports; i++){
+        if (strcmp(config->ports[i].name, name) == 0){
+            return i;
+        }
+    }
+    n = strtoul(name, &end, 10);
+    if (name[0] != '\0' && *end == '\0' && n < config->nports){
+        return n;
+    }
+    return -1;
+}
+/*
+* Ports forward in pairs unless the map says otherwise, a port left
+* without a partner sends frames back out
+*/
+static bool set_port_map(arg_config_t *config, char *map){
+    char buf[PORT_MAP_SIZE];
+    char *pair, *out, *save;
+    int from, to;
+    unsigned int i;
+
+    for (i = 0; i < config->nports; i++){
+        config->ports[i].peer = ((i ^ 1) < config->nports) ? (i ^ 1) : i;
+    }
+    if (map == NULL){
+        return true;
+    }
+    if (strlen(map) >= PORT_MAP_SIZE){
+        printf("ERROR: Port map: %s longer than %d\n", map, PORT_MAP_SIZE - 1);
+        return false;
+    }
+    strcpy(buf, map);
+    for (pair = strtok_r(buf, ",", &save); pair != NULL; pair = strtok_r(NULL, ",", &save)){
+        out = strchr(pair, ':');
+        if (out == NULL){
+            printf("ERROR: Port map entry: %s is not in:out\n", pair);
+            return false;
+        }
+        *out++ = '\0';
+        from = find_port(config, pair);
+        to = find_port(config, out);
+        if (from == -1 || to == -1){
+            printf("ERROR: Port map entry: %s:%s names an unknown port\n", pair, out);
+            return false;
+        }
+        config->ports[from].peer = to;
+    }
+    return true;
+}
+/*
+* The first and second interfaces are ports 0 and 1, then come the ones
+* given with --port
+*/
+bool set_ports(arg_config_t *config, char **specs, unsigned int nspecs, char *map){
+    unsigned int i;
+
+    config->nports = 0;
+    if (config->first[0] != '\0' && !add_port(config, config->first)){
+        return false;
+    }
+    if (config->second[0] != '\0' && strcmp(config->second, config->first) != 0 && !add_port(config, config->second)){
+        return false;
+    }
+    for (i = 0; i < nspecs; i++){
+        if (!add_port(config, specs[i])){
+            return false;
+        }
+    }
+    return set_port_map(config, map);
+}
@@ -0,0 +1,142 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*! Ring autotuning
+ *
+ * At startup the rings of a port are sized to hold absorb_us of minimum
+ * size frames arriving at the link speed, in blocks of about
+ * TUNE_BLOCK_BYTES, and are never made smaller than asked for. While
+ * running, the kernel drop counter and the RX slots found losing are
+ * sampled once a TUNE_PERIOD_MS. A period with losses doubles the ring:
+ * the new geometry is printed as ring options for the next run or, when
+ * applying, the worker re-creates the rings the next time the port is
+ * quiet. A port that stays busy for a whole period is resized anyway and
+ * the frames waiting in its RX ring are lost. A direction never grows
+ * past TUNE_MAX_RING_BYTES.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <linux/if_packet.h>
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnfstats.h"
+#include "vnftune.h"
+
+int get_link_speed(int fd, char *name);
+
+/*
+* Frames per block and blocks of a ring of frame_size frames with room
+* for wanted frames. Both stay powers of two and there are at least two
+* blocks. The ring keeps its current size when it is already larger.
+*/
+static void tune_geometry(unsigned long frame_size, unsigned long current, unsigned long wanted,
+	unsigned long *frames, unsigned long *blocks){
+	unsigned long per_block = MAX(TUNE_BLOCK_BYTES / frame_size, 1);
+	unsigned long limit = MAX(TUNE_MAX_RING_BYTES / frame_size, 2 * per_block);
+	unsigned long total = 2 * per_block;
+
+	wanted = MAX(wanted, current);
+	while (total < wanted && total < limit){
+		total <<= 1;
+	}
+	if (total < current || total % per_block != 0){
+		total = current;
+	}
+	*frames = per_block;
+	*blocks = total / per_block;
+}
+
+void tune_init(intf_config_t *config, arg_config_t *arg_config){
+	tune_state_t *tune = &config->tune;
+	unsigned long wanted, frames, blocks;
+	int speed;
+
+	tune->absorb_us = arg_config->autotune_us;
+	tune->apply = arg_config->autotune_apply;
+	speed = get_link_speed(config->fd, config->name);
+	if (speed == -1){
+		printf("Autotune: link speed of: %s unknown, assuming %u Mbps\n", config->name, TUNE_DEFAULT_SPEED);
+		speed = TUNE_DEFAULT_SPEED;
+	}
+	/*
+	* Mbps times us is bits
+	*/
+	wanted = (unsigned long)speed * tune->absorb_us / (TUNE_WIRE_BYTES * 8);
+	tune_geometry(config->max_frame_size, config->max_ring_frames * config->max_ring_blocks, wanted, &frames, &blocks);
+	if (frames * blocks != config->max_ring_frames * config->max_ring_blocks){
+		config->max_ring_frames = frames;
+		config->max_ring_blocks = blocks;
+	}
+	printf("Autotune: %s at %d Mbps, %u us of minimum size frames is %lu frames, rings of %lu frames in %lu blocks\n",
+		config->name, speed, tune->absorb_us, wanted, config->max_ring_frames, config->max_ring_blocks);
+}
+
+bool tune_sample(intf_config_t *config, uint64_t now){
+	tune_state_t *tune = &config->tune;
+	unsigned long base, frames, blocks;
+	uint64_t drops;
+	unsigned long losing;
+
+	if (now < tune->next_ns){
+		return tune->apply && tune->want_frames != 0;
+	}
+	tune->next_ns = now + TUNE_PERIOD_NS;
+	stats_poll_socket(config);
+	drops = config->kernel->drops - tune->drops;
+	losing = config->burst.losing - tune->losing;
+	tune->drops = config->kernel->drops;
+	tune->losing = config->burst.losing;
+	if (drops == 0 && losing == 0){
+		return tune->apply && tune->want_frames != 0;
+	}
+	if (tune->apply && tune->want_frames != 0){
+		return true;
+	}
+	base = config->max_ring_frames * config->max_ring_blocks;
+	tune_geometry(config->max_frame_size, base, 2 * base, &frames, &blocks);
+	if (frames * blocks <= base){
+		if (!tune->limited){
+			printf("Autotune: %s dropped %lu frames, its rings are at their limit\n", config->name, drops);
+			tune->limited = true;
+		}
+		return tune->apply && tune->want_frames != 0;
+	}
+	if (frames == tune->want_frames && blocks == tune->want_blocks){
+		return tune->apply;
+	}
+	tune->want_frames = frames;
+	tune->want_blocks = blocks;
+	tune->want_ns = now;
+	printf("Autotune: %s dropped %lu frames, %lu slots losing, %s -r %lu -n %lu\n", config->name, drops, losing,
+		tune->apply ? "resizing to" : "try", frames, blocks);
+	return tune->apply;
+}
+/*
+* Print the geometry the rings ended up with
+*/
+void print_tune_stats(intf_config_t *config){
+	tune_state_t *tune = &config->tune;
+
+	if (tune->absorb_us == 0){
+		return;
+	}
+	printf("\n---- Ring autotune: %s ----\n", config->name);
+	printf("Rings: %lu frames in %lu blocks of %lu bytes, resizes: %lu, kernel drops: %lu\n", config->max_ring_frames,
+		config->max_ring_blocks, config->max_ring_frames * config->max_frame_size, tune->resizes, (unsigned long)tune->drops);
+	if (!tune->apply && tune->want_frames != 0){
+		printf("Recommended: -r %lu -n %lu\n", tune->want_frames, tune->want_blocks);
+	}
+}
@@ -0,0 +1,235 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+* io_uring event engine. The rings are set up and mapped with the raw
+* syscalls so there is no dependency on liburing. The forwarding loop
+* queues readiness polls and TX kicks as entries and hands them over with
+* the wait, with SQPOLL a kernel thread takes them without any syscall.
+*/
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+//
+#include <sys/mman.h>
+#include <sys/syscall.h>
+//
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnfuring.h"
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *params){
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t arg_len){
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_len);
+}
+/*
+* Without SQPOLL only the worker submits and completions are only needed
+* when it enters the kernel anyway, kernels before 6.0 refuse the flags
+*/
+static int uring_setup(unsigned int entries, struct io_uring_params *params, bool sqpoll){
+	unsigned int flags = IORING_SETUP_CQSIZE;
+	int fd;
+
+	memset(params, 0, sizeof(*params));
+	params->cq_entries = entries * 2;
+	if (sqpoll){
+		params->flags = flags | IORING_SETUP_SQPOLL;
+		params->sq_thread_idle = URING_SQ_IDLE_MS;
+		return sys_io_uring_setup(entries, params);
+	}
+	params->flags = flags | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+	fd = sys_io_uring_setup(entries, params);
+	if (fd == -1 && errno == EINVAL){
+		memset(params, 0, sizeof(*params));
+		params->cq_entries = entries * 2;
+		params->flags = flags;
+		fd = sys_io_uring_setup(entries, params);
+	}
+	return fd;
+}
+
+static void *uring_map(int fd, size_t len, off_t offset){
+	void *map;
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+	if (map == MAP_FAILED){
+		perror("mmap io_uring");
+		return NULL;
+	}
+	return map;
+}
+
+int uring_init(uring_t *ring, unsigned int entries, bool sqpoll){
+	struct io_uring_params params;
+	uint8_t *sq, *cq;
+	unsigned int i;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->sqpoll = sqpoll;
+	ring->fd = uring_setup(entries, &params, sqpoll);
+	if (ring->fd == -1){
+		perror("io_uring_setup");
+		return -1;
+	}
+	if (sqpoll && sysconf(_SC_NPROCESSORS_ONLN) < 2){
+		printf("WARNING: The SQPOLL thread spins on the only CPU, it takes time from the worker\n");
+	}
+	if ((params.features & IORING_FEAT_EXT_ARG) == 0){
+		printf("ERROR: io_uring needs Linux 5.11 or later for timed waits\n");
+		close(ring->fd);
+		return -1;
+	}
+	ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP){
+		ring->sq_map_len = MAX(ring->sq_map_len, ring->cq_map_len);
+		ring->cq_map_len = 0;
+	}
+	ring->sq_map = uring_map(ring->fd, ring->sq_map_len, IORING_OFF_SQ_RING);
+	if (ring->sq_map == NULL){
+		close(ring->fd);
+		return -1;
+	}
+	ring->cq_map = ring->sq_map;
+	if (ring->cq_map_len > 0 && (ring->cq_map = uring_map(ring->fd, ring->cq_map_len, IORING_OFF_CQ_RING)) == NULL){
+		uring_free(ring);
+		return -1;
+	}
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = uring_map(ring->fd, ring->sqes_len, IORING_OFF_SQES);
+	if (ring->sqes == NULL){
+		uring_free(ring);
+		return -1;
+	}
+	sq = ring->sq_map;
+	ring->sq_head = (uint32_t *)(sq + params.sq_off.head);
+	ring->sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+	ring->sq_flags = (uint32_t *)(sq + params.sq_off.flags);
+	ring->sq_array = (uint32_t *)(sq + params.sq_off.array);
+	ring->sq_mask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+	cq = ring->cq_map;
+	ring->cq_head = (uint32_t *)(cq + params.cq_off.head);
+	ring->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+	ring->cq_mask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	/*
+	* Entries are used in order, the index array never changes
+	*/
+	for (i = 0; i < params.sq_entries; i++){
+		ring->sq_array[i] = i;
+	}
+	ring->tail = *ring->sq_tail;
+	return 0;
+}
+
+void uring_free(uring_t *ring){
+	if (ring->sqes != NULL){
+		munmap(ring->sqes, ring->sqes_len);
+	}
+	if (ring->cq_map != NULL && ring->cq_map != ring->sq_map){
+		munmap(ring->cq_map, ring->cq_map_len);
+	}
+	if (ring->sq_map != NULL){
+		munmap(ring->sq_map, ring->sq_map_len);
+	}
+	if (ring->fd != -1){
+		close(ring->fd);
+	}
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(uring_t *ring, uint32_t *index){
+	struct io_uring_sqe *sqe;
+
+	if (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask){
+		return NULL;
+	}
+	sqe = &ring->sqes[ring->tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	*index = ring->tail++;
+	return sqe;
+}
+
+bool uring_taken(uring_t *ring, uint32_t index){
+	return (int32_t)(__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) - index) > 0;
+}
+/*
+* The SQPOLL thread only needs a syscall when it went to sleep, the
+* barrier orders the tail store before the flag load as the kernel
+* expects
+*/
+int uring_enter(uring_t *ring, bool wait, int timeout_ms){
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int to_submit, flags = 0;
+	uint32_t sq_flags;
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+	to_submit = ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sqpoll){
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	sq_flags = __atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED);
+	if (ring->sqpoll){
+		if (to_submit > 0 && (sq_flags & IORING_SQ_NEED_WAKEUP)){
+			flags |= IORING_ENTER_SQ_WAKEUP;
+		}
+	} else if (to_submit == 0 && !wait && (sq_flags & IORING_SQ_CQ_OVERFLOW) == 0){
+		return 0;
+	}
+	if (sq_flags & IORING_SQ_CQ_OVERFLOW){
+		flags |= IORING_ENTER_GETEVENTS;
+	}
+	if (!wait){
+		if (flags == 0 && ring->sqpoll){
+			return 0;
+		}
+		ret = sys_io_uring_enter(ring->fd, to_submit, 0, flags, NULL, 0);
+	} else {
+		memset(&arg, 0, sizeof(arg));
+		arg.sigmask_sz = _NSIG / 8;
+		if (timeout_ms >= 0){
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+		}
+		ret = sys_io_uring_enter(ring->fd, to_submit, 1, flags | IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	}
+	if (ret == -1 && errno != ETIME){
+		return -1;
+	}
+	return 1;
+}
+
+struct io_uring_cqe *uring_cqe(uring_t *ring){
+	uint32_t head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+		return NULL;
+	}
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring){
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
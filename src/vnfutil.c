@@ -25,6 +25,9 @@
 //
 #include <arpa/inet.h>
 #include <linux/if_packet.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <linux/mempolicy.h>
 //
 #include <sys/types.h>
 #include <sys/ioctl.h>
@@ -32,6 +35,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/epoll.h>
+#include <sys/syscall.h>
 //
 #include <netinet/ip.h>
 #include <net/ethernet.h>
@@ -122,50 +126,121 @@ bool get_interface_status(int fd, char * intf_name){
 	return status;
 }
 /*
-* Configure ring buffer for socket
+* Release any rings attached to the socket so the version can be changed
+*/
+static void clear_pmap(int fd){
+	struct tpacket_req3 treq;
+
+	memset(&treq, 0, sizeof(treq));
+	setsockopt(fd, SOL_PACKET, PACKET_RX_RING, (void*)&treq, sizeof(treq));
+	setsockopt(fd, SOL_PACKET, PACKET_TX_RING, (void*)&treq, sizeof(treq));
+}
+/*
+* Request RX and TX rings of the configured geometry. V3 RX blocks retire
+* after the timeout, the TX ring must not set a timeout, private area or
+* feature word. V2 only reads the leading tpacket_req fields.
+*/
+static int request_rings(intf_config_t *vnf_config){
+	struct tpacket_req3 treq_rx, treq_tx;
+
+	memset(&treq_rx, 0, sizeof(treq_rx));
+	treq_rx.tp_block_size = vnf_config->max_ring_frames * vnf_config->max_frame_size;
+	treq_rx.tp_block_nr   = vnf_config->max_ring_blocks;
+	treq_rx.tp_frame_size = vnf_config->max_frame_size;
+	treq_rx.tp_frame_nr   = vnf_config->max_ring_frames * vnf_config->max_ring_blocks;
+	memcpy(&treq_tx, &treq_rx, sizeof(treq_tx));
+	if (vnf_config->tpacket_version == TPACKET_V3){
+		treq_rx.tp_retire_blk_tov = vnf_config->block_timeout;
+	}
+	if (setsockopt(vnf_config->fd, SOL_PACKET, PACKET_RX_RING, (void*)&treq_rx, sizeof(treq_rx)) == -1){
+		perror("PACKET_RX_RING");
+		return -1;
+	}
+	if (setsockopt(vnf_config->fd, SOL_PACKET, PACKET_TX_RING, (void*)&treq_tx, sizeof(treq_tx)) == -1){
+		perror("PACKET_TX_RING");
+		clear_pmap(vnf_config->fd);
+		return -1;
+	}
+	return 0;
+}
+/*
+* Map both rings, TX follows RX
+*/
+static int map_rings(intf_config_t *vnf_config){
+	unsigned long memlen;
+
+	memlen = vnf_config->max_ring_frames * vnf_config->max_frame_size * vnf_config->max_ring_blocks;
+	vnf_config->r_ring = mmap(NULL, 2 * memlen, PROT_READ | PROT_WRITE, MAP_SHARED, vnf_config->fd, 0);
+	if (vnf_config->r_ring == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	vnf_config->w_ring = vnf_config->r_ring + memlen;
+	vnf_config->ringr_offset = 0;
+	vnf_config->ringw_offset = 0;
+	vnf_config->ringc_offset = 0;
+	vnf_config->tx_inflight = 0;
+	vnf_config->tx_pending = 0;
+	return 0;
+}
+/*
+* Configure ring buffer for socket, TPACKET_V3 needs kernel 4.11 or later
+* for its TX ring
 */
 int set_pmap(intf_config_t *vnf_config, uint8_t **read_ring, uint8_t **write_ring){
- 	struct tpacket_req treq_rx, treq_tx;
- 	int status = 0;
- 	unsigned long memlen;
- 	int v = TPACKET_V2;
-
- 	memset(&treq_rx, 0, sizeof(treq_rx));
- 	treq_rx.tp_block_size =  vnf_config->max_ring_frames * vnf_config->max_frame_size;
-	treq_rx.tp_block_nr   =  vnf_config->max_ring_blocks;
-	treq_rx.tp_frame_size =  vnf_config->max_frame_size;
-	treq_rx.tp_frame_nr   =  vnf_config->max_ring_frames * vnf_config->max_ring_blocks;
-
-	memset(&treq_tx, 0, sizeof(treq_tx));
-	treq_tx.tp_block_size = vnf_config->max_ring_frames * vnf_config->max_frame_size;
-	treq_tx.tp_block_nr   = vnf_config->max_ring_blocks;
-	treq_tx.tp_frame_size = vnf_config->max_frame_size;
-	treq_tx.tp_frame_nr   = vnf_config->max_ring_frames * vnf_config->max_ring_blocks;
+	int v = TPACKET_V3;
 
+	if (vnf_config->tpacket_version == TPACKET_V3){
+		if (setsockopt(vnf_config->fd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) == 0 && request_rings(vnf_config) == 0){
+			goto map;
+		}
+		printf("WARNING: TPACKET_V3 not available on: %s, falling back to TPACKET_V2\n", vnf_config->name);
+		vnf_config->tpacket_version = TPACKET_V2;
+	}
+	v = TPACKET_V2;
 	if (setsockopt(vnf_config->fd , SOL_PACKET , PACKET_VERSION , &v , sizeof(v)) == -1){
 		perror("PACKET_VERSION");
 		close(vnf_config->fd);
 		return -1;
 	}
-	if (setsockopt(vnf_config->fd , SOL_PACKET , PACKET_RX_RING , (void*)&treq_rx , sizeof(treq_rx)) == -1){
-		perror("PACKET_RX_RING");
-		exit (-1);
+	if (request_rings(vnf_config) == -1){
+		exit(-1);
 	}
-   if (setsockopt(vnf_config->fd, SOL_PACKET , PACKET_TX_RING , (void*)&treq_tx , sizeof(treq_tx)) == -1){
-		perror("PACKET_TX_RING");
+map:
+	if (map_rings(vnf_config) == -1){
+		printf("Error: mmap failed: %d\n", errno);
 		exit(-1);
 	}
-	memlen = treq_rx.tp_block_size * treq_rx.tp_block_nr;
-
-  	*read_ring = mmap(NULL, 2 * memlen, PROT_READ | PROT_WRITE, MAP_SHARED, vnf_config->fd, 0);
-  	if (*read_ring == MAP_FAILED) {
-  		perror("mmap");
-   		printf("Error: mmap failed: %d\n", errno);
-   	    exit(-1);
-   	}
-   	*write_ring = *read_ring+memlen;
+	*read_ring = vnf_config->r_ring;
+	*write_ring = vnf_config->w_ring;
+	return 0;
+}
+/*
+* Replace the rings with ones of another geometry, the frame size stays.
+* Frames still in the rings are lost, so the caller waits until the RX
+* ring has nothing ready and every TX frame went out. The kernel only
+* frees rings nobody maps and only sets up new ones once the old are
+* gone. The old geometry is put back if the new one cannot be had.
+*/
+int resize_pmap(intf_config_t *vnf_config, unsigned long frames, unsigned long blocks){
+	unsigned long old_frames = vnf_config->max_ring_frames;
+	unsigned long old_blocks = vnf_config->max_ring_blocks;
 
-	return status;
+	munmap(vnf_config->r_ring, 2 * old_frames * vnf_config->max_frame_size * old_blocks);
+	clear_pmap(vnf_config->fd);
+	vnf_config->max_ring_frames = frames;
+	vnf_config->max_ring_blocks = blocks;
+	if (request_rings(vnf_config) == 0 && map_rings(vnf_config) == 0){
+		return 0;
+	}
+	clear_pmap(vnf_config->fd);
+	vnf_config->max_ring_frames = old_frames;
+	vnf_config->max_ring_blocks = old_blocks;
+	if (request_rings(vnf_config) == -1 || map_rings(vnf_config) == -1){
+		printf("ERROR: Restoring the rings of: %s\n", vnf_config->name);
+		exit(-1);
+	}
+	return -1;
 }
 int get_mtu_size(int fd, char *name){
 
@@ -177,6 +252,42 @@ int get_mtu_size(int fd, char *name){
 
 	return -1;
 }
+/*
+* Link speed in Mbps from the ethtool ioctl, -1 when the driver does not
+* know it
+*/
+int get_link_speed(int fd, char *name){
+	struct ethtool_cmd cmd;
+	struct ifreq ifr;
+	uint32_t speed;
+
+	memset(&cmd, 0, sizeof(cmd));
+	memset(&ifr, 0, sizeof(ifr));
+	cmd.cmd = ETHTOOL_GSET;
+	strncpy(ifr.ifr_name, name, IFNAMSIZ-1);
+	ifr.ifr_data = (void *)&cmd;
+	if (ioctl(fd, SIOCETHTOOL, &ifr) == -1){
+		return -1;
+	}
+	speed = ethtool_cmd_speed(&cmd);
+	if (speed == 0 || speed == (uint32_t)SPEED_UNKNOWN){
+		return -1;
+	}
+	return speed;
+}
+/*
+* Frame size for an interface whose frames, Ethernet header included, are
+* up to mtu_size bytes. Frames stay a power of two so a block holds a whole
+* number of them and ring slots can be indexed with a mask.
+*/
+unsigned long frame_size_for_mtu(unsigned int mtu_size){
+	unsigned long frame_size = TPACKET_ALIGNMENT;
+
+	while (frame_size < mtu_size + VLAN_TAG_LEN + FRAME_HEADROOM && frame_size < MAX_FRAME_SIZE){
+		frame_size <<= 1;
+	}
+	return frame_size;
+}
 bool is_power_two(int n)
 {
   /*
@@ -196,6 +307,128 @@ bool is_power_two(int n)
   return true;
 }
 /*
+* Parse a cpu list such as "2,3,6-9", returns the number of cpus or -1
+*/
+int parse_cpu_list(char *list, int *cpus, unsigned int max_cpus){
+	unsigned int ncpus = 0;
+	long first, last, cpu;
+	char *cur = list;
+	char *end;
+
+	while (*cur != '\0'){
+		first = strtol(cur, &end, 10);
+		if (end == cur || first < 0){
+			return -1;
+		}
+		last = first;
+		if (*end == '-'){
+			cur = end + 1;
+			last = strtol(cur, &end, 10);
+			if (end == cur || last < first){
+				return -1;
+			}
+		}
+		for (cpu = first; cpu <= last; cpu++){
+			if (ncpus == max_cpus){
+				return -1;
+			}
+			cpus[ncpus++] = cpu;
+		}
+		if (*end == ','){
+			end++;
+		} else if (*end != '\0'){
+			return -1;
+		}
+		cur = end;
+	}
+	return ncpus;
+}
+/*
+* NUMA node of the device behind an interface, -1 for virtual interfaces
+* and platforms without NUMA
+*/
+int get_intf_numa_node(char *name){
+	char path[128];
+	FILE *file;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", name);
+	file = fopen(path, "r");
+	if (file == NULL){
+		return -1;
+	}
+	if (fscanf(file, "%d", &node) != 1){
+		node = -1;
+	}
+	fclose(file);
+	return node;
+}
+/*
+* Read a sysfs list such as "0-3,8-11" under /sys/devices/system/node,
+* returns the number of entries or -1
+*/
+static int read_node_list(char *name, int *list, unsigned int max){
+	char path[128];
+	char buf[4096];
+	FILE *file;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/%s", name);
+	file = fopen(path, "r");
+	if (file == NULL){
+		return -1;
+	}
+	if (fgets(buf, sizeof(buf), file) == NULL){
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+	buf[strcspn(buf, "\n")] = '\0';
+	return parse_cpu_list(buf, list, max);
+}
+/*
+* Online NUMA nodes, 1 when the kernel has no NUMA support
+*/
+int get_numa_nodes(void){
+	int nodes[MAX_NUMA_NODES];
+	int n;
+
+	n = read_node_list("online", nodes, MAX_NUMA_NODES);
+	return (n > 0) ? n : 1;
+}
+/*
+* Cores of a NUMA node, returns their number or -1 when the node does
+* not exist
+*/
+int get_numa_node_cpus(int node, int *cpus, unsigned int max_cpus){
+	char name[32];
+	int all[MAX_NODE_CPUS];
+	int n;
+
+	snprintf(name, sizeof(name), "node%d/cpulist", node);
+	n = read_node_list(name, all, MAX_NODE_CPUS);
+	if (n == -1){
+		return -1;
+	}
+	n = MIN((unsigned int)n, max_cpus);
+	memcpy(cpus, all, n * sizeof(int));
+	return n;
+}
+/*
+* Prefer memory of a node for everything the calling thread touches from
+* now on, threads it creates inherit the policy. A node of -1 goes back
+* to the default of the node the thread runs on.
+*/
+int set_numa_policy(int node){
+	unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+
+	if (node < 0){
+		return syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+	}
+	memset(mask, 0, sizeof(mask));
+	mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+	return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, MAX_NUMA_NODES);
+}
+/*
 * Utilities to print out network headers
 */
 uint16_t display_ethernet(uint8_t *buffer){
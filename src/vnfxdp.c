@@ -0,0 +1,446 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+* AF_XDP I/O backend. Both interfaces share one UMEM so forwarding a frame
+* is a descriptor move from the RX ring of one socket to the TX ring of
+* the other. The redirect program is loaded directly with the bpf syscall
+* so there is no dependency on libbpf.
+*/
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+//
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+//
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <net/if.h>
+
+#include "vnfapp.h"
+#include "vnfxdp.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+static int sys_bpf(int cmd, union bpf_attr *attr){
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+/*
+* Create a single entry XSKMAP keyed by RX queue
+*/
+static int xdp_create_map(void){
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = 1;
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int xdp_update_map(int map_fd, uint32_t key, uint32_t value){
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uint64_t)(unsigned long)&key;
+	attr.value = (uint64_t)(unsigned long)&value;
+	attr.flags = BPF_ANY;
+	return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+/*
+* Load the equivalent of:
+*
+*   return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS);
+*
+* Queues without a socket fall through to the normal stack.
+*/
+static int xdp_load_prog(int map_fd){
+	union bpf_attr attr;
+	char license[] = "GPL";
+	struct bpf_insn prog[] = {
+		/* r2 = ctx->rx_queue_index */
+		{ .code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1,
+		  .off = offsetof(struct xdp_md, rx_queue_index) },
+		/* r1 = map */
+		{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD,
+		  .imm = map_fd },
+		{ 0 },
+		/* r3 = XDP_PASS */
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uint64_t)(unsigned long)prog;
+	attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+	attr.license = (uint64_t)(unsigned long)license;
+	return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+/*
+* Attach through a bpf link, the program is detached when the process exits
+*/
+static int xdp_attach_prog(int prog_fd, int ifindex, bool drv_mode){
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = prog_fd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = drv_mode ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+	return sys_bpf(BPF_LINK_CREATE, &attr);
+}
+
+static int xsk_map_ring(int fd, struct xdp_ring_offset *off, uint64_t pgoff, size_t entry_size, uint32_t size, xsk_ring_t *ring){
+	ring->map_len = off->desc + size * entry_size;
+	ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if (ring->map == MAP_FAILED){
+		perror("mmap xsk ring");
+		ring->map = NULL;
+		return -1;
+	}
+	ring->producer = (uint32_t *)((uint8_t *)ring->map + off->producer);
+	ring->consumer = (uint32_t *)((uint8_t *)ring->map + off->consumer);
+	ring->flags = (uint32_t *)((uint8_t *)ring->map + off->flags);
+	ring->ring = (uint8_t *)ring->map + off->desc;
+	ring->size = size;
+	ring->mask = size - 1;
+	return 0;
+}
+/*
+* Create and bind one AF_XDP socket, the second socket shares the UMEM
+* registered by the first but keeps its own fill and completion rings
+*/
+static int xsk_open(xdp_config_t *xdp, xsk_socket_t *sock, int shared_fd){
+	struct xdp_umem_reg mr;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	socklen_t optlen;
+	uint32_t size = xdp->ring_size;
+
+	sock->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (sock->fd == -1){
+		perror("AF_XDP socket");
+		return -1;
+	}
+	if (shared_fd == -1){
+		memset(&mr, 0, sizeof(mr));
+		mr.addr = (uint64_t)(unsigned long)xdp->umem;
+		mr.len = xdp->umem_len;
+		mr.chunk_size = xdp->frame_size;
+		mr.headroom = 0;
+		if (setsockopt(sock->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) == -1){
+			perror("XDP_UMEM_REG");
+			return -1;
+		}
+	}
+	if (setsockopt(sock->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) == -1 ||
+		setsockopt(sock->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) == -1 ||
+		setsockopt(sock->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) == -1 ||
+		setsockopt(sock->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) == -1){
+		perror("XDP ring size");
+		return -1;
+	}
+	optlen = sizeof(off);
+	if (getsockopt(sock->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1){
+		perror("XDP_MMAP_OFFSETS");
+		return -1;
+	}
+	if (xsk_map_ring(sock->fd, &off.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t), size, &sock->fill) == -1 ||
+		xsk_map_ring(sock->fd, &off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t), size, &sock->comp) == -1 ||
+		xsk_map_ring(sock->fd, &off.rx, XDP_PGOFF_RX_RING, sizeof(struct xdp_desc), size, &sock->rx) == -1 ||
+		xsk_map_ring(sock->fd, &off.tx, XDP_PGOFF_TX_RING, sizeof(struct xdp_desc), size, &sock->tx) == -1){
+		return -1;
+	}
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = sock->ifindex;
+	sxdp.sxdp_queue_id = 0;
+	if (shared_fd != -1){
+		/*
+		* Flags are inherited from the owner of the UMEM
+		*/
+		sxdp.sxdp_flags = XDP_SHARED_UMEM;
+		sxdp.sxdp_shared_umem_fd = shared_fd;
+	} else {
+		sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | (xdp->drv_mode ? XDP_ZEROCOPY : XDP_COPY);
+	}
+	if (bind(sock->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == -1){
+		if (shared_fd == -1 && xdp->drv_mode){
+			printf("WARNING: Zero copy not supported on: %s, using copy mode\n", sock->name);
+			sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+			if (bind(sock->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0){
+				return 0;
+			}
+		}
+		perror("AF_XDP bind");
+		return -1;
+	}
+	return 0;
+}
+/*
+* Steer the interface's queue 0 to the socket
+*/
+static int xsk_attach(xdp_config_t *xdp, xsk_socket_t *sock){
+	sock->map_fd = xdp_create_map();
+	if (sock->map_fd == -1){
+		perror("BPF_MAP_CREATE");
+		return -1;
+	}
+	if (xdp_update_map(sock->map_fd, 0, sock->fd) == -1){
+		perror("BPF_MAP_UPDATE_ELEM");
+		return -1;
+	}
+	sock->prog_fd = xdp_load_prog(sock->map_fd);
+	if (sock->prog_fd == -1){
+		perror("BPF_PROG_LOAD");
+		return -1;
+	}
+	sock->link_fd = xdp_attach_prog(sock->prog_fd, sock->ifindex, xdp->drv_mode);
+	if (sock->link_fd == -1){
+		perror("BPF_LINK_CREATE");
+		return -1;
+	}
+	return 0;
+}
+
+static void xsk_unmap_ring(xsk_ring_t *ring){
+	if (ring->map != NULL){
+		munmap(ring->map, ring->map_len);
+		ring->map = NULL;
+	}
+}
+
+static void xdp_teardown(xdp_config_t *xdp){
+	int i;
+
+	for (i = 0; i < 2; i++){
+		xsk_socket_t *sock = &xdp->sock[i];
+		xsk_unmap_ring(&sock->rx);
+		xsk_unmap_ring(&sock->tx);
+		xsk_unmap_ring(&sock->fill);
+		xsk_unmap_ring(&sock->comp);
+		if (sock->link_fd != -1) close(sock->link_fd);
+		if (sock->prog_fd != -1) close(sock->prog_fd);
+		if (sock->map_fd != -1) close(sock->map_fd);
+		if (sock->fd != -1) close(sock->fd);
+	}
+	if (xdp->umem != NULL){
+		munmap(xdp->umem, xdp->umem_len);
+		xdp->umem = NULL;
+	}
+}
+/*
+* Hand frames [first, first + count) to the fill ring of a socket
+*/
+static void xsk_fill(xsk_socket_t *sock, uint64_t *addrs, uint32_t count){
+	uint32_t prod = *sock->fill.producer;
+	uint64_t *ring = (uint64_t *)sock->fill.ring;
+	uint32_t i;
+
+	for (i = 0; i < count; i++){
+		ring[(prod + i) & sock->fill.mask] = addrs[i];
+	}
+	__atomic_store_n(sock->fill.producer, prod + count, __ATOMIC_RELEASE);
+}
+/*
+* Set up AF_XDP sockets on both interfaces, returns -1 if AF_XDP is not
+* available so the caller can fall back to packet mmap
+*/
+int xdp_setup(xdp_config_t *xdp, intf_config_t *f_config, intf_config_t *s_config, bool drv_mode){
+	uint64_t addr;
+	uint32_t i, j, nsock;
+
+	memset(xdp, 0, sizeof(*xdp));
+	for (i = 0; i < 2; i++){
+		xdp->sock[i].fd = -1;
+		xdp->sock[i].map_fd = -1;
+		xdp->sock[i].prog_fd = -1;
+		xdp->sock[i].link_fd = -1;
+	}
+	xdp->single = f_config->single;
+	xdp->drv_mode = drv_mode;
+	/*
+	* UMEM chunks hold a frame in one page at most, so no jumbo frames
+	*/
+	xdp->frame_size = (f_config->max_frame_size == AUTO_FRAME_SIZE) ? (uint32_t)getpagesize() : f_config->max_frame_size;
+	xdp->ring_size = f_config->max_ring_frames * f_config->max_ring_blocks;
+	if (xdp->frame_size < 2048 || xdp->frame_size > (uint32_t)getpagesize()){
+		printf("ERROR: AF_XDP needs a frame size from 2048 to the page size, got: %u\n", xdp->frame_size);
+		return -1;
+	}
+	nsock = xdp->single ? 1 : 2;
+	strncpy(xdp->sock[0].name, f_config->name, IFNAMSIZ-1);
+	xdp->sock[0].stats = f_config->stats;
+	if (!xdp->single){
+		strncpy(xdp->sock[1].name, s_config->name, IFNAMSIZ-1);
+		xdp->sock[1].stats = s_config->stats;
+	}
+	/*
+	* Each socket owns ring_size frames of the shared UMEM
+	*/
+	xdp->umem_len = (size_t)xdp->frame_size * xdp->ring_size * nsock;
+	xdp->umem = mmap(NULL, xdp->umem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (xdp->umem == MAP_FAILED){
+		perror("mmap umem");
+		xdp->umem = NULL;
+		return -1;
+	}
+	for (i = 0; i < nsock; i++){
+		xdp->sock[i].ifindex = if_nametoindex(xdp->sock[i].name);
+		if (xdp->sock[i].ifindex == 0){
+			printf("Error: failed to find interface %s\n", xdp->sock[i].name);
+			xdp_teardown(xdp);
+			return -1;
+		}
+		if (xsk_open(xdp, &xdp->sock[i], (i == 0) ? -1 : xdp->sock[0].fd) == -1 ||
+			xsk_attach(xdp, &xdp->sock[i]) == -1){
+			xdp_teardown(xdp);
+			return -1;
+		}
+		for (j = 0; j < xdp->ring_size; j++){
+			addr = ((uint64_t)i * xdp->ring_size + j) * xdp->frame_size;
+			xsk_fill(&xdp->sock[i], &addr, 1);
+		}
+		printf("Interface: %s using AF_XDP %s mode\n", xdp->sock[i].name, drv_mode ? "driver" : "generic (skb)");
+	}
+	return 0;
+}
+/*
+* Completed TX frames go back to the fill ring of the socket they were
+* received on
+*/
+static void xsk_reclaim(xsk_socket_t *out, xsk_socket_t *in){
+	uint32_t cons = *out->comp.consumer;
+	uint32_t prod = __atomic_load_n(out->comp.producer, __ATOMIC_ACQUIRE);
+	uint64_t *ring = (uint64_t *)out->comp.ring;
+	uint64_t addrs[XDP_BATCH_SIZE];
+	uint32_t n, i;
+
+	while (prod != cons){
+		n = MIN(prod - cons, XDP_BATCH_SIZE);
+		for (i = 0; i < n; i++){
+			addrs[i] = ring[(cons + i) & out->comp.mask];
+		}
+		cons += n;
+		__atomic_store_n(out->comp.consumer, cons, __ATOMIC_RELEASE);
+		xsk_fill(in, addrs, n);
+	}
+}
+/*
+* Move a burst of descriptors from the RX ring of in to the TX ring of out
+*/
+static void xsk_forward(xsk_socket_t *in, xsk_socket_t *out){
+	struct xdp_desc *rx = (struct xdp_desc *)in->rx.ring;
+	struct xdp_desc *tx = (struct xdp_desc *)out->tx.ring;
+	uint64_t drops[XDP_BATCH_SIZE];
+	uint64_t bytes = 0, dropped_bytes = 0;
+	uint32_t rx_cons, rx_prod, tx_prod, tx_cons;
+	uint32_t n, room, i;
+
+	rx_cons = *in->rx.consumer;
+	rx_prod = __atomic_load_n(in->rx.producer, __ATOMIC_ACQUIRE);
+	n = MIN(rx_prod - rx_cons, XDP_BATCH_SIZE);
+	if (n == 0){
+		return;
+	}
+	tx_prod = *out->tx.producer;
+	tx_cons = __atomic_load_n(out->tx.consumer, __ATOMIC_ACQUIRE);
+	room = MIN(out->tx.size - (tx_prod - tx_cons), n);
+	for (i = 0; i < room; i++){
+		tx[(tx_prod + i) & out->tx.mask] = rx[(rx_cons + i) & in->rx.mask];
+		bytes += rx[(rx_cons + i) & in->rx.mask].len;
+	}
+	/*
+	* No room on the peer, return the frames to our own fill ring
+	*/
+	for (i = room; i < n; i++){
+		drops[i - room] = rx[(rx_cons + i) & in->rx.mask].addr;
+		dropped_bytes += rx[(rx_cons + i) & in->rx.mask].len;
+	}
+	__atomic_store_n(out->tx.producer, tx_prod + room, __ATOMIC_RELEASE);
+	__atomic_store_n(in->rx.consumer, rx_cons + n, __ATOMIC_RELEASE);
+	if (n > room){
+		xsk_fill(in, drops, n - room);
+	}
+	in->stats->rx_packets += n;
+	in->stats->rx_bytes += bytes + dropped_bytes;
+	out->stats->tx_packets += room;
+	out->stats->tx_bytes += bytes;
+	out->stats->tx_drops += n - room;
+	/*
+	* Poke kernel to send
+	*/
+	if (room > 0 && (__atomic_load_n(out->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)){
+		if (sendto(out->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1 &&
+			errno != EAGAIN && errno != EBUSY && errno != ENOBUFS && errno != ENETDOWN){
+			perror("AF_XDP sendto");
+			exit(1);
+		}
+	}
+	xsk_reclaim(out, in);
+}
+/*
+* Forwarding loop for the AF_XDP backend
+*/
+void xdp_read_write(xdp_config_t *xdp){
+	struct pollfd fds[2];
+	xsk_socket_t *f_sock = &xdp->sock[0];
+	xsk_socket_t *s_sock = xdp->single ? &xdp->sock[0] : &xdp->sock[1];
+	int nfds = xdp->single ? 1 : 2;
+	int ready;
+
+	memset(fds, 0, sizeof(fds));
+	fds[0].fd = f_sock->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = s_sock->fd;
+	fds[1].events = POLLIN;
+	while (true){
+		ready = poll(fds, nfds, 100);
+		if (ready == -1){
+			perror("poll");
+			exit(1);
+		}
+		xsk_forward(f_sock, s_sock);
+		if (!xdp->single){
+			xsk_forward(s_sock, f_sock);
+		}
+		/*
+		* Zero copy drivers complete asynchronously
+		*/
+		if (ready == 0){
+			xsk_reclaim(s_sock, f_sock);
+			if (!xdp->single){
+				xsk_reclaim(f_sock, s_sock);
+			}
+		}
+	}
+}